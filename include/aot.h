@@ -0,0 +1,65 @@
+#ifndef aot_h
+#define aot_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Ahead-of-time translated ROMs. chip8-aot turns a ROM into a C file with
+// one function per basic block, compiles it to <cache>/<ROM hash>.so and
+// chip8_aot_load picks that up with dlopen. Blocks run only while the
+// memory they were translated from still holds the original ROM bytes,
+// anything else (computed jumps into untranslated code, self-modified
+// code) goes to the interpreter. Blocks hand DXYN, key waits and invalid
+// opcodes back to the interpreter one instruction at a time. CHIP8_CHECKED
+// builds never load translations, they would skip the bounds checks. Chips
+// set to other quirks than CHIP8_QUIRKS_DEFAULT are interpreted.
+
+// bump whenever chip8_aot_block or chip8_aot_module change
+#define CHIP8_AOT_ABI 3
+
+// the data symbol every translated ROM exports
+#define CHIP8_AOT_SYMBOL "chip8_aot_translation"
+
+// what blocks call for the instructions they leave to the interpreter
+typedef void (*chip8_aot_interpret)(chip8* chip, uint32_t cycles);
+
+typedef struct {
+  void (*run)(chip8* chip, chip8_aot_interpret interpret);
+  uint16_t start;                 // translated from memory [start, end)
+  uint16_t end;
+  uint16_t count;                 // instructions, terminator included
+  uint16_t interpreted;           // of those, run through interpret
+  uint16_t lastOpcode;
+  uint8_t stores;                 // bytes the last instruction wrote at I
+} chip8_aot_block;
+
+typedef struct {
+  uint32_t abi;
+  uint32_t chipSize;              // sizeof(chip8) the code was built against
+  uint64_t romHash;
+  uint32_t romSize;
+  const uint8_t* rom;
+  uint32_t blockCount;
+  const chip8_aot_block* blocks;
+} chip8_aot_module;
+
+typedef struct chip8_aot chip8_aot;
+
+// <cacheDir>/<hash>.so, false if it does not fit
+bool chip8_aot_cachePath(char* path, size_t capacity, const char* cacheDir, uint64_t hash);
+
+// NULL if the cache has no usable translation of this ROM
+chip8_aot* chip8_aot_load(chip8* chip, const char* cacheDir, const uint8_t* rom, size_t size);
+void chip8_aot_unload(chip8_aot* aot);
+
+// re-attaches to the chip, needed after chip8_initialize
+void chip8_aot_reset(chip8_aot* aot);
+
+// same contract as chip8_execute and chip8_runFrame
+void chip8_aot_execute(chip8_aot* aot, uint32_t cycles);
+void chip8_aot_runFrame(chip8_aot* aot, uint32_t ipf);
+
+#endif // !aot_h
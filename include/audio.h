@@ -0,0 +1,51 @@
+#ifndef audio_h
+#define audio_h
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define AUDIO_RING_FRAMES 8       // power of two, a few frames of slack
+#define AUDIO_AMPLITUDE 0x2000    // a quarter of full scale
+#define AUDIO_TONE 440            // Hz, square wave when no pattern is loaded
+
+// What the sound hardware does during one 60 Hz frame
+typedef struct {
+  bool on;                        // sound timer running
+  uint8_t pitch;                  // FX3A
+  uint8_t pattern[16];            // F002, all zero plays the plain tone
+} audio_frame;
+
+// Sound synthesizer fed by the emulation thread and drained by the audio
+// callback. The emulation side only copies one small record per frame into
+// a single producer / single consumer ring, all synthesis happens on the
+// audio thread. Every render starts with the newest record waiting,
+// skipping any older ones, and plays it for a frame worth of samples or
+// until the next one arrives. When no record comes in time the current one
+// keeps playing, so the latency is at most one device period on top of
+// the device buffer.
+typedef struct {
+  audio_frame ring[AUDIO_RING_FRAMES];
+  atomic_uint head;               // producer side, next slot to write
+  atomic_uint tail;               // consumer side, next slot to read
+
+  // owned by the audio thread
+  uint32_t sampleRate;
+  uint32_t remaining;             // samples left of the current record
+  uint32_t fraction;              // sampleRate % FRAME_RATE carried over
+  audio_frame current;
+  uint32_t phase;                 // 2^32 is one period of the tone or pattern
+  uint32_t step;                  // phase increment per sample
+  bool usePattern;
+} audio_synth;
+
+void audio_init(audio_synth* synth, uint32_t sampleRate);
+
+// emulation thread, once per frame. Dropped if the audio thread stalled
+// long enough for the ring to fill up
+void audio_push(audio_synth* synth, bool on, uint8_t pitch, const uint8_t* pattern);
+
+// audio thread, writes that many mono 16-bit samples
+void audio_render(audio_synth* synth, int16_t* out, uint32_t samples);
+
+#endif // !audio_h
@@ -0,0 +1,47 @@
+#ifndef capture_h
+#define capture_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "triplebuffer.h"
+
+#define CAPTURE_POOL_FRAMES 128   // about two seconds of slack at 60 Hz
+
+typedef enum {
+  CAPTURE_Y4M,                    // raw 128x64 video, 60 fps, 4:2:0 full range
+  CAPTURE_GIF,                    // animated, only the rectangle that changed
+  CAPTURE_PNG,                    // one numbered image per frame
+  CAPTURE_FORMAT_COUNT
+} capture_format;
+
+typedef struct {
+  uint64_t frames;                // pushed and encoded
+  uint64_t dropped;               // pushed while the pool was full
+  bool failed;                    // a write failed, the rest was discarded
+} capture_stats;
+
+// Records frames into a file on a background encoder thread. Pushing copies
+// the frame into a slot of a preallocated pool and never takes a lock; when
+// all slots are taken the frame is dropped and counted. Frames carry their
+// sequence, gaps between them (frames that drew nothing, or were dropped)
+// hold the previous picture, so the recording keeps the emulated timing.
+typedef struct capture capture;
+
+// from the extension of path: .y4m, .gif or .png, CAPTURE_FORMAT_COUNT if
+// none of them
+capture_format capture_formatOf(const char* path);
+
+// NULL if the file cannot be created. PNG sequences are written next to
+// path as <path without .png>-<frame>.png, numbered by sequence from the
+// first frame. lossless makes capture_push wait for a free slot instead of
+// dropping, for headless runs that have no frame rate to keep up with
+capture* capture_open(const char* path, capture_format format, bool lossless);
+
+// false if the frame was dropped
+bool capture_push(capture* cap, const chip8_frame* frame);
+
+// encodes what is left in the pool, finishes the file and frees everything
+capture_stats capture_close(capture* cap);
+
+#endif // !capture_h
@@ -1,18 +1,143 @@
 #ifndef chip_8_h
 #define chip_8_h
 
-#include "raudio.h"
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
-#define MAX_MEMORY 4096           // 4k
-#define WIDTH 64
+#define MAX_MEMORY 0x10000        // 64k, as XO-CHIP; CHIP-8 ROMs use the first 4k
+#define CODE_MEMORY 0x1000        // what 12-bit jumps reach, see chip8.decoded
+#define DIRTY_BLOCK 64            // bytes per bit of chip8.dirty
+#define DIRTY_WORDS (MAX_MEMORY / DIRTY_BLOCK / 64)
+#define WIDTH 64                  // lores
 #define HEIGHT 32
+#define HIRES_WIDTH 128           // SUPER-CHIP and XO-CHIP 00FF
+#define HIRES_HEIGHT 64
+#define PLANES 2                  // XO-CHIP bitplanes, see chip8.gfx
+#define PLANE_WORDS (HIRES_WIDTH * HIRES_HEIGHT / 64)
 #define STACK_SIZE 16
 #define KEY_SIZE 16
 #define REGISTERS_SIZE 16
+#define PROGRAM_START 0x200
 
+// every handler the interpreter knows about, sub-ops of the 0/5/8/E/F
+// groups included, so a decoded instruction needs a single dispatch. Next
+// to CHIP-8 this covers SUPER-CHIP 1.1 (00CN, 00FB-00FF, DXY0 in DXYN,
+// FX30, FX75, FX85) and XO-CHIP (00DN, 5XY2, 5XY3, F000, FN01, F002, FX3A),
+// which only the profiles of those machines run, see chip8_quirks.
+// BREAK is never decoded, a debugger patches it over the entry of an
+// address it breaks on, see chip8.breakpoints
+#define CHIP8_OPS(X) \
+  X(DECODE) X(INVALID) \
+  X(00CN) X(00DN) X(00E0) X(00EE) X(00FB) X(00FC) X(00FD) X(00FE) X(00FF) \
+  X(1NNN) X(2NNN) X(3XNN) X(4XNN) X(5XY0) X(5XY2) X(5XY3) X(6XNN) X(7XNN) \
+  X(8XY0) X(8XY1) X(8XY2) X(8XY3) X(8XY4) X(8XY5) X(8XY6) X(8XY7) X(8XYE) \
+  X(9XY0) X(ANNN) X(BNNN) X(CXNN) X(DXYN) X(EX9E) X(EXA1) \
+  X(F000) X(FN01) X(F002) X(FX07) X(FX0A) X(FX15) X(FX18) X(FX1E) X(FX29) \
+  X(FX30) X(FX33) X(FX3A) X(FX55) X(FX65) X(FX75) X(FX85) \
+  X(BREAK)
+
+typedef enum {
+#define CHIP8_OP_ENUM(name) CHIP8_OP_##name,
+  CHIP8_OPS(CHIP8_OP_ENUM)
+#undef CHIP8_OP_ENUM
+  CHIP8_OP_COUNT
+} chip8_op;
+
+// an instruction with its operands already extracted. CHIP8_OP_DECODE
+// (zero) marks an entry that has to be decoded from memory again
 typedef struct {
+  uint8_t op;
+  uint8_t x;
+  uint8_t y;
+  uint8_t nn;
+  uint16_t nnn;
+  uint16_t opcode;
+} chip8_decoded;
+
+// why the last chip8_execute stopped early. The interpreter spots loops
+// that cannot end before the keys or the delay timer change, and skips the
+// rest of its budget in one step instead of running them
+typedef enum {
+  CHIP8_IDLE_NONE,
+  CHIP8_IDLE_KEY,                 // FX0A with no key pressed
+  CHIP8_IDLE_TIMER,               // FX07 VX; 3X00; 1NNN back to the FX07
+  CHIP8_IDLE_HALT,                // 1NNN jumping to itself
+  CHIP8_IDLE_BREAK,               // stopped in front of a breakpoint, see
+                                  // chip8.breakpoints; the rest of the
+                                  // budget did not run
+} chip8_idle;
+
+// the machines whose behavior ROMs were written for. Each profile gets its
+// own copy of the interpreter, compiled with its quirks as constants, so
+// picking one costs a single branch per chip8_execute:
+//   DEFAULT  what this emulator always did: shifts in place, FX55/FX65
+//            leave I alone, BNNN adds V0, sprites clip at the edges
+//   VIP      COSMAC VIP: 8XY1-3 clear VF, shifts read VY, FX55/FX65 leave I
+//            past the last register, DXYN ends the frame
+//   CHIP48   BXNN adds VX, FX55/FX65 advance I by X
+//   SCHIP    SUPER-CHIP 1.1: BXNN adds VX, its opcodes run
+//   XOCHIP   shifts read VY, FX55/FX65 advance I by X + 1, sprites wrap,
+//            skips step over all four bytes of F000 NNNN, the SUPER-CHIP
+//            and XO-CHIP opcodes run
+// The first three are plain CHIP-8: the extended opcodes are invalid there
+// and DXY0 draws nothing.
+typedef enum {
+  CHIP8_QUIRKS_DEFAULT,
+  CHIP8_QUIRKS_VIP,
+  CHIP8_QUIRKS_CHIP48,
+  CHIP8_QUIRKS_SCHIP,
+  CHIP8_QUIRKS_XOCHIP,
+  CHIP8_QUIRKS_COUNT
+} chip8_quirks;
+
+#ifdef CHIP8_CHECKED
+// what a checked build (cmake -DCHIP8_CHECKED=ON) stopped on. Such builds
+// check every access a ROM controls and stop at the first one out of
+// bounds, where normal builds trust the ROM and run off the arrays
+typedef enum {
+  CHIP8_FAULT_NONE,
+  CHIP8_FAULT_INVALID_OPCODE,     // address holds the opcode
+  CHIP8_FAULT_MEMORY,             // an access at I past 0xFFFF, address is I
+  CHIP8_FAULT_STACK_OVERFLOW,     // 2NNN with all levels in use
+  CHIP8_FAULT_STACK_UNDERFLOW,    // 00EE with an empty stack
+  CHIP8_FAULT_KEY,                // EX9E/EXA1 on key VX > F, address is VX
+  CHIP8_FAULT_FONT,               // FX29/FX30 on digit VX > F, address is VX
+} chip8_fault;
+
+// one counter per address, then one per handler, see chip8.coverage
+#define CHIP8_COVERAGE_SIZE (MAX_MEMORY + CHIP8_OP_COUNT)
+#endif
+
+#ifdef CHIP8_PROFILE
+#define PROFILE_DRAW_BUCKETS 16   // the last bucket counts frames with 15+ draws
+
+// per-instance counters, only compiled in with CHIP8_PROFILE (see profile.h)
+typedef struct {
+  uint64_t ops[CHIP8_OP_COUNT];   // executions per handler, DECODE = cache misses
+  uint64_t pcHits[MAX_MEMORY];    // executions per address
+  uint64_t frames;
+  uint32_t frameDraws;            // DXYN/00E0 in the frame in progress
+  uint64_t drawsPerFrame[PROFILE_DRAW_BUCKETS];
+  uint64_t renders;               // filled in by the frontend
+  double renderSeconds;
+} chip8_profile;
+#endif
+
+typedef struct chip8 chip8;
+
+// what the core keeps up to date for a trace (trace.h), see chip8.trace.
+// chip8_execute calls begin with the state a traced call starts from and
+// end with how many instructions it ran, the trace sets both
+typedef struct chip8_traceLink chip8_traceLink;
+struct chip8_traceLink {
+  uint64_t written[DIRTY_WORDS];  // memory blocks written since the last traced call
+  bool sync;                      // the next traced call records the whole machine
+  void (*begin)(chip8_traceLink* link, const chip8* chip);
+  void (*end)(chip8_traceLink* link, const chip8* chip, uint64_t instructions);
+};
+
+struct chip8 {
   uint16_t opcode;                // 35 opcodes, two bytes long
   uint8_t memory[MAX_MEMORY];
   uint8_t V[REGISTERS_SIZE];      // 15 8-bit general purpose registers
@@ -23,18 +148,181 @@ typedef struct {
   uint8_t delay_timer;
   uint8_t sound_timer;
 
-  uint8_t gfx[WIDTH * HEIGHT];    // black and white screen with 2048 pixels
+  // the screen, one bit per pixel in each plane. Rows are packed at the
+  // current resolution: one word per row in lores, two in hires, the MSB of
+  // a word is its leftmost pixel. Words past the resolution's stay zero, so
+  // lores plane 0 reads as HEIGHT rows of WIDTH pixels
+  uint64_t gfx[PLANES][PLANE_WORDS];
+  bool hires;                     // HIRES_WIDTH x HIRES_HEIGHT, set by 00FF
+  uint8_t planes;                 // FN01 mask of the planes drawn and scrolled
   uint8_t key[KEY_SIZE];
 
-  bool drawFlag;
+  uint8_t flags[REGISTERS_SIZE];  // FX75/FX85, the HP48's RPL user flags
+  uint8_t pattern[16];            // F002 audio pattern, one bit per sample
+  uint8_t pitch;                  // FX3A, playback rate of the pattern
+
+  // output flags, set by the core and cleared by the frontend
+  bool drawFlag;                  // gfx changed since the last present
+  bool beepFlag;                  // the sound timer just ran out
+  uint8_t idle;                   // chip8_idle, set by chip8_execute
+
+  uint64_t cycles;                // instructions executed since initialize
+  uint64_t skipped;               // of those, skipped in idle loops rather than run
+  uint64_t rng;                   // xorshift64* state for CXNN, see chip8_seed
+  uint8_t quirks;                 // chip8_quirks, DEFAULT after initialize
+
+  // one bit per DIRTY_BLOCK bytes of memory written since initialize, set
+  // by chip8_invalidate. Memory outside them is as chip8_initialize left
+  // it, so chip8_restore only has to look at these blocks
+  uint64_t dirty[DIRTY_WORDS];
+
+  // called after memory in [address, address + length) was written, so
+  // translated code (see jit.h) can be dropped. Cleared by chip8_initialize
+  void (*codeWriteHook)(void* user, uint16_t address, uint16_t length);
+  void* hookUser;
+
+  // NULL, or a debugger's bitmap with one bit per address below
+  // CODE_MEMORY (bit N % 8 of byte N / 8). Entries at set even addresses
+  // hold CHIP8_OP_BREAK, re-patched whenever they are decoded again, so
+  // breakpoints cost nothing on the hot path. Cleared by chip8_initialize
+  const uint8_t* breakpoints;
 
-  Sound beep;
-} chip8;
+  // NULL, or the trace (trace.h) recording this chip. It records where
+  // each chip8_execute call starts from and how many instructions it ran,
+  // the instructions themselves are replayed when the trace is read, so the
+  // interpreter runs as it does untraced. Cleared by chip8_initialize
+  chip8_traceLink* trace;
 
+#ifdef CHIP8_PROFILE
+  chip8_profile profile;
+#endif
+
+#ifdef CHIP8_CHECKED
+  // the first fault sticks and chip8_execute does nothing more until
+  // chip8_initialize or chip8_restore
+  uint8_t fault;                  // chip8_fault
+  uint16_t faultPc;               // address of the faulting instruction
+  uint16_t faultAddress;          // see chip8_fault
+
+  // NULL, or CHIP8_COVERAGE_SIZE counters bumped for every instruction,
+  // e.g. a fuzzer's coverage map
+  uint8_t* coverage;
+#endif
+
+  // decode cache, one entry per even address below CODE_MEMORY, the rest
+  // is decoded as it runs. Entries are invalidated whenever the memory they
+  // were decoded from is written to
+  chip8_decoded decoded[CODE_MEMORY / 2];
+};
+
+// full machine state, everything needed to resume execution exactly
+typedef struct {
+  uint8_t memory[MAX_MEMORY];
+  uint64_t gfx[PLANES][PLANE_WORDS];
+  uint64_t rng;
+  uint16_t stack[STACK_SIZE];
+  uint16_t opcode;
+  uint16_t I;
+  uint16_t pc;
+  uint8_t V[REGISTERS_SIZE];
+  uint8_t key[KEY_SIZE];
+  uint8_t sp;
+  uint8_t delay_timer;
+  uint8_t sound_timer;
+  bool hires;
+  uint8_t planes;
+  uint8_t flags[REGISTERS_SIZE];
+  uint8_t pattern[16];
+  uint8_t pitch;
+  uint64_t dirty[DIRTY_WORDS];    // chip8.dirty, memory outside is as initialized
+} chip8_state;
+
+// CXNN draws from a generator owned by the instance, so runs with the same
+// seed and input are identical no matter how many instances share a process
+#define CHIP8_DEFAULT_SEED 0x43484950382D3031ULL
+
+// bump whenever an instruction leaves another state than it used to, so
+// recordings replayed on the core (trace.h) can tell they no longer match
+#define CHIP8_CORE_ABI 1
+
+// XO-CHIP's pitch after initialize, the pattern plays at 4000 Hz
+#define CHIP8_DEFAULT_PITCH 64
+
+// chip8_initialize seeds with CHIP8_DEFAULT_SEED
 void chip8_initialize(chip8* chip);
-void chip8_load(chip8* chip, const char* path);
+void chip8_seed(chip8* chip, uint64_t seed);
+// the generator state chip8_seed starts from, never zero
+uint64_t chip8_seedState(uint64_t seed);
+// returns the ROM size, exits on failure
+size_t chip8_load(chip8* chip, const char* path);
+bool chip8_loadBuffer(chip8* chip, const uint8_t* data, size_t size);
 void chip8_emulateCycle(chip8* chip);
+void chip8_execute(chip8* chip, uint32_t cycles);
+void chip8_tickTimers(chip8* chip);
+void chip8_runFrame(chip8* chip, uint32_t ipf);
+void chip8_setKeys(chip8* chip, uint16_t mask);
+void chip8_invalidate(chip8* chip, uint16_t address, uint16_t length);
+
+// true when the last frame ended parked on FX0A or a halt loop with both
+// timers stopped, so nothing but a key press can change the state. Every
+// frame until then only adds ipf to cycles, see chip8_skipFrames
+bool chip8_waitsForInput(const chip8* chip);
+void chip8_skipFrames(chip8* chip, uint32_t ipf, uint32_t frames);
+
+// handler name as in the comments, e.g. "8XY4"
+const char* chip8_opName(chip8_op op);
+
+#ifdef CHIP8_CHECKED
+// e.g. "stack overflow"
+const char* chip8_faultName(chip8_fault fault);
+#endif
+
+// decodes exactly like the interpreter, for tools that translate ROMs
+chip8_decoded chip8_decode(uint16_t opcode);
+
+void chip8_snapshot(const chip8* chip, chip8_state* state);
+void chip8_restore(chip8* chip, const chip8_state* state);
+
+_Static_assert(WIDTH == 64 && HIRES_WIDTH == 128, "gfx stores one uint64_t per lores row, two per hires row");
+
+// 64-bit FNV-1a hash of a ROM file, what input logs, quirk databases and
+// the AOT cache know it by
+uint64_t chip8_romHash(const uint8_t* rom, size_t size);
+
+// 64-bit FNV-1a hash of the screen, to compare frames across runs. Covers
+// the words of plane 0 the resolution uses, and plane 1 once it has any
+// pixel set, so CHIP-8 frames hash as they did before planes and hires
+uint64_t chip8_frameHash(const chip8* chip);
+
+// byte-per-pixel view of gfx for frontends, out holds HIRES_WIDTH *
+// HIRES_HEIGHT bytes, each the pixel's plane bits. Lores pixels are doubled
+void chip8_gfxToBytes(const chip8* chip, uint8_t* out);
+
+// whether a chip8.breakpoints bitmap breaks on address
+static inline bool chip8_breakpointAt(const uint8_t* breakpoints, uint16_t address) {
+  return address < CODE_MEMORY && !(address & 1) && ((breakpoints[address >> 3] >> (address & 7)) & 1);
+}
+
+// words of each plane the current resolution uses
+static inline int chip8_gfxWords(const chip8* chip) {
+  return chip->hires ? PLANE_WORDS : HEIGHT;
+}
+
+// the next byte of a generator (chip8.rng), what CXNN masks with NN
+static inline uint8_t chip8_random(uint64_t* rng) {
+  uint64_t x = *rng;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *rng = x;
+  return (uint8_t)((x * 0x2545F4914F6CDD1DULL) >> 56);
+}
 
-typedef void (*Instruction)(chip8* chip);
+// the plane bits of a pixel, in the current resolution's coordinates
+static inline uint8_t chip8_getPixel(const chip8* chip, int x, int y) {
+  int word = chip->hires ? y * 2 + x / 64 : y;
+  int shift = 63 - x % 64;
+  return ((chip->gfx[0][word] >> shift) & 1) | (((chip->gfx[1][word] >> shift) & 1) << 1);
+}
 
 #endif // !chip_8_h
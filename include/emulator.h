@@ -0,0 +1,75 @@
+#ifndef emulator_h
+#define emulator_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "aot.h"
+#include "audio.h"
+#include "chip8.h"
+#include "gdbstub.h"
+#include "inputlog.h"
+#include "rewind.h"
+#include "triplebuffer.h"
+
+#define REWIND_ARENA_SIZE (8 * 1024 * 1024)
+#define REWIND_MAX_FRAMES (5 * 60 * 60) // five minutes at 60 Hz
+
+// Runs a chip8 on its own thread, paced by the scheduler. The presenting
+// thread only talks to it through atomics and the frame triple buffer.
+// While the ROM waits for a key with its timers stopped the thread sleeps
+// until the input changes instead of emulating frames that change nothing.
+typedef struct {
+  chip8 chip;                     // owned by the emulation thread
+  chip8_aot* aot;                 // translated ROM to run instead, or NULL
+  uint32_t ipf;
+  bool turbo;
+
+  triplebuffer frames;            // emulation -> presentation
+  atomic_uint_least16_t keys;     // input -> emulation, one bit per key
+  atomic_bool rewinding;          // input -> emulation, step back each frame
+  atomic_bool quit;
+  atomic_bool idle;               // emulation -> presentation, asleep on input
+
+  // wakes the idle emulation thread, signalled on any input change
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+
+  rewind_buffer history;          // owned by the emulation thread
+  bool hasHistory;                // false if the buffer could not be allocated
+
+  // set before emulator_start, both NULL by default. While a replay lasts
+  // its keys replace the input and rewinding is off. The recording follows
+  // rewinds, frames stepped back over are dropped from it
+  inputlog* recording;            // owned by the emulation thread while it runs
+  const inputlog* replay;
+
+  // set before emulator_start, NULL by default. Gets the sound state of
+  // every frame, rendered by whoever drains it
+  audio_synth* audio;
+
+  // set before emulator_start, NULL by default. Runs the ROM under GDB,
+  // which also keeps the thread from sleeping while the ROM waits for a
+  // key. quit is set once GDB kills the program
+  gdbstub* debugger;
+
+  // called on the emulation thread after a frame is published,
+  // e.g. to wake up a presenter blocked waiting for events
+  void (*onFrame)(void* user);
+  void* user;
+
+  pthread_t thread;
+} emulator;
+
+void emulator_init(emulator* emu, uint32_t ipf, bool turbo);
+bool emulator_start(emulator* emu);
+
+// joins the emulation thread and frees the rewind history
+void emulator_stop(emulator* emu);
+
+void emulator_setKey(emulator* emu, uint8_t key, bool pressed);
+void emulator_setRewinding(emulator* emu, bool rewinding);
+
+#endif // !emulator_h
@@ -0,0 +1,68 @@
+#ifndef env_h
+#define env_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Gym-style vectorized environments for training code: n copies of one
+// ROM stepped together across a thread pool. The action of an env is the
+// key mask it holds down for a step (bit N is key N of the key array).
+// Outputs go to caller-provided arrays, nothing is allocated per step.
+//
+// An env whose done hook fired starts over on its next step: that step
+// ignores the action and returns the initial observation with reward 0
+// and done false, as Gymnasium's next-step autoreset does. Its random
+// numbers carry on from the last episode, only chip8_env_reset reseeds.
+
+typedef struct chip8_env chip8_env;
+
+typedef struct {
+  // both called on a worker thread after an env finished its step, with
+  // the env's machine, e.g. to read a score from memory. A NULL reward
+  // hook rewards 0, a NULL done hook never ends an episode
+  float (*reward)(const chip8* chip, uint32_t env, void* user);
+  bool (*done)(const chip8* chip, uint32_t env, void* user);
+  void* user;
+
+  uint32_t ipf;                   // instructions per frame, 0 for the default
+  unsigned threads;               // 0 for one per core, 1 steps on the caller
+
+  // env i draws its random numbers from chip8_seed(seed + i), so a run is
+  // reproducible whatever the thread count
+  uint64_t seed;
+
+  uint8_t quirks;                 // chip8_quirks every env runs with
+} chip8_env_config;
+
+#define CHIP8_ENV_DEFAULT_IPF 10
+
+// words per env in observations, a copy of chip8.gfx: every plane at the
+// resolution the env is in, lores CHIP-8 ROMs only fill the first HEIGHT
+#define CHIP8_ENV_OBSERVATION_WORDS (PLANES * PLANE_WORDS)
+
+// copies of the ROM in their initial state, NULL if the ROM does not fit or
+// out of memory. config may be NULL for the defaults
+chip8_env* chip8_env_create(const uint8_t* rom, size_t size, uint32_t envs, const chip8_env_config* config);
+void chip8_env_destroy(chip8_env* env);
+
+uint32_t chip8_env_count(const chip8_env* env);
+
+// puts every env back into its initial state and seed. observations may be
+// NULL, otherwise it receives CHIP8_ENV_OBSERVATION_WORDS per env
+void chip8_env_reset(chip8_env* env, uint64_t* observations);
+
+// holds actions[i] down on env i for framesPerStep frames, then writes each
+// env's framebuffer to observations (CHIP8_ENV_OBSERVATION_WORDS per env),
+// the reward hook to rewards and the done hook to dones. Any output may be
+// NULL
+void chip8_env_stepBatch(chip8_env* env, const uint16_t* actions, uint32_t framesPerStep,
+                         uint64_t* observations, float* rewards, uint8_t* dones);
+
+// direct access to an env's machine between steps, chip->gfx is its
+// current observation
+const chip8* chip8_env_chip(const chip8_env* env, uint32_t index);
+
+#endif // !env_h
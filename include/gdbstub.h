@@ -0,0 +1,39 @@
+#ifndef gdbstub_h
+#define gdbstub_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// GDB remote serial protocol stub. GDB runs the show while the machine is
+// stopped: the thread that owns the chip serves it from inside
+// gdbstub_execute until it continues or steps, so windowed and headless
+// runs debug the same way. Supported:
+//   registers   g/G/p/P, in order V0-VF, I, pc, sp, delay and sound timers;
+//               I and pc are 16-bit little-endian, the rest 8-bit.
+//               qXfer:features:read serves the matching target.xml
+//   memory      m/M over the 64K address space
+//   execution   c, s, ? and Ctrl-C, polled once per gdbstub_execute
+//   breakpoints Z0/Z1 at even addresses below CODE_MEMORY, patched into
+//               the decode cache (see chip8.breakpoints)
+//   watchpoints Z2 on memory writes, which run one instruction at a time
+//               while any is set
+// Without breakpoints or watchpoints the interpreter runs at full speed.
+typedef struct gdbstub gdbstub;
+
+#define GDBSTUB_PACKET_SIZE 4096
+
+// listens on address, a TCP port on 127.0.0.1 or the path of a Unix
+// socket, and waits for GDB to connect. The machine starts out stopped.
+// NULL on failure
+gdbstub* gdbstub_open(const char* address);
+// detaches from the chip it last ran, closes the connection
+void gdbstub_close(gdbstub* stub);
+
+// runs up to cycles instructions like chip8_execute, stopping for GDB on
+// breakpoints, watchpoints, single steps and Ctrl-C. Once GDB detached or
+// hung up it is plain chip8_execute. false if GDB killed the program
+bool gdbstub_execute(gdbstub* stub, chip8* chip, uint32_t cycles);
+
+#endif // !gdbstub_h
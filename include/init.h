@@ -2,11 +2,13 @@
 #define init_h
 
 #include "chip8.h"
+#include "emulator.h"
+#include "triplebuffer.h"
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
-GLFWwindow* setup(chip8* chip);
+GLFWwindow* setup(emulator* emu);
 
-void render(chip8* chip);
+void render(const chip8_frame* frame);
 
 #endif // !graphics_H
@@ -0,0 +1,46 @@
+#ifndef inputlog_h
+#define inputlog_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Input log: everything besides the ROM that decides a run, so it can be
+// replayed exactly, headless and as fast as the host allows. Frames are
+// counted as emulated, the keys only change at the recorded frames.
+//
+// File layout, little-endian:
+//   "C8IN", u16 version, u16 quirks, u32 ipf, u32 frames, u64 seed, u64 ROM hash
+//   then one (u32 frame, u16 key mask) record per change of the keys
+typedef struct {
+  uint32_t frame;                 // the keys apply from this frame on
+  uint16_t keys;                  // bit N is key N
+} inputlog_event;
+
+typedef struct {
+  uint32_t ipf;
+  uint32_t frames;                // length of the run
+  uint64_t seed;                  // passed to chip8_seed
+  uint64_t romHash;               // chip8_romHash of the ROM it was made with
+  uint16_t quirks;                // chip8_quirks, DEFAULT after inputlog_init
+
+  inputlog_event* events;         // in frame order
+  size_t count;
+  size_t capacity;
+} inputlog;
+
+void inputlog_init(inputlog* log, uint32_t ipf, uint64_t seed, uint64_t romHash);
+void inputlog_free(inputlog* log);
+
+// called before emulating frame with the keys it runs with, stores an event
+// only if they differ from the last frame's. false when out of memory
+bool inputlog_record(inputlog* log, uint32_t frame, uint16_t keys);
+
+// drops everything from frame frames on, e.g. after stepping back in time
+void inputlog_truncate(inputlog* log, uint32_t frames);
+
+bool inputlog_save(const inputlog* log, const char* path);
+// false if the file cannot be read or is not an input log
+bool inputlog_load(inputlog* log, const char* path);
+
+#endif // !inputlog_h
@@ -0,0 +1,32 @@
+#ifndef jit_h
+#define jit_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Basic-block recompiler to x86-64. A block starts at pc and runs until a
+// jump or skip (included), or until the first instruction the JIT leaves
+// to the interpreter (DXYN, FX0A, calls, memory stores, ...). Within a
+// block the V registers and I live in host registers. Blocks are cached by
+// address and dropped when memory they were translated from is written.
+//
+// chip8_jit_create returns NULL where native code is not supported (not
+// x86-64, no executable memory, or a CHIP8_CHECKED build whose bounds
+// checks only the interpreter does), callers then keep using chip8_execute.
+// Chips set to other quirks than CHIP8_QUIRKS_DEFAULT are interpreted.
+typedef struct chip8_jit chip8_jit;
+
+chip8_jit* chip8_jit_create(chip8* chip);
+void chip8_jit_destroy(chip8_jit* jit);
+
+// drops all translations and re-attaches to the chip, needed after
+// chip8_initialize since that clears codeWriteHook
+void chip8_jit_reset(chip8_jit* jit);
+
+// same contract as chip8_execute and chip8_runFrame
+void chip8_jit_execute(chip8_jit* jit, uint32_t cycles);
+void chip8_jit_runFrame(chip8_jit* jit, uint32_t ipf);
+
+#endif // !jit_h
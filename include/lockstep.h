@@ -0,0 +1,63 @@
+#ifndef lockstep_h
+#define lockstep_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Many copies ("lanes") of one ROM stepped together, e.g. to train agents
+// or fuzz with different inputs. State is kept structure-of-arrays, one
+// array per register with an element per lane, so while the lanes agree
+// on the next opcode it runs across all of them with SIMD. Lanes that went
+// different ways are split into groups sharing an opcode for that step.
+//
+// Lanes behave like chip8 instances running plain CHIP-8, with two
+// differences: invalid opcodes, and with them the SUPER-CHIP and XO-CHIP
+// ones, are skipped silently, and memory is 4K with accesses wrapping at
+// its end. Lanes always follow CHIP8_QUIRKS_DEFAULT, ROMs must fit in 4K.
+
+typedef struct chip8_lockstep chip8_lockstep;
+
+typedef struct {
+  uint64_t steps;                 // instructions executed by every lane
+  uint64_t uniformSteps;          // of those, all lanes at one shared opcode
+  uint64_t groups;                // opcode groups over the other steps
+} chip8_lockstep_stats;
+
+// NULL if lanes is zero or out of memory
+chip8_lockstep* chip8_lockstep_create(uint32_t lanes);
+void chip8_lockstep_destroy(chip8_lockstep* ls);
+
+uint32_t chip8_lockstep_lanes(const chip8_lockstep* ls);
+
+// resets every lane as chip8_initialize does and loads the same ROM into each
+bool chip8_lockstep_load(chip8_lockstep* ls, const uint8_t* rom, size_t size);
+
+void chip8_lockstep_setKeys(chip8_lockstep* ls, uint32_t lane, uint16_t mask);
+
+// every lane starts out with chip8_initialize's seed, so lanes given the
+// same input stay identical until seeded apart
+void chip8_lockstep_seed(chip8_lockstep* ls, uint32_t lane, uint64_t seed);
+
+// same contract as chip8_execute, chip8_tickTimers and chip8_runFrame,
+// for every lane
+void chip8_lockstep_execute(chip8_lockstep* ls, uint32_t cycles);
+void chip8_lockstep_tickTimers(chip8_lockstep* ls);
+void chip8_lockstep_runFrame(chip8_lockstep* ls, uint32_t ipf);
+
+// one lane in the layout chip8 uses
+void chip8_lockstep_snapshot(const chip8_lockstep* ls, uint32_t lane, chip8_state* state);
+void chip8_lockstep_restore(chip8_lockstep* ls, uint32_t lane, const chip8_state* state);
+
+// same hash as chip8_frameHash
+uint64_t chip8_lockstep_frameHash(const chip8_lockstep* ls, uint32_t lane);
+
+// the drawFlag and beepFlag of a lane, cleared by reading them
+bool chip8_lockstep_takeDraw(chip8_lockstep* ls, uint32_t lane);
+bool chip8_lockstep_takeBeep(chip8_lockstep* ls, uint32_t lane);
+
+chip8_lockstep_stats chip8_lockstep_getStats(const chip8_lockstep* ls);
+
+#endif // !lockstep_h
@@ -0,0 +1,25 @@
+#ifndef pool_h
+#define pool_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Work-stealing thread pool over job indices. Every worker starts with an
+// even share of [0, jobs) and runs it from one end; a worker that runs dry
+// steals half of the largest remaining share from the other end.
+typedef struct pool pool;
+
+// worker is in [0, pool_workers()), so tasks can keep per-worker state
+typedef void (*pool_task)(void* context, size_t job, unsigned worker);
+
+pool* pool_create(unsigned workers);
+void pool_destroy(pool* p);
+unsigned pool_workers(const pool* p);
+
+// runs task for every job in [0, jobs) and blocks until all of them finished
+void pool_run(pool* p, size_t jobs, pool_task task, void* context);
+
+// number of online cores, at least 1
+unsigned pool_defaultWorkers(void);
+
+#endif // !pool_h
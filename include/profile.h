@@ -0,0 +1,35 @@
+#ifndef profile_h
+#define profile_h
+
+#include <stdbool.h>
+
+#include "chip8.h"
+
+// Opcode and hot-PC instrumentation, compiled out unless the core is built
+// with CHIP8_PROFILE (cmake -DCHIP8_PROFILING=ON). The hooks are no-ops
+// otherwise, so release builds pay nothing for them.
+#ifdef CHIP8_PROFILE
+#define PROFILE_OP(chip, op) ((chip)->profile.ops[(op)]++)
+#define PROFILE_PC(chip, pc) ((chip)->profile.pcHits[(pc) & (MAX_MEMORY - 1)]++)
+#define PROFILE_DRAW(chip) ((chip)->profile.frameDraws++)
+#define PROFILE_FRAME(chip) chip8_profileEndFrame(&(chip)->profile)
+
+void chip8_profileEndFrame(chip8_profile* profile);
+
+// adds from's counters and instructions to into's, for a profile of many
+// runs. An address keeps the handler of the first run that executed it
+void chip8_profileMerge(chip8* into, const chip8* from);
+
+// writes the profile as a folded-stack file for flamegraph tools if path
+// ends in ".folded", as JSON otherwise. Only the interpreter counts:
+// blocks run by the JIT, AOT translations and lockstep lanes are missing
+// from ops and pc, whatever they hand back to it is there
+bool chip8_profileDump(const chip8* chip, const char* path);
+#else
+#define PROFILE_OP(chip, op) ((void)0)
+#define PROFILE_PC(chip, pc) ((void)0)
+#define PROFILE_DRAW(chip) ((void)0)
+#define PROFILE_FRAME(chip) ((void)0)
+#endif
+
+#endif // !profile_h
@@ -0,0 +1,23 @@
+#ifndef quirks_h
+#define quirks_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Quirk profiles by name and by ROM. The database is a text file with a
+// "<ROM hash> <profile>" line per ROM, the hash in the 16 hex digits of
+// chip8_romHash and the profile a quirks_name. '#' starts a comment.
+
+// e.g. "vip", the name frontends accept
+const char* quirks_name(chip8_quirks quirks);
+// false if name is none of them
+bool quirks_parse(const char* name, chip8_quirks* quirks);
+
+// the profile the database at path lists for the ROM, fallback if the file
+// cannot be read or does not know the ROM. Malformed lines are reported
+// and skipped
+chip8_quirks quirks_lookup(const char* path, uint64_t romHash, chip8_quirks fallback);
+
+#endif // !quirks_h
@@ -0,0 +1,82 @@
+#ifndef raster_h
+#define raster_h
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+#define RASTER_MAX_SCALE 8
+
+typedef enum {
+  RASTER_RGBA8888,                // bytes R, G, B, A
+  RASTER_RGB565,                  // native-endian 16-bit words
+  RASTER_FORMAT_COUNT
+} raster_format;
+
+// Software renderer, for machines without a GPU or display. The screen is
+// drawn at HIRES_WIDTH x HIRES_HEIGHT times scale, lores pixels cover two
+// by two of those. Every source row is first widened one plane byte at a
+// time through a table, then turned into colours eight pixels at a time by
+// a SIMD kernel and copied down for the rows it covers. With scanlines the
+// last output row of every hires row is drawn at half brightness.
+//
+// Read-only once set up, one raster can be shared by any number of
+// instances and threads.
+typedef struct {
+  raster_format format;
+  uint32_t scale;
+  uint32_t width;                 // output pixels
+  uint32_t height;
+  size_t stride;                  // bytes per output row
+  bool scanlines;
+
+  uint32_t colors[2][4];          // in the output format, bright and scanline
+  uint8_t spread[2][256][2 * RASTER_MAX_SCALE]; // hires, lores: a byte widened
+} raster;
+
+// shade per combination of the two plane bits as 0xRRGGBB, like on screen
+extern const uint32_t raster_defaultPalette[4];
+
+// false if scale is not in [1, RASTER_MAX_SCALE]. palette may be NULL for
+// raster_defaultPalette
+bool raster_init(raster* r, raster_format format, uint32_t scale, const uint32_t palette[4],
+                 bool scanlines);
+
+// bytes of a whole picture, height * stride
+size_t raster_size(const raster* r);
+
+// draws the two planes of chip8.gfx, or chip8_frame.gfx, into out
+void raster_render(const raster* r, const uint64_t* plane0, const uint64_t* plane1, bool hires,
+                   void* out);
+
+// Shared-memory file other processes can map to watch the screen, e.g.
+// under /dev/shm. A header is followed by the pixels at RASTER_SHM_PIXELS.
+// sequence is odd while a picture is written: readers load it, copy the
+// pixels and load it again, and retry if it was odd or changed.
+#define RASTER_SHM_PIXELS 64
+
+typedef struct {
+  char magic[4];                  // "C8FB"
+  uint32_t format;                // raster_format
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint32_t reserved;
+  atomic_uint_least64_t sequence;
+  uint64_t frame;                 // the emulated frame it shows
+} raster_shmHeader;
+
+typedef struct raster_shm raster_shm;
+
+// creates or truncates path and maps it, NULL on failure
+raster_shm* raster_shmOpen(const raster* r, const char* path);
+void raster_shmClose(raster_shm* shm);
+
+// the pixels to render into between the two calls
+void* raster_shmBegin(raster_shm* shm);
+void raster_shmEnd(raster_shm* shm, uint64_t frame);
+
+#endif // !raster_h
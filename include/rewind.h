@@ -0,0 +1,46 @@
+#ifndef rewind_h
+#define rewind_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "chip8.h"
+
+// Rewind history. Every pushed frame is stored as the XOR between its state
+// and the one before, run-length encoded, in a circular arena; when the
+// arena or the frame limit is full the oldest frames are dropped. Frames
+// mostly differ in a handful of bytes, so minutes of history take a few MB.
+typedef struct {
+  size_t offset;
+  size_t size;
+} rewind_entry;
+
+typedef struct {
+  uint8_t* arena;
+  size_t arenaSize;
+  size_t writePos;
+
+  rewind_entry* entries;          // ring, oldest at head
+  size_t capacity;
+  size_t head;
+  size_t count;
+
+  chip8_state current;            // newest state, deltas lead back from it
+  bool hasCurrent;
+
+  chip8_state scratch;
+  uint8_t* packed;                // worst-case sized encode buffer
+} rewind_buffer;
+
+bool rewind_init(rewind_buffer* buffer, size_t arenaSize, size_t maxFrames);
+void rewind_free(rewind_buffer* buffer);
+
+void rewind_push(rewind_buffer* buffer, const chip8* chip);
+
+// restores the frame before the newest one and drops the newest,
+// returns false when there is no older frame left
+bool rewind_stepBack(rewind_buffer* buffer, chip8* chip);
+
+size_t rewind_frames(const rewind_buffer* buffer);
+
+#endif // !rewind_h
@@ -0,0 +1,24 @@
+#ifndef scheduler_h
+#define scheduler_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define FRAME_RATE 60             // timers and presentation run at 60 Hz
+#define DEFAULT_IPF 10            // instructions per frame, ~600 Hz
+
+typedef struct {
+  uint32_t ipf;                   // instructions executed per frame
+  bool turbo;                     // uncapped, never sleeps
+  struct timespec deadline;       // when the next frame is due
+  uint64_t frames;
+} scheduler;
+
+void scheduler_init(scheduler* sched, uint32_t ipf, bool turbo);
+
+// sleeps until the next frame deadline. If the host fell more than a frame
+// behind, the deadline is moved instead of running frames back to back
+void scheduler_waitNextFrame(scheduler* sched);
+
+#endif // !scheduler_h
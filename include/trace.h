@@ -0,0 +1,108 @@
+#ifndef trace_h
+#define trace_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+#define TRACE_DEFAULT_BYTES (4 << 20)  // ring, minutes of calls at emulator speed
+#define TRACE_BLOCK_BYTES (256 << 10)  // of records per compressed block
+#define TRACE_FLUSH_MS 50              // how often the writer looks at the ring
+
+// Execution trace of every instruction a chip runs, recorded a
+// chip8_execute call at a time: chip8.trace makes each call append the
+// machine state it starts from and, once it returns, how many instructions
+// it ran. The core is deterministic, so the reader gets every instruction
+// back by running the calls again from their recorded states; the
+// interpreter itself runs exactly as it does untraced.
+//
+// Records go into an in-memory ring that a background thread compresses
+// into a file. Appending never takes a lock or waits for the disk. When
+// the ring is full the call is dropped and counted, and the next one that
+// fits records the whole machine again, unless the trace is lossless, then
+// the call waits for room first.
+//
+// File layout, little-endian:
+//   "C8TR", u16 version, u16 build flags (bit 0 CHIP8_CHECKED, bit 1
+//   CHIP8_PROFILE), u32 ring bytes, u32 CHIP8_CORE_ABI. Readers only take
+//   traces of a core that replays them the same way
+//   then blocks of u64 first instruction, u32 bytes, u32 compressed bytes
+//   and that many bytes of records compressed as one LZ4 block. A block of
+//   no bytes ends the file, its first is how many instructions were traced.
+// A record is one call:
+//   u32 size, u64 first instruction, u32 instructions run, u8 kind (0 a
+//   call, 1 the whole machine), u8 mask of the groups of the state below
+//   that differ from where the last call stopped, u16 flags (bit 0: it
+//   ended in an idle loop or a fault, which the reader does not run), u32
+//   FNV-1a of the pc, I, V and sp it ended with otherwise, those groups.
+//   The groups are u8 quirks, sp, delay and sound timers, hires, planes,
+//   pitch and zero; u16 I, pc, opcode and zero; u64 rng; the 16 key bytes;
+//   V0-VF; the 16 flags; the 16 pattern bytes; the 16 u16 of the stack.
+//   Whole machine records have every group, then the screen (chip8.gfx, as
+//   u64). Last u16 count and count times a u16 block number and its
+//   DIRTY_BLOCK bytes of memory: those written since the last call, or
+//   every block chip8.dirty lists for the whole machine.
+// Instructions are numbered from 0, those missing between records were
+// dropped.
+typedef struct trace trace;
+
+typedef struct {
+  uint64_t entries;               // instructions traced
+  uint64_t written;               // to the file
+  uint64_t dropped;               // run by calls the ring had no room for
+  uint64_t bytes;                 // file size
+  bool failed;                    // a write failed, the rest was discarded
+} trace_stats;
+
+// NULL if the file cannot be created. bytes is the size of the ring and is
+// rounded up to a power of two of at least twice TRACE_BLOCK_BYTES
+trace* trace_open(const char* path, uint32_t bytes, bool lossless);
+
+// what to set chip8.trace to. The next call records the whole machine, so
+// one trace can follow several chips, or one chip reinitialized, in turn
+chip8_traceLink* trace_link(trace* t);
+
+// writes what is left in the ring, finishes the file and frees everything.
+// The chip must not run with the link anymore
+trace_stats trace_close(trace* t);
+
+// Reading a trace back, as the instructions the calls ran
+
+// one executed instruction: where it ran and the state it left behind. x
+// is the X of the opcode, vx what V[x] holds after it, which is the
+// register it changed for those that write one
+typedef struct {
+  uint16_t pc;
+  uint16_t opcode;
+  uint16_t I;
+  uint8_t x;
+  uint8_t vx;
+  uint8_t vf;
+  uint8_t sp;
+  uint8_t delay_timer;
+  uint8_t sound_timer;
+} trace_entry;
+
+typedef struct trace_reader trace_reader;
+
+typedef struct {
+  uint64_t first;                 // number of entries[0]
+  uint32_t count;
+  const trace_entry* entries;     // valid until the next read
+  bool diverged;                  // the call the block ends ended elsewhere when traced
+} trace_block;
+
+// NULL if the file cannot be read, is not a trace or comes from a core
+// that would replay it differently, which is reported
+trace_reader* trace_readerOpen(const char* path);
+void trace_readerClose(trace_reader* reader);
+
+// false at the end of the trace, or at a block that cannot be read
+bool trace_read(trace_reader* reader, trace_block* block);
+
+// once trace_read returned false: whether the file ended properly, and if
+// so how many instructions were traced
+bool trace_complete(const trace_reader* reader, uint64_t* entries);
+
+#endif // !trace_h
@@ -0,0 +1,37 @@
+#ifndef triplebuffer_h
+#define triplebuffer_h
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+typedef struct {
+  uint64_t gfx[PLANES][PLANE_WORDS]; // same layout as chip8.gfx
+  bool hires;
+  uint64_t sequence;              // number of the emulated frame it came from
+} chip8_frame;
+
+// Wait-free single producer / single consumer handoff. The producer always
+// owns the back slot and the consumer the front slot; publishing and
+// consuming swap them with the shared middle slot in one atomic exchange,
+// so neither side ever waits for the other.
+typedef struct {
+  chip8_frame slots[3];
+  atomic_uint_fast8_t middle;     // slot index, TRIPLEBUFFER_FRESH if unread
+  uint8_t back;                   // producer side
+  uint8_t front;                  // consumer side
+} triplebuffer;
+
+void triplebuffer_init(triplebuffer* tb);
+
+// producer: fill the back slot, then publish it
+chip8_frame* triplebuffer_back(triplebuffer* tb);
+void triplebuffer_publish(triplebuffer* tb);
+
+// consumer: returns true if a newer frame was swapped into the front slot
+bool triplebuffer_consume(triplebuffer* tb);
+const chip8_frame* triplebuffer_front(const triplebuffer* tb);
+
+#endif // !triplebuffer_h
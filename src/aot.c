@@ -0,0 +1,202 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "aot.h"
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct chip8_aot {
+  chip8* chip;
+  void* library;
+  const chip8_aot_module* module;
+
+  // blocks only come from code memory
+  const chip8_aot_block* byAddress[CODE_MEMORY];
+  bool covered[CODE_MEMORY];
+  uint16_t longestBlock;          // bytes
+
+  // set when memory under a block may no longer hold the ROM bytes it was
+  // translated from, cleared again once it is checked to still match
+  bool* stale;
+};
+
+bool chip8_aot_cachePath(char* path, size_t capacity, const char* cacheDir, uint64_t hash) {
+  int length = snprintf(path, capacity, "%s/%016llx.so", cacheDir, (unsigned long long)hash);
+  return length > 0 && (size_t)length < capacity;
+}
+
+static void markAllStale(chip8_aot* aot) {
+  for (uint32_t i = 0; i < aot->module->blockCount; i++)
+    aot->stale[i] = true;
+}
+
+static void onCodeWrite(void* user, uint16_t address, uint16_t length) {
+  chip8_aot* aot = user;
+
+  for (uint16_t i = 0; i < length; i++) {
+    uint16_t byte = (address + i) & (MAX_MEMORY - 1);
+    if (byte >= CODE_MEMORY || !aot->covered[byte])
+      continue;
+
+    int lowest = byte - aot->longestBlock + 1;
+    for (int start = lowest < 0 ? 0 : lowest; start <= byte; start++) {
+      const chip8_aot_block* block = aot->byAddress[start];
+      if (block != NULL && byte < block->end)
+        aot->stale[block - aot->module->blocks] = true;
+    }
+  }
+}
+
+// true once the block's memory matches the ROM it was translated from
+static bool verify(chip8_aot* aot, const chip8_aot_block* block) {
+  size_t index = block - aot->module->blocks;
+  if (!aot->stale[index])
+    return true;
+
+  const uint8_t* original = aot->module->rom + (block->start - PROGRAM_START);
+  if (memcmp(aot->chip->memory + block->start, original, block->end - block->start) != 0)
+    return false;
+
+  aot->stale[index] = false;
+  return true;
+}
+
+static bool validModule(const chip8_aot_module* module, const uint8_t* rom, size_t size) {
+  if (module->abi != CHIP8_AOT_ABI || module->chipSize != sizeof(chip8))
+    return false;
+  if (module->romSize != size || memcmp(module->rom, rom, size) != 0)
+    return false;
+
+  for (uint32_t i = 0; i < module->blockCount; i++) {
+    const chip8_aot_block* block = &module->blocks[i];
+    if (block->start < PROGRAM_START || block->end <= block->start ||
+        block->end > PROGRAM_START + size || block->end > CODE_MEMORY ||
+        block->interpreted > block->count)
+      return false;
+  }
+
+  return true;
+}
+
+chip8_aot* chip8_aot_load(chip8* chip, const char* cacheDir, const uint8_t* rom, size_t size) {
+#ifdef CHIP8_CHECKED
+  (void)chip;
+  (void)cacheDir;
+  (void)rom;
+  (void)size;
+  return NULL;
+#endif
+
+  char path[4096];
+  if (!chip8_aot_cachePath(path, sizeof(path), cacheDir, chip8_romHash(rom, size)))
+    return NULL;
+
+  void* library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (library == NULL)
+    return NULL;
+
+  const chip8_aot_module* module = dlsym(library, CHIP8_AOT_SYMBOL);
+  if (module == NULL || !validModule(module, rom, size)) {
+    fprintf(stderr, "Ignoring stale AOT translation \"%s\".\n", path);
+    dlclose(library);
+    return NULL;
+  }
+
+  chip8_aot* aot = calloc(1, sizeof(*aot));
+  bool* stale = calloc(module->blockCount + 1, sizeof(bool));
+  if (aot == NULL || stale == NULL) {
+    free(aot);
+    free(stale);
+    dlclose(library);
+    return NULL;
+  }
+
+  aot->chip = chip;
+  aot->library = library;
+  aot->module = module;
+  aot->stale = stale;
+
+  for (uint32_t i = 0; i < module->blockCount; i++) {
+    const chip8_aot_block* block = &module->blocks[i];
+    aot->byAddress[block->start] = block;
+
+    for (uint16_t a = block->start; a < block->end; a++)
+      aot->covered[a] = true;
+
+    if (block->end - block->start > aot->longestBlock)
+      aot->longestBlock = block->end - block->start;
+  }
+
+  chip8_aot_reset(aot);
+  return aot;
+}
+
+void chip8_aot_unload(chip8_aot* aot) {
+  if (aot == NULL)
+    return;
+
+  if (aot->chip->hookUser == aot)
+    aot->chip->codeWriteHook = NULL;
+
+  dlclose(aot->library);
+  free(aot->stale);
+  free(aot);
+}
+
+void chip8_aot_reset(chip8_aot* aot) {
+  // the chip may hold anything now, every block is checked on first use
+  markAllStale(aot);
+  aot->chip->codeWriteHook = onCodeWrite;
+  aot->chip->hookUser = aot;
+}
+
+void chip8_aot_execute(chip8_aot* aot, uint32_t cycles) {
+  chip8* chip = aot->chip;
+
+  // translations implement the default quirks only
+  if (chip->quirks != CHIP8_QUIRKS_DEFAULT) {
+    chip8_execute(chip, cycles);
+    return;
+  }
+
+  chip->idle = CHIP8_IDLE_NONE;
+
+  while (cycles > 0) {
+    uint16_t pc = chip->pc;
+    const chip8_aot_block* block = pc < CODE_MEMORY ? aot->byAddress[pc] : NULL;
+
+    if (block == NULL || !verify(aot, block)) {
+      chip8_execute(chip, 1);
+      cycles--;
+      continue;
+    }
+
+    // never overshoot the budget, the rest of it goes to the interpreter
+    if (block->count > cycles) {
+      chip8_execute(chip, cycles);
+      return;
+    }
+
+    // interpreted instructions already counted themselves
+    block->run(chip, chip8_execute);
+    chip->opcode = block->lastOpcode;
+    chip->cycles += block->count - block->interpreted;
+    cycles -= block->count;
+
+    if (block->stores != 0)
+      chip8_invalidate(chip, chip->I, block->stores);
+
+    // a key wait handed to the interpreter found no key, it skips the rest
+    if (chip->idle != CHIP8_IDLE_NONE && cycles > 0) {
+      chip8_execute(chip, cycles);
+      return;
+    }
+  }
+}
+
+void chip8_aot_runFrame(chip8_aot* aot, uint32_t ipf) {
+  chip8_aot_execute(aot, ipf);
+  chip8_tickTimers(aot->chip);
+}
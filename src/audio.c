@@ -0,0 +1,108 @@
+#include "audio.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "scheduler.h"
+
+#define AUDIO_RING_MASK (AUDIO_RING_FRAMES - 1)
+#define PATTERN_BITS 128
+
+_Static_assert((AUDIO_RING_FRAMES & AUDIO_RING_MASK) == 0,
+               "AUDIO_RING_FRAMES must be a power of two");
+
+void audio_init(audio_synth* synth, uint32_t sampleRate) {
+  memset(synth->ring, 0x0, sizeof(synth->ring));
+  atomic_init(&synth->head, 0);
+  atomic_init(&synth->tail, 0);
+
+  synth->sampleRate = sampleRate;
+  synth->remaining = 0;
+  synth->fraction = 0;
+  memset(&synth->current, 0x0, sizeof(synth->current));
+  synth->phase = 0;
+  synth->step = 0;
+  synth->usePattern = false;
+}
+
+void audio_push(audio_synth* synth, bool on, uint8_t pitch, const uint8_t* pattern) {
+  unsigned head = atomic_load_explicit(&synth->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&synth->tail, memory_order_acquire);
+  if (head - tail == AUDIO_RING_FRAMES)
+    return;
+
+  audio_frame* frame = &synth->ring[head & AUDIO_RING_MASK];
+  frame->on = on;
+  frame->pitch = pitch;
+  memcpy(frame->pattern, pattern, sizeof(frame->pattern));
+  atomic_store_explicit(&synth->head, head + 1, memory_order_release);
+}
+
+// the pattern is played at 4000 * 2^((pitch - 64) / 48) bits per second,
+// one pass over its 128 bits is a full turn of the phase
+static void startFrame(audio_synth* synth) {
+  const audio_frame* frame = &synth->current;
+
+  synth->usePattern = false;
+  for (int i = 0; i < 16; i++)
+    synth->usePattern |= frame->pattern[i] != 0;
+
+  double rate = synth->usePattern ? 4000.0 * exp2((frame->pitch - 64) / 48.0) / PATTERN_BITS
+                                  : AUDIO_TONE;
+  synth->step = (uint32_t)(rate * 4294967296.0 / synth->sampleRate);
+
+  // silence restarts the waveform so every note begins the same way
+  if (!frame->on)
+    synth->phase = 0;
+
+  uint32_t total = synth->sampleRate + synth->fraction;
+  synth->remaining = total / FRAME_RATE;
+  synth->fraction = total % FRAME_RATE;
+}
+
+// takes the newest record waiting, false on an underrun
+static bool nextFrame(audio_synth* synth) {
+  unsigned tail = atomic_load_explicit(&synth->tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&synth->head, memory_order_acquire);
+  if (head == tail)
+    return false;
+
+  synth->current = synth->ring[(head - 1) & AUDIO_RING_MASK];
+  atomic_store_explicit(&synth->tail, head, memory_order_release);
+  startFrame(synth);
+  return true;
+}
+
+void audio_render(audio_synth* synth, int16_t* out, uint32_t samples) {
+  // a frame that arrived since the last call starts right away instead of
+  // after the current one, sound reacts within one device period
+  nextFrame(synth);
+
+  while (samples > 0) {
+    if (synth->remaining == 0 && !nextFrame(synth))
+      startFrame(synth);
+
+    uint32_t count = samples < synth->remaining ? samples : synth->remaining;
+    const audio_frame* frame = &synth->current;
+
+    if (!frame->on) {
+      memset(out, 0x0, count * sizeof(*out));
+    } else if (synth->usePattern) {
+      for (uint32_t i = 0; i < count; i++) {
+        uint32_t bit = synth->phase >> 25;
+        bool high = frame->pattern[bit >> 3] & (0x80 >> (bit & 7));
+        out[i] = high ? AUDIO_AMPLITUDE : -AUDIO_AMPLITUDE;
+        synth->phase += synth->step;
+      }
+    } else {
+      for (uint32_t i = 0; i < count; i++) {
+        out[i] = synth->phase < 0x80000000u ? AUDIO_AMPLITUDE : -AUDIO_AMPLITUDE;
+        synth->phase += synth->step;
+      }
+    }
+
+    out += count;
+    samples -= count;
+    synth->remaining -= count;
+  }
+}
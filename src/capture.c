@@ -0,0 +1,502 @@
+#include "capture.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scheduler.h"
+
+#define CAPTURE_POOL_MASK (CAPTURE_POOL_FRAMES - 1)
+#define PIXELS (HIRES_WIDTH * HIRES_HEIGHT)
+
+#define GIF_MIN_CODE_SIZE 2       // four colours
+#define GIF_CLEAR (1 << GIF_MIN_CODE_SIZE)
+#define GIF_MAX_CODE 4095
+#define GIF_MIN_DELAY 2           // centiseconds, viewers slow down anything shorter
+
+_Static_assert((CAPTURE_POOL_FRAMES & CAPTURE_POOL_MASK) == 0,
+               "CAPTURE_POOL_FRAMES must be a power of two");
+
+// shade per combination of the two plane bits, as on screen
+static const uint8_t capture_palette[4] = { 0x00, 0xFF, 0x80, 0xC0 };
+
+struct capture {
+  capture_format format;
+  bool lossless;
+  FILE* file;                     // NULL for PNG sequences
+  char* stem;                     // PNG sequences, path without .png
+
+  // frame pool, a ring between the pushing thread and the encoder. filled
+  // counts frames to encode, free the slots left
+  chip8_frame* pool;
+  atomic_uint head;               // written by the pushing thread
+  unsigned tail;                  // encoder side
+  sem_t filled;
+  sem_t free;
+  atomic_bool closing;
+  uint64_t dropped;               // pushing thread
+
+  // encoder thread. The picture held is written out once the next
+  // different one shows how long it lasted
+  pthread_t thread;
+  uint64_t frames;
+  bool failed;
+  bool holding;
+  uint64_t first;                 // sequence of the first frame
+  uint64_t heldSequence;          // when the held picture appeared
+  uint8_t held[PIXELS];           // palette indices, 128x64
+  uint8_t next[PIXELS];
+
+  // GIF: what the viewer shows so far, and the LZW dictionary
+  bool drawn;                     // the first image covers the whole screen
+  uint8_t shown[PIXELS];
+  uint16_t codes[GIF_MAX_CODE + 1][4];
+  uint32_t bits;
+  int bitCount;
+  uint8_t block[255];
+  int blockLength;
+};
+
+capture_format capture_formatOf(const char* path) {
+  static const char* extensions[CAPTURE_FORMAT_COUNT] = { ".y4m", ".gif", ".png" };
+
+  size_t length = strlen(path);
+  for (int format = 0; format < CAPTURE_FORMAT_COUNT; format++) {
+    size_t extension = strlen(extensions[format]);
+    if (length > extension && strcmp(path + length - extension, extensions[format]) == 0)
+      return (capture_format)format;
+  }
+  return CAPTURE_FORMAT_COUNT;
+}
+
+// lores frames have their pixels doubled, like on screen
+static void expand(const chip8_frame* frame, uint8_t* pixels) {
+  int scale = frame->hires ? 1 : 2;
+  int words = frame->hires ? HIRES_WIDTH / 64 : 1;
+
+  for (int y = 0; y < HIRES_HEIGHT; y++) {
+    const uint64_t* row0 = frame->gfx[0] + (y / scale) * words;
+    const uint64_t* row1 = frame->gfx[1] + (y / scale) * words;
+    for (int x = 0; x < HIRES_WIDTH; x++) {
+      int column = x / scale;
+      int shift = 63 - column % 64;
+      pixels[x + (y * HIRES_WIDTH)] = ((row0[column / 64] >> shift) & 1) |
+                                      (((row1[column / 64] >> shift) & 1) << 1);
+    }
+  }
+}
+
+static void put(capture* cap, const void* data, size_t size) {
+  if (!cap->failed && fwrite(data, 1, size, cap->file) != size)
+    cap->failed = true;
+}
+
+// Y4M: the held picture once per frame it lasted, chroma is flat grey
+
+static void y4mHeader(capture* cap) {
+  char header[64];
+  int length = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+                        HIRES_WIDTH, HIRES_HEIGHT, FRAME_RATE);
+  put(cap, header, (size_t)length);
+}
+
+static void y4mFrame(capture* cap, uint64_t frames) {
+  uint8_t luma[PIXELS];
+  for (int i = 0; i < PIXELS; i++)
+    luma[i] = capture_palette[cap->held[i]];
+  uint8_t chroma[PIXELS / 2];
+  memset(chroma, 0x80, sizeof(chroma));
+
+  for (uint64_t i = 0; i < frames; i++) {
+    put(cap, "FRAME\n", 6);
+    put(cap, luma, sizeof(luma));
+    put(cap, chroma, sizeof(chroma));
+  }
+}
+
+// GIF: every picture is drawn over the previous one, so only the rectangle
+// that changed is encoded
+
+static void gifHeader(capture* cap) {
+  uint8_t header[13 + 3 * 4] = {
+    'G', 'I', 'F', '8', '9', 'a',
+    HIRES_WIDTH & 0xFF, HIRES_WIDTH >> 8, HIRES_HEIGHT & 0xFF, HIRES_HEIGHT >> 8,
+    0xF1,                         // global table of 2^(1 + 1) colours, 8 bits each
+    0, 0,
+  };
+  for (int i = 0; i < 4; i++)
+    memset(header + 13 + 3 * i, capture_palette[i], 3);
+  put(cap, header, sizeof(header));
+}
+
+static void gifByte(capture* cap, uint8_t byte) {
+  cap->block[cap->blockLength++] = byte;
+  if (cap->blockLength == sizeof(cap->block)) {
+    uint8_t length = (uint8_t)cap->blockLength;
+    put(cap, &length, 1);
+    put(cap, cap->block, sizeof(cap->block));
+    cap->blockLength = 0;
+  }
+}
+
+static void gifCode(capture* cap, unsigned code, int size) {
+  cap->bits |= (uint32_t)code << cap->bitCount;
+  cap->bitCount += size;
+  while (cap->bitCount >= 8) {
+    gifByte(cap, cap->bits & 0xFF);
+    cap->bits >>= 8;
+    cap->bitCount -= 8;
+  }
+}
+
+// LZW over the four colours, the dictionary is a trie indexed by the code of
+// the prefix and the next colour
+static void gifPixels(capture* cap, int left, int top, int width, int height) {
+  uint8_t minCodeSize = GIF_MIN_CODE_SIZE;
+  put(cap, &minCodeSize, 1);
+
+  memset(cap->codes, 0x0, sizeof(cap->codes));
+  cap->bits = 0;
+  cap->bitCount = 0;
+  cap->blockLength = 0;
+
+  int size = GIF_MIN_CODE_SIZE + 1;
+  unsigned last = GIF_CLEAR + 1;
+  gifCode(cap, GIF_CLEAR, size);
+
+  int current = -1;
+  for (int y = top; y < top + height; y++) {
+    for (int x = left; x < left + width; x++) {
+      uint8_t pixel = cap->held[x + (y * HIRES_WIDTH)];
+      if (current < 0) {
+        current = pixel;
+        continue;
+      }
+      if (cap->codes[current][pixel] != 0) {
+        current = cap->codes[current][pixel];
+        continue;
+      }
+
+      gifCode(cap, (unsigned)current, size);
+      cap->codes[current][pixel] = (uint16_t)++last;
+      if (last >= (1u << size))
+        size++;
+      if (last == GIF_MAX_CODE) {
+        gifCode(cap, GIF_CLEAR, size);
+        memset(cap->codes, 0x0, sizeof(cap->codes));
+        size = GIF_MIN_CODE_SIZE + 1;
+        last = GIF_CLEAR + 1;
+      }
+      current = pixel;
+    }
+  }
+
+  gifCode(cap, (unsigned)current, size);
+  gifCode(cap, GIF_CLEAR, size);
+  gifCode(cap, GIF_CLEAR + 1, GIF_MIN_CODE_SIZE + 1);
+  if (cap->bitCount > 0)
+    gifByte(cap, cap->bits & 0xFF);
+
+  uint8_t length = (uint8_t)cap->blockLength;
+  if (length > 0) {
+    put(cap, &length, 1);
+    put(cap, cap->block, length);
+  }
+  uint8_t terminator = 0;
+  put(cap, &terminator, 1);
+}
+
+// centiseconds from the first frame, rounded down so the delays add up
+static uint64_t gifTime(const capture* cap, uint64_t sequence) {
+  return (sequence - cap->first) * 100 / FRAME_RATE;
+}
+
+// false while the picture lasted too short to show, it is then skipped and
+// the next one takes its place
+static bool gifFrame(capture* cap, uint64_t end, bool last) {
+  uint64_t delay = gifTime(cap, end) - gifTime(cap, cap->heldSequence);
+  if (delay < GIF_MIN_DELAY) {
+    if (!last)
+      return false;
+    delay = GIF_MIN_DELAY;
+  }
+  if (delay > UINT16_MAX)
+    delay = UINT16_MAX;
+
+  int left = HIRES_WIDTH, right = -1, top = HIRES_HEIGHT, bottom = -1;
+  for (int y = 0; y < HIRES_HEIGHT; y++) {
+    for (int x = 0; x < HIRES_WIDTH; x++) {
+      if (cap->held[x + (y * HIRES_WIDTH)] == cap->shown[x + (y * HIRES_WIDTH)])
+        continue;
+      left = x < left ? x : left;
+      right = x > right ? x : right;
+      top = y < top ? y : top;
+      bottom = y > bottom ? y : bottom;
+    }
+  }
+  // nothing changed since the last image, e.g. a change that was skipped
+  // and undone. One pixel carries the delay
+  if (right < 0)
+    left = right = top = bottom = 0;
+  if (!cap->drawn) {
+    left = top = 0;
+    right = HIRES_WIDTH - 1;
+    bottom = HIRES_HEIGHT - 1;
+    cap->drawn = true;
+  }
+
+  int width = right - left + 1;
+  int height = bottom - top + 1;
+  uint8_t header[8 + 10] = {
+    0x21, 0xF9, 4, 1 << 2,        // graphic control, keep the image drawn
+    delay & 0xFF, delay >> 8, 0, 0,
+    0x2C, left & 0xFF, left >> 8, top & 0xFF, top >> 8,
+    width & 0xFF, width >> 8, height & 0xFF, height >> 8, 0,
+  };
+  put(cap, header, sizeof(header));
+  gifPixels(cap, left, top, width, height);
+
+  memcpy(cap->shown, cap->held, sizeof(cap->shown));
+  return true;
+}
+
+// PNG: two bits per pixel on a four entry palette, stored without
+// compression since a frame is only 2K
+
+static uint32_t pngCrc(uint32_t crc, const uint8_t* data, size_t size) {
+  static uint32_t table[256];
+  if (table[1] == 0) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+        c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+  }
+
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++)
+    crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+static uint8_t* putBig32(uint8_t* out, uint32_t value) {
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+  return out + 4;
+}
+
+// chunk holds 4 bytes of room for the length in front of type and data and
+// the CRC behind them
+static void pngChunk(FILE* file, uint8_t* chunk, uint32_t length, bool* failed) {
+  putBig32(chunk, length);
+  putBig32(chunk + 8 + length, pngCrc(0, chunk + 4, length + 4));
+  if (fwrite(chunk, 1, length + 12, file) != length + 12)
+    *failed = true;
+}
+
+#define PNG_ROW (1 + HIRES_WIDTH / 4)
+#define PNG_DATA (PNG_ROW * HIRES_HEIGHT)
+
+static void pngFrame(capture* cap) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s-%06" PRIu64 ".png", cap->stem, cap->heldSequence - cap->first);
+  FILE* file = fopen(path, "wb");
+  if (file == NULL) {
+    cap->failed = true;
+    return;
+  }
+
+  static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+  bool failed = fwrite(signature, 1, sizeof(signature), file) != sizeof(signature);
+
+  uint8_t header[12 + 13] = { 0, 0, 0, 0, 'I', 'H', 'D', 'R' };
+  uint8_t* out = putBig32(putBig32(header + 8, HIRES_WIDTH), HIRES_HEIGHT);
+  memcpy(out, (uint8_t[]){ 2, 3, 0, 0, 0 }, 5); // 2-bit palette indices
+  pngChunk(file, header, 13, &failed);
+
+  uint8_t palette[12 + 3 * 4] = { 0, 0, 0, 0, 'P', 'L', 'T', 'E' };
+  for (int i = 0; i < 4; i++)
+    memset(palette + 8 + 3 * i, capture_palette[i], 3);
+  pngChunk(file, palette, 3 * 4, &failed);
+
+  // zlib stream of a single stored deflate block
+  uint8_t data[12 + 2 + 5 + PNG_DATA + 4] = { 0, 0, 0, 0, 'I', 'D', 'A', 'T', 0x78, 0x01, 1,
+                                              PNG_DATA & 0xFF, PNG_DATA >> 8,
+                                              ~PNG_DATA & 0xFF, (~PNG_DATA >> 8) & 0xFF };
+  uint8_t* rows = data + 8 + 2 + 5;
+  memset(rows, 0x0, PNG_DATA);
+  for (int y = 0; y < HIRES_HEIGHT; y++) {
+    uint8_t* row = rows + y * PNG_ROW;
+    for (int x = 0; x < HIRES_WIDTH; x++)
+      row[1 + x / 4] |= cap->held[x + (y * HIRES_WIDTH)] << (6 - 2 * (x % 4));
+  }
+  uint32_t a = 1, b = 0;
+  for (int i = 0; i < PNG_DATA; i++) {
+    a = (a + rows[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  putBig32(rows + PNG_DATA, (b << 16) | a);
+  pngChunk(file, data, 2 + 5 + PNG_DATA + 4, &failed);
+
+  uint8_t end[12] = { 0, 0, 0, 0, 'I', 'E', 'N', 'D' };
+  pngChunk(file, end, 0, &failed);
+
+  if (fclose(file) != 0 || failed)
+    cap->failed = true;
+}
+
+// writes the held picture, which lasted until end. false if it was skipped
+static bool encodeHeld(capture* cap, uint64_t end, bool last) {
+  switch (cap->format) {
+    case CAPTURE_Y4M:
+      y4mFrame(cap, end - cap->heldSequence);
+      return true;
+    case CAPTURE_GIF:
+      return gifFrame(cap, end, last);
+    case CAPTURE_PNG:
+      pngFrame(cap);
+      return true;
+    default:
+      return true;
+  }
+}
+
+// repeats of the held picture only stretch it, a new one flushes it
+static void encode(capture* cap, const chip8_frame* frame) {
+  cap->frames++;
+  if (cap->failed)
+    return;
+
+  expand(frame, cap->next);
+  if (!cap->holding) {
+    cap->holding = true;
+    cap->first = frame->sequence;
+    cap->heldSequence = frame->sequence;
+    memcpy(cap->held, cap->next, sizeof(cap->held));
+    return;
+  }
+
+  // a frame from before the held one, the sequence restarted
+  uint64_t sequence = frame->sequence > cap->heldSequence ? frame->sequence : cap->heldSequence + 1;
+  if (memcmp(cap->next, cap->held, sizeof(cap->held)) == 0)
+    return;
+
+  if (encodeHeld(cap, sequence, false))
+    cap->heldSequence = sequence;
+  memcpy(cap->held, cap->next, sizeof(cap->held));
+}
+
+static void* encoderThread(void* arg) {
+  capture* cap = arg;
+
+  for (;;) {
+    while (sem_wait(&cap->filled) != 0 && errno == EINTR)
+      continue;
+
+    if (cap->tail == atomic_load_explicit(&cap->head, memory_order_acquire)) {
+      // woken up by capture_close, everything pushed is encoded
+      if (atomic_load_explicit(&cap->closing, memory_order_relaxed))
+        break;
+      continue;
+    }
+
+    encode(cap, &cap->pool[cap->tail & CAPTURE_POOL_MASK]);
+    cap->tail++;
+    sem_post(&cap->free);
+  }
+
+  if (cap->holding && !cap->failed)
+    encodeHeld(cap, cap->heldSequence + 1, true);
+  return NULL;
+}
+
+capture* capture_open(const char* path, capture_format format, bool lossless) {
+  capture* cap = calloc(1, sizeof(capture));
+  if (cap == NULL)
+    return NULL;
+  cap->format = format;
+  cap->lossless = lossless;
+
+  cap->pool = malloc(CAPTURE_POOL_FRAMES * sizeof(chip8_frame));
+  if (cap->pool == NULL)
+    goto fail;
+
+  if (format == CAPTURE_PNG) {
+    size_t length = strlen(path) - strlen(".png");
+    if ((cap->stem = malloc(length + 1)) == NULL)
+      goto fail;
+    memcpy(cap->stem, path, length);
+    cap->stem[length] = '\0';
+  } else {
+    if ((cap->file = fopen(path, "wb")) == NULL)
+      goto fail;
+    if (format == CAPTURE_Y4M)
+      y4mHeader(cap);
+    else
+      gifHeader(cap);
+  }
+
+  atomic_init(&cap->head, 0);
+  atomic_init(&cap->closing, false);
+  sem_init(&cap->filled, 0, 0);
+  sem_init(&cap->free, 0, CAPTURE_POOL_FRAMES);
+
+  if (pthread_create(&cap->thread, NULL, encoderThread, cap) != 0) {
+    sem_destroy(&cap->filled);
+    sem_destroy(&cap->free);
+    goto fail;
+  }
+  return cap;
+
+fail:
+  if (cap->file != NULL)
+    fclose(cap->file);
+  free(cap->stem);
+  free(cap->pool);
+  free(cap);
+  return NULL;
+}
+
+bool capture_push(capture* cap, const chip8_frame* frame) {
+  if (cap->lossless) {
+    while (sem_wait(&cap->free) != 0 && errno == EINTR)
+      continue;
+  } else if (sem_trywait(&cap->free) != 0) {
+    cap->dropped++;
+    return false;
+  }
+
+  unsigned head = atomic_load_explicit(&cap->head, memory_order_relaxed);
+  memcpy(&cap->pool[head & CAPTURE_POOL_MASK], frame, sizeof(*frame));
+  atomic_store_explicit(&cap->head, head + 1, memory_order_release);
+  sem_post(&cap->filled);
+  return true;
+}
+
+capture_stats capture_close(capture* cap) {
+  atomic_store_explicit(&cap->closing, true, memory_order_relaxed);
+  sem_post(&cap->filled);
+  pthread_join(cap->thread, NULL);
+
+  if (cap->format == CAPTURE_GIF)
+    put(cap, ";", 1);
+  if (cap->file != NULL && fclose(cap->file) != 0)
+    cap->failed = true;
+
+  capture_stats stats = { cap->frames, cap->dropped, cap->failed };
+
+  sem_destroy(&cap->filled);
+  sem_destroy(&cap->free);
+  free(cap->stem);
+  free(cap->pool);
+  free(cap);
+  return stats;
+}
@@ -1,14 +1,15 @@
 #include "chip8.h"
-#include "raudio.h"
+#include "profile.h"
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
-#include <time.h>
 
 #define FONT_SET 80
+#define BIG_FONT_START FONT_SET   // FX30 digits right after the small ones
+#define BIG_FONT_SET 160
 
 uint8_t chip8_fontset[] = {
     0xF0, 0x90, 0x90, 0x90, 0xF0,      // 0
@@ -29,36 +30,65 @@ uint8_t chip8_fontset[] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
-void chip8_initialize(chip8* chip) {
-  // initialize registers and memory once
-  chip->pc = 0x200;
-  chip->I = 0;
-  chip->sp = 0;
-  chip->opcode = 0;
+// 8x10 digits for FX30, 0-9 as on the SUPER-CHIP, A-F as in Octo
+uint8_t chip8_bigFontset[] = {
+    0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+    0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+    0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+    0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+    0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+    0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+};
 
-  memset(chip->gfx, 0x0, sizeof(chip->gfx));
-  memset(chip->stack, 0x0, sizeof(chip->stack));
-  memset(chip->V, 0x0, sizeof(chip->V));
-  memset(chip->memory, 0x0, sizeof(chip->memory));
-  memset(chip->key, 0x0, sizeof(chip->key));
+void chip8_initialize(chip8* chip) {
+  // no file I/O or audio here, so headless instances are cheap to create
+  memset(chip, 0x0, sizeof(*chip));
 
   // load fontset
-  for (int i = 0; i < FONT_SET; i++) {
-    chip->memory[i] = chip8_fontset[i];
-  }
+  memcpy(chip->memory, chip8_fontset, FONT_SET);
+  memcpy(chip->memory + BIG_FONT_START, chip8_bigFontset, BIG_FONT_SET);
 
-  chip->delay_timer = 0;
-  chip->sound_timer = 0;
+  chip->pc = PROGRAM_START;
+  chip->planes = 0x1;
+  chip->pitch = CHIP8_DEFAULT_PITCH;
   chip->drawFlag = true;
+  chip8_seed(chip, CHIP8_DEFAULT_SEED);
+}
 
-  chip->beep = LoadSound("../assets/beep.wav");
+uint64_t chip8_seedState(uint64_t seed) {
+  // one splitmix64 step, so nearby seeds give unrelated streams and the
+  // state is never the zero xorshift cannot leave
+  uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  return z != 0 ? z : 0x9E3779B97F4A7C15ULL;
+}
 
-  srand(time(NULL));
+void chip8_seed(chip8* chip, uint64_t seed) {
+  chip->rng = chip8_seedState(seed);
 }
 
-void chip8_load(chip8* chip, const char* path) {
-#define PROGRAM_START 0x200
+bool chip8_loadBuffer(chip8* chip, const uint8_t* data, size_t size) {
+  if (size == 0 || size > MAX_MEMORY - PROGRAM_START)
+    return false;
 
+  memcpy(chip->memory + PROGRAM_START, data, size);
+  chip8_invalidate(chip, PROGRAM_START, size);
+  return true;
+}
+
+size_t chip8_load(chip8* chip, const char* path) {
   FILE* file = fopen(path, "rb");
   if (file == NULL) {
     fprintf(stderr, "Could not open file \"%s\".\n", path);
@@ -87,286 +117,685 @@ void chip8_load(chip8* chip, const char* path) {
     exit(1);
   }
 
-  for (size_t i = 0; i < fileSize; i++) {
-    chip->memory[i + PROGRAM_START] = buffer[i];
-  }
+  chip8_loadBuffer(chip, (const uint8_t*)buffer, fileSize);
 
   free(buffer);
   fclose(file);
+  return fileSize;
+}
+
+uint64_t chip8_romHash(const uint8_t* rom, size_t size) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
 
-#undef PROGRAM_START
+  for (size_t i = 0; i < size; i++) {
+    hash ^= rom[i];
+    hash *= 0x100000001B3ULL;
+  }
+
+  return hash;
 }
 
-Instruction chip8_table[];
-Instruction chip8_arithmetic[];
+static uint64_t hashWords(uint64_t hash, const uint64_t* words, int count) {
+  for (int w = 0; w < count; w++) {
+    for (int i = 0; i < 8; i++) {
+      hash ^= (words[w] >> (i * 8)) & 0xFF;
+      hash *= 0x100000001B3ULL;
+    }
+  }
+  return hash;
+}
 
-void chip8_emulateCycle(chip8* chip) {
-#define CHIP8_FETCH(chip) \
-  ((uint16_t)(((chip)->memory[(chip)->pc] << 8) | ((chip)->memory[(chip)->pc + 1])))
+uint64_t chip8_frameHash(const chip8* chip) {
+  int words = chip8_gfxWords(chip);
+  uint64_t hash = hashWords(0xCBF29CE484222325ULL, chip->gfx[0], words);
 
-  chip->opcode = CHIP8_FETCH(chip);
-  chip->pc += 2;
+  for (int w = 0; w < words; w++) {
+    if (chip->gfx[1][w] != 0)
+      return hashWords(hash, chip->gfx[1], words);
+  }
 
-  Instruction instruction = chip8_table[(chip->opcode & 0xF000) >> 12];
-  instruction(chip);
+  return hash;
+}
 
-  // update timers
-  if (chip->delay_timer > 0)
-    --chip->delay_timer;
+void chip8_gfxToBytes(const chip8* chip, uint8_t* out) {
+  int scale = chip->hires ? 1 : 2;
 
-  if (chip->sound_timer > 0) {
-    if (chip->sound_timer == 1)
-      PlaySound(chip->beep);
-    --chip->sound_timer;
+  for (int y = 0; y < HIRES_HEIGHT; y++) {
+    for (int x = 0; x < HIRES_WIDTH; x++)
+      out[x + (y * HIRES_WIDTH)] = chip8_getPixel(chip, x / scale, y / scale);
   }
+}
 
-#undef CHIP8_FETCH
+void chip8_invalidate(chip8* chip, uint16_t address, uint16_t length) {
+  if (length == 0)
+    return;
+
+  // an entry at an even address covers that byte and the next one, only
+  // code memory has entries
+  uint32_t first = address >> 1;
+  uint32_t last = ((uint32_t)address + length - 1) >> 1;
+
+  for (uint32_t i = first; i <= last && i < CODE_MEMORY / 2; i++)
+    chip->decoded[i].op = CHIP8_OP_DECODE;
+
+  uint32_t end = (uint32_t)address + length;
+  if (end > MAX_MEMORY)
+    end = MAX_MEMORY;
+  for (uint32_t block = address / DIRTY_BLOCK; block <= (end - 1) / DIRTY_BLOCK; block++) {
+    chip->dirty[block / 64] |= 1ULL << (block % 64);
+    if (chip->trace != NULL)
+      chip->trace->written[block / 64] |= 1ULL << (block % 64);
+  }
+
+  if (chip->codeWriteHook != NULL)
+    chip->codeWriteHook(chip->hookUser, address, length);
 }
 
-static void chip8_NULL(chip8* chip) {
-  fprintf(stderr, "Invalid opcode: 0x%04X.\n", chip->opcode);
+void chip8_snapshot(const chip8* chip, chip8_state* state) {
+  memcpy(state->memory, chip->memory, sizeof(state->memory));
+  memcpy(state->gfx, chip->gfx, sizeof(state->gfx));
+  memcpy(state->flags, chip->flags, sizeof(state->flags));
+  memcpy(state->pattern, chip->pattern, sizeof(state->pattern));
+  state->hires = chip->hires;
+  state->planes = chip->planes;
+  state->pitch = chip->pitch;
+  state->rng = chip->rng;
+  memcpy(state->stack, chip->stack, sizeof(state->stack));
+  memcpy(state->V, chip->V, sizeof(state->V));
+  memcpy(state->key, chip->key, sizeof(state->key));
+  state->opcode = chip->opcode;
+  state->I = chip->I;
+  state->pc = chip->pc;
+  state->sp = chip->sp;
+  state->delay_timer = chip->delay_timer;
+  state->sound_timer = chip->sound_timer;
+  memcpy(state->dirty, chip->dirty, sizeof(state->dirty));
 }
 
-// 00E0: clears the screen
-static void chip8_00E0(chip8* chip) {
-  memset(chip->gfx, 0x0, sizeof(chip->gfx));
+void chip8_restore(chip8* chip, const chip8_state* state) {
+  // outside the blocks either side wrote to both are as initialized, and
+  // restores usually only touch a few bytes of RAM, so only dirty blocks
+  // that actually differ are copied and have their decode entries
+  // invalidated
+  for (uint32_t word = 0; word < DIRTY_WORDS; word++) {
+    uint64_t blocks = chip->dirty[word] | state->dirty[word];
+    for (uint32_t bit = 0; blocks != 0; bit++, blocks >>= 1) {
+      uint32_t i = (word * 64 + bit) * DIRTY_BLOCK;
+      if ((blocks & 1) && memcmp(chip->memory + i, state->memory + i, DIRTY_BLOCK) != 0) {
+        memcpy(chip->memory + i, state->memory + i, DIRTY_BLOCK);
+        chip8_invalidate(chip, i, DIRTY_BLOCK);
+      }
+    }
+  }
+  memcpy(chip->dirty, state->dirty, sizeof(chip->dirty));
+
+  memcpy(chip->gfx, state->gfx, sizeof(chip->gfx));
+  memcpy(chip->flags, state->flags, sizeof(chip->flags));
+  memcpy(chip->pattern, state->pattern, sizeof(chip->pattern));
+  chip->hires = state->hires;
+  chip->planes = state->planes;
+  chip->pitch = state->pitch;
+  chip->rng = state->rng;
+  memcpy(chip->stack, state->stack, sizeof(chip->stack));
+  memcpy(chip->V, state->V, sizeof(chip->V));
+  memcpy(chip->key, state->key, sizeof(chip->key));
+  chip->opcode = state->opcode;
+  chip->I = state->I;
+  chip->pc = state->pc;
+  chip->sp = state->sp;
+  chip->delay_timer = state->delay_timer;
+  chip->sound_timer = state->sound_timer;
+
+  chip->drawFlag = true;
+  chip->idle = CHIP8_IDLE_NONE;
+#ifdef CHIP8_CHECKED
+  chip->fault = CHIP8_FAULT_NONE;
+#endif
+  // the screen changed behind the trace's back
+  if (chip->trace != NULL)
+    chip->trace->sync = true;
+}
+
+const char* chip8_opName(chip8_op op) {
+#define CHIP8_OP_NAME(name) #name,
+  static const char* names[CHIP8_OP_COUNT] = { CHIP8_OPS(CHIP8_OP_NAME) };
+#undef CHIP8_OP_NAME
+
+  return op < CHIP8_OP_COUNT ? names[op] : "INVALID";
+}
+
+chip8_decoded chip8_decode(uint16_t opcode) {
+  chip8_decoded d = {
+    .op = CHIP8_OP_INVALID,
+    .x = (opcode & 0x0F00) >> 8,
+    .y = (opcode & 0x00F0) >> 4,
+    .nn = opcode & 0x00FF,
+    .nnn = opcode & 0x0FFF,
+    .opcode = opcode,
+  };
+
+  static const uint8_t groups[16] = {
+    CHIP8_OP_INVALID, CHIP8_OP_1NNN, CHIP8_OP_2NNN, CHIP8_OP_3XNN,
+    CHIP8_OP_4XNN,    CHIP8_OP_INVALID, CHIP8_OP_6XNN, CHIP8_OP_7XNN,
+    CHIP8_OP_INVALID, CHIP8_OP_9XY0, CHIP8_OP_ANNN, CHIP8_OP_BNNN,
+    CHIP8_OP_CXNN,    CHIP8_OP_DXYN, CHIP8_OP_INVALID, CHIP8_OP_INVALID,
+  };
+
+  static const uint8_t arithmetic[16] = {
+    CHIP8_OP_8XY0, CHIP8_OP_8XY1, CHIP8_OP_8XY2, CHIP8_OP_8XY3,
+    CHIP8_OP_8XY4, CHIP8_OP_8XY5, CHIP8_OP_8XY6, CHIP8_OP_8XY7,
+    CHIP8_OP_INVALID, CHIP8_OP_INVALID, CHIP8_OP_INVALID, CHIP8_OP_INVALID,
+    CHIP8_OP_INVALID, CHIP8_OP_INVALID, CHIP8_OP_8XYE, CHIP8_OP_INVALID,
+  };
+
+  switch (opcode & 0xF000) {
+    case 0x0000:
+      switch (d.nn & 0xF0) {
+        case 0xC0: d.op = CHIP8_OP_00CN; break;
+        case 0xD0: d.op = CHIP8_OP_00DN; break;
+      }
+      switch (d.nn) {
+        case 0xE0: d.op = CHIP8_OP_00E0; break;
+        case 0xEE: d.op = CHIP8_OP_00EE; break;
+        case 0xFB: d.op = CHIP8_OP_00FB; break;
+        case 0xFC: d.op = CHIP8_OP_00FC; break;
+        case 0xFD: d.op = CHIP8_OP_00FD; break;
+        case 0xFE: d.op = CHIP8_OP_00FE; break;
+        case 0xFF: d.op = CHIP8_OP_00FF; break;
+      }
+      break;
+    case 0x5000:
+      switch (opcode & 0x000F) {
+        case 0x2: d.op = CHIP8_OP_5XY2; break;
+        case 0x3: d.op = CHIP8_OP_5XY3; break;
+        default: d.op = CHIP8_OP_5XY0; break;
+      }
+      break;
+    case 0x8000:
+      d.op = arithmetic[opcode & 0x000F];
+      break;
+    case 0xE000:
+      if (d.nn == 0x9E)
+        d.op = CHIP8_OP_EX9E;
+      else if (d.nn == 0xA1)
+        d.op = CHIP8_OP_EXA1;
+      break;
+    case 0xF000:
+      // F000 and F002 take no register
+      if (opcode == 0xF000)
+        d.op = CHIP8_OP_F000;
+      else if (opcode == 0xF002)
+        d.op = CHIP8_OP_F002;
+
+      switch (d.nn) {
+        case 0x01: d.op = CHIP8_OP_FN01; break;
+        case 0x07: d.op = CHIP8_OP_FX07; break;
+        case 0x0A: d.op = CHIP8_OP_FX0A; break;
+        case 0x15: d.op = CHIP8_OP_FX15; break;
+        case 0x18: d.op = CHIP8_OP_FX18; break;
+        case 0x1E: d.op = CHIP8_OP_FX1E; break;
+        case 0x29: d.op = CHIP8_OP_FX29; break;
+        case 0x30: d.op = CHIP8_OP_FX30; break;
+        case 0x33: d.op = CHIP8_OP_FX33; break;
+        case 0x3A: d.op = CHIP8_OP_FX3A; break;
+        case 0x55: d.op = CHIP8_OP_FX55; break;
+        case 0x65: d.op = CHIP8_OP_FX65; break;
+        case 0x75: d.op = CHIP8_OP_FX75; break;
+        case 0x85: d.op = CHIP8_OP_FX85; break;
+      }
+      break;
+    default:
+      d.op = groups[opcode >> 12];
+      break;
+  }
+
+  return d;
+}
+
+#ifdef CHIP8_CHECKED
+static void chip8_setFault(chip8* chip, chip8_fault fault, uint16_t address) {
+  if (chip->fault != CHIP8_FAULT_NONE)
+    return;
+
+  chip->fault = fault;
+  chip->faultPc = (chip->pc - 2) & (MAX_MEMORY - 1);
+  chip->faultAddress = address;
+}
+
+const char* chip8_faultName(chip8_fault fault) {
+  switch (fault) {
+    case CHIP8_FAULT_NONE: return "none";
+    case CHIP8_FAULT_INVALID_OPCODE: return "invalid opcode";
+    case CHIP8_FAULT_MEMORY: return "memory out of bounds";
+    case CHIP8_FAULT_STACK_OVERFLOW: return "stack overflow";
+    case CHIP8_FAULT_STACK_UNDERFLOW: return "stack underflow";
+    case CHIP8_FAULT_KEY: return "key out of range";
+    case CHIP8_FAULT_FONT: return "font digit out of range";
+  }
+  return "unknown";
+}
+
+// leaves the handler before an out of bounds access, chip8_execute stops
+// right after it
+#define CHECK(chip, ok, fault, address)           \
+  do {                                            \
+    if (!(ok)) {                                  \
+      chip8_setFault((chip), (fault), (address)); \
+      return;                                     \
+    }                                             \
+  } while (0)
+#else
+#define CHECK(chip, ok, fault, address) ((void)0)
+#endif
+
+// where FX55/FX65 leave I
+typedef enum {
+  LOAD_STORE_KEEP,
+  LOAD_STORE_ADD_X,               // CHIP-48
+  LOAD_STORE_ADD_X_PLUS_1,        // VIP, XO-CHIP
+} chip8_loadStore;
+
+#define CHIP8_FETCH(chip, pc) \
+  ((uint16_t)(((chip)->memory[(pc)] << 8) | ((chip)->memory[((pc) + 1) & (MAX_MEMORY - 1)])))
+
+// the planes FN01 selected, in order
+#define FOR_EACH_PLANE(chip, plane)                  \
+  for (int plane = 0; plane < PLANES; plane++)       \
+    if ((chip)->planes & (1 << plane))
+
+static void chip8_NULL(chip8* chip, const chip8_decoded* d) {
+  CHECK(chip, false, CHIP8_FAULT_INVALID_OPCODE, d->opcode);
+  (void)chip;
+  fprintf(stderr, "Invalid opcode: 0x%04X.\n", d->opcode);
+}
+
+// 00CN: scrolls the selected planes down by N rows, of the current resolution
+static inline void chip8_00CN(chip8* chip, const chip8_decoded* d) {
+  int total = chip8_gfxWords(chip);
+  int shift = (d->nn & 0x0F) * (chip->hires ? HIRES_WIDTH / 64 : 1);
+
+  FOR_EACH_PLANE(chip, plane) {
+    uint64_t* gfx = chip->gfx[plane];
+    memmove(gfx + shift, gfx, (total - shift) * sizeof(*gfx));
+    memset(gfx, 0x0, shift * sizeof(*gfx));
+  }
+  chip->drawFlag = true;
+}
+
+// 00DN: scrolls the selected planes up by N rows (XO-CHIP)
+static inline void chip8_00DN(chip8* chip, const chip8_decoded* d) {
+  int total = chip8_gfxWords(chip);
+  int shift = (d->nn & 0x0F) * (chip->hires ? HIRES_WIDTH / 64 : 1);
+
+  FOR_EACH_PLANE(chip, plane) {
+    uint64_t* gfx = chip->gfx[plane];
+    memmove(gfx, gfx + shift, (total - shift) * sizeof(*gfx));
+    memset(gfx + total - shift, 0x0, shift * sizeof(*gfx));
+  }
   chip->drawFlag = true;
 }
 
-#define GET_X(opcode) (((opcode) & 0x0F00) >> 8)
-#define GET_Y(opcode) (((opcode) & 0x00F0) >> 4)
-#define GET_N(opcode) ((opcode) & 0x000F)
-#define GET_NN(opcode) ((opcode) & 0x00FF)
-#define GET_NNN(opcode) ((opcode) & 0x0FFF)
+// 00E0: clears the selected planes
+static inline void chip8_00E0(chip8* chip, const chip8_decoded* d) {
+  (void)d;
+  PROFILE_DRAW(chip);
+  FOR_EACH_PLANE(chip, plane)
+    memset(chip->gfx[plane], 0x0, chip8_gfxWords(chip) * sizeof(uint64_t));
+  chip->drawFlag = true;
+}
 
 // 00EE: returns from a subroutine
-static void chip8_00EE(chip8* chip) {
+static inline void chip8_00EE(chip8* chip, const chip8_decoded* d) {
+  (void)d;
+  CHECK(chip, chip->sp != 0, CHIP8_FAULT_STACK_UNDERFLOW, 0);
   chip->sp--;
   chip->pc = chip->stack[chip->sp];
 }
 
+// 00FB: scrolls the selected planes right by 4 pixels
+static inline void chip8_00FB(chip8* chip, const chip8_decoded* d) {
+  (void)d;
+  FOR_EACH_PLANE(chip, plane) {
+    uint64_t* gfx = chip->gfx[plane];
+    if (chip->hires) {
+      for (int w = 0; w < PLANE_WORDS; w += 2) {
+        gfx[w + 1] = (gfx[w + 1] >> 4) | (gfx[w] << 60);
+        gfx[w] >>= 4;
+      }
+    } else {
+      for (int y = 0; y < HEIGHT; y++)
+        gfx[y] >>= 4;
+    }
+  }
+  chip->drawFlag = true;
+}
+
+// 00FC: scrolls the selected planes left by 4 pixels
+static inline void chip8_00FC(chip8* chip, const chip8_decoded* d) {
+  (void)d;
+  FOR_EACH_PLANE(chip, plane) {
+    uint64_t* gfx = chip->gfx[plane];
+    if (chip->hires) {
+      for (int w = 0; w < PLANE_WORDS; w += 2) {
+        gfx[w] = (gfx[w] << 4) | (gfx[w + 1] >> 60);
+        gfx[w + 1] <<= 4;
+      }
+    } else {
+      for (int y = 0; y < HEIGHT; y++)
+        gfx[y] <<= 4;
+    }
+  }
+  chip->drawFlag = true;
+}
+
+// 00FE/00FF: switches to lores/hires, which clears every plane
+static inline void chip8_setResolution(chip8* chip, bool hires) {
+  chip->hires = hires;
+  memset(chip->gfx, 0x0, sizeof(chip->gfx));
+  chip->drawFlag = true;
+}
+
 // 1NNN: jumps to address NNN
-static void chip8_1NNN(chip8* chip) {
-  uint16_t NNN = GET_NNN(chip->opcode);
-  chip->pc = NNN;
+static inline void chip8_1NNN(chip8* chip, const chip8_decoded* d) {
+  chip->pc = d->nnn;
 }
 
 // 2NNN: calls subroutine at NNN
-static void chip8_2NNN(chip8* chip) {
-  uint16_t NNN = GET_NNN(chip->opcode);
-
+static inline void chip8_2NNN(chip8* chip, const chip8_decoded* d) {
+  CHECK(chip, chip->sp < STACK_SIZE, CHIP8_FAULT_STACK_OVERFLOW, chip->sp);
   chip->stack[chip->sp] = chip->pc;
   chip->sp++;
-  chip->pc = NNN;
+  chip->pc = d->nnn;
 }
 
-// 3XNN: skips next instruction if VX equals NN
-static void chip8_3XNN(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-  uint8_t NN = GET_NN(chip->opcode);
+// steps over the next instruction, on XO-CHIP all four bytes of an F000 NNNN
+static inline void chip8_skip(chip8* chip, bool longSkip) {
+  chip->pc += longSkip && CHIP8_FETCH(chip, chip->pc) == 0xF000 ? 4 : 2;
+}
 
-  if (chip->V[X] == NN)
-    chip->pc += 2;
+// 3XNN: skips next instruction if VX equals NN
+static inline void chip8_3XNN(chip8* chip, const chip8_decoded* d, bool longSkip) {
+  if (chip->V[d->x] == d->nn)
+    chip8_skip(chip, longSkip);
 }
 
 // 4XNN: skips the next instruction if VX doesn't equal NN
-static void chip8_4XNN(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-  uint8_t NN = GET_NN(chip->opcode);
-
-  if (chip->V[X] != NN)
-    chip->pc += 2;
+static inline void chip8_4XNN(chip8* chip, const chip8_decoded* d, bool longSkip) {
+  if (chip->V[d->x] != d->nn)
+    chip8_skip(chip, longSkip);
 }
 
 // 5XY0: skips the next instruction if VX equals VY
-static void chip8_5XY0(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-  uint8_t Y = GET_Y(chip->opcode);
-
-  if (chip->V[X] == chip->V[Y])
-    chip->pc += 2;
+static inline void chip8_5XY0(chip8* chip, const chip8_decoded* d, bool longSkip) {
+  if (chip->V[d->x] == chip->V[d->y])
+    chip8_skip(chip, longSkip);
 }
 
-// 6XNN: sets VX to NM
-static void chip8_6XNN(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-  uint8_t NN = GET_NN(chip->opcode);
+// 5XY2: stores VX to VY in memory starting at I, in either direction.
+// I is not changed (XO-CHIP)
+static inline void chip8_5XY2(chip8* chip, const chip8_decoded* d) {
+  int step = d->x <= d->y ? 1 : -1;
+  int count = (d->y - d->x) * step + 1;
 
-  chip->V[X] = NN;
-}
+  CHECK(chip, chip->I + count <= MAX_MEMORY, CHIP8_FAULT_MEMORY, chip->I);
 
-// 7XNN: adds NN to VX (carry flag is not changed)
-static void chip8_7XNN(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-  uint8_t NN = GET_NN(chip->opcode);
+  for (int i = 0; i < count; i++)
+    chip->memory[chip->I + i] = chip->V[d->x + i * step];
 
-  chip->V[X] += NN;
+  chip8_invalidate(chip, chip->I, count);
 }
 
-// 8XY0: sets VX to the value of VY
-static void chip8_8XY0(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-  uint8_t Y = GET_Y(chip->opcode);
+// 5XY3: loads VX to VY from memory starting at I, like 5XY2
+static inline void chip8_5XY3(chip8* chip, const chip8_decoded* d) {
+  int step = d->x <= d->y ? 1 : -1;
+  int count = (d->y - d->x) * step + 1;
+
+  CHECK(chip, chip->I + count <= MAX_MEMORY, CHIP8_FAULT_MEMORY, chip->I);
 
-  chip->V[X] = chip->V[Y];
+  for (int i = 0; i < count; i++)
+    chip->V[d->x + i * step] = chip->memory[chip->I + i];
 }
 
-// 8XY1: sets VX to VX or VY (bitwise OR op)
-static void chip8_8XY1(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-  uint8_t Y = GET_Y(chip->opcode);
+// 6XNN: sets VX to NM
+static inline void chip8_6XNN(chip8* chip, const chip8_decoded* d) {
+  chip->V[d->x] = d->nn;
+}
 
-  chip->V[X] |= chip->V[Y];
+// 7XNN: adds NN to VX (carry flag is not changed)
+static inline void chip8_7XNN(chip8* chip, const chip8_decoded* d) {
+  chip->V[d->x] += d->nn;
 }
 
-// 8XY2: sets VX to VX and VY (bitwise AND op)
-static void chip8_8XY2(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-  uint8_t Y = GET_Y(chip->opcode);
+// 8XY0: sets VX to the value of VY
+static inline void chip8_8XY0(chip8* chip, const chip8_decoded* d) {
+  chip->V[d->x] = chip->V[d->y];
+}
 
-  chip->V[X] &= chip->V[Y];
+// 8XY1: sets VX to VX or VY (bitwise OR op), the VIP also clears VF
+static inline void chip8_8XY1(chip8* chip, const chip8_decoded* d, bool resetVF) {
+  chip->V[d->x] |= chip->V[d->y];
+  if (resetVF)
+    chip->V[0xF] = 0;
 }
 
-// 8XY3: sets VX to VX xor VY
-static void chip8_8XY3(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-  uint8_t Y = GET_Y(chip->opcode);
+// 8XY2: sets VX to VX and VY (bitwise AND op), the VIP also clears VF
+static inline void chip8_8XY2(chip8* chip, const chip8_decoded* d, bool resetVF) {
+  chip->V[d->x] &= chip->V[d->y];
+  if (resetVF)
+    chip->V[0xF] = 0;
+}
 
-  chip->V[X] ^= chip->V[Y];
+// 8XY3: sets VX to VX xor VY, the VIP also clears VF
+static inline void chip8_8XY3(chip8* chip, const chip8_decoded* d, bool resetVF) {
+  chip->V[d->x] ^= chip->V[d->y];
+  if (resetVF)
+    chip->V[0xF] = 0;
 }
 
 // 8XY4: adds VY to VX, VF is set to 1 when there's a overflow
-static void chip8_8XY4(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-  uint8_t Y = GET_Y(chip->opcode);
-
-  uint16_t sum = chip->V[X] + chip->V[Y];
+static inline void chip8_8XY4(chip8* chip, const chip8_decoded* d) {
+  uint16_t sum = chip->V[d->x] + chip->V[d->y];
   chip->V[0xF] = (sum > 0xFF) ? 1 : 0;
-  chip->V[X] = sum & 0xFF;
+  chip->V[d->x] = sum & 0xFF;
 }
 
 // 8XY5: VY is subtracted from VX, VF is set to 0 when there's a underflow
-static void chip8_8XY5(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-  uint8_t Y = GET_Y(chip->opcode);
-
-  chip->V[0xF] = (chip->V[X] >= chip->V[Y]) ? 1 : 0;
-  chip->V[X] = chip->V[X] - chip->V[Y];
+static inline void chip8_8XY5(chip8* chip, const chip8_decoded* d) {
+  chip->V[0xF] = (chip->V[d->x] >= chip->V[d->y]) ? 1 : 0;
+  chip->V[d->x] = chip->V[d->x] - chip->V[d->y];
 }
 
 // 8XY6: shifts VX to the right by 1, store LSB in VF
-static void chip8_8XY6(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
- 
-  chip->V[0xF] = chip->V[X] & 0x1; // LSB (bit 0)
+// the VIP shifts VY and stores the result in VX
+static inline void chip8_8XY6(chip8* chip, const chip8_decoded* d, bool useVY) {
+  uint8_t source = useVY ? d->y : d->x;
+
+  // VF first, like the other arithmetic ops and every backend
+  chip->V[0xF] = chip->V[source] & 0x1; // LSB (bit 0)
 
-  chip->V[X] >>= 1;
+  chip->V[d->x] = chip->V[source] >> 1;
 }
 
 // 8XY7: sets VX to VY minus VX, VF is set to 0 if there's a underflow
-static void chip8_8XY7(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-  uint8_t Y = GET_Y(chip->opcode);
-
-  chip->V[0xF] = (chip->V[Y] >= chip->V[X]) ? 1 : 0;
-  chip->V[X] = chip->V[Y] - chip->V[X];
+static inline void chip8_8XY7(chip8* chip, const chip8_decoded* d) {
+  chip->V[0xF] = (chip->V[d->y] >= chip->V[d->x]) ? 1 : 0;
+  chip->V[d->x] = chip->V[d->y] - chip->V[d->x];
 }
 
 // 8XYE: shifts VX to the left by 1, store MSB in VF
-static void chip8_8XYE(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
- 
-  chip->V[0xF] = (chip->V[X] >> 7) & 0x1; // MSB (bit 7)
+// the VIP shifts VY and stores the result in VX
+static inline void chip8_8XYE(chip8* chip, const chip8_decoded* d, bool useVY) {
+  uint8_t source = useVY ? d->y : d->x;
 
-  chip->V[X] <<= 1;
-}
+  chip->V[0xF] = (chip->V[source] >> 7) & 0x1; // MSB (bit 7)
 
-// uses the second table
-static void chip8_8XXX(chip8* chip) {
-  chip8_arithmetic[chip->opcode & 0x00F](chip);
+  chip->V[d->x] = (uint8_t)(chip->V[source] << 1);
 }
 
 // 9XY0: skips the next instruction if VX doesn't equal VY
-static void chip8_9XY0(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-  uint8_t Y = GET_Y(chip->opcode);
-
-  if (chip->V[X] != chip->V[Y])
-    chip->pc += 2;
+static inline void chip8_9XY0(chip8* chip, const chip8_decoded* d, bool longSkip) {
+  if (chip->V[d->x] != chip->V[d->y])
+    chip8_skip(chip, longSkip);
 }
 
 // ANNN: sets I to the address NNN
-static void chip8_ANNN(chip8* chip) { chip->I = chip->opcode & 0x0FFF; }
+static inline void chip8_ANNN(chip8* chip, const chip8_decoded* d) { chip->I = d->nnn; }
 
 // BNNN: jumps to the address NNN plus V0
-static void chip8_BNNN(chip8* chip) {
-  uint16_t NNN = GET_NNN(chip->opcode);
-
-  chip->pc = chip->V[0] + NNN;
+// CHIP-48 and SUPER-CHIP read it as BXNN and add VX instead
+static inline void chip8_BNNN(chip8* chip, const chip8_decoded* d, bool useVX) {
+  chip->pc = chip->V[useVX ? d->x : 0] + d->nnn;
 }
 
 // CXNN: sets VX to the result of an operation on a random number and NN
-static void chip8_CXNN(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-  uint8_t NN = GET_NN(chip->opcode);
-
-  chip->V[X] = (rand() & 0xFF) & NN;
+static inline void chip8_CXNN(chip8* chip, const chip8_decoded* d) {
+  chip->V[d->x] = chip8_random(&chip->rng) & d->nn;
 }
 
-// DXYN: draws a sprite at coordinate (VX, VY) with a height of N
-// VF is set to 1 if any screen pixels are flipped from set to unset
-static void chip8_DXYN(chip8* chip) {
-  uint8_t X = chip->V[GET_X(chip->opcode)];
-  uint8_t Y = chip->V[GET_Y(chip->opcode)];
-  uint8_t height = chip->opcode & 0x000F;
+// the draw kernels are only fast specialized to their constant arguments,
+// which takes inlining them into every interpreter copy
+#if defined(__GNUC__)
+#define DRAW_INLINE inline __attribute__((always_inline))
+#else
+#define DRAW_INLINE inline
+#endif
+
+// XORs one plane's sprite rows into gfx, returns the pixels it turned off.
+// wide, wrap, width and height are constants once inlined, so each case
+// gets a loop without branches on them
+static DRAW_INLINE uint64_t chip8_drawPlane(uint64_t* gfx, const uint8_t* memory, uint16_t address,
+                                       int X, int Y, int rows, bool wide, bool wrap,
+                                       int width, int height) {
+  const int words = width / 64;
+  const int spriteWidth = wide ? 16 : 8;
+  int word = X / 64;
+  int s = X % 64;
+  // the word the columns shifted out of the first one land in, -1 if clipped
+  int next = word + 1 < words ? word + 1 : wrap ? 0 : -1;
+
+  uint64_t collision = 0;
+  for (int yline = 0; yline < rows; yline++) {
+    uint64_t sprite;
+    if (wide) {
+      uint16_t at = address + yline * 2;
+      sprite = ((uint64_t)memory[at] << 8) | memory[(at + 1) & (MAX_MEMORY - 1)];
+    } else {
+      sprite = memory[(uint16_t)(address + yline)];
+    }
+    sprite <<= 64 - spriteWidth;
 
-  uint8_t pixel;
+    int y = wrap ? (Y + yline) % height : Y + yline;
+    uint64_t* row = gfx + y * words;
 
-  chip->V[0xF] = 0;
-  for (int yline = 0; yline < height; yline++) {
-    pixel = chip->memory[chip->I + yline];
+    uint64_t left = sprite >> s;
+    collision |= row[word] & left;
+    row[word] ^= left;
 
-    for (int xline = 0; xline < 8; xline++) {
-      if ((pixel & (0x80 >> xline)) != 0) {
-        uint16_t x = (X + xline);
-        uint16_t y = (Y + yline);
-        uint16_t index = x + (y * WIDTH);
+    if (s > 64 - spriteWidth && next >= 0) {
+      uint64_t right = sprite << (64 - s);
+      collision |= row[next] & right;
+      row[next] ^= right;
+    }
+  }
 
-        // check for collision (pixel being turned off)
-        if (chip->gfx[index] == 1) {
-          chip->V[0xF] = 1;
-        }
+  return collision;
+}
 
-        chip->gfx[index] ^= 1;
-      }
+// DXYN: draws a sprite at coordinate (VX, VY) with a height of N on every
+// selected plane, DXY0 draws a 16x16 one. Each plane's sprite data follows
+// the previous one's in memory
+// VF is set to 1 if any screen pixels are flipped from set to unset
+// the starting position wraps around the screen, the sprite itself is clipped
+// unless wrap is set (XO-CHIP), then it wraps around the edges as well
+static DRAW_INLINE void chip8_draw(chip8* chip, const chip8_decoded* d, bool wrap, bool sixteen,
+                                   int width, int height) {
+  int X = chip->V[d->x] % width;
+  int Y = chip->V[d->y] % height;
+  int rows = d->nn & 0x0F;
+  bool wide = rows == 0 && sixteen;
+
+  if (wide)
+    rows = 16;
+
+  int size = wide ? 2 * rows : rows; // one plane's sprite, in bytes
+  int visible = !wrap && rows > height - Y ? height - Y : rows;
+
+#ifdef CHIP8_CHECKED
+  int last = -1;
+  FOR_EACH_PLANE(chip, plane)
+    last++;
+  CHECK(chip, last < 0 || chip->I + last * size + (wide ? 2 : 1) * visible <= MAX_MEMORY,
+        CHIP8_FAULT_MEMORY, chip->I);
+#endif
+
+  uint64_t collision = 0;
+  if (chip->planes == 0x1) {
+    // plain CHIP-8 and SUPER-CHIP
+    collision = wide
+      ? chip8_drawPlane(chip->gfx[0], chip->memory, chip->I, X, Y, visible, true, wrap, width, height)
+      : chip8_drawPlane(chip->gfx[0], chip->memory, chip->I, X, Y, visible, false, wrap, width, height);
+  } else {
+    uint16_t address = chip->I;
+    FOR_EACH_PLANE(chip, plane) {
+      collision |= chip8_drawPlane(chip->gfx[plane], chip->memory, address, X, Y, visible,
+                                   wide, wrap, width, height);
+      address += size;
     }
   }
+
+  chip->V[0xF] = collision != 0;
   chip->drawFlag = true;
+  PROFILE_DRAW(chip);
+}
+
+// DXY0 draws a 16x16 sprite if sixteen is set, nothing otherwise
+static DRAW_INLINE void chip8_DXYN(chip8* chip, const chip8_decoded* d, bool wrap, bool sixteen) {
+  if (chip->hires)
+    chip8_draw(chip, d, wrap, sixteen, HIRES_WIDTH, HIRES_HEIGHT);
+  else
+    chip8_draw(chip, d, wrap, sixteen, WIDTH, HEIGHT);
 }
 
 // EX9E: skips the next instruction if the key stored in VX is pressed
-static void chip8_EX9E(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-  if (chip->key[chip->V[X]] != 0)
-    chip->pc += 2;
+static inline void chip8_EX9E(chip8* chip, const chip8_decoded* d, bool longSkip) {
+  CHECK(chip, chip->V[d->x] < KEY_SIZE, CHIP8_FAULT_KEY, chip->V[d->x]);
+  if (chip->key[chip->V[d->x]] != 0)
+    chip8_skip(chip, longSkip);
 }
 
 // EXA1: skips the next instruction if the key stored in VX is not pressed
-static void chip8_EXA1(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-  if (chip->key[chip->V[X]] == 0)
-    chip->pc += 2;
+static inline void chip8_EXA1(chip8* chip, const chip8_decoded* d, bool longSkip) {
+  CHECK(chip, chip->V[d->x] < KEY_SIZE, CHIP8_FAULT_KEY, chip->V[d->x]);
+  if (chip->key[chip->V[d->x]] == 0)
+    chip8_skip(chip, longSkip);
 }
 
-// FX0A: a key pressed is awaited, and then stored in VX
-static void chip8_FX0A(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
+// F000 NNNN: sets I to the 16-bit address in the next two bytes (XO-CHIP)
+static inline void chip8_F000(chip8* chip, const chip8_decoded* d) {
+  (void)d;
+  chip->I = CHIP8_FETCH(chip, chip->pc);
+  chip->pc += 2;
+}
+
+// FN01: selects the planes drawn, scrolled and cleared, bit 0 is plane 0
+static inline void chip8_FN01(chip8* chip, const chip8_decoded* d) {
+  chip->planes = d->x & ((1 << PLANES) - 1);
+}
 
+// F002: loads the 16-byte audio pattern from memory at I
+static inline void chip8_F002(chip8* chip, const chip8_decoded* d) {
+  (void)d;
+  CHECK(chip, chip->I + sizeof(chip->pattern) <= MAX_MEMORY, CHIP8_FAULT_MEMORY, chip->I);
+  memcpy(chip->pattern, chip->memory + chip->I, sizeof(chip->pattern));
+}
+
+// FX0A: a key pressed is awaited, and then stored in VX
+static inline void chip8_FX0A(chip8* chip, const chip8_decoded* d) {
   bool key_pressed = false;
 
   for (int i = 0; i < KEY_SIZE; i++) {
     if (chip->key[i] != 0) {
-      chip->V[X] = i;
+      chip->V[d->x] = i;
       key_pressed = true;
       break;
     }
@@ -377,176 +806,295 @@ static void chip8_FX0A(chip8* chip) {
 }
 
 // FX1E: adds VX to I. VF is not affected
-static void chip8_FX1E(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-
-  chip->I += chip->V[X];
+static inline void chip8_FX1E(chip8* chip, const chip8_decoded* d) {
+  chip->I += chip->V[d->x];
 }
 
 // FX07: sets VX to the value of the delay timer
-static void chip8_FX07(chip8 *chip) {
-  uint8_t X = GET_X(chip->opcode);
-
-  chip->V[X] = chip->delay_timer;
+static inline void chip8_FX07(chip8 *chip, const chip8_decoded* d) {
+  chip->V[d->x] = chip->delay_timer;
 }
 
 // FX15: sets the delay timer to VX
-static void chip8_FX15(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-
-  chip->delay_timer = chip->V[X];
+static inline void chip8_FX15(chip8* chip, const chip8_decoded* d) {
+  chip->delay_timer = chip->V[d->x];
 }
 
 // FX18: sets the sound timer to VX
-static void chip8_FX18(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
-
-  chip->sound_timer = chip->V[X];
+static inline void chip8_FX18(chip8* chip, const chip8_decoded* d) {
+  chip->sound_timer = chip->V[d->x];
 }
 
 // FX29: sets I to the location of the sprite for the character in VX
 // characters 0-F (in hexadecimal) are represented by a 4x5 font
-static void chip8_FX29(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
+static inline void chip8_FX29(chip8* chip, const chip8_decoded* d) {
+  CHECK(chip, chip->V[d->x] < 16, CHIP8_FAULT_FONT, chip->V[d->x]);
+  chip->I = chip->V[d->x] * 0x5;
+}
 
-  chip->I = chip->V[X] * 0x5;
+// FX30: sets I to the 8x10 sprite for the digit in VX (SUPER-CHIP)
+static inline void chip8_FX30(chip8* chip, const chip8_decoded* d) {
+  CHECK(chip, chip->V[d->x] < 16, CHIP8_FAULT_FONT, chip->V[d->x]);
+  chip->I = BIG_FONT_START + chip->V[d->x] * 10;
+}
+
+// FX3A: sets the pitch the audio pattern plays at to VX (XO-CHIP)
+static inline void chip8_FX3A(chip8* chip, const chip8_decoded* d) {
+  chip->pitch = chip->V[d->x];
 }
 
 // FX33: stores the binary-coded decimal representation of VX
-static void chip8_FX33(chip8* chip) {
-  uint8_t X = GET_X(chip->opcode);
+static inline void chip8_FX33(chip8* chip, const chip8_decoded* d) {
+  uint8_t VX = chip->V[d->x];
+
+  CHECK(chip, chip->I + 3 <= MAX_MEMORY, CHIP8_FAULT_MEMORY, chip->I);
+
+  chip->memory[chip->I]     = VX / 100;
+  chip->memory[chip->I + 1] = (VX / 10) % 10;
+  chip->memory[chip->I + 2] = VX % 10;
 
-  chip->memory[chip->I]     = chip->V[X] / 100;
-  chip->memory[chip->I + 1] = (chip->V[X] / 10) % 10;
-  chip->memory[chip->I + 2] = chip->V[X] % 10;
+  chip8_invalidate(chip, chip->I, 3);
 }
 
 // FX55: stores from V0 to VX (including VX) in memory, starting at address I
-static void chip8_FX55(chip8 *chip) {
-  uint8_t X = GET_X(chip->opcode);
+// where I ends up depends on the machine, see chip8_loadStore
+static inline void chip8_FX55(chip8 *chip, const chip8_decoded* d, chip8_loadStore advance) {
+  uint8_t X = d->x;
+
+  CHECK(chip, chip->I + X + 1 <= MAX_MEMORY, CHIP8_FAULT_MEMORY, chip->I);
 
   for (int i = 0; i <= X; i++)
     chip->memory[chip->I + i] = chip->V[i];
 
-  // chip->I += X + 1;
+  chip8_invalidate(chip, chip->I, X + 1);
+
+  chip->I += advance == LOAD_STORE_ADD_X_PLUS_1 ? X + 1 : advance == LOAD_STORE_ADD_X ? X : 0;
 }
 
 // FX65: fills from V0 to VX (including VX) in memory, starting at address
-static void chip8_FX65(chip8 *chip) {
-  uint8_t X = GET_X(chip->opcode);
+static inline void chip8_FX65(chip8 *chip, const chip8_decoded* d, chip8_loadStore advance) {
+  uint8_t X = d->x;
+
+  CHECK(chip, chip->I + X + 1 <= MAX_MEMORY, CHIP8_FAULT_MEMORY, chip->I);
 
   for (int i = 0; i <= X; i++)
     chip->V[i] = chip->memory[chip->I + i];
 
-  // chip->I += X + 1;
+  chip->I += advance == LOAD_STORE_ADD_X_PLUS_1 ? X + 1 : advance == LOAD_STORE_ADD_X ? X : 0;
 }
 
-static void chip8_0XXX(chip8* chip) {
-  switch (chip->opcode & 0x00FF) {
-    case 0x00E0:
-      chip8_00E0(chip);
-      break;
-    case 0x00EE:
-      chip8_00EE(chip);
-      break;
-    default: 
-      chip8_NULL(chip);
-      break;
+// FX75: stores V0 to VX in the flags, which outlive the program on the HP48
+static inline void chip8_FX75(chip8* chip, const chip8_decoded* d) {
+  memcpy(chip->flags, chip->V, d->x + 1);
+}
+
+// FX85: fills V0 to VX from the flags
+static inline void chip8_FX85(chip8* chip, const chip8_decoded* d) {
+  memcpy(chip->V, chip->flags, d->x + 1);
+}
+
+// returns the cache entry for pc. A stale entry dispatches to the DECODE
+// handler, which fills it in. Odd addresses and those past code memory are
+// not cached and are decoded into scratch instead
+static inline chip8_decoded* chip8_fetch(chip8* chip, chip8_decoded* scratch) {
+  uint16_t pc = chip->pc & (MAX_MEMORY - 1);
+
+  if (pc & (uint16_t)~(CODE_MEMORY - 2)) {
+    *scratch = chip8_decode(CHIP8_FETCH(chip, pc));
+    return scratch;
   }
+
+  return &chip->decoded[pc >> 1];
 }
 
-static void chip8_EXXX(chip8* chip) {
-  switch (chip->opcode & 0x00FF) {
-    case 0x009E:
-      chip8_EX9E(chip);
-      break;
-    case 0x00A1:
-      chip8_EXA1(chip);
-      break;
+// Idle loops. Keys and timers never change inside one chip8_execute, so a
+// failed FX0A, a jump to itself or a delay timer poll repeat the same few
+// instructions for the rest of the budget. The interpreter skips that
+// budget in one step, leaving exactly the state running it would have
+// left. Skipped instructions still count in cycles, and in skipped, but
+// not in the profile.
+
+// the 1NNN at from just jumped with cycles instructions left to run.
+// Returns what kind of idle loop it closes, after skipping them
+static inline chip8_idle chip8_idleJump(chip8* chip, uint16_t from, uint32_t cycles) {
+  uint16_t target = chip->pc;
+
+  // a breakpoint in the loop has to stop it on every pass
+  if (chip->breakpoints != NULL && target <= from) {
+    for (uint32_t address = target; address <= from && address < CODE_MEMORY; address += 2) {
+      if (chip8_breakpointAt(chip->breakpoints, (uint16_t)address))
+        return CHIP8_IDLE_NONE;
+    }
+  }
 
-    default:
-      chip8_NULL(chip);
-      break;
+  if (target == from)
+    return CHIP8_IDLE_HALT;
+
+  if (target != (uint16_t)(from - 4) || chip->delay_timer == 0)
+    return CHIP8_IDLE_NONE;
+
+  chip8_decoded read = chip8_decode(CHIP8_FETCH(chip, target));
+  chip8_decoded test = chip8_decode(CHIP8_FETCH(chip, target + 2));
+  if (read.op != CHIP8_OP_FX07 || test.op != CHIP8_OP_3XNN || test.x != read.x || test.nn != 0)
+    return CHIP8_IDLE_NONE;
+
+  // VX reads the non-zero timer, so 3X00 never skips: the loop goes round
+  // in threes until the budget runs out
+  if (cycles > 0) {
+    uint16_t last = target + 2 * ((cycles - 1) % 3);
+    chip->V[read.x] = chip->delay_timer;
+    chip->opcode = CHIP8_FETCH(chip, last);
+    chip->pc = target + 2 * (cycles % 3);
   }
+
+  return CHIP8_IDLE_TIMER;
 }
 
-static void chip8_FXXX(chip8* chip) {
-  switch (chip->opcode & 0x00FF) {
-    case 0x000A:
-      chip8_FX0A(chip);
-      break;
-    case 0x001E:
-      chip8_FX1E(chip);
-      break;
-    case 0x0007:
-      chip8_FX07(chip);
-      break;
-    case 0x0015:
-      chip8_FX15(chip);
-      break;
-    case 0x0018:
-      chip8_FX18(chip);
-      break;
-    case 0x0029:
-      chip8_FX29(chip);
-      break;
-    case 0x0033:
-      chip8_FX33(chip);
-      break;
-    case 0x0055:
-      chip8_FX55(chip);
-      break;
-    case 0x0065:
-      chip8_FX65(chip);
-      break;
+// Direct-threaded interpreter: with GCC/Clang every handler jumps straight
+// to the next one through a table of label addresses, otherwise the same
+// bodies are driven by a switch. Each quirk profile gets its own copy,
+// see execute.inc.
+#if defined(__GNUC__) && !defined(CHIP8_NO_THREADED_DISPATCH)
+#define CHIP8_THREADED_DISPATCH 1
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+#define EXECUTE executeDefault
+#define QUIRK_VF_RESET 0
+#define QUIRK_LOAD_STORE LOAD_STORE_KEEP
+#define QUIRK_SHIFT_VY 0
+#define QUIRK_JUMP_VX 0
+#define QUIRK_WRAP 0
+#define QUIRK_VBLANK 0
+#define QUIRK_LONG_SKIP 0
+#define QUIRK_SCHIP 0
+#define QUIRK_XOCHIP 0
+#include "execute.inc"
+
+#define EXECUTE executeVip
+#define QUIRK_VF_RESET 1
+#define QUIRK_LOAD_STORE LOAD_STORE_ADD_X_PLUS_1
+#define QUIRK_SHIFT_VY 1
+#define QUIRK_JUMP_VX 0
+#define QUIRK_WRAP 0
+#define QUIRK_VBLANK 1
+#define QUIRK_LONG_SKIP 0
+#define QUIRK_SCHIP 0
+#define QUIRK_XOCHIP 0
+#include "execute.inc"
+
+#define EXECUTE executeChip48
+#define QUIRK_VF_RESET 0
+#define QUIRK_LOAD_STORE LOAD_STORE_ADD_X
+#define QUIRK_SHIFT_VY 0
+#define QUIRK_JUMP_VX 1
+#define QUIRK_WRAP 0
+#define QUIRK_VBLANK 0
+#define QUIRK_LONG_SKIP 0
+#define QUIRK_SCHIP 0
+#define QUIRK_XOCHIP 0
+#include "execute.inc"
+
+#define EXECUTE executeSchip
+#define QUIRK_VF_RESET 0
+#define QUIRK_LOAD_STORE LOAD_STORE_KEEP
+#define QUIRK_SHIFT_VY 0
+#define QUIRK_JUMP_VX 1
+#define QUIRK_WRAP 0
+#define QUIRK_VBLANK 0
+#define QUIRK_LONG_SKIP 0
+#define QUIRK_SCHIP 1
+#define QUIRK_XOCHIP 0
+#include "execute.inc"
+
+#define EXECUTE executeXoChip
+#define QUIRK_VF_RESET 0
+#define QUIRK_LOAD_STORE LOAD_STORE_ADD_X_PLUS_1
+#define QUIRK_SHIFT_VY 1
+#define QUIRK_JUMP_VX 0
+#define QUIRK_WRAP 1
+#define QUIRK_VBLANK 0
+#define QUIRK_LONG_SKIP 1
+#define QUIRK_SCHIP 1
+#define QUIRK_XOCHIP 1
+#include "execute.inc"
 
-    default:
-      chip8_NULL(chip);
-      break;
+#undef CHIP8_FETCH
+#undef FOR_EACH_PLANE
+#undef DRAW_INLINE
+
+#ifdef CHIP8_THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
+
+// one branch per call picks the profile's loop
+static inline void executeProfile(chip8* chip, uint32_t cycles) {
+  switch (chip->quirks) {
+    case CHIP8_QUIRKS_VIP: executeVip(chip, cycles); break;
+    case CHIP8_QUIRKS_CHIP48: executeChip48(chip, cycles); break;
+    case CHIP8_QUIRKS_SCHIP: executeSchip(chip, cycles); break;
+    case CHIP8_QUIRKS_XOCHIP: executeXoChip(chip, cycles); break;
+    default: executeDefault(chip, cycles); break;
   }
 }
 
-Instruction chip8_table[] = {
-  chip8_0XXX,       // 0x0XXX - Group 0 instructions
-  chip8_1NNN,       // 0x1XXX - JP addr
-  chip8_2NNN,       // 0x2XXX - CALL addr  
-  chip8_3XNN,       // 0x3XXX - SE Vx, byte
-  chip8_4XNN,       // 0x4XXX - SNE Vx, byte
-  chip8_5XY0,       // 0x5XXX - SE Vx, Vy
-  chip8_6XNN,       // 0x6XXX - LD Vx, byte
-  chip8_7XNN,       // 0x7XXX - ADD Vx, byte
-  chip8_8XXX,       // 0x8XXX - Arithmetic operations (uses second table!)
-  chip8_9XY0,       // 0x9XXX - SNE Vx, Vy
-  chip8_ANNN,      // 0xAXXX - LD I, addr
-  chip8_BNNN,      // 0xBXXX - JP V0, addr
-  chip8_CXNN,      // 0xCXXX - RND Vx, byte
-  chip8_DXYN,      // 0xDXXX - DRW Vx, Vy, nibble
-  chip8_EXXX,      // 0xEXXX - SKP Vx / SKNP Vx
-  chip8_FXXX,      // 0xFXXX - LD Vx, DT / LD Vx, K / etc.
-  chip8_NULL
-};
+// records the state the call starts from and how many instructions it ran
+// in chip.trace, the interpreter itself runs as usual
+static void executeTraced(chip8* chip, uint32_t cycles) {
+  uint64_t ran = chip->cycles - chip->skipped;
+  chip->trace->begin(chip->trace, chip);
+  executeProfile(chip, cycles);
+  chip->trace->end(chip->trace, chip, chip->cycles - chip->skipped - ran);
+}
 
-Instruction chip8_arithmetic[] = {
-  chip8_8XY0,       // 0x8XY0 - LD Vx, Vy
-  chip8_8XY1,       // 0x8XY1 - OR Vx, Vy
-  chip8_8XY2,       // 0x8XY2 - AND Vx, Vy
-  chip8_8XY3,       // 0x8XY3 - XOR Vx, Vy
-  chip8_8XY4,       // 0x8XY4 - ADD Vx, Vy
-  chip8_8XY5,       // 0x8XY5 - SUB Vx, Vy
-  chip8_8XY6,       // 0x8XY6 - SHR Vx {, Vy}
-  chip8_8XY7,       // 0x8XY7 - SUBN Vx, Vy
-  chip8_8XYE,       // 0x8XYE - SHL Vx {, Vy}
-  chip8_NULL,       // 0x8XY9
-  chip8_NULL,      // 0x8XYA
-  chip8_NULL,      // 0x8XYB
-  chip8_NULL,      // 0x8XYC
-  chip8_NULL,      // 0x8XYD
-  chip8_NULL,      // 0x8XYE
-  chip8_NULL       // 0x8XYF
-};
+void chip8_execute(chip8* chip, uint32_t cycles) {
+  if (chip->trace != NULL) {
+    executeTraced(chip, cycles);
+    return;
+  }
+  executeProfile(chip, cycles);
+}
+
+// executes a single instruction, timers are ticked separately at 60 Hz
+void chip8_emulateCycle(chip8* chip) {
+  chip8_execute(chip, 1);
+}
+
+bool chip8_waitsForInput(const chip8* chip) {
+  return (chip->idle == CHIP8_IDLE_KEY || chip->idle == CHIP8_IDLE_HALT) &&
+         chip->delay_timer == 0 && chip->sound_timer == 0;
+}
+
+// does what that many more frames of waiting for input would have done
+void chip8_skipFrames(chip8* chip, uint32_t ipf, uint32_t frames) {
+  chip->cycles += (uint64_t)ipf * frames;
+  chip->skipped += (uint64_t)ipf * frames;
+
+  for (uint32_t i = 0; i < frames; i++)
+    PROFILE_FRAME(chip);
+}
 
-#undef GET_X
-#undef GET_Y
-#undef GET_N
-#undef GET_NN
-#undef GET_NNN
+void chip8_tickTimers(chip8* chip) {
+  if (chip->delay_timer > 0)
+    --chip->delay_timer;
+
+  if (chip->sound_timer > 0) {
+    if (chip->sound_timer == 1)
+      chip->beepFlag = true;
+    --chip->sound_timer;
+  }
+}
+
+// sets the whole keypad from a mask with one bit per key
+void chip8_setKeys(chip8* chip, uint16_t mask) {
+  for (int i = 0; i < KEY_SIZE; i++)
+    chip->key[i] = (mask >> i) & 1;
+}
+
+// one 60 Hz frame: ipf instructions followed by a timer tick
+void chip8_runFrame(chip8* chip, uint32_t ipf) {
+  chip8_execute(chip, ipf);
+  chip8_tickTimers(chip);
+  PROFILE_FRAME(chip);
+}
@@ -0,0 +1,171 @@
+#include "emulator.h"
+
+#include <string.h>
+
+#include "scheduler.h"
+
+void emulator_init(emulator* emu, uint32_t ipf, bool turbo) {
+  chip8_initialize(&emu->chip);
+  emu->aot = NULL;
+  emu->ipf = ipf;
+  emu->turbo = turbo;
+
+  triplebuffer_init(&emu->frames);
+  atomic_init(&emu->keys, 0);
+  atomic_init(&emu->rewinding, false);
+  atomic_init(&emu->quit, false);
+  atomic_init(&emu->idle, false);
+  pthread_mutex_init(&emu->lock, NULL);
+  pthread_cond_init(&emu->wake, NULL);
+
+  emu->hasHistory = rewind_init(&emu->history, REWIND_ARENA_SIZE, REWIND_MAX_FRAMES);
+  emu->recording = NULL;
+  emu->replay = NULL;
+  emu->audio = NULL;
+  emu->debugger = NULL;
+
+  emu->onFrame = NULL;
+  emu->user = NULL;
+}
+
+// taking the lock after the change means the emulation thread either
+// sees it before going to sleep or is already asleep and gets the signal
+static void wakeEmulation(emulator* emu) {
+  pthread_mutex_lock(&emu->lock);
+  atomic_store_explicit(&emu->idle, false, memory_order_relaxed);
+  pthread_cond_signal(&emu->wake);
+  pthread_mutex_unlock(&emu->lock);
+}
+
+void emulator_setKey(emulator* emu, uint8_t key, bool pressed) {
+  uint_least16_t bit = (uint_least16_t)(1u << key);
+
+  if (pressed)
+    atomic_fetch_or_explicit(&emu->keys, bit, memory_order_relaxed);
+  else
+    atomic_fetch_and_explicit(&emu->keys, (uint_least16_t)~bit, memory_order_relaxed);
+
+  wakeEmulation(emu);
+}
+
+void emulator_setRewinding(emulator* emu, bool rewinding) {
+  atomic_store_explicit(&emu->rewinding, rewinding, memory_order_relaxed);
+  wakeEmulation(emu);
+}
+
+// sleeps until the keys differ from the ones the last frame ran with
+static void waitForInput(emulator* emu, uint16_t keys) {
+  pthread_mutex_lock(&emu->lock);
+
+  while (!atomic_load_explicit(&emu->quit, memory_order_relaxed) &&
+         !atomic_load_explicit(&emu->rewinding, memory_order_relaxed) &&
+         atomic_load_explicit(&emu->keys, memory_order_relaxed) == keys) {
+    atomic_store_explicit(&emu->idle, true, memory_order_relaxed);
+    pthread_cond_wait(&emu->wake, &emu->lock);
+  }
+
+  atomic_store_explicit(&emu->idle, false, memory_order_relaxed);
+  pthread_mutex_unlock(&emu->lock);
+}
+
+static void publishFrame(emulator* emu, uint64_t sequence) {
+  chip8_frame* frame = triplebuffer_back(&emu->frames);
+  memcpy(frame->gfx, emu->chip.gfx, sizeof(frame->gfx));
+  frame->hires = emu->chip.hires;
+  frame->sequence = sequence;
+  triplebuffer_publish(&emu->frames);
+
+  if (emu->onFrame != NULL)
+    emu->onFrame(emu->user);
+}
+
+static void* emulationThread(void* arg) {
+  emulator* emu = arg;
+  chip8* chip = &emu->chip;
+
+  scheduler sched;
+  scheduler_init(&sched, emu->ipf, emu->turbo);
+
+  // frames emulated on the current timeline, rewinding steps it back
+  uint32_t frame = 0;
+  size_t nextEvent = 0;
+  uint16_t replayKeys = 0;
+
+  while (!atomic_load_explicit(&emu->quit, memory_order_relaxed)) {
+    bool replaying = emu->replay != NULL && frame < emu->replay->frames;
+    bool rewinding = emu->hasHistory && !replaying &&
+                     atomic_load_explicit(&emu->rewinding, memory_order_relaxed);
+
+    uint16_t keys = atomic_load_explicit(&emu->keys, memory_order_relaxed);
+    if (replaying) {
+      while (nextEvent < emu->replay->count && emu->replay->events[nextEvent].frame <= frame)
+        replayKeys = emu->replay->events[nextEvent++].keys;
+      keys = replayKeys;
+    }
+
+    if (rewinding) {
+      if (rewind_stepBack(&emu->history, chip) && frame > 0) {
+        frame--;
+        if (emu->recording != NULL)
+          inputlog_truncate(emu->recording, frame);
+      }
+    } else {
+      if (emu->recording != NULL)
+        inputlog_record(emu->recording, frame, keys);
+
+      chip8_setKeys(chip, keys);
+      if (emu->debugger != NULL) {
+        if (!gdbstub_execute(emu->debugger, chip, sched.ipf)) {
+          atomic_store(&emu->quit, true);
+          if (emu->onFrame != NULL)
+            emu->onFrame(emu->user);
+        }
+        chip8_tickTimers(chip);
+      } else if (emu->aot != NULL) {
+        chip8_aot_runFrame(emu->aot, sched.ipf);
+      } else {
+        chip8_runFrame(chip, sched.ipf);
+      }
+      frame++;
+
+      if (emu->hasHistory)
+        rewind_push(&emu->history, chip);
+    }
+
+    if (chip->drawFlag) {
+      publishFrame(emu, sched.frames);
+      chip->drawFlag = false;
+    }
+
+    // a timer that ran out during the frame still sounded in it
+    if (emu->audio != NULL)
+      audio_push(emu->audio, chip->sound_timer > 0 || chip->beepFlag, chip->pitch, chip->pattern);
+    chip->beepFlag = false;
+
+    // frames that only wait for a key are not emulated, nor pushed to
+    // the history or counted. The scheduler resyncs on waking up. A replay
+    // has its keys at hand and just runs them
+    if (!rewinding && !replaying && emu->debugger == NULL && chip8_waitsForInput(chip))
+      waitForInput(emu, keys);
+
+    scheduler_waitNextFrame(&sched);
+  }
+
+  return NULL;
+}
+
+bool emulator_start(emulator* emu) {
+  return pthread_create(&emu->thread, NULL, emulationThread, emu) == 0;
+}
+
+void emulator_stop(emulator* emu) {
+  atomic_store(&emu->quit, true);
+  wakeEmulation(emu);
+  pthread_join(emu->thread, NULL);
+
+  pthread_cond_destroy(&emu->wake);
+  pthread_mutex_destroy(&emu->lock);
+
+  if (emu->hasHistory)
+    rewind_free(&emu->history);
+}
@@ -0,0 +1,174 @@
+#include "env.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+// envs are handed to the pool in a few contiguous ranges per worker, enough
+// to even out ROMs that run at different speeds without a job per env
+#define JOBS_PER_WORKER 4
+
+struct chip8_env {
+  chip8* chips;
+  uint32_t count;
+  chip8_state initial;            // right after loading, what reset restores
+  bool* restart;                  // done last step, starts over on the next
+  chip8_env_config config;
+
+  pool* workers;                  // NULL when stepping on the caller's thread
+  size_t jobs;
+
+  // the step in progress, read by the workers
+  const uint16_t* actions;
+  uint32_t framesPerStep;
+  uint64_t* observations;
+  float* rewards;
+  uint8_t* dones;
+};
+
+chip8_env* chip8_env_create(const uint8_t* rom, size_t size, uint32_t envs, const chip8_env_config* config) {
+  if (envs == 0)
+    return NULL;
+
+  chip8_env* env = calloc(1, sizeof(*env));
+  if (env == NULL)
+    return NULL;
+
+  if (config != NULL)
+    env->config = *config;
+  if (env->config.ipf == 0)
+    env->config.ipf = CHIP8_ENV_DEFAULT_IPF;
+
+  env->count = envs;
+  env->chips = malloc((size_t)envs * sizeof(chip8));
+  env->restart = calloc(envs, sizeof(bool));
+  if (env->chips == NULL || env->restart == NULL) {
+    chip8_env_destroy(env);
+    return NULL;
+  }
+
+  chip8_initialize(&env->chips[0]);
+  if (!chip8_loadBuffer(&env->chips[0], rom, size)) {
+    chip8_env_destroy(env);
+    return NULL;
+  }
+  env->chips[0].quirks = env->config.quirks;
+
+  chip8_snapshot(&env->chips[0], &env->initial);
+  for (uint32_t i = 1; i < envs; i++)
+    env->chips[i] = env->chips[0];
+  for (uint32_t i = 0; i < envs; i++)
+    chip8_seed(&env->chips[i], env->config.seed + i);
+
+  unsigned threads = env->config.threads != 0 ? env->config.threads : pool_defaultWorkers();
+  if (threads > envs)
+    threads = envs;
+
+  if (threads > 1) {
+    env->workers = pool_create(threads);
+    if (env->workers == NULL) {
+      chip8_env_destroy(env);
+      return NULL;
+    }
+  }
+
+  env->jobs = env->workers != NULL ? (size_t)pool_workers(env->workers) * JOBS_PER_WORKER : 1;
+  if (env->jobs > envs)
+    env->jobs = envs;
+
+  return env;
+}
+
+void chip8_env_destroy(chip8_env* env) {
+  if (env == NULL)
+    return;
+
+  if (env->workers != NULL)
+    pool_destroy(env->workers);
+  free(env->chips);
+  free(env->restart);
+  free(env);
+}
+
+uint32_t chip8_env_count(const chip8_env* env) {
+  return env->count;
+}
+
+const chip8* chip8_env_chip(const chip8_env* env, uint32_t index) {
+  return &env->chips[index];
+}
+
+static void observe(chip8_env* env, uint32_t index, uint64_t* observations) {
+  if (observations != NULL)
+    memcpy(observations + (size_t)index * CHIP8_ENV_OBSERVATION_WORDS, env->chips[index].gfx,
+           sizeof(env->chips[index].gfx));
+}
+
+void chip8_env_reset(chip8_env* env, uint64_t* observations) {
+  for (uint32_t i = 0; i < env->count; i++) {
+    chip8_restore(&env->chips[i], &env->initial);
+    chip8_seed(&env->chips[i], env->config.seed + i);
+    env->restart[i] = false;
+    observe(env, i, observations);
+  }
+}
+
+static void stepOne(chip8_env* env, uint32_t index) {
+  chip8* chip = &env->chips[index];
+  float reward = 0.0f;
+  bool done = false;
+
+  if (env->restart[index]) {
+    uint64_t rng = chip->rng;
+    chip8_restore(chip, &env->initial);
+    chip->rng = rng;
+    env->restart[index] = false;
+  } else {
+    chip8_setKeys(chip, env->actions != NULL ? env->actions[index] : 0);
+    for (uint32_t f = 0; f < env->framesPerStep; f++)
+      chip8_runFrame(chip, env->config.ipf);
+
+    if (env->config.reward != NULL)
+      reward = env->config.reward(chip, index, env->config.user);
+    if (env->config.done != NULL)
+      done = env->config.done(chip, index, env->config.user);
+    env->restart[index] = done;
+  }
+
+  // nothing presents or plays these
+  chip->drawFlag = false;
+  chip->beepFlag = false;
+
+  observe(env, index, env->observations);
+  if (env->rewards != NULL)
+    env->rewards[index] = reward;
+  if (env->dones != NULL)
+    env->dones[index] = done;
+}
+
+// one contiguous range of envs, so neighbouring outputs come from one core
+static void stepRange(void* context, size_t job, unsigned worker) {
+  chip8_env* env = context;
+  (void)worker;
+
+  uint32_t first = (uint32_t)(job * env->count / env->jobs);
+  uint32_t last = (uint32_t)((job + 1) * env->count / env->jobs);
+
+  for (uint32_t i = first; i < last; i++)
+    stepOne(env, i);
+}
+
+void chip8_env_stepBatch(chip8_env* env, const uint16_t* actions, uint32_t framesPerStep,
+                         uint64_t* observations, float* rewards, uint8_t* dones) {
+  env->actions = actions;
+  env->framesPerStep = framesPerStep;
+  env->observations = observations;
+  env->rewards = rewards;
+  env->dones = dones;
+
+  if (env->workers != NULL)
+    pool_run(env->workers, env->jobs, stepRange, env);
+  else
+    stepRange(env, 0, 0);
+}
@@ -0,0 +1,609 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "gdbstub.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SIGNAL_INT 2
+#define SIGNAL_TRAP 5
+
+#define REGISTER_I 16
+#define REGISTER_PC 17
+#define REGISTER_SP 18
+#define REGISTER_DT 19
+#define REGISTER_ST 20
+#define REGISTER_COUNT 21
+#define REGISTER_BYTES (REGISTERS_SIZE + 2 + 2 + 3)
+
+static const char targetXml[] =
+  "<?xml version=\"1.0\"?>"
+  "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+  "<target version=\"1.0\"><feature name=\"org.chip8.core\">"
+  "<reg name=\"v0\" bitsize=\"8\" type=\"uint8\" regnum=\"0\"/>"
+  "<reg name=\"v1\" bitsize=\"8\" type=\"uint8\"/><reg name=\"v2\" bitsize=\"8\" type=\"uint8\"/>"
+  "<reg name=\"v3\" bitsize=\"8\" type=\"uint8\"/><reg name=\"v4\" bitsize=\"8\" type=\"uint8\"/>"
+  "<reg name=\"v5\" bitsize=\"8\" type=\"uint8\"/><reg name=\"v6\" bitsize=\"8\" type=\"uint8\"/>"
+  "<reg name=\"v7\" bitsize=\"8\" type=\"uint8\"/><reg name=\"v8\" bitsize=\"8\" type=\"uint8\"/>"
+  "<reg name=\"v9\" bitsize=\"8\" type=\"uint8\"/><reg name=\"va\" bitsize=\"8\" type=\"uint8\"/>"
+  "<reg name=\"vb\" bitsize=\"8\" type=\"uint8\"/><reg name=\"vc\" bitsize=\"8\" type=\"uint8\"/>"
+  "<reg name=\"vd\" bitsize=\"8\" type=\"uint8\"/><reg name=\"ve\" bitsize=\"8\" type=\"uint8\"/>"
+  "<reg name=\"vf\" bitsize=\"8\" type=\"uint8\"/>"
+  "<reg name=\"i\" bitsize=\"16\" type=\"data_ptr\"/>"
+  "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+  "<reg name=\"sp\" bitsize=\"8\" type=\"uint8\"/>"
+  "<reg name=\"dt\" bitsize=\"8\" type=\"uint8\"/>"
+  "<reg name=\"st\" bitsize=\"8\" type=\"uint8\"/>"
+  "</feature></target>";
+
+struct gdbstub {
+  int listener;
+  int fd;                         // -1 once GDB detached or hung up
+  char* socketPath;               // Unix socket to unlink, or NULL
+
+  chip8* chip;                    // attached to, breakpoints point in here
+  uint8_t breakpoints[CODE_MEMORY / 8];
+  uint8_t watchpoints[MAX_MEMORY / 8];
+  uint32_t watchCount;
+
+  bool stopped;                   // GDB has the machine
+  bool stepping;                  // stop again after one instruction
+  bool resuming;                  // c or s, runs the instruction at pc even on a breakpoint
+  bool reportStop;                // GDB waits for a stop reply
+  int stopSignal;
+  bool watchHit;
+  uint16_t watchAddress;
+  bool debuggerWrite;             // M packets do not hit watchpoints
+
+  char input[GDBSTUB_PACKET_SIZE];
+  size_t inputLength;
+  char packet[GDBSTUB_PACKET_SIZE];
+  char reply[GDBSTUB_PACKET_SIZE];
+};
+
+static bool testBit(const uint8_t* bits, uint32_t address) {
+  return (bits[address >> 3] >> (address & 7)) & 1;
+}
+
+static void setBit(uint8_t* bits, uint32_t address, bool set) {
+  if (set)
+    bits[address >> 3] |= (uint8_t)(1u << (address & 7));
+  else
+    bits[address >> 3] &= (uint8_t) ~(1u << (address & 7));
+}
+
+// the connection
+
+static void hangUp(gdbstub* stub) {
+  if (stub->fd >= 0)
+    close(stub->fd);
+  stub->fd = -1;
+}
+
+static void sendAll(gdbstub* stub, const char* data, size_t length) {
+  while (length > 0 && stub->fd >= 0) {
+    ssize_t sent = send(stub->fd, data, length, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0) {
+      hangUp(stub);
+      return;
+    }
+    data += sent;
+    length -= (size_t)sent;
+  }
+}
+
+static void sendPacket(gdbstub* stub, const char* data) {
+  static const char hex[] = "0123456789abcdef";
+  size_t length = strlen(data);
+  uint8_t checksum = 0;
+  for (size_t i = 0; i < length; i++)
+    checksum += (uint8_t)data[i];
+
+  char trailer[3] = { '#', hex[checksum >> 4], hex[checksum & 0xF] };
+  sendAll(stub, "$", 1);
+  sendAll(stub, data, length);
+  sendAll(stub, trailer, sizeof(trailer));
+}
+
+// reads more input, waiting for it if wait is set. false on hang up or, when
+// not waiting, if there is nothing to read
+static bool receive(gdbstub* stub, bool wait) {
+  if (stub->fd < 0 || stub->inputLength == sizeof(stub->input))
+    return false;
+
+  ssize_t got;
+  do {
+    got = recv(stub->fd, stub->input + stub->inputLength, sizeof(stub->input) - stub->inputLength,
+               wait ? 0 : MSG_DONTWAIT);
+  } while (got < 0 && errno == EINTR);
+
+  if (got > 0) {
+    stub->inputLength += (size_t)got;
+    return true;
+  }
+  if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+    hangUp(stub);
+  return false;
+}
+
+static void consume(gdbstub* stub, size_t count) {
+  memmove(stub->input, stub->input + count, stub->inputLength - count);
+  stub->inputLength -= count;
+}
+
+// the next packet into stub->packet, acknowledged. Acks from GDB are
+// skipped, as is a Ctrl-C that arrives while already stopped
+static bool readPacket(gdbstub* stub) {
+  for (;;) {
+    while (stub->inputLength > 0 && stub->input[0] != '$')
+      consume(stub, 1);
+
+    char* end = memchr(stub->input, '#', stub->inputLength);
+    if (end != NULL && (size_t)(end - stub->input) + 3 <= stub->inputLength) {
+      size_t length = (size_t)(end - stub->input) - 1;
+      memcpy(stub->packet, stub->input + 1, length);
+      stub->packet[length] = '\0';
+      consume(stub, length + 4);
+      sendAll(stub, "+", 1);
+      return true;
+    }
+    if (stub->inputLength == sizeof(stub->input))
+      stub->inputLength = 0;
+    if (!receive(stub, true))
+      return false;
+  }
+}
+
+// a Ctrl-C that arrived while running
+static bool interrupted(gdbstub* stub) {
+  while (receive(stub, false))
+    continue;
+
+  for (size_t i = 0; i < stub->inputLength; i++) {
+    if (stub->input[i] == 0x03) {
+      consume(stub, i + 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+// packets
+
+static int hexDigit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+static char* toHex(char* out, const uint8_t* data, size_t length) {
+  static const char hex[] = "0123456789abcdef";
+  for (size_t i = 0; i < length; i++) {
+    *out++ = hex[data[i] >> 4];
+    *out++ = hex[data[i] & 0xF];
+  }
+  *out = '\0';
+  return out;
+}
+
+static bool fromHex(const char* in, uint8_t* data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    int high = hexDigit(in[2 * i]), low = hexDigit(in[2 * i + 1]);
+    if (high < 0 || low < 0)
+      return false;
+    data[i] = (uint8_t)(high << 4 | low);
+  }
+  return true;
+}
+
+static void readRegisters(const chip8* chip, uint8_t* out) {
+  memcpy(out, chip->V, REGISTERS_SIZE);
+  out[REGISTERS_SIZE] = chip->I & 0xFF;
+  out[REGISTERS_SIZE + 1] = chip->I >> 8;
+  out[REGISTERS_SIZE + 2] = chip->pc & 0xFF;
+  out[REGISTERS_SIZE + 3] = chip->pc >> 8;
+  out[REGISTERS_SIZE + 4] = chip->sp;
+  out[REGISTERS_SIZE + 5] = chip->delay_timer;
+  out[REGISTERS_SIZE + 6] = chip->sound_timer;
+}
+
+static void writeRegisters(chip8* chip, const uint8_t* in) {
+  memcpy(chip->V, in, REGISTERS_SIZE);
+  chip->I = (uint16_t)(in[REGISTERS_SIZE] | in[REGISTERS_SIZE + 1] << 8);
+  chip->pc = (uint16_t)(in[REGISTERS_SIZE + 2] | in[REGISTERS_SIZE + 3] << 8);
+  chip->sp = in[REGISTERS_SIZE + 4] % (STACK_SIZE + 1);
+  chip->delay_timer = in[REGISTERS_SIZE + 5];
+  chip->sound_timer = in[REGISTERS_SIZE + 6];
+}
+
+// byte offset and size of register n in the g packet layout
+static bool registerSpan(unsigned n, size_t* offset, size_t* size) {
+  if (n >= REGISTER_COUNT)
+    return false;
+  if (n < REGISTER_I) {
+    *offset = n;
+    *size = 1;
+  } else if (n <= REGISTER_PC) {
+    *offset = REGISTERS_SIZE + 2 * (n - REGISTER_I);
+    *size = 2;
+  } else {
+    *offset = REGISTERS_SIZE + 4 + (n - REGISTER_SP);
+    *size = 1;
+  }
+  return true;
+}
+
+// "addr,length" in hex, within the 64K address space
+static bool parseRange(const char* in, uint32_t* address, uint32_t* length, const char** rest) {
+  char* end;
+  unsigned long a = strtoul(in, &end, 16);
+  if (*end != ',')
+    return false;
+  unsigned long l = strtoul(end + 1, &end, 16);
+  if (a >= MAX_MEMORY || l > MAX_MEMORY - a)
+    return false;
+
+  *address = (uint32_t)a;
+  *length = (uint32_t)l;
+  if (rest != NULL)
+    *rest = end;
+  return true;
+}
+
+// a code breakpoint lives in the bitmap and, once decoded, in its entry
+static void setBreakpoint(gdbstub* stub, uint16_t address, bool set) {
+  setBit(stub->breakpoints, address, set);
+  if (stub->chip != NULL)
+    stub->chip->decoded[address >> 1].op = set ? CHIP8_OP_BREAK : CHIP8_OP_DECODE;
+}
+
+// Z and z packets: "type,addr,kind"
+static const char* point(gdbstub* stub, const char* in, bool set) {
+  uint32_t address, length;
+  if (!parseRange(in + 2, &address, &length, NULL) || in[1] != ',')
+    return "E01";
+
+  switch (in[0]) {
+    case '0':
+    case '1':
+      if (address >= CODE_MEMORY || (address & 1))
+        return "E02";
+      setBreakpoint(stub, (uint16_t)address, set);
+      return "OK";
+    case '2':
+      for (uint32_t a = address; a < address + length; a++) {
+        if (testBit(stub->watchpoints, a) != set) {
+          if (set)
+            stub->watchCount++;
+          else
+            stub->watchCount--;
+        }
+        setBit(stub->watchpoints, a, set);
+      }
+      return "OK";
+    default:
+      return "";
+  }
+}
+
+static const char* query(gdbstub* stub, const char* in) {
+  if (strncmp(in, "qSupported", 10) == 0) {
+    snprintf(stub->reply, sizeof(stub->reply), "PacketSize=%x;qXfer:features:read+",
+             GDBSTUB_PACKET_SIZE - 8);
+    return stub->reply;
+  }
+  if (strcmp(in, "qAttached") == 0)
+    return "1";
+  if (strcmp(in, "qC") == 0)
+    return "QC1";
+  if (strcmp(in, "qfThreadInfo") == 0)
+    return "m1";
+  if (strcmp(in, "qsThreadInfo") == 0)
+    return "l";
+
+  const char* features = "qXfer:features:read:target.xml:";
+  if (strncmp(in, features, strlen(features)) == 0) {
+    char* end;
+    unsigned long offset = strtoul(in + strlen(features), &end, 16);
+    unsigned long length = *end == ',' ? strtoul(end + 1, NULL, 16) : 0;
+    size_t size = sizeof(targetXml) - 1;
+    if (offset >= size)
+      return "l";
+    size_t count = size - offset;
+    if (count > length)
+      count = length;
+    if (count > sizeof(stub->reply) - 2)
+      count = sizeof(stub->reply) - 2;
+    stub->reply[0] = offset + count < size ? 'm' : 'l';
+    memcpy(stub->reply + 1, targetXml + offset, count);
+    stub->reply[1 + count] = '\0';
+    return stub->reply;
+  }
+  return "";
+}
+
+// handles one packet, "" for the unsupported ones. Sets stopped to false
+// when the machine should run again
+static const char* handle(gdbstub* stub, chip8* chip, bool* kill) {
+  const char* in = stub->packet;
+  uint8_t bytes[GDBSTUB_PACKET_SIZE / 2];
+  uint32_t address, length;
+
+  switch (in[0]) {
+    case '?':
+      snprintf(stub->reply, sizeof(stub->reply), "S%02x", stub->stopSignal);
+      return stub->reply;
+    case 'g':
+      readRegisters(chip, bytes);
+      toHex(stub->reply, bytes, REGISTER_BYTES);
+      return stub->reply;
+    case 'G':
+      if (strlen(in + 1) < 2 * REGISTER_BYTES || !fromHex(in + 1, bytes, REGISTER_BYTES))
+        return "E01";
+      writeRegisters(chip, bytes);
+      return "OK";
+    case 'p':
+    case 'P': {
+      char* end;
+      unsigned n = (unsigned)strtoul(in + 1, &end, 16);
+      size_t offset, size;
+      if (!registerSpan(n, &offset, &size))
+        return "E01";
+      readRegisters(chip, bytes);
+      if (in[0] == 'p') {
+        toHex(stub->reply, bytes + offset, size);
+        return stub->reply;
+      }
+      if (*end != '=' || strlen(end + 1) < 2 * size || !fromHex(end + 1, bytes + offset, size))
+        return "E01";
+      writeRegisters(chip, bytes);
+      return "OK";
+    }
+    case 'm':
+      if (!parseRange(in + 1, &address, &length, NULL) || 2 * length >= sizeof(stub->reply))
+        return "E01";
+      toHex(stub->reply, chip->memory + address, length);
+      return stub->reply;
+    case 'M': {
+      const char* data;
+      if (!parseRange(in + 1, &address, &length, &data) || *data != ':' ||
+          strlen(data + 1) < 2 * length || !fromHex(data + 1, bytes, length))
+        return "E01";
+      memcpy(chip->memory + address, bytes, length);
+      // decoded entries follow the new bytes, breakpoints are patched back
+      stub->debuggerWrite = true;
+      chip8_invalidate(chip, (uint16_t)address, (uint16_t)length);
+      stub->debuggerWrite = false;
+      return "OK";
+    }
+    case 'c':
+    case 's':
+      if (in[1] != '\0')
+        chip->pc = (uint16_t)strtoul(in + 1, NULL, 16);
+      stub->stepping = in[0] == 's';
+      stub->resuming = true;
+      stub->stopped = false;
+      stub->reportStop = true;
+      return NULL;
+    case 'Z':
+      return point(stub, in + 1, true);
+    case 'z':
+      return point(stub, in + 1, false);
+    case 'H':
+      return "OK";
+    case 'T':
+      return "OK";
+    case 'q':
+      return query(stub, in);
+    case 'D':
+      sendPacket(stub, "OK");
+      hangUp(stub);
+      stub->stopped = false;
+      return NULL;
+    case 'k':
+      *kill = true;
+      hangUp(stub);
+      return NULL;
+    default:
+      return "";
+  }
+}
+
+// serves GDB until it resumes the machine. false if it killed it
+static bool serve(gdbstub* stub, chip8* chip) {
+  if (stub->reportStop) {
+    if (stub->watchHit)
+      snprintf(stub->reply, sizeof(stub->reply), "T%02xwatch:%x;", SIGNAL_TRAP, stub->watchAddress);
+    else
+      snprintf(stub->reply, sizeof(stub->reply), "S%02x", stub->stopSignal);
+    sendPacket(stub, stub->reply);
+    stub->reportStop = false;
+  }
+  stub->watchHit = false;
+
+  bool kill = false;
+  while (stub->stopped && stub->fd >= 0 && readPacket(stub)) {
+    const char* reply = handle(stub, chip, &kill);
+    if (reply != NULL)
+      sendPacket(stub, reply);
+  }
+  stub->stopped = false;
+  return !kill;
+}
+
+static void stop(gdbstub* stub, int signal) {
+  stub->stopped = true;
+  stub->stepping = false;
+  stub->stopSignal = signal;
+}
+
+static void onWrite(void* user, uint16_t address, uint16_t length) {
+  gdbstub* stub = user;
+  if (stub->watchCount == 0 || stub->debuggerWrite)
+    return;
+
+  for (uint32_t i = 0; i < length; i++) {
+    uint16_t at = (uint16_t)(address + i);
+    if (testBit(stub->watchpoints, at)) {
+      stub->watchHit = true;
+      stub->watchAddress = at;
+      return;
+    }
+  }
+}
+
+// points chip at the bitmap and patches every breakpoint in, e.g. again
+// after chip8_initialize cleared it
+static void attach(gdbstub* stub, chip8* chip) {
+  stub->chip = chip;
+  chip->breakpoints = stub->breakpoints;
+  chip->codeWriteHook = onWrite;
+  chip->hookUser = stub;
+
+  for (uint32_t address = 0; address < CODE_MEMORY; address += 2) {
+    if (testBit(stub->breakpoints, address))
+      chip->decoded[address >> 1].op = CHIP8_OP_BREAK;
+  }
+}
+
+static void detach(gdbstub* stub) {
+  chip8* chip = stub->chip;
+  if (chip == NULL || chip->breakpoints != stub->breakpoints)
+    return;
+
+  chip->breakpoints = NULL;
+  chip->codeWriteHook = NULL;
+  chip->hookUser = NULL;
+  for (uint32_t address = 0; address < CODE_MEMORY; address += 2) {
+    if (testBit(stub->breakpoints, address))
+      chip->decoded[address >> 1].op = CHIP8_OP_DECODE;
+  }
+  stub->chip = NULL;
+}
+
+// runs the instruction a breakpoint is patched over, once
+static void stepOver(gdbstub* stub, chip8* chip) {
+  uint16_t pc = chip->pc;
+  setBit(stub->breakpoints, pc, false);
+  chip->decoded[pc >> 1].op = CHIP8_OP_DECODE;
+  chip8_execute(chip, 1);
+  setBreakpoint(stub, pc, true);
+}
+
+bool gdbstub_execute(gdbstub* stub, chip8* chip, uint32_t cycles) {
+  if (stub->fd < 0) {
+    detach(stub);
+    chip8_execute(chip, cycles);
+    return true;
+  }
+  if (chip->breakpoints != stub->breakpoints)
+    attach(stub, chip);
+
+  if (interrupted(stub))
+    stop(stub, SIGNAL_INT);
+
+  uint64_t executed = 0;
+  for (;;) {
+    if (stub->stopped && !serve(stub, chip))
+      return false;
+    if (stub->fd < 0) {
+      detach(stub);
+      chip8_execute(chip, (uint32_t)(cycles - executed));
+      return true;
+    }
+    if (executed == cycles)
+      return true;
+
+    // a breakpoint reached at the end of the last budget has not stopped
+    // yet, only the one GDB resumes from is stepped over
+    uint64_t before = chip->cycles;
+    if (stub->resuming && chip8_breakpointAt(stub->breakpoints, chip->pc))
+      stepOver(stub, chip);
+    else
+      chip8_execute(chip, stub->stepping || stub->watchCount > 0 ? 1 : (uint32_t)(cycles - executed));
+    stub->resuming = false;
+    // nothing ran, e.g. a checked build stopped on a fault
+    if (chip->cycles == before && chip->idle != CHIP8_IDLE_BREAK)
+      return true;
+    executed += chip->cycles - before;
+
+    if (chip->idle == CHIP8_IDLE_BREAK || stub->watchHit || stub->stepping)
+      stop(stub, SIGNAL_TRAP);
+  }
+}
+
+gdbstub* gdbstub_open(const char* address) {
+  gdbstub* stub = calloc(1, sizeof(gdbstub));
+  if (stub == NULL)
+    return NULL;
+  stub->listener = -1;
+  stub->fd = -1;
+  stub->stopped = true;
+  stub->stopSignal = SIGNAL_TRAP;
+
+  char* end;
+  unsigned long port = strtoul(address, &end, 10);
+  if (*address != '\0' && *end == '\0') {
+    struct sockaddr_in inet = { 0 };
+    inet.sin_family = AF_INET;
+    inet.sin_port = htons((uint16_t)port);
+    inet.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int reuse = 1;
+    stub->listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (stub->listener < 0 ||
+        setsockopt(stub->listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+        bind(stub->listener, (struct sockaddr*)&inet, sizeof(inet)) != 0)
+      goto fail;
+  } else {
+    struct sockaddr_un local = { 0 };
+    local.sun_family = AF_UNIX;
+    if (strlen(address) >= sizeof(local.sun_path))
+      goto fail;
+    strcpy(local.sun_path, address);
+
+    unlink(address);
+    stub->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (stub->listener < 0 || bind(stub->listener, (struct sockaddr*)&local, sizeof(local)) != 0)
+      goto fail;
+    if ((stub->socketPath = malloc(strlen(address) + 1)) != NULL)
+      strcpy(stub->socketPath, address);
+  }
+
+  if (listen(stub->listener, 1) != 0)
+    goto fail;
+  do {
+    stub->fd = accept(stub->listener, NULL, NULL);
+  } while (stub->fd < 0 && errno == EINTR);
+  if (stub->fd < 0)
+    goto fail;
+  return stub;
+
+fail:
+  gdbstub_close(stub);
+  return NULL;
+}
+
+void gdbstub_close(gdbstub* stub) {
+  detach(stub);
+  hangUp(stub);
+  if (stub->listener >= 0)
+    close(stub->listener);
+  if (stub->socketPath != NULL) {
+    unlink(stub->socketPath);
+    free(stub->socketPath);
+  }
+  free(stub);
+}
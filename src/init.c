@@ -44,7 +44,7 @@ static void initKeymap(void) {
 }
 
 static void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
-  chip8* chip = (chip8*)glfwGetWindowUserPointer(window);
+  emulator* emu = (emulator*)glfwGetWindowUserPointer(window);
 
   // to supress warnings
   (void)scancode;
@@ -53,10 +53,15 @@ static void keyCallback(GLFWwindow* window, int key, int scancode, int action, i
   if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
     glfwSetWindowShouldClose(window, GLFW_TRUE);
 
+  // hold backspace to rewind
+  if (key == GLFW_KEY_BACKSPACE)
+    emulator_setRewinding(emu, action != GLFW_RELEASE);
+
   if (key >= 0 && key <= GLFW_KEY_LAST) {
     uint8_t mapped = keymap[key];
-    if (mapped != 0xFF)
-      chip->key[mapped] = (action == GLFW_PRESS) ? 1 : 0;
+    // key repeats leave the key held
+    if (mapped != 0xFF && action != GLFW_REPEAT)
+      emulator_setKey(emu, mapped, action == GLFW_PRESS);
   }
 }
 
@@ -121,35 +126,84 @@ static GLFWwindow* setupWindow(void) {
   return window;
 }
 
-static void drawPixel(int x, int y) {
-  glBegin(GL_QUADS);
-  glVertex2f(x, y);
-  glVertex2f(x + 1, y);
-  glVertex2f(x + 1, y + 1);
-  glVertex2f(x, y + 1);
-  glEnd();
+// the framebuffer is uploaded as a HIRES_WIDTH x HIRES_HEIGHT luminance
+// texture, lores frames with their pixels doubled, through
+// a pixel buffer object that is orphaned every frame, so the driver never
+// has to wait for the previous upload before we can write the next one
+static GLuint screenTexture;
+static GLuint screenPbo;
+
+static void setupRenderer(void) {
+  glGenTextures(1, &screenTexture);
+  glBindTexture(GL_TEXTURE_2D, screenTexture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE8, HIRES_WIDTH, HIRES_HEIGHT, 0,
+               GL_LUMINANCE, GL_UNSIGNED_BYTE, NULL);
+
+  glGenBuffers(1, &screenPbo);
+
+  glEnable(GL_TEXTURE_2D);
+  glColor3f(1.0f, 1.0f, 1.0f);
 }
 
-void render(chip8* chip) {
-  glClear(GL_COLOR_BUFFER_BIT);
-  for (int y = 0; y < HEIGHT; y++) {
-    for (int x = 0; x < WIDTH; x++) {
-      if (chip->gfx[x + (y * WIDTH)] == 0)
-        glColor3f(0.0f, 0.0f, 0.0f);
-      else
-        glColor3f(1.0f, 1.0f, 1.0f);
-
-      drawPixel(x, y);
+static void uploadFrame(const chip8_frame* frame) {
+  const GLsizeiptr size = HIRES_WIDTH * HIRES_HEIGHT;
+  // shade per combination of the two plane bits
+  static const uint8_t palette[4] = { 0x00, 0xFF, 0x80, 0xC0 };
+  int scale = frame->hires ? 1 : 2;
+  int words = frame->hires ? HIRES_WIDTH / 64 : 1;
+
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, screenPbo);
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+
+  uint8_t* pixels = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+                                     GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  if (pixels != NULL) {
+    for (int y = 0; y < HIRES_HEIGHT; y++) {
+      const uint64_t* row0 = frame->gfx[0] + (y / scale) * words;
+      const uint64_t* row1 = frame->gfx[1] + (y / scale) * words;
+      for (int x = 0; x < HIRES_WIDTH; x++) {
+        int column = x / scale;
+        int shift = 63 - column % 64;
+        int bits = ((row0[column / 64] >> shift) & 1) | (((row1[column / 64] >> shift) & 1) << 1);
+        pixels[x + (y * HIRES_WIDTH)] = palette[bits];
+      }
     }
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
   }
-  chip->drawFlag = false;
+
+  // with a PBO bound the last argument is an offset into it
+  glBindTexture(GL_TEXTURE_2D, screenTexture);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, HIRES_WIDTH, HIRES_HEIGHT,
+                  GL_LUMINANCE, GL_UNSIGNED_BYTE, (const void*)0);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void render(const chip8_frame* frame) {
+  uploadFrame(frame);
+
+  glClear(GL_COLOR_BUFFER_BIT);
+
+  // one quad covering the WIDTH x HEIGHT projection set in windowSizeCallback
+  glBegin(GL_QUADS);
+  glTexCoord2f(0.0f, 0.0f); glVertex2f(0, 0);
+  glTexCoord2f(1.0f, 0.0f); glVertex2f(WIDTH, 0);
+  glTexCoord2f(1.0f, 1.0f); glVertex2f(WIDTH, HEIGHT);
+  glTexCoord2f(0.0f, 1.0f); glVertex2f(0, HEIGHT);
+  glEnd();
 }
 
-GLFWwindow* setup(chip8* chip) {
+GLFWwindow* setup(emulator* emu) {
   GLFWwindow* window = setupWindow();
 
   initKeymap();
-  glfwSetWindowUserPointer(window, chip);
+  setupRenderer();
+  glfwSetWindowUserPointer(window, emu);
   glfwSetKeyCallback(window, keyCallback);
 
   int fbWidth, fbHeight;
@@ -0,0 +1,146 @@
+#include "inputlog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INPUTLOG_MAGIC "C8IN"
+#define INPUTLOG_VERSION 1
+#define HEADER_SIZE 32
+#define RECORD_SIZE 6
+
+// explicit byte order, the logs are shared between machines
+static void put16(uint8_t* p, uint16_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+  put16(p, (uint16_t)v);
+  put16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void put64(uint8_t* p, uint64_t v) {
+  put32(p, (uint32_t)v);
+  put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint16_t get16(const uint8_t* p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get32(const uint8_t* p) {
+  return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static uint64_t get64(const uint8_t* p) {
+  return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+void inputlog_init(inputlog* log, uint32_t ipf, uint64_t seed, uint64_t romHash) {
+  memset(log, 0x0, sizeof(*log));
+  log->ipf = ipf;
+  log->seed = seed;
+  log->romHash = romHash;
+}
+
+void inputlog_free(inputlog* log) {
+  free(log->events);
+  log->events = NULL;
+  log->count = 0;
+  log->capacity = 0;
+}
+
+static bool append(inputlog* log, inputlog_event event) {
+  if (log->count == log->capacity) {
+    size_t capacity = log->capacity != 0 ? log->capacity * 2 : 64;
+    inputlog_event* grown = realloc(log->events, capacity * sizeof(*grown));
+    if (grown == NULL)
+      return false;
+
+    log->events = grown;
+    log->capacity = capacity;
+  }
+
+  log->events[log->count++] = event;
+  return true;
+}
+
+bool inputlog_record(inputlog* log, uint32_t frame, uint16_t keys) {
+  log->frames = frame + 1;
+
+  uint16_t last = log->count != 0 ? log->events[log->count - 1].keys : 0;
+  if (keys == last)
+    return true;
+
+  return append(log, (inputlog_event){ .frame = frame, .keys = keys });
+}
+
+void inputlog_truncate(inputlog* log, uint32_t frames) {
+  while (log->count != 0 && log->events[log->count - 1].frame >= frames)
+    log->count--;
+
+  if (log->frames > frames)
+    log->frames = frames;
+}
+
+bool inputlog_save(const inputlog* log, const char* path) {
+  FILE* file = fopen(path, "wb");
+  if (file == NULL)
+    return false;
+
+  uint8_t header[HEADER_SIZE] = { 0 };
+  memcpy(header, INPUTLOG_MAGIC, 4);
+  put16(header + 4, INPUTLOG_VERSION);
+  put16(header + 6, log->quirks);
+  put32(header + 8, log->ipf);
+  put32(header + 12, log->frames);
+  put64(header + 16, log->seed);
+  put64(header + 24, log->romHash);
+
+  bool ok = fwrite(header, sizeof(header), 1, file) == 1;
+
+  for (size_t i = 0; ok && i < log->count; i++) {
+    uint8_t record[RECORD_SIZE];
+    put32(record, log->events[i].frame);
+    put16(record + 4, log->events[i].keys);
+    ok = fwrite(record, sizeof(record), 1, file) == 1;
+  }
+
+  return fclose(file) == 0 && ok;
+}
+
+bool inputlog_load(inputlog* log, const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    return false;
+
+  uint8_t header[HEADER_SIZE];
+  if (fread(header, sizeof(header), 1, file) != 1 || memcmp(header, INPUTLOG_MAGIC, 4) != 0 ||
+      get16(header + 4) != INPUTLOG_VERSION) {
+    fclose(file);
+    return false;
+  }
+
+  inputlog_init(log, get32(header + 8), get64(header + 16), get64(header + 24));
+  log->frames = get32(header + 12);
+  // zero in logs from before quirk profiles, which is the default one
+  log->quirks = get16(header + 6);
+
+  uint8_t record[RECORD_SIZE];
+  size_t read;
+  bool ok = true;
+  while (ok && (read = fread(record, 1, sizeof(record), file)) != 0) {
+    inputlog_event event = { .frame = get32(record), .keys = get16(record + 4) };
+
+    // a cut off record or events out of order mean a damaged file
+    ok = read == sizeof(record) &&
+         (log->count == 0 || event.frame > log->events[log->count - 1].frame) &&
+         append(log, event);
+  }
+
+  fclose(file);
+  if (!ok)
+    inputlog_free(log);
+  return ok;
+}
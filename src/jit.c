@@ -0,0 +1,693 @@
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+
+#include <stdlib.h>
+
+#if defined(__x86_64__) && !defined(_WIN32) && !defined(CHIP8_CHECKED)
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define JIT_ARENA_SIZE (1024 * 1024)
+#define JIT_MAX_BLOCKS 8192
+#define JIT_MAX_BLOCK_OPS 64
+#define JIT_MAX_BLOCK_BYTES (JIT_MAX_BLOCK_OPS * 2)
+#define JIT_MAX_CODE 2048         // more than the largest block can need
+
+typedef void (*jit_code)(chip8* chip);
+
+// a block with no code starts with an instruction the JIT leaves to the
+// interpreter, count is then the run of such instructions to interpret
+typedef struct {
+  jit_code code;
+  uint16_t start;                 // translated from memory [start, end)
+  uint16_t end;
+  uint16_t count;                 // instructions, terminator included
+  uint16_t lastOpcode;
+  bool idle;                      // no code, starts with an idleJump
+} jit_block;
+
+struct chip8_jit {
+  chip8* chip;
+
+  uint8_t* arena;                 // executable memory, filled linearly
+  size_t used;
+
+  jit_block blocks[JIT_MAX_BLOCKS];
+  size_t blockCount;
+
+  // only code memory is translated, anything past it is interpreted
+  jit_block* byAddress[CODE_MEMORY];
+  bool covered[CODE_MEMORY];      // translated from, until the next flush
+};
+
+// host registers, in x86 encoding order
+enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// rdi holds the chip pointer, rax is scratch and r15 holds I. V registers
+// are allocated from this list in order of first use within a block
+static const uint8_t hostRegisters[] = {
+  RCX, RDX, RSI, R8, R9, R10, R11, RBX, RBP, R12, R13, R14,
+};
+#define HOST_REGISTERS (sizeof(hostRegisters) / sizeof(hostRegisters[0]))
+
+// callee-saved in the System V ABI, so pushed by the blocks that use them
+static bool calleeSaved(int reg) {
+  return reg == RBX || reg == RBP || reg >= R12;
+}
+
+#define OFFSET_V(x) ((int32_t)(offsetof(chip8, V) + (x)))
+#define OFFSET_I ((int32_t)offsetof(chip8, I))
+#define OFFSET_PC ((int32_t)offsetof(chip8, pc))
+#define OFFSET_DT ((int32_t)offsetof(chip8, delay_timer))
+#define OFFSET_ST ((int32_t)offsetof(chip8, sound_timer))
+
+// x86 opcodes for "op r/m8, r8" and the /digit of "op r/m8, imm8"
+#define X86_ADD 0x00
+#define X86_OR 0x08
+#define X86_AND 0x20
+#define X86_SUB 0x28
+#define X86_XOR 0x30
+#define X86_CMP 0x38
+#define X86_MOV 0x88
+#define X86_EXT_ADD 0
+#define X86_EXT_CMP 7
+#define X86_EXT_SHL 4
+#define X86_EXT_SHR 5
+#define X86_SETC 0x92
+#define X86_SETNC 0x93
+#define X86_JE 0x74
+#define X86_JNE 0x75
+
+typedef struct {
+  uint8_t* p;
+} emitter;
+
+static void emit8(emitter* e, uint8_t byte) {
+  *e->p++ = byte;
+}
+
+static void emit16(emitter* e, uint16_t value) {
+  emit8(e, value & 0xFF);
+  emit8(e, value >> 8);
+}
+
+static void emit32(emitter* e, int32_t value) {
+  for (int i = 0; i < 4; i++)
+    emit8(e, ((uint32_t)value >> (i * 8)) & 0xFF);
+}
+
+// always emitted for byte operations, so sil/dil/bpl are reachable
+static void rex(emitter* e, int reg, int rm) {
+  emit8(e, 0x40 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+static void modrmRegister(emitter* e, int reg, int rm) {
+  emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// [rdi + disp32]
+static void modrmChip(emitter* e, int reg, int32_t offset) {
+  emit8(e, 0x80 | ((reg & 7) << 3) | RDI);
+  emit32(e, offset);
+}
+
+// op dst8, src8
+static void alu8(emitter* e, uint8_t opcode, int dst, int src) {
+  rex(e, src, dst);
+  emit8(e, opcode);
+  modrmRegister(e, src, dst);
+}
+
+// op dst8, imm8
+static void aluImm8(emitter* e, int ext, int dst, uint8_t imm) {
+  rex(e, 0, dst);
+  emit8(e, 0x80);
+  modrmRegister(e, ext, dst);
+  emit8(e, imm);
+}
+
+static void movImm8(emitter* e, int dst, uint8_t imm) {
+  rex(e, 0, dst);
+  emit8(e, 0xB0 + (dst & 7));
+  emit8(e, imm);
+}
+
+// shl/shr dst8, 1
+static void shift1(emitter* e, int ext, int dst) {
+  rex(e, 0, dst);
+  emit8(e, 0xD0);
+  modrmRegister(e, ext, dst);
+}
+
+// movzx reg32, byte [rdi + offset]
+static void loadByte(emitter* e, int reg, int32_t offset) {
+  rex(e, reg, 0);
+  emit8(e, 0x0F);
+  emit8(e, 0xB6);
+  modrmChip(e, reg, offset);
+}
+
+// mov byte [rdi + offset], reg8
+static void storeByte(emitter* e, int reg, int32_t offset) {
+  rex(e, reg, 0);
+  emit8(e, 0x88);
+  modrmChip(e, reg, offset);
+}
+
+// movzx r15d, word [rdi + I]
+static void loadI(emitter* e) {
+  rex(e, R15, 0);
+  emit8(e, 0x0F);
+  emit8(e, 0xB7);
+  modrmChip(e, R15, OFFSET_I);
+}
+
+// mov word [rdi + I], r15w
+static void storeI(emitter* e) {
+  emit8(e, 0x66);
+  rex(e, R15, 0);
+  emit8(e, 0x89);
+  modrmChip(e, R15, OFFSET_I);
+}
+
+// mov r15w, imm16
+static void setI(emitter* e, uint16_t value) {
+  emit8(e, 0x66);
+  rex(e, 0, R15);
+  emit8(e, 0xB8 + (R15 & 7));
+  emit16(e, value);
+}
+
+// add r15w, reg16 (V registers are kept zero-extended)
+static void addI(emitter* e, int reg) {
+  emit8(e, 0x66);
+  rex(e, reg, R15);
+  emit8(e, 0x01);
+  modrmRegister(e, reg, R15);
+}
+
+// r15d = reg32 * 5
+static void fontI(emitter* e, int reg) {
+  rex(e, reg, R15);
+  emit8(e, 0x89);
+  modrmRegister(e, reg, R15);
+
+  rex(e, R15, R15);
+  emit8(e, 0x6B);
+  modrmRegister(e, R15, R15);
+  emit8(e, 5);
+}
+
+// mov word [rdi + pc], imm16
+static void storePc(emitter* e, uint16_t pc) {
+  emit8(e, 0x66);
+  emit8(e, 0xC7);
+  modrmChip(e, 0, OFFSET_PC);
+  emit16(e, pc);
+}
+#define STORE_PC_SIZE 9
+
+// setcc al, then VF = al
+static void flagFromCarry(emitter* e, uint8_t setcc, int vf) {
+  emit8(e, 0x0F);
+  emit8(e, setcc);
+  emit8(e, 0xC0);
+  alu8(e, X86_MOV, vf, RAX);
+}
+
+static void push(emitter* e, int reg) {
+  if (reg >= R8)
+    emit8(e, 0x41);
+  emit8(e, 0x50 + (reg & 7));
+}
+
+static void pop(emitter* e, int reg) {
+  if (reg >= R8)
+    emit8(e, 0x41);
+  emit8(e, 0x58 + (reg & 7));
+}
+
+typedef enum {
+  KIND_STOP,                      // left to the interpreter, ends the block before it
+  KIND_STRAIGHT,
+  KIND_JUMP,
+  KIND_SKIP,
+} jit_kind;
+
+typedef struct {
+  jit_kind kind;
+  uint16_t registersRead;         // bit per V register
+  uint16_t registersWritten;
+  bool usesI;
+} jit_info;
+
+// mirrors the decoder in chip8.c for every opcode the JIT translates
+static jit_info classify(uint16_t opcode) {
+  uint8_t x = (opcode >> 8) & 0xF;
+  uint8_t y = (opcode >> 4) & 0xF;
+  uint16_t vx = 1u << x;
+  uint16_t vy = 1u << y;
+  uint16_t vf = 1u << 0xF;
+
+  jit_info info = { .kind = KIND_STOP };
+
+  switch (opcode & 0xF000) {
+    case 0x1000:
+      info.kind = KIND_JUMP;
+      break;
+    case 0x3000:
+    case 0x4000:
+      info = (jit_info){ .kind = KIND_SKIP, .registersRead = vx };
+      break;
+    case 0x5000:
+      // 5XY2 and 5XY3 are register range stores and loads
+      if ((opcode & 0x000F) == 0x2 || (opcode & 0x000F) == 0x3)
+        break;
+      info = (jit_info){ .kind = KIND_SKIP, .registersRead = vx | vy };
+      break;
+    case 0x9000:
+      info = (jit_info){ .kind = KIND_SKIP, .registersRead = vx | vy };
+      break;
+    case 0x6000:
+      info = (jit_info){ .kind = KIND_STRAIGHT, .registersWritten = vx };
+      break;
+    case 0x7000:
+      info = (jit_info){ .kind = KIND_STRAIGHT, .registersRead = vx, .registersWritten = vx };
+      break;
+    case 0x8000:
+      switch (opcode & 0x000F) {
+        case 0x0: case 0x1: case 0x2: case 0x3:
+          info = (jit_info){ .kind = KIND_STRAIGHT, .registersRead = vx | vy, .registersWritten = vx };
+          break;
+        case 0x4: case 0x5: case 0x7:
+          // the interpreter's VF ordering only matches when neither is VF
+          if (x != 0xF && y != 0xF)
+            info = (jit_info){ .kind = KIND_STRAIGHT, .registersRead = vx | vy, .registersWritten = vx | vf };
+          break;
+        case 0x6: case 0xE:
+          if (x != 0xF)
+            info = (jit_info){ .kind = KIND_STRAIGHT, .registersRead = vx, .registersWritten = vx | vf };
+          break;
+      }
+      break;
+    case 0xA000:
+      info = (jit_info){ .kind = KIND_STRAIGHT, .usesI = true };
+      break;
+    case 0xF000:
+      switch (opcode & 0x00FF) {
+        case 0x07:
+          info = (jit_info){ .kind = KIND_STRAIGHT, .registersWritten = vx };
+          break;
+        case 0x15:
+        case 0x18:
+          info = (jit_info){ .kind = KIND_STRAIGHT, .registersRead = vx };
+          break;
+        case 0x1E:
+        case 0x29:
+          info = (jit_info){ .kind = KIND_STRAIGHT, .registersRead = vx, .usesI = true };
+          break;
+      }
+      break;
+  }
+
+  return info;
+}
+
+// a jump the interpreter may park in, see chip8_idleJump: to itself, or
+// back over an FX07 / 3X00 poll of the delay timer. Left to the interpreter
+// so it sets chip.idle and skips the rest of the budget
+static bool idleJump(const uint8_t* memory, uint16_t pc, uint16_t opcode) {
+  if ((opcode & 0xF000) != 0x1000)
+    return false;
+
+  uint16_t target = opcode & 0x0FFF;
+  if (target == pc)
+    return true;
+  if (target != (uint16_t)(pc - 4))
+    return false;
+
+  uint16_t read = (memory[target] << 8) | memory[target + 1];
+  uint16_t test = (memory[target + 2] << 8) | memory[target + 3];
+  return (read & 0xF0FF) == 0xF007 && (test & 0xF0FF) == 0x3000 && (read & 0x0F00) == (test & 0x0F00);
+}
+
+static int countBits(uint16_t bits) {
+  int count = 0;
+  for (; bits != 0; bits &= bits - 1)
+    count++;
+  return count;
+}
+
+static void emitStraight(emitter* e, uint16_t opcode, const int8_t* host) {
+  int x = host[(opcode >> 8) & 0xF];
+  int y = host[(opcode >> 4) & 0xF];
+  int vf = host[0xF];
+  uint8_t nn = opcode & 0xFF;
+
+  switch (opcode & 0xF000) {
+    case 0x6000: movImm8(e, x, nn); return;
+    case 0x7000: aluImm8(e, X86_EXT_ADD, x, nn); return;
+    case 0xA000: setI(e, opcode & 0x0FFF); return;
+  }
+
+  if ((opcode & 0xF000) == 0x8000) {
+    switch (opcode & 0x000F) {
+      case 0x0: alu8(e, X86_MOV, x, y); return;
+      case 0x1: alu8(e, X86_OR, x, y); return;
+      case 0x2: alu8(e, X86_AND, x, y); return;
+      case 0x3: alu8(e, X86_XOR, x, y); return;
+      case 0x4:
+        alu8(e, X86_ADD, x, y);
+        flagFromCarry(e, X86_SETC, vf);
+        return;
+      case 0x5:
+        alu8(e, X86_SUB, x, y);
+        flagFromCarry(e, X86_SETNC, vf);
+        return;
+      case 0x7:
+        alu8(e, X86_MOV, RAX, y);
+        alu8(e, X86_SUB, RAX, x);
+        alu8(e, X86_MOV, x, RAX);
+        flagFromCarry(e, X86_SETNC, vf);
+        return;
+      case 0x6:
+        shift1(e, X86_EXT_SHR, x);
+        flagFromCarry(e, X86_SETC, vf);
+        return;
+      case 0xE:
+        shift1(e, X86_EXT_SHL, x);
+        flagFromCarry(e, X86_SETC, vf);
+        return;
+    }
+  }
+
+  switch (opcode & 0x00FF) {
+    case 0x07: loadByte(e, x, OFFSET_DT); return;
+    case 0x15: storeByte(e, x, OFFSET_DT); return;
+    case 0x18: storeByte(e, x, OFFSET_ST); return;
+    case 0x1E: addI(e, x); return;
+    case 0x29: fontI(e, x); return;
+  }
+}
+
+static void flush(chip8_jit* jit) {
+  jit->used = 0;
+  jit->blockCount = 0;
+  memset(jit->byAddress, 0x0, sizeof(jit->byAddress));
+  memset(jit->covered, 0x0, sizeof(jit->covered));
+}
+
+static jit_block* compile(chip8_jit* jit, uint16_t start) {
+  const uint8_t* memory = jit->chip->memory;
+
+  // first pass: find where the block ends and which registers it needs
+  uint16_t opcodes[JIT_MAX_BLOCK_OPS];
+  int count = 0;
+  uint16_t used = 0;
+  uint16_t written = 0;
+  bool usesI = false;
+  jit_kind terminator = KIND_STOP;
+
+  for (uint16_t pc = start; count < JIT_MAX_BLOCK_OPS && pc <= CODE_MEMORY - 2; pc += 2) {
+    uint16_t opcode = (memory[pc] << 8) | memory[pc + 1];
+    jit_info info = classify(opcode);
+
+    if (info.kind == KIND_STOP || idleJump(memory, pc, opcode))
+      break;
+    if (countBits(used | info.registersRead | info.registersWritten) > (int)HOST_REGISTERS)
+      break;
+
+    opcodes[count++] = opcode;
+    used |= info.registersRead | info.registersWritten;
+    written |= info.registersWritten;
+    usesI |= info.usesI;
+
+    if (info.kind != KIND_STRAIGHT) {
+      terminator = info.kind;
+      break;
+    }
+  }
+
+  if (jit->used + JIT_MAX_CODE > JIT_ARENA_SIZE || jit->blockCount == JIT_MAX_BLOCKS)
+    flush(jit);
+
+  if (count == 0) {
+    uint16_t run = 0;
+    for (uint16_t pc = start; run < JIT_MAX_BLOCK_OPS && pc <= CODE_MEMORY - 2; pc += 2, run++) {
+      uint16_t opcode = (memory[pc] << 8) | memory[pc + 1];
+      if (classify(opcode).kind != KIND_STOP && !idleJump(memory, pc, opcode))
+        break;
+    }
+
+    uint16_t first = (memory[start] << 8) | memory[start + 1];
+    jit_block* block = &jit->blocks[jit->blockCount++];
+    *block = (jit_block){ .start = start, .end = start + 2, .count = run, .lastOpcode = first,
+                          .idle = idleJump(memory, start, first) };
+    jit->covered[start] = true;
+    jit->covered[start + 1] = true;
+    jit->byAddress[start] = block;
+    return block;
+  }
+
+  int8_t host[REGISTERS_SIZE];
+  memset(host, -1, sizeof(host));
+  for (int v = 0, next = 0; v < REGISTERS_SIZE; v++) {
+    if (used & (1u << v))
+      host[v] = hostRegisters[next++];
+  }
+
+  // second pass: emit
+  uint8_t* code = jit->arena + jit->used;
+  emitter e = { code };
+
+  uint8_t saved[HOST_REGISTERS + 1];
+  size_t savedCount = 0;
+  for (int v = 0; v < REGISTERS_SIZE; v++) {
+    if (host[v] >= 0 && calleeSaved(host[v]))
+      saved[savedCount++] = host[v];
+  }
+  if (usesI)
+    saved[savedCount++] = R15;
+
+  for (size_t i = 0; i < savedCount; i++)
+    push(&e, saved[i]);
+
+  for (int v = 0; v < REGISTERS_SIZE; v++) {
+    if (host[v] >= 0)
+      loadByte(&e, host[v], OFFSET_V(v));
+  }
+  if (usesI)
+    loadI(&e);
+
+  int straight = terminator == KIND_STOP ? count : count - 1;
+  for (int i = 0; i < straight; i++)
+    emitStraight(&e, opcodes[i], host);
+
+  uint16_t end = start + count * 2;
+  uint16_t last = opcodes[count - 1];
+
+  // skips compare first, the spills below are plain movs and keep the flags
+  uint8_t skipJump = 0;
+  if (terminator == KIND_SKIP) {
+    int x = host[(last >> 8) & 0xF];
+    int y = host[(last >> 4) & 0xF];
+
+    switch (last & 0xF000) {
+      case 0x3000: aluImm8(&e, X86_EXT_CMP, x, last & 0xFF); skipJump = X86_JNE; break;
+      case 0x4000: aluImm8(&e, X86_EXT_CMP, x, last & 0xFF); skipJump = X86_JE; break;
+      case 0x5000: alu8(&e, X86_CMP, x, y); skipJump = X86_JNE; break;
+      case 0x9000: alu8(&e, X86_CMP, x, y); skipJump = X86_JE; break;
+    }
+  }
+
+  for (int v = 0; v < REGISTERS_SIZE; v++) {
+    if (written & (1u << v))
+      storeByte(&e, host[v], OFFSET_V(v));
+  }
+  if (usesI)
+    storeI(&e);
+
+  switch (terminator) {
+    case KIND_JUMP:
+      storePc(&e, last & 0x0FFF);
+      break;
+    case KIND_SKIP:
+      storePc(&e, end);
+      emit8(&e, skipJump);
+      emit8(&e, STORE_PC_SIZE);
+      storePc(&e, end + 2);
+      break;
+    default:
+      storePc(&e, end);
+      break;
+  }
+
+  for (size_t i = savedCount; i-- > 0;)
+    pop(&e, saved[i]);
+  emit8(&e, 0xC3);
+
+  jit->used += (size_t)(e.p - code);
+
+  // ISO C has no object to function pointer conversion, POSIX guarantees it
+  union {
+    uint8_t* data;
+    jit_code function;
+  } entry = { .data = code };
+
+  jit_block* block = &jit->blocks[jit->blockCount++];
+  *block = (jit_block){
+    .code = entry.function,
+    .start = start,
+    .end = end,
+    .count = (uint16_t)count,
+    .lastOpcode = last,
+  };
+
+  for (uint16_t a = start; a < end; a++)
+    jit->covered[a] = true;
+
+  jit->byAddress[start] = block;
+  return block;
+}
+
+// drops every block translated from a byte in the written range
+static void onCodeWrite(void* user, uint16_t address, uint16_t length) {
+  chip8_jit* jit = user;
+
+  for (uint16_t i = 0; i < length; i++) {
+    uint16_t byte = (address + i) & (MAX_MEMORY - 1);
+    if (byte >= CODE_MEMORY || !jit->covered[byte])
+      continue;
+
+    int lowest = byte - JIT_MAX_BLOCK_BYTES + 1;
+    for (int start = lowest < 0 ? 0 : lowest; start <= byte; start++) {
+      jit_block* block = jit->byAddress[start];
+      if (block != NULL && byte < block->end)
+        jit->byAddress[start] = NULL;
+    }
+  }
+}
+
+chip8_jit* chip8_jit_create(chip8* chip) {
+  chip8_jit* jit = calloc(1, sizeof(*jit));
+  if (jit == NULL)
+    return NULL;
+
+  jit->arena = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->arena == MAP_FAILED) {
+    free(jit);
+    return NULL;
+  }
+
+  jit->chip = chip;
+  chip8_jit_reset(jit);
+  return jit;
+}
+
+void chip8_jit_destroy(chip8_jit* jit) {
+  if (jit == NULL)
+    return;
+
+  if (jit->chip->hookUser == jit)
+    jit->chip->codeWriteHook = NULL;
+
+  munmap(jit->arena, JIT_ARENA_SIZE);
+  free(jit);
+}
+
+void chip8_jit_reset(chip8_jit* jit) {
+  flush(jit);
+  jit->chip->codeWriteHook = onCodeWrite;
+  jit->chip->hookUser = jit;
+}
+
+void chip8_jit_execute(chip8_jit* jit, uint32_t cycles) {
+  chip8* chip = jit->chip;
+
+  // translations implement the default quirks only
+  if (chip->quirks != CHIP8_QUIRKS_DEFAULT) {
+    chip8_execute(chip, cycles);
+    return;
+  }
+
+  chip->idle = CHIP8_IDLE_NONE;
+
+  while (cycles > 0) {
+    uint16_t pc = chip->pc;
+
+    if (pc >= CODE_MEMORY || (pc & 1) != 0) {
+      chip8_execute(chip, 1);
+      cycles--;
+      continue;
+    }
+
+    jit_block* block = jit->byAddress[pc];
+    if (block == NULL)
+      block = compile(jit, pc);
+
+    // the interpreter parks there with the whole budget, as it would have
+    // on its own: a jump to itself always, a timer poll while DT runs
+    if (block->idle && ((block->lastOpcode & 0x0FFF) == pc || chip->delay_timer != 0)) {
+      chip8_execute(chip, cycles);
+      return;
+    }
+
+    // a block never overshoots the budget, so results match the interpreter
+    // instruction for instruction. Whatever is left over once the next block
+    // no longer fits goes to the interpreter in one call
+    if (block->code == NULL || block->count > cycles) {
+      uint32_t run = block->code == NULL && block->count < cycles ? block->count : cycles;
+      chip8_execute(chip, run);
+      cycles -= run;
+
+      // parked in an idle loop, the interpreter skips the rest in one go
+      if (chip->idle != CHIP8_IDLE_NONE && cycles > 0) {
+        chip8_execute(chip, cycles);
+        return;
+      }
+      continue;
+    }
+
+    block->code(chip);
+    chip->opcode = block->lastOpcode;
+    chip->cycles += block->count;
+    cycles -= block->count;
+  }
+}
+
+#else
+
+struct chip8_jit {
+  chip8* chip;
+};
+
+chip8_jit* chip8_jit_create(chip8* chip) {
+  (void)chip;
+  return NULL;
+}
+
+void chip8_jit_destroy(chip8_jit* jit) {
+  free(jit);
+}
+
+void chip8_jit_reset(chip8_jit* jit) {
+  (void)jit;
+}
+
+void chip8_jit_execute(chip8_jit* jit, uint32_t cycles) {
+  chip8_execute(jit->chip, cycles);
+}
+
+#endif
+
+void chip8_jit_runFrame(chip8_jit* jit, uint32_t ipf) {
+  chip8_jit_execute(jit, ipf);
+  chip8_tickTimers(jit->chip);
+}
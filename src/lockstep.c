@@ -0,0 +1,915 @@
+#include "lockstep.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Lanes are processed in blocks of LANE_BLOCK. With the GCC/Clang vector
+// extensions a block is one SIMD vector, otherwise it is a single lane and
+// the same code compiles to plain scalar C.
+#if defined(__GNUC__)
+#define LANE_BLOCK 32
+typedef uint8_t lanes8 __attribute__((vector_size(LANE_BLOCK)));
+typedef uint16_t lanes16 __attribute__((vector_size(LANE_BLOCK * 2)));
+typedef int8_t signed8 __attribute__((vector_size(LANE_BLOCK)));
+typedef int16_t signed16 __attribute__((vector_size(LANE_BLOCK * 2)));
+#define TRUE8(condition) ((lanes8)(condition))
+#define WIDEN_MASK(mask) ((lanes16)__builtin_convertvector((signed8)(mask), signed16))
+#define ZEXT16(v) __builtin_convertvector((v), lanes16)
+// vectors only ever pass between static functions in this file, so the
+// psABI note about passing them without AVX enabled does not apply
+#ifndef __clang__
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+#else
+#define LANE_BLOCK 1
+typedef uint8_t lanes8;
+typedef uint16_t lanes16;
+#define TRUE8(condition) ((lanes8) - (condition))
+#define WIDEN_MASK(mask) ((lanes16)(int16_t)(int8_t)(mask))
+#define ZEXT16(v) ((lanes16)(v))
+#endif
+
+// all ones or zero per lane for a condition, and n where mask is set
+#define BLEND(mask, n, old) (((n) & (mask)) | ((old) & ~(mask)))
+#define SPLAT8(value) ((lanes8){ 0 } + (uint8_t)(value))
+#define SPLAT16(value) ((lanes16){ 0 } + (uint16_t)(value))
+
+// the SIMD kernels are built once per instruction set and the best one
+// for the CPU is picked at load time
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define LANE_CLONES __attribute__((target_clones("avx2", "sse4.1", "default")))
+#endif
+#endif
+#ifndef LANE_CLONES
+#define LANE_CLONES
+#endif
+
+#define LANE_ALIGN 64
+#define LANE_MEMORY 0x1000        // lanes run CHIP-8, which addresses 4K
+#define MAX_ALLOCATIONS 64
+
+struct chip8_lockstep {
+  uint32_t lanes;
+  uint32_t stride;                // lanes rounded up to whole blocks
+
+  // one element per lane, the padding lanes past lanes are never active
+  uint8_t* V[REGISTERS_SIZE];
+  uint16_t* I;
+  uint16_t* pc;
+  uint16_t* opcode;
+  uint16_t* stack[STACK_SIZE];
+  uint8_t* sp;
+  uint64_t* rng;
+  uint8_t* delayTimer;
+  uint8_t* soundTimer;
+  uint16_t* keys;                 // one bit per key
+  uint8_t* drawFlag;
+  uint8_t* beepFlag;
+  uint64_t* gfx;                  // HEIGHT rows per lane, lane after lane
+  uint8_t* memory;                // a byte per lane for each address in turn
+
+  // bytes known to hold the same value in every lane, cleared once any
+  // lane stores to them. While every pc is the same and its opcode is
+  // shared, a step runs on all lanes at once from the decode cache
+  bool shared[LANE_MEMORY];
+  chip8_decoded decoded[LANE_MEMORY / 2];
+  bool converged;                 // every lane has the same pc
+
+  // lanes of the group executing the current opcode, 0xFF/0xFFFF if active
+  uint8_t* mask8;
+  uint16_t* mask16;
+  uint8_t* allMask8;
+  uint16_t* allMask16;
+
+  // splitting a step into opcode groups: a hash table from opcode to group,
+  // then the lanes sorted by group
+  uint32_t* groupOf;
+  uint32_t* order;
+  uint32_t* groupStart;
+  uint32_t* groupCount;
+  uint16_t* groupOpcode;
+  uint32_t* tableStamp;           // slot is in use if it matches stamp
+  uint32_t* tableGroup;
+  uint32_t tableMask;
+  uint32_t stamp;
+
+  chip8_lockstep_stats stats;
+
+  void* allocations[MAX_ALLOCATIONS];
+  size_t allocationCount;
+};
+
+static inline lanes8 load8(const uint8_t* p) {
+  lanes8 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline void store8(uint8_t* p, lanes8 v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline lanes16 load16(const uint16_t* p) {
+  lanes16 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline void store16(uint16_t* p, lanes16 v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+static void* laneArray(chip8_lockstep* ls, size_t bytes) {
+  if (ls->allocationCount == MAX_ALLOCATIONS)
+    return NULL;
+
+  bytes = (bytes + LANE_ALIGN - 1) & ~(size_t)(LANE_ALIGN - 1);
+  void* p = aligned_alloc(LANE_ALIGN, bytes);
+  if (p != NULL) {
+    memset(p, 0, bytes);
+    ls->allocations[ls->allocationCount++] = p;
+  }
+  return p;
+}
+
+// addresses wrap at 4K. Lanes reading or writing the same address touch
+// neighbouring bytes, which keeps memory instructions cache friendly
+static inline uint8_t* memoryByte(const chip8_lockstep* ls, uint16_t address, uint32_t lane) {
+  return &ls->memory[(size_t)(address & (LANE_MEMORY - 1)) * ls->stride + lane];
+}
+
+static inline uint64_t* laneGfx(const chip8_lockstep* ls, uint32_t lane) {
+  return ls->gfx + (size_t)lane * HEIGHT;
+}
+
+chip8_lockstep* chip8_lockstep_create(uint32_t lanes) {
+  if (lanes == 0)
+    return NULL;
+
+  chip8_lockstep* ls = calloc(1, sizeof(*ls));
+  if (ls == NULL)
+    return NULL;
+
+  uint32_t stride = (lanes + LANE_BLOCK - 1) / LANE_BLOCK * LANE_BLOCK;
+  uint32_t table = 1;
+  while (table < 2 * lanes)
+    table <<= 1;
+
+  ls->lanes = lanes;
+  ls->stride = stride;
+  ls->tableMask = table - 1;
+
+  bool ok = true;
+#define LANE_ARRAY(field, count) \
+  ok = ok && (ls->field = laneArray(ls, (size_t)(count) * sizeof(*ls->field))) != NULL
+
+  for (int r = 0; r < REGISTERS_SIZE; r++)
+    LANE_ARRAY(V[r], stride);
+  for (int s = 0; s < STACK_SIZE; s++)
+    LANE_ARRAY(stack[s], stride);
+  LANE_ARRAY(I, stride);
+  LANE_ARRAY(pc, stride);
+  LANE_ARRAY(opcode, stride);
+  LANE_ARRAY(sp, stride);
+  LANE_ARRAY(rng, stride);
+  LANE_ARRAY(delayTimer, stride);
+  LANE_ARRAY(soundTimer, stride);
+  LANE_ARRAY(keys, stride);
+  LANE_ARRAY(drawFlag, stride);
+  LANE_ARRAY(beepFlag, stride);
+  LANE_ARRAY(gfx, (size_t)lanes * HEIGHT);
+  LANE_ARRAY(memory, (size_t)stride * LANE_MEMORY);
+  LANE_ARRAY(mask8, stride);
+  LANE_ARRAY(mask16, stride);
+  LANE_ARRAY(allMask8, stride);
+  LANE_ARRAY(allMask16, stride);
+  LANE_ARRAY(groupOf, lanes);
+  LANE_ARRAY(order, lanes);
+  LANE_ARRAY(groupStart, lanes);
+  LANE_ARRAY(groupCount, lanes);
+  LANE_ARRAY(groupOpcode, lanes);
+  LANE_ARRAY(tableStamp, table);
+  LANE_ARRAY(tableGroup, table);
+#undef LANE_ARRAY
+
+  if (!ok || !chip8_lockstep_load(ls, NULL, 0)) {
+    chip8_lockstep_destroy(ls);
+    return NULL;
+  }
+
+  for (uint32_t l = 0; l < lanes; l++) {
+    ls->allMask8[l] = 0xFF;
+    ls->allMask16[l] = 0xFFFF;
+  }
+
+  return ls;
+}
+
+void chip8_lockstep_destroy(chip8_lockstep* ls) {
+  if (ls == NULL)
+    return;
+
+  for (size_t i = 0; i < ls->allocationCount; i++)
+    free(ls->allocations[i]);
+  free(ls);
+}
+
+uint32_t chip8_lockstep_lanes(const chip8_lockstep* ls) {
+  return ls->lanes;
+}
+
+// a NULL rom only resets the lanes
+bool chip8_lockstep_load(chip8_lockstep* ls, const uint8_t* rom, size_t size) {
+  // the fontset and ROM layout come from a regular instance
+  chip8* chip = malloc(sizeof(*chip));
+  if (chip == NULL)
+    return false;
+
+  chip8_initialize(chip);
+  if (rom != NULL && (size > LANE_MEMORY - PROGRAM_START || !chip8_loadBuffer(chip, rom, size))) {
+    free(chip);
+    return false;
+  }
+
+  uint32_t stride = ls->stride;
+  for (int r = 0; r < REGISTERS_SIZE; r++)
+    memset(ls->V[r], 0, stride);
+  for (int s = 0; s < STACK_SIZE; s++)
+    memset(ls->stack[s], 0, stride * sizeof(uint16_t));
+  memset(ls->I, 0, stride * sizeof(uint16_t));
+  memset(ls->opcode, 0, stride * sizeof(uint16_t));
+  memset(ls->keys, 0, stride * sizeof(uint16_t));
+  memset(ls->sp, 0, stride);
+  memset(ls->delayTimer, 0, stride);
+  memset(ls->soundTimer, 0, stride);
+  memset(ls->beepFlag, 0, stride);
+  memset(ls->gfx, 0, (size_t)ls->lanes * HEIGHT * sizeof(uint64_t));
+
+  for (uint16_t a = 0; a < LANE_MEMORY; a++)
+    memset(memoryByte(ls, a, 0), chip->memory[a], stride);
+
+  for (uint32_t l = 0; l < ls->lanes; l++) {
+    ls->pc[l] = PROGRAM_START;
+    ls->rng[l] = chip->rng;
+    ls->drawFlag[l] = true;
+  }
+  free(chip);
+
+  memset(ls->shared, true, sizeof(ls->shared));
+  memset(ls->decoded, 0, sizeof(ls->decoded));
+  ls->converged = true;
+  memset(&ls->stats, 0, sizeof(ls->stats));
+  return true;
+}
+
+void chip8_lockstep_setKeys(chip8_lockstep* ls, uint32_t lane, uint16_t mask) {
+  ls->keys[lane] = mask;
+}
+
+void chip8_lockstep_seed(chip8_lockstep* ls, uint32_t lane, uint64_t seed) {
+  ls->rng[lane] = chip8_seedState(seed);
+}
+
+static inline void storeByte(chip8_lockstep* ls, uint16_t address, uint32_t lane, uint8_t value) {
+  *memoryByte(ls, address, lane) = value;
+  ls->shared[address & (LANE_MEMORY - 1)] = false;
+}
+
+// one instruction on one lane, the interpreter's handlers in lane form
+static void executeLane(chip8_lockstep* ls, uint32_t l, const chip8_decoded* d) {
+#define V(r) ls->V[r][l]
+
+  ls->opcode[l] = d->opcode;
+  ls->pc[l] += 2;
+
+  switch (d->op) {
+    case CHIP8_OP_00E0:
+      memset(laneGfx(ls, l), 0, HEIGHT * sizeof(uint64_t));
+      ls->drawFlag[l] = true;
+      break;
+    case CHIP8_OP_00EE:
+      ls->sp[l] = (ls->sp[l] - 1) & (STACK_SIZE - 1);
+      ls->pc[l] = ls->stack[ls->sp[l]][l];
+      break;
+    case CHIP8_OP_1NNN:
+      ls->pc[l] = d->nnn;
+      break;
+    case CHIP8_OP_2NNN:
+      ls->stack[ls->sp[l]][l] = ls->pc[l];
+      ls->sp[l] = (ls->sp[l] + 1) & (STACK_SIZE - 1);
+      ls->pc[l] = d->nnn;
+      break;
+    case CHIP8_OP_3XNN:
+      if (V(d->x) == d->nn)
+        ls->pc[l] += 2;
+      break;
+    case CHIP8_OP_4XNN:
+      if (V(d->x) != d->nn)
+        ls->pc[l] += 2;
+      break;
+    case CHIP8_OP_5XY0:
+      if (V(d->x) == V(d->y))
+        ls->pc[l] += 2;
+      break;
+    case CHIP8_OP_6XNN:
+      V(d->x) = d->nn;
+      break;
+    case CHIP8_OP_7XNN:
+      V(d->x) += d->nn;
+      break;
+    case CHIP8_OP_8XY0:
+      V(d->x) = V(d->y);
+      break;
+    case CHIP8_OP_8XY1:
+      V(d->x) |= V(d->y);
+      break;
+    case CHIP8_OP_8XY2:
+      V(d->x) &= V(d->y);
+      break;
+    case CHIP8_OP_8XY3:
+      V(d->x) ^= V(d->y);
+      break;
+    case CHIP8_OP_8XY4: {
+      uint16_t sum = V(d->x) + V(d->y);
+      V(0xF) = sum > 0xFF;
+      V(d->x) = sum & 0xFF;
+      break;
+    }
+    case CHIP8_OP_8XY5:
+      V(0xF) = V(d->x) >= V(d->y);
+      V(d->x) = V(d->x) - V(d->y);
+      break;
+    case CHIP8_OP_8XY6:
+      V(0xF) = V(d->x) & 0x1;
+      V(d->x) >>= 1;
+      break;
+    case CHIP8_OP_8XY7:
+      V(0xF) = V(d->y) >= V(d->x);
+      V(d->x) = V(d->y) - V(d->x);
+      break;
+    case CHIP8_OP_8XYE:
+      V(0xF) = (V(d->x) >> 7) & 0x1;
+      V(d->x) <<= 1;
+      break;
+    case CHIP8_OP_9XY0:
+      if (V(d->x) != V(d->y))
+        ls->pc[l] += 2;
+      break;
+    case CHIP8_OP_ANNN:
+      ls->I[l] = d->nnn;
+      break;
+    case CHIP8_OP_BNNN:
+      ls->pc[l] = V(0) + d->nnn;
+      break;
+    case CHIP8_OP_CXNN:
+      V(d->x) = chip8_random(&ls->rng[l]) & d->nn;
+      break;
+    case CHIP8_OP_DXYN: {
+      uint8_t X = V(d->x) % WIDTH;
+      uint8_t Y = V(d->y) % HEIGHT;
+      uint8_t height = d->nn & 0x0F;
+      if (height > HEIGHT - Y)
+        height = HEIGHT - Y;
+
+      uint64_t* gfx = laneGfx(ls, l);
+      uint64_t collision = 0;
+      for (int yline = 0; yline < height; yline++) {
+        uint8_t pixel = *memoryByte(ls, ls->I[l] + yline, l);
+        uint64_t row = ((uint64_t)pixel << (WIDTH - 8)) >> X;
+        collision |= gfx[Y + yline] & row;
+        gfx[Y + yline] ^= row;
+      }
+
+      V(0xF) = collision != 0;
+      ls->drawFlag[l] = true;
+      break;
+    }
+    case CHIP8_OP_EX9E:
+      if (V(d->x) < KEY_SIZE && ((ls->keys[l] >> V(d->x)) & 1))
+        ls->pc[l] += 2;
+      break;
+    case CHIP8_OP_EXA1:
+      if (V(d->x) >= KEY_SIZE || !((ls->keys[l] >> V(d->x)) & 1))
+        ls->pc[l] += 2;
+      break;
+    case CHIP8_OP_FX07:
+      V(d->x) = ls->delayTimer[l];
+      break;
+    case CHIP8_OP_FX0A: {
+      int key = 0;
+      while (key < KEY_SIZE && !((ls->keys[l] >> key) & 1))
+        key++;
+
+      if (key < KEY_SIZE)
+        V(d->x) = key;
+      else
+        ls->pc[l] -= 2;
+      break;
+    }
+    case CHIP8_OP_FX15:
+      ls->delayTimer[l] = V(d->x);
+      break;
+    case CHIP8_OP_FX18:
+      ls->soundTimer[l] = V(d->x);
+      break;
+    case CHIP8_OP_FX1E:
+      ls->I[l] += V(d->x);
+      break;
+    case CHIP8_OP_FX29:
+      ls->I[l] = V(d->x) * 0x5;
+      break;
+    case CHIP8_OP_FX33: {
+      uint8_t VX = V(d->x);
+      storeByte(ls, ls->I[l], l, VX / 100);
+      storeByte(ls, ls->I[l] + 1, l, (VX / 10) % 10);
+      storeByte(ls, ls->I[l] + 2, l, VX % 10);
+      break;
+    }
+    case CHIP8_OP_FX55:
+      for (int i = 0; i <= d->x; i++)
+        storeByte(ls, ls->I[l] + i, l, V(i));
+      break;
+    case CHIP8_OP_FX65:
+      for (int i = 0; i <= d->x; i++)
+        V(i) = *memoryByte(ls, ls->I[l] + i, l);
+      break;
+    default:
+      // invalid opcodes are skipped
+      break;
+  }
+}
+
+#undef V
+
+// ops with a SIMD kernel, the rest run lane by lane
+static bool vectorized(uint8_t op) {
+  switch (op) {
+    case CHIP8_OP_INVALID:
+    case CHIP8_OP_1NNN:
+    case CHIP8_OP_3XNN:
+    case CHIP8_OP_4XNN:
+    case CHIP8_OP_5XY0:
+    case CHIP8_OP_6XNN:
+    case CHIP8_OP_7XNN:
+    case CHIP8_OP_8XY0:
+    case CHIP8_OP_8XY1:
+    case CHIP8_OP_8XY2:
+    case CHIP8_OP_8XY3:
+    case CHIP8_OP_8XY4:
+    case CHIP8_OP_8XY5:
+    case CHIP8_OP_8XY6:
+    case CHIP8_OP_8XY7:
+    case CHIP8_OP_8XYE:
+    case CHIP8_OP_9XY0:
+    case CHIP8_OP_ANNN:
+    case CHIP8_OP_BNNN:
+    case CHIP8_OP_FX07:
+    case CHIP8_OP_FX15:
+    case CHIP8_OP_FX18:
+    case CHIP8_OP_FX1E:
+    case CHIP8_OP_FX29:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// ops after which lanes that agreed on pc may disagree
+static bool divergent(uint8_t op) {
+  switch (op) {
+    case CHIP8_OP_00EE:
+    case CHIP8_OP_3XNN:
+    case CHIP8_OP_4XNN:
+    case CHIP8_OP_5XY0:
+    case CHIP8_OP_9XY0:
+    case CHIP8_OP_BNNN:
+    case CHIP8_OP_EX9E:
+    case CHIP8_OP_EXA1:
+    case CHIP8_OP_FX0A:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool accessesMemory(uint8_t op) {
+  return op == CHIP8_OP_FX33 || op == CHIP8_OP_FX55 || op == CHIP8_OP_FX65;
+}
+
+// one vectorized op on the lanes set in mask8/mask16, a block at a time.
+// Flag writes go before the result, as in the interpreter, so VX or VY
+// being VF behaves the same. Memory ops need I to be the same in every
+// active lane, they then touch one row of bytes per address
+LANE_CLONES
+static void executeVector(chip8_lockstep* ls, const chip8_decoded* d,
+                          const uint8_t* mask8, const uint16_t* mask16, uint16_t I) {
+  uint8_t* vx = ls->V[d->x];
+  uint8_t* vy = ls->V[d->y];
+  uint8_t* vf = ls->V[0xF];
+  uint8_t* rows[REGISTERS_SIZE];
+
+  if (accessesMemory(d->op)) {
+    int addresses = d->op == CHIP8_OP_FX33 ? 3 : d->x + 1;
+    for (int i = 0; i < addresses; i++) {
+      rows[i] = memoryByte(ls, I + i, 0);
+      if (d->op != CHIP8_OP_FX65)
+        ls->shared[(I + i) & (LANE_MEMORY - 1)] = false;
+    }
+  }
+
+  for (uint32_t b = 0; b < ls->stride; b += LANE_BLOCK) {
+    lanes8 m8 = load8(mask8 + b);
+    lanes16 m16 = load16(mask16 + b);
+    lanes16 pc = load16(ls->pc + b) + (m16 & 2);
+    store16(ls->opcode + b, BLEND(m16, SPLAT16(d->opcode), load16(ls->opcode + b)));
+
+    lanes8 x = load8(vx + b);
+    lanes8 y = load8(vy + b);
+    lanes8 skip = SPLAT8(0);
+
+    switch (d->op) {
+      case CHIP8_OP_1NNN:
+        pc = BLEND(m16, SPLAT16(d->nnn), pc);
+        break;
+      case CHIP8_OP_3XNN:
+        skip = TRUE8(x == SPLAT8(d->nn));
+        break;
+      case CHIP8_OP_4XNN:
+        skip = TRUE8(x != SPLAT8(d->nn));
+        break;
+      case CHIP8_OP_5XY0:
+        skip = TRUE8(x == y);
+        break;
+      case CHIP8_OP_9XY0:
+        skip = TRUE8(x != y);
+        break;
+      case CHIP8_OP_6XNN:
+        store8(vx + b, BLEND(m8, SPLAT8(d->nn), x));
+        break;
+      case CHIP8_OP_7XNN: {
+        lanes8 sum = x + SPLAT8(d->nn);
+        store8(vx + b, BLEND(m8, sum, x));
+        break;
+      }
+      case CHIP8_OP_8XY0:
+        store8(vx + b, BLEND(m8, y, x));
+        break;
+      case CHIP8_OP_8XY1: {
+        lanes8 result = x | y;
+        store8(vx + b, BLEND(m8, result, x));
+        break;
+      }
+      case CHIP8_OP_8XY2: {
+        lanes8 result = x & y;
+        store8(vx + b, BLEND(m8, result, x));
+        break;
+      }
+      case CHIP8_OP_8XY3: {
+        lanes8 result = x ^ y;
+        store8(vx + b, BLEND(m8, result, x));
+        break;
+      }
+      case CHIP8_OP_8XY4: {
+        lanes8 sum = x + y;
+        lanes8 carry = TRUE8(sum < x) & 1;
+        store8(vf + b, BLEND(m8, carry, load8(vf + b)));
+        store8(vx + b, BLEND(m8, sum, load8(vx + b)));
+        break;
+      }
+      case CHIP8_OP_8XY5: {
+        lanes8 flag = TRUE8(x >= y) & 1;
+        store8(vf + b, BLEND(m8, flag, load8(vf + b)));
+        x = load8(vx + b);
+        y = load8(vy + b);
+        lanes8 difference = x - y;
+        store8(vx + b, BLEND(m8, difference, x));
+        break;
+      }
+      case CHIP8_OP_8XY6: {
+        lanes8 flag = x & 1;
+        store8(vf + b, BLEND(m8, flag, load8(vf + b)));
+        x = load8(vx + b);
+        lanes8 shifted = x >> 1;
+        store8(vx + b, BLEND(m8, shifted, x));
+        break;
+      }
+      case CHIP8_OP_8XY7: {
+        lanes8 flag = TRUE8(y >= x) & 1;
+        store8(vf + b, BLEND(m8, flag, load8(vf + b)));
+        x = load8(vx + b);
+        y = load8(vy + b);
+        lanes8 difference = y - x;
+        store8(vx + b, BLEND(m8, difference, x));
+        break;
+      }
+      case CHIP8_OP_8XYE: {
+        lanes8 flag = x >> 7;
+        store8(vf + b, BLEND(m8, flag, load8(vf + b)));
+        x = load8(vx + b);
+        lanes8 shifted = x << 1;
+        store8(vx + b, BLEND(m8, shifted, x));
+        break;
+      }
+      case CHIP8_OP_ANNN:
+        store16(ls->I + b, BLEND(m16, SPLAT16(d->nnn), load16(ls->I + b)));
+        break;
+      case CHIP8_OP_BNNN: {
+        lanes16 target = ZEXT16(load8(ls->V[0] + b)) + SPLAT16(d->nnn);
+        pc = BLEND(m16, target, pc);
+        break;
+      }
+      case CHIP8_OP_FX07:
+        store8(vx + b, BLEND(m8, load8(ls->delayTimer + b), x));
+        break;
+      case CHIP8_OP_FX15:
+        store8(ls->delayTimer + b, BLEND(m8, x, load8(ls->delayTimer + b)));
+        break;
+      case CHIP8_OP_FX18:
+        store8(ls->soundTimer + b, BLEND(m8, x, load8(ls->soundTimer + b)));
+        break;
+      case CHIP8_OP_FX1E: {
+        lanes16 index = load16(ls->I + b);
+        lanes16 sum = index + ZEXT16(x);
+        store16(ls->I + b, BLEND(m16, sum, index));
+        break;
+      }
+      case CHIP8_OP_FX29: {
+        lanes16 font = ZEXT16(x) * SPLAT16(5);
+        store16(ls->I + b, BLEND(m16, font, load16(ls->I + b)));
+        break;
+      }
+      case CHIP8_OP_FX33: {
+        lanes8 hundreds = x / SPLAT8(100);
+        lanes8 tens = x / SPLAT8(10) % SPLAT8(10);
+        lanes8 ones = x % SPLAT8(10);
+        store8(rows[0] + b, BLEND(m8, hundreds, load8(rows[0] + b)));
+        store8(rows[1] + b, BLEND(m8, tens, load8(rows[1] + b)));
+        store8(rows[2] + b, BLEND(m8, ones, load8(rows[2] + b)));
+        break;
+      }
+      case CHIP8_OP_FX55:
+        for (int i = 0; i <= d->x; i++)
+          store8(rows[i] + b, BLEND(m8, load8(ls->V[i] + b), load8(rows[i] + b)));
+        break;
+      case CHIP8_OP_FX65:
+        for (int i = 0; i <= d->x; i++)
+          store8(ls->V[i] + b, BLEND(m8, load8(rows[i] + b), load8(ls->V[i] + b)));
+        break;
+      default:
+        break;
+    }
+
+    lanes8 taken = skip & m8;
+    pc += WIDEN_MASK(taken) & 2;
+    store16(ls->pc + b, pc);
+  }
+}
+
+static inline uint16_t fetch(const chip8_lockstep* ls, uint16_t pc, uint32_t lane) {
+  return (uint16_t)((*memoryByte(ls, pc, lane) << 8) | *memoryByte(ls, pc + 1, lane));
+}
+
+static bool samePc(const chip8_lockstep* ls) {
+  uint16_t difference = 0;
+  for (uint32_t l = 1; l < ls->lanes; l++)
+    difference |= ls->pc[l] ^ ls->pc[0];
+  return difference == 0;
+}
+
+// the instruction every lane is at, or NULL if some lane may see another
+static const chip8_decoded* sharedInstruction(chip8_lockstep* ls, chip8_decoded* scratch) {
+  if (!ls->converged && !(ls->converged = samePc(ls)))
+    return NULL;
+
+  uint16_t pc = ls->pc[0] & (LANE_MEMORY - 1);
+  if (!ls->shared[pc] || !ls->shared[(pc + 1) & (LANE_MEMORY - 1)])
+    return NULL;
+
+  // shared bytes never change, so cached entries never go stale
+  if (pc & 1) {
+    *scratch = chip8_decode(fetch(ls, pc, 0));
+    return scratch;
+  }
+
+  chip8_decoded* d = &ls->decoded[pc >> 1];
+  if (d->op == CHIP8_OP_DECODE)
+    *d = chip8_decode(fetch(ls, pc, 0));
+  return d;
+}
+
+#define LANE(k) (lanes != NULL ? lanes[k] : (k))
+
+static bool sameI(const chip8_lockstep* ls, const uint32_t* lanes, uint32_t count) {
+  uint16_t difference = 0;
+  for (uint32_t k = 1; k < count; k++)
+    difference |= ls->I[LANE(k)] ^ ls->I[LANE(0)];
+  return difference == 0;
+}
+
+// runs d on count lanes listed in lanes, or on every lane if lanes is NULL
+static void executeGroup(chip8_lockstep* ls, const chip8_decoded* d, const uint32_t* lanes, uint32_t count) {
+  // a masked pass over every lane beats going lane by lane once the group
+  // is a sizeable part of them
+  bool vector = accessesMemory(d->op) ? sameI(ls, lanes, count) : vectorized(d->op);
+
+  if (vector && (lanes == NULL || count * 4 >= ls->lanes)) {
+    uint16_t I = ls->I[LANE(0)];
+
+    if (lanes == NULL) {
+      executeVector(ls, d, ls->allMask8, ls->allMask16, I);
+      return;
+    }
+
+    memset(ls->mask8, 0, ls->stride);
+    memset(ls->mask16, 0, ls->stride * sizeof(uint16_t));
+    for (uint32_t k = 0; k < count; k++) {
+      ls->mask8[lanes[k]] = 0xFF;
+      ls->mask16[lanes[k]] = 0xFFFF;
+    }
+    executeVector(ls, d, ls->mask8, ls->mask16, I);
+    return;
+  }
+
+  for (uint32_t k = 0; k < count; k++)
+    executeLane(ls, LANE(k), d);
+}
+
+#undef LANE
+
+static inline uint32_t hashOpcode(uint16_t opcode) {
+  return (opcode * 0x9E3779B1u) >> 16;
+}
+
+// lanes disagree on the opcode: group them by it and run each group
+static void splitStep(chip8_lockstep* ls) {
+  uint32_t groups = 0;
+  ls->stamp++;
+
+  for (uint32_t l = 0; l < ls->lanes; l++) {
+    uint16_t opcode = fetch(ls, ls->pc[l], l);
+    uint32_t slot = hashOpcode(opcode) & ls->tableMask;
+
+    while (ls->tableStamp[slot] == ls->stamp && ls->groupOpcode[ls->tableGroup[slot]] != opcode)
+      slot = (slot + 1) & ls->tableMask;
+
+    if (ls->tableStamp[slot] != ls->stamp) {
+      ls->tableStamp[slot] = ls->stamp;
+      ls->tableGroup[slot] = groups;
+      ls->groupOpcode[groups] = opcode;
+      ls->groupCount[groups] = 0;
+      groups++;
+    }
+
+    uint32_t group = ls->tableGroup[slot];
+    ls->groupOf[l] = group;
+    ls->groupCount[group]++;
+  }
+
+  uint32_t start = 0;
+  for (uint32_t g = 0; g < groups; g++) {
+    ls->groupStart[g] = start;
+    start += ls->groupCount[g];
+  }
+
+  for (uint32_t l = 0; l < ls->lanes; l++)
+    ls->order[ls->groupStart[ls->groupOf[l]]++] = l;
+
+  for (uint32_t g = 0; g < groups; g++) {
+    chip8_decoded d = chip8_decode(ls->groupOpcode[g]);
+    uint32_t count = ls->groupCount[g];
+    executeGroup(ls, &d, ls->order + ls->groupStart[g] - count, count);
+  }
+
+  ls->converged = false;
+  ls->stats.groups += groups;
+}
+
+void chip8_lockstep_execute(chip8_lockstep* ls, uint32_t cycles) {
+  chip8_decoded scratch;
+  ls->stats.steps += cycles;
+
+  while (cycles-- != 0) {
+    const chip8_decoded* d = sharedInstruction(ls, &scratch);
+    if (d == NULL) {
+      splitStep(ls);
+      continue;
+    }
+
+    executeGroup(ls, d, NULL, ls->lanes);
+    if (divergent(d->op))
+      ls->converged = false;
+    ls->stats.uniformSteps++;
+  }
+}
+
+LANE_CLONES
+void chip8_lockstep_tickTimers(chip8_lockstep* ls) {
+  for (uint32_t b = 0; b < ls->stride; b += LANE_BLOCK) {
+    lanes8 delay = load8(ls->delayTimer + b);
+    lanes8 sound = load8(ls->soundTimer + b);
+    lanes8 beep = TRUE8(sound == SPLAT8(1)) & 1;
+
+    lanes8 delayRunning = TRUE8(delay != SPLAT8(0)) & 1;
+    lanes8 soundRunning = TRUE8(sound != SPLAT8(0)) & 1;
+    store8(ls->delayTimer + b, delay - delayRunning);
+    store8(ls->soundTimer + b, sound - soundRunning);
+    store8(ls->beepFlag + b, load8(ls->beepFlag + b) | beep);
+  }
+}
+
+void chip8_lockstep_runFrame(chip8_lockstep* ls, uint32_t ipf) {
+  chip8_lockstep_execute(ls, ipf);
+  chip8_lockstep_tickTimers(ls);
+}
+
+void chip8_lockstep_snapshot(const chip8_lockstep* ls, uint32_t lane, chip8_state* state) {
+  // everything a CHIP-8 machine does not have stays as chip8_initialize
+  // leaves it
+  memset(state, 0, sizeof(*state));
+  for (uint16_t a = 0; a < LANE_MEMORY; a++)
+    state->memory[a] = *memoryByte(ls, a, lane);
+  // which of the lane's bytes were written is not tracked
+  for (uint32_t block = 0; block < LANE_MEMORY / DIRTY_BLOCK; block++)
+    state->dirty[block / 64] |= 1ULL << (block % 64);
+  memcpy(state->gfx[0], laneGfx(ls, lane), HEIGHT * sizeof(uint64_t));
+  state->planes = 0x1;
+  state->pitch = CHIP8_DEFAULT_PITCH;
+  state->rng = ls->rng[lane];
+
+  for (int s = 0; s < STACK_SIZE; s++)
+    state->stack[s] = ls->stack[s][lane];
+  for (int r = 0; r < REGISTERS_SIZE; r++)
+    state->V[r] = ls->V[r][lane];
+  for (int k = 0; k < KEY_SIZE; k++)
+    state->key[k] = (ls->keys[lane] >> k) & 1;
+
+  state->opcode = ls->opcode[lane];
+  state->I = ls->I[lane];
+  state->pc = ls->pc[lane];
+  state->sp = ls->sp[lane];
+  state->delay_timer = ls->delayTimer[lane];
+  state->sound_timer = ls->soundTimer[lane];
+}
+
+void chip8_lockstep_restore(chip8_lockstep* ls, uint32_t lane, const chip8_state* state) {
+  // only the CHIP-8 part of the state is taken: the first 4K of memory and
+  // the lores rows of plane 0
+  // bytes this lane no longer has in common with the others
+  for (uint16_t a = 0; a < LANE_MEMORY; a++) {
+    if (*memoryByte(ls, a, lane) != state->memory[a])
+      storeByte(ls, a, lane, state->memory[a]);
+  }
+
+  memcpy(laneGfx(ls, lane), state->gfx[0], HEIGHT * sizeof(uint64_t));
+
+  uint16_t keys = 0;
+  for (int k = 0; k < KEY_SIZE; k++)
+    keys |= (state->key[k] != 0) << k;
+
+  for (int s = 0; s < STACK_SIZE; s++)
+    ls->stack[s][lane] = state->stack[s];
+  for (int r = 0; r < REGISTERS_SIZE; r++)
+    ls->V[r][lane] = state->V[r];
+
+  ls->keys[lane] = keys;
+  ls->opcode[lane] = state->opcode;
+  ls->I[lane] = state->I;
+  ls->pc[lane] = state->pc;
+  ls->sp[lane] = state->sp & (STACK_SIZE - 1);
+  ls->rng[lane] = state->rng;
+  ls->delayTimer[lane] = state->delay_timer;
+  ls->soundTimer[lane] = state->sound_timer;
+  ls->drawFlag[lane] = true;
+  ls->converged = false;
+}
+
+uint64_t chip8_lockstep_frameHash(const chip8_lockstep* ls, uint32_t lane) {
+  const uint64_t* gfx = laneGfx(ls, lane);
+  uint64_t hash = 0xCBF29CE484222325ULL;
+
+  for (int y = 0; y < HEIGHT; y++) {
+    for (int i = 0; i < 8; i++) {
+      hash ^= (gfx[y] >> (i * 8)) & 0xFF;
+      hash *= 0x100000001B3ULL;
+    }
+  }
+
+  return hash;
+}
+
+bool chip8_lockstep_takeDraw(chip8_lockstep* ls, uint32_t lane) {
+  bool draw = ls->drawFlag[lane];
+  ls->drawFlag[lane] = false;
+  return draw;
+}
+
+bool chip8_lockstep_takeBeep(chip8_lockstep* ls, uint32_t lane) {
+  bool beep = ls->beepFlag[lane];
+  ls->beepFlag[lane] = false;
+  return beep;
+}
+
+chip8_lockstep_stats chip8_lockstep_getStats(const chip8_lockstep* ls) {
+  return ls->stats;
+}
@@ -1,44 +1,424 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <raudio.h>
 
+#include "capture.h"
 #include "chip8.h"
+#include "emulator.h"
+#include "gdbstub.h"
 #include "init.h"
+#include "inputlog.h"
+#include "profile.h"
+#include "quirks.h"
+#include "raster.h"
+#include "scheduler.h"
+#include "trace.h"
+
+#define IDLE_WAIT_SECONDS 1.0
+#define AUDIO_SAMPLE_RATE 44100
+#define AUDIO_BUFFER_SAMPLES 256  // ~6 ms, raudio rounds it up to the device period
+#define DEFAULT_SHM_SCALE 4
+#define QUIRKS_DATABASE "../assets/quirks.txt"
+
+// large, and shared with the emulation thread
+static emulator emu;
+// raudio callbacks get no user pointer
+static audio_synth synth;
+
+static void fillAudio(void* buffer, unsigned int frames) {
+  audio_render(&synth, buffer, frames);
+}
+
+static void wakePresenter(void* user) {
+  (void)user;
+  glfwPostEmptyEvent();
+}
+
+static void usage(const char* program) {
+  fprintf(stderr, "Usage: %s [--ipf <instructions per frame>] [--turbo] [--aot <cache dir>] "
+                  "[--quirks <profile>] [--capture <.y4m, .gif or .png>] "
+                  "[--shm <file> [--scale <1-8>] [--scanlines]] [--gdb <port or socket path>] [--trace <file>] "
+                  "[--record <input log> | --replay <input log> [--headless]] <ROM file>.\n", program);
+  exit(EXIT_FAILURE);
+}
+
+static void loadReplay(chip8* chip, const inputlog* log, const char* romPath, size_t romSize) {
+  if (chip8_romHash(chip->memory + PROGRAM_START, romSize) != log->romHash) {
+    fprintf(stderr, "The input log was not recorded with \"%s\".\n", romPath);
+    exit(EXIT_FAILURE);
+  }
+  chip8_seed(chip, log->seed);
+  chip->quirks = (uint8_t)log->quirks;
+}
+
+static capture* openCapture(const char* path, bool lossless) {
+  capture* cap = capture_open(path, capture_formatOf(path), lossless);
+  if (cap == NULL) {
+    fprintf(stderr, "Could not capture to \"%s\".\n", path);
+    exit(EXIT_FAILURE);
+  }
+  return cap;
+}
+
+static void closeCapture(capture* cap, const char* path) {
+  capture_stats stats = capture_close(cap);
+  if (stats.failed)
+    fprintf(stderr, "Could not write the capture \"%s\".\n", path);
+  fprintf(stderr, "Captured %" PRIu64 " frames to \"%s\", %" PRIu64 " dropped.\n",
+          stats.frames, path, stats.dropped);
+}
+
+// the screen as RGBA in a shared-memory file, for watching without a window
+static raster_shm* openShm(raster* r, const char* path, uint32_t scale, bool scanlines) {
+  raster_shm* shm = NULL;
+  if (raster_init(r, RASTER_RGBA8888, scale, NULL, scanlines))
+    shm = raster_shmOpen(r, path);
+  if (shm == NULL) {
+    fprintf(stderr, "Could not map \"%s\".\n", path);
+    exit(EXIT_FAILURE);
+  }
+  return shm;
+}
+
+static void publishShm(raster_shm* shm, const raster* r, const chip8_frame* frame) {
+  raster_render(r, frame->gfx[0], frame->gfx[1], frame->hires, raster_shmBegin(shm));
+  raster_shmEnd(shm, frame->sequence);
+}
+
+static trace* openTrace(const char* path, bool lossless) {
+  trace* t = trace_open(path, TRACE_DEFAULT_BYTES, lossless);
+  if (t == NULL) {
+    fprintf(stderr, "Could not trace to \"%s\".\n", path);
+    exit(EXIT_FAILURE);
+  }
+  return t;
+}
+
+static void closeTrace(trace* t, const char* path) {
+  trace_stats stats = trace_close(t);
+  if (stats.failed)
+    fprintf(stderr, "Could not write the trace \"%s\".\n", path);
+  fprintf(stderr, "Traced %" PRIu64 " instructions to \"%s\", %" PRIu64 " dropped.\n",
+          stats.entries, path, stats.dropped);
+}
+
+static gdbstub* openDebugger(const char* address) {
+  fprintf(stderr, "Waiting for GDB on %s.\n", address);
+  gdbstub* stub = gdbstub_open(address);
+  if (stub == NULL) {
+    fprintf(stderr, "Could not listen for GDB on %s.\n", address);
+    exit(EXIT_FAILURE);
+  }
+  return stub;
+}
+
+#ifdef CHIP8_PROFILE
+// to CHIP8_PROFILE_OUT if set, windowed or headless
+static void dumpProfile(const chip8* chip) {
+  const char* path = getenv("CHIP8_PROFILE_OUT");
+  chip8_profileDump(chip, path != NULL ? path : "chip8-profile.json");
+}
+#endif
+
+// runs the whole log as fast as possible and prints how it ended, in the
+// format of chip8-batch
+static int replayHeadless(const char* romPath, const inputlog* log, const char* aotCache,
+                          capture* cap, raster_shm* shm, const raster* r, gdbstub* stub, trace* tracer) {
+  chip8* chip = &emu.chip;
+  chip8_initialize(chip);
+  if (tracer != NULL)
+    chip->trace = trace_link(tracer);
+  size_t romSize = chip8_load(chip, romPath);
+  loadReplay(chip, log, romPath, romSize);
+
+  chip8_aot* aot = NULL;
+  if (aotCache != NULL && (aot = chip8_aot_load(chip, aotCache, chip->memory + PROGRAM_START, romSize)) == NULL)
+    fprintf(stderr, "No translation of \"%s\" in \"%s\", interpreting it.\n", romPath, aotCache);
+
+  struct timespec start, end;
+  timespec_get(&start, TIME_UTC);
+
+  size_t next = 0;
+  for (uint32_t frame = 0; frame < log->frames; frame++) {
+    while (next < log->count && log->events[next].frame <= frame)
+      chip8_setKeys(chip, log->events[next++].keys);
+
+    if (stub != NULL) {
+      if (!gdbstub_execute(stub, chip, log->ipf))
+        break;
+      chip8_tickTimers(chip);
+    } else if (aot != NULL) {
+      chip8_aot_runFrame(aot, log->ipf);
+    } else {
+      chip8_runFrame(chip, log->ipf);
+    }
+
+    if ((cap != NULL || shm != NULL) && chip->drawFlag) {
+      chip8_frame drawn;
+      memcpy(drawn.gfx, chip->gfx, sizeof(drawn.gfx));
+      drawn.hires = chip->hires;
+      drawn.sequence = frame;
+      // waits for the encoder rather than dropping, there is no frame rate
+      // to keep up with
+      if (cap != NULL)
+        capture_push(cap, &drawn);
+      if (shm != NULL)
+        publishShm(shm, r, &drawn);
+    }
+    chip->drawFlag = false;
+
+    // nothing changes before the next key event, jump straight to it. Not
+    // under GDB, which may break on the instruction waiting
+    if (stub == NULL && chip8_waitsForInput(chip)) {
+      uint32_t until = next < log->count && log->events[next].frame < log->frames ? log->events[next].frame : log->frames;
+      if (until > frame + 1) {
+        chip8_skipFrames(chip, log->ipf, until - frame - 1);
+        frame = until - 1;
+      }
+    }
+  }
+
+  timespec_get(&end, TIME_UTC);
+  double wallMs = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+  printf("# rom\tframes\tinstructions\thash\twall_ms\n");
+  printf("%s\t%" PRIu32 "\t%" PRIu64 "\t%016" PRIx64 "\t%.3f\n",
+         romPath, log->frames, chip->cycles, chip8_frameHash(chip), wallMs);
+
+  chip8_aot_unload(aot);
+  return EXIT_SUCCESS;
+}
 
 int main(int argc, char *argv[]) {
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s <ROM file>.\n", argv[0]);
-    return EXIT_FAILURE;
+  const char* romPath = NULL;
+  uint32_t ipf = DEFAULT_IPF;
+  bool turbo = false;
+  const char* aotCache = NULL;
+  const char* recordPath = NULL;
+  const char* replayPath = NULL;
+  const char* capturePath = NULL;
+  const char* shmPath = NULL;
+  const char* gdbAddress = NULL;
+  const char* tracePath = NULL;
+  uint32_t shmScale = DEFAULT_SHM_SCALE;
+  bool scanlines = false;
+  bool headless = false;
+  chip8_quirks quirks = CHIP8_QUIRKS_COUNT; // none given
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc) {
+      ipf = (uint32_t)strtoul(argv[++i], NULL, 10);
+      if (ipf == 0)
+        usage(argv[0]);
+    } else if (strcmp(argv[i], "--turbo") == 0) {
+      turbo = true;
+    } else if (strcmp(argv[i], "--aot") == 0 && i + 1 < argc) {
+      aotCache = argv[++i];
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      recordPath = argv[++i];
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      replayPath = argv[++i];
+    } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+      capturePath = argv[++i];
+      if (capture_formatOf(capturePath) == CAPTURE_FORMAT_COUNT)
+        usage(argv[0]);
+    } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+      shmPath = argv[++i];
+    } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+      shmScale = (uint32_t)strtoul(argv[++i], NULL, 10);
+      if (shmScale < 1 || shmScale > RASTER_MAX_SCALE)
+        usage(argv[0]);
+    } else if (strcmp(argv[i], "--scanlines") == 0) {
+      scanlines = true;
+    } else if (strcmp(argv[i], "--gdb") == 0 && i + 1 < argc) {
+      gdbAddress = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      tracePath = argv[++i];
+    } else if (strcmp(argv[i], "--headless") == 0) {
+      headless = true;
+    } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+      if (!quirks_parse(argv[++i], &quirks))
+        usage(argv[0]);
+    } else if (argv[i][0] == '-' || romPath != NULL) {
+      usage(argv[0]);
+    } else {
+      romPath = argv[i];
+    }
+  }
+
+  if (romPath == NULL || (recordPath != NULL && replayPath != NULL) || (headless && replayPath == NULL))
+    usage(argv[0]);
+
+  // a replay runs at the rate it was recorded with
+  inputlog replay;
+  if (replayPath != NULL) {
+    if (!inputlog_load(&replay, replayPath)) {
+      fprintf(stderr, "Could not read input log \"%s\".\n", replayPath);
+      exit(EXIT_FAILURE);
+    }
+    ipf = replay.ipf;
+    // and with the profile it was recorded with
+    if (quirks != CHIP8_QUIRKS_COUNT)
+      fprintf(stderr, "Ignoring --quirks under --replay.\n");
+  }
+
+  capture* cap = capturePath != NULL ? openCapture(capturePath, headless) : NULL;
+  // large, the widening tables are 8K
+  static raster shmRaster;
+  raster_shm* shm = shmPath != NULL ? openShm(&shmRaster, shmPath, shmScale, scanlines) : NULL;
+
+  // GDB debugs the interpreter, translated blocks would run past breakpoints
+  if (gdbAddress != NULL && aotCache != NULL) {
+    fprintf(stderr, "Ignoring --aot under --gdb.\n");
+    aotCache = NULL;
+  }
+  // likewise only the interpreter traces. Headless runs wait for the writer
+  // instead of dropping, like captures
+  if (tracePath != NULL && aotCache != NULL) {
+    fprintf(stderr, "Ignoring --aot under --trace.\n");
+    aotCache = NULL;
   }
- 
+  trace* tracer = tracePath != NULL ? openTrace(tracePath, headless) : NULL;
+  gdbstub* stub = gdbAddress != NULL ? openDebugger(gdbAddress) : NULL;
+
+  if (headless) {
+    int status = replayHeadless(romPath, &replay, aotCache, cap, shm, &shmRaster, stub, tracer);
+#ifdef CHIP8_PROFILE
+    dumpProfile(&emu.chip);
+#endif
+    inputlog_free(&replay);
+    if (tracer != NULL)
+      closeTrace(tracer, tracePath);
+    if (cap != NULL)
+      closeCapture(cap, capturePath);
+    if (shm != NULL)
+      raster_shmClose(shm);
+    if (stub != NULL)
+      gdbstub_close(stub);
+    return status;
+  }
+
+  // synthesized from the sound state of each frame, pulled by the device
   InitAudioDevice();
- 
-  chip8 chip;
-  chip8_initialize(&chip);
+  audio_init(&synth, AUDIO_SAMPLE_RATE);
+  SetAudioStreamBufferSizeDefault(AUDIO_BUFFER_SAMPLES);
+  AudioStream stream = LoadAudioStream(AUDIO_SAMPLE_RATE, 16, 1);
+  SetAudioStreamCallback(stream, fillAudio);
+  PlayAudioStream(stream);
+
+  emulator_init(&emu, ipf, turbo);
+  emu.audio = &synth;
+  emu.debugger = stub;
+  if (tracer != NULL)
+    emu.chip.trace = trace_link(tracer);
+
+  GLFWwindow* window = setup(&emu);
 
-  GLFWwindow* window = setup(&chip);
+  size_t romSize = chip8_load(&emu.chip, romPath);
 
-  chip8_load(&chip, argv[1]);
+  inputlog recording;
+  if (replayPath != NULL) {
+    loadReplay(&emu.chip, &replay, romPath, romSize);
+    emu.replay = &replay;
+  } else {
+    uint64_t seed = (uint64_t)time(NULL);
+    chip8_seed(&emu.chip, seed);
 
-  while (!glfwWindowShouldClose(window)) {
-    chip8_emulateCycle(&chip);
+    // without --quirks the database knows which ROMs need another profile
+    uint64_t romHash = chip8_romHash(emu.chip.memory + PROGRAM_START, romSize);
+    if (quirks == CHIP8_QUIRKS_COUNT)
+      quirks = quirks_lookup(QUIRKS_DATABASE, romHash, CHIP8_QUIRKS_DEFAULT);
+    emu.chip.quirks = (uint8_t)quirks;
+    printf("ROM %016" PRIx64 ", %s quirks.\n", romHash, quirks_name(quirks));
+
+    if (recordPath != NULL) {
+      inputlog_init(&recording, ipf, seed, romHash);
+      recording.quirks = (uint16_t)quirks;
+      emu.recording = &recording;
+    }
+  }
+
+  // translated by chip8-aot beforehand, the ROM is still untouched in memory
+  if (aotCache != NULL) {
+    emu.aot = chip8_aot_load(&emu.chip, aotCache, emu.chip.memory + PROGRAM_START, romSize);
+    if (emu.aot == NULL)
+      fprintf(stderr, "No translation of \"%s\" in \"%s\", interpreting it.\n", romPath, aotCache);
+  }
 
-    if (chip.drawFlag) {
-      render(&chip);
+  // presenting runs on its own thread now, so waiting for vsync no longer
+  // stalls emulation. In turbo mode frames arrive far faster than we can
+  // show them, so the presenter just polls at the display rate instead
+  glfwSwapInterval(1);
+  if (!turbo) {
+    emu.onFrame = wakePresenter;
+  }
+
+  if (!emulator_start(&emu)) {
+    fprintf(stderr, "Failed to start the emulation thread.\n");
+    exit(1);
+  }
+
+  // the emulation thread quits by itself when GDB kills the program
+  while (!glfwWindowShouldClose(window) && !atomic_load(&emu.quit)) {
+    // nothing to present while the ROM waits for a key, and the key press
+    // itself wakes us up
+    bool idle = atomic_load(&emu.idle);
+    glfwWaitEventsTimeout(idle ? IDLE_WAIT_SECONDS : 1.0 / FRAME_RATE);
+
+    if (triplebuffer_consume(&emu.frames)) {
+      // copied into the capture pool, or dropped if the encoder is behind
+      if (cap != NULL)
+        capture_push(cap, triplebuffer_front(&emu.frames));
+      if (shm != NULL)
+        publishShm(shm, &shmRaster, triplebuffer_front(&emu.frames));
+#ifdef CHIP8_PROFILE
+      double renderStart = glfwGetTime();
+#endif
+      render(triplebuffer_front(&emu.frames));
+#ifdef CHIP8_PROFILE
+      // written only here, the emulation thread never touches these two
+      emu.chip.profile.renderSeconds += glfwGetTime() - renderStart;
+      emu.chip.profile.renders++;
+#endif
       glfwSwapBuffers(window);
     }
+  }
+
+  emulator_stop(&emu);
+  chip8_aot_unload(emu.aot);
 
-    glfwPollEvents();
+  if (cap != NULL)
+    closeCapture(cap, capturePath);
+  if (shm != NULL)
+    raster_shmClose(shm);
+  if (stub != NULL)
+    gdbstub_close(stub);
+  if (tracer != NULL)
+    closeTrace(tracer, tracePath);
+
+  if (emu.recording != NULL) {
+    if (!inputlog_save(&recording, recordPath))
+      fprintf(stderr, "Could not write input log \"%s\".\n", recordPath);
+    inputlog_free(&recording);
   }
+  if (emu.replay != NULL)
+    inputlog_free(&replay);
+
+#ifdef CHIP8_PROFILE
+  dumpProfile(&emu.chip);
+#endif
 
   glfwDestroyWindow(window);
   glfwTerminate();
 
-  UnloadSound(chip.beep);
+  UnloadAudioStream(stream);
   CloseAudioDevice();
 
   return EXIT_SUCCESS;
@@ -0,0 +1,208 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// jobs a worker still owns, popped from the bottom and stolen from the top
+typedef struct {
+  pthread_mutex_t lock;
+  size_t top;
+  size_t bottom;
+} pool_deque;
+
+typedef struct {
+  pool* owner;
+  unsigned index;
+  pthread_t thread;
+} pool_worker;
+
+struct pool {
+  unsigned workerCount;
+  pool_worker* workers;
+  pool_deque* deques;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;            // a new run started, or shutdown
+  pthread_cond_t done;            // the current run finished
+  uint64_t generation;
+  unsigned active;                // workers still busy with this run
+  bool shutdown;
+
+  pool_task task;
+  void* context;
+};
+
+static bool popLocal(pool_deque* deque, size_t* job) {
+  bool found = false;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->top < deque->bottom) {
+    *job = --deque->bottom;
+    found = true;
+  }
+  pthread_mutex_unlock(&deque->lock);
+
+  return found;
+}
+
+// moves half of the fullest other deque into ours
+static bool steal(pool* p, unsigned self) {
+  for (;;) {
+    unsigned victim = self;
+    size_t most = 0;
+
+    for (unsigned i = 0; i < p->workerCount; i++) {
+      if (i == self)
+        continue;
+      pthread_mutex_lock(&p->deques[i].lock);
+      size_t left = p->deques[i].bottom - p->deques[i].top;
+      pthread_mutex_unlock(&p->deques[i].lock);
+      if (left > most) {
+        most = left;
+        victim = i;
+      }
+    }
+
+    if (victim == self)
+      return false;
+
+    pool_deque* from = &p->deques[victim];
+    pthread_mutex_lock(&from->lock);
+    size_t left = from->bottom - from->top;
+    size_t take = (left + 1) / 2;
+    size_t start = from->top;
+    from->top += take;
+    pthread_mutex_unlock(&from->lock);
+
+    // someone else emptied it first, look again
+    if (take == 0)
+      continue;
+
+    pool_deque* to = &p->deques[self];
+    pthread_mutex_lock(&to->lock);
+    to->top = start;
+    to->bottom = start + take;
+    pthread_mutex_unlock(&to->lock);
+    return true;
+  }
+}
+
+static void* workerMain(void* arg) {
+  pool_worker* worker = arg;
+  pool* p = worker->owner;
+  uint64_t seen = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&p->lock);
+    while (!p->shutdown && p->generation == seen)
+      pthread_cond_wait(&p->wake, &p->lock);
+    if (p->shutdown) {
+      pthread_mutex_unlock(&p->lock);
+      return NULL;
+    }
+    seen = p->generation;
+    pthread_mutex_unlock(&p->lock);
+
+    size_t job;
+    for (;;) {
+      if (popLocal(&p->deques[worker->index], &job))
+        p->task(p->context, job, worker->index);
+      else if (!steal(p, worker->index))
+        break;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    if (--p->active == 0)
+      pthread_cond_signal(&p->done);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+pool* pool_create(unsigned workers) {
+  if (workers == 0)
+    workers = 1;
+
+  pool* p = calloc(1, sizeof(*p));
+  if (p == NULL)
+    return NULL;
+
+  p->workerCount = workers;
+  p->workers = calloc(workers, sizeof(*p->workers));
+  p->deques = calloc(workers, sizeof(*p->deques));
+  if (p->workers == NULL || p->deques == NULL) {
+    free(p->workers);
+    free(p->deques);
+    free(p);
+    return NULL;
+  }
+
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wake, NULL);
+  pthread_cond_init(&p->done, NULL);
+
+  for (unsigned i = 0; i < workers; i++) {
+    pthread_mutex_init(&p->deques[i].lock, NULL);
+    p->workers[i].owner = p;
+    p->workers[i].index = i;
+    pthread_create(&p->workers[i].thread, NULL, workerMain, &p->workers[i]);
+  }
+
+  return p;
+}
+
+void pool_destroy(pool* p) {
+  if (p == NULL)
+    return;
+
+  pthread_mutex_lock(&p->lock);
+  p->shutdown = true;
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+
+  for (unsigned i = 0; i < p->workerCount; i++) {
+    pthread_join(p->workers[i].thread, NULL);
+    pthread_mutex_destroy(&p->deques[i].lock);
+  }
+
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->wake);
+  pthread_cond_destroy(&p->done);
+  free(p->workers);
+  free(p->deques);
+  free(p);
+}
+
+unsigned pool_workers(const pool* p) {
+  return p->workerCount;
+}
+
+void pool_run(pool* p, size_t jobs, pool_task task, void* context) {
+  if (jobs == 0)
+    return;
+
+  // deal out contiguous shares, stealing evens out the rest
+  for (unsigned i = 0; i < p->workerCount; i++) {
+    p->deques[i].top = jobs * i / p->workerCount;
+    p->deques[i].bottom = jobs * (i + 1) / p->workerCount;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  p->task = task;
+  p->context = context;
+  p->active = p->workerCount;
+  p->generation++;
+  pthread_cond_broadcast(&p->wake);
+
+  while (p->active != 0)
+    pthread_cond_wait(&p->done, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+}
+
+unsigned pool_defaultWorkers(void) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 0 ? (unsigned)cores : 1;
+}
@@ -0,0 +1,113 @@
+#include "profile.h"
+
+#ifdef CHIP8_PROFILE
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+void chip8_profileEndFrame(chip8_profile* profile) {
+  uint32_t bucket = profile->frameDraws;
+  if (bucket >= PROFILE_DRAW_BUCKETS)
+    bucket = PROFILE_DRAW_BUCKETS - 1;
+
+  profile->drawsPerFrame[bucket]++;
+  profile->frameDraws = 0;
+  profile->frames++;
+}
+
+void chip8_profileMerge(chip8* into, const chip8* from) {
+  chip8_profile* total = &into->profile;
+  const chip8_profile* profile = &from->profile;
+
+  for (int op = 0; op < CHIP8_OP_COUNT; op++)
+    total->ops[op] += profile->ops[op];
+  for (uint32_t pc = 0; pc < MAX_MEMORY; pc++) {
+    if (profile->pcHits[pc] == 0)
+      continue;
+    if (total->pcHits[pc] == 0 && (pc & 1) == 0 && pc < CODE_MEMORY)
+      into->decoded[pc >> 1] = from->decoded[pc >> 1];
+    total->pcHits[pc] += profile->pcHits[pc];
+  }
+  for (int i = 0; i < PROFILE_DRAW_BUCKETS; i++)
+    total->drawsPerFrame[i] += profile->drawsPerFrame[i];
+  total->frames += profile->frames;
+  total->renders += profile->renders;
+  total->renderSeconds += profile->renderSeconds;
+
+  into->cycles += from->cycles;
+  into->skipped += from->skipped;
+}
+
+// the handler currently at an address, as the decoder would see it
+static const char* opAt(const chip8* chip, uint32_t address) {
+  if ((address & 1) != 0 || address >= CODE_MEMORY)
+    return "unknown";
+
+  const chip8_decoded* d = &chip->decoded[address >> 1];
+  return d->op != CHIP8_OP_DECODE ? chip8_opName(d->op) : "unknown";
+}
+
+static void dumpFolded(const chip8* chip, FILE* file) {
+  const chip8_profile* profile = &chip->profile;
+
+  // chip8;<handler>;<address> <count>, one stack per executed address
+  for (uint32_t pc = 0; pc < MAX_MEMORY; pc++) {
+    if (profile->pcHits[pc] != 0)
+      fprintf(file, "chip8;%s;0x%03X %" PRIu64 "\n", opAt(chip, pc), pc, profile->pcHits[pc]);
+  }
+}
+
+static void dumpJson(const chip8* chip, FILE* file) {
+  const chip8_profile* profile = &chip->profile;
+  const char* separator = "";
+
+  fprintf(file, "{\n  \"instructions\": %" PRIu64 ",\n", chip->cycles);
+  fprintf(file, "  \"frames\": %" PRIu64 ",\n", profile->frames);
+
+  fprintf(file, "  \"ops\": {");
+  for (int op = 0; op < CHIP8_OP_COUNT; op++) {
+    if (profile->ops[op] == 0)
+      continue;
+    fprintf(file, "%s\n    \"%s\": %" PRIu64, separator, chip8_opName(op), profile->ops[op]);
+    separator = ",";
+  }
+  fprintf(file, "\n  },\n");
+
+  separator = "";
+  fprintf(file, "  \"pc\": {");
+  for (uint32_t pc = 0; pc < MAX_MEMORY; pc++) {
+    if (profile->pcHits[pc] == 0)
+      continue;
+    fprintf(file, "%s\n    \"0x%03X\": %" PRIu64, separator, pc, profile->pcHits[pc]);
+    separator = ",";
+  }
+  fprintf(file, "\n  },\n");
+
+  fprintf(file, "  \"draws_per_frame\": [");
+  for (int i = 0; i < PROFILE_DRAW_BUCKETS; i++)
+    fprintf(file, "%s%" PRIu64, i == 0 ? "" : ", ", profile->drawsPerFrame[i]);
+  fprintf(file, "],\n");
+
+  fprintf(file, "  \"render\": { \"calls\": %" PRIu64 ", \"seconds\": %.6f }\n}\n",
+          profile->renders, profile->renderSeconds);
+}
+
+bool chip8_profileDump(const chip8* chip, const char* path) {
+  FILE* file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not write profile \"%s\".\n", path);
+    return false;
+  }
+
+  size_t length = strlen(path);
+  if (length >= 7 && strcmp(path + length - 7, ".folded") == 0)
+    dumpFolded(chip, file);
+  else
+    dumpJson(chip, file);
+
+  fclose(file);
+  return true;
+}
+
+#endif
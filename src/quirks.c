@@ -0,0 +1,65 @@
+#include "quirks.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char* names[CHIP8_QUIRKS_COUNT] = {
+  [CHIP8_QUIRKS_DEFAULT] = "default",
+  [CHIP8_QUIRKS_VIP] = "vip",
+  [CHIP8_QUIRKS_CHIP48] = "chip48",
+  [CHIP8_QUIRKS_SCHIP] = "schip",
+  [CHIP8_QUIRKS_XOCHIP] = "xochip",
+};
+
+const char* quirks_name(chip8_quirks quirks) {
+  return quirks < CHIP8_QUIRKS_COUNT ? names[quirks] : "unknown";
+}
+
+bool quirks_parse(const char* name, chip8_quirks* quirks) {
+  for (int i = 0; i < CHIP8_QUIRKS_COUNT; i++) {
+    if (strcmp(name, names[i]) == 0) {
+      *quirks = (chip8_quirks)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+chip8_quirks quirks_lookup(const char* path, uint64_t romHash, chip8_quirks fallback) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL)
+    return fallback;
+
+  chip8_quirks found = fallback;
+  char line[256];
+  int lineNumber = 0;
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    lineNumber++;
+
+    char* comment = strchr(line, '#');
+    if (comment != NULL)
+      *comment = '\0';
+
+    char name[32];
+    uint64_t hash;
+    int fields = sscanf(line, "%" SCNx64 " %31s", &hash, name);
+    if (fields == EOF)
+      continue;
+
+    chip8_quirks quirks;
+    if (fields != 2 || !quirks_parse(name, &quirks)) {
+      fprintf(stderr, "%s:%d: expected \"<ROM hash> <profile>\".\n", path, lineNumber);
+      continue;
+    }
+
+    if (hash == romHash) {
+      found = quirks;
+      break;
+    }
+  }
+
+  fclose(file);
+  return found;
+}
@@ -0,0 +1,240 @@
+#include "raster.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// the colour kernels work on one SIMD vector of pixels at a time with the
+// GCC/Clang vector extensions, otherwise on plain arrays of the same size
+#if defined(__GNUC__)
+typedef uint32_t pixels32 __attribute__((vector_size(32)));
+typedef uint16_t pixels16 __attribute__((vector_size(32)));
+#define MASK(v, bit) ((__typeof__(v))(((v) & (bit)) != 0))
+#define BLEND(mask, n, old) (((n) & (mask)) | ((old) & ~(mask)))
+#endif
+
+// built once per instruction set, the best one for the CPU is picked at
+// load time
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define RASTER_CLONES __attribute__((target_clones("avx2", "sse4.1", "default")))
+#endif
+#endif
+#ifndef RASTER_CLONES
+#define RASTER_CLONES
+#endif
+
+#define MAX_LINE_BYTES (HIRES_WIDTH * RASTER_MAX_SCALE / 8)
+
+const uint32_t raster_defaultPalette[4] = { 0x000000, 0xFFFFFF, 0x808080, 0xC0C0C0 };
+
+struct raster_shm {
+  raster_shmHeader* header;
+  size_t size;
+};
+
+static uint32_t toFormat(raster_format format, uint32_t rgb) {
+  uint8_t red = rgb >> 16, green = rgb >> 8, blue = rgb;
+
+  if (format == RASTER_RGB565)
+    return (uint32_t)((red >> 3) << 11 | (green >> 2) << 5 | (blue >> 3));
+
+  uint8_t bytes[4] = { red, green, blue, 0xFF };
+  uint32_t color;
+  memcpy(&color, bytes, sizeof(color));
+  return color;
+}
+
+bool raster_init(raster* r, raster_format format, uint32_t scale, const uint32_t palette[4],
+                 bool scanlines) {
+  if (scale < 1 || scale > RASTER_MAX_SCALE || format >= RASTER_FORMAT_COUNT)
+    return false;
+  if (palette == NULL)
+    palette = raster_defaultPalette;
+
+  r->format = format;
+  r->scale = scale;
+  r->width = HIRES_WIDTH * scale;
+  r->height = HIRES_HEIGHT * scale;
+  r->stride = r->width * (format == RASTER_RGB565 ? 2 : 4);
+  // a scanline needs a row of the pixel left to be seen between them
+  r->scanlines = scanlines && scale > 1;
+
+  for (int i = 0; i < 4; i++) {
+    r->colors[0][i] = toFormat(format, palette[i]);
+    r->colors[1][i] = toFormat(format, (palette[i] >> 1) & 0x7F7F7F);
+  }
+
+  // bit j of the widened bytes, most significant first, is bit j / factor
+  // of the source byte
+  memset(r->spread, 0x0, sizeof(r->spread));
+  for (int lores = 0; lores < 2; lores++) {
+    uint32_t factor = scale << lores;
+    for (uint32_t byte = 0; byte < 256; byte++) {
+      uint8_t* out = r->spread[lores][byte];
+      for (uint32_t j = 0; j < 8 * factor; j++) {
+        if ((byte >> (7 - j / factor)) & 1)
+          out[j / 8] |= 0x80 >> (j % 8);
+      }
+    }
+  }
+  return true;
+}
+
+size_t raster_size(const raster* r) {
+  return r->height * r->stride;
+}
+
+// one row of a plane at output width, a bit per pixel
+static void widen(const uint8_t (*spread)[2 * RASTER_MAX_SCALE], uint32_t factor,
+                  const uint64_t* row, int words, uint8_t* out) {
+  for (int w = 0; w < words; w++) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      memcpy(out, spread[(row[w] >> shift) & 0xFF], factor);
+      out += factor;
+    }
+  }
+}
+
+// bit pixels of both planes to colours, eight pixels per byte
+RASTER_CLONES
+static void colorize32(const uint8_t* bits0, const uint8_t* bits1, size_t bytes,
+                       const uint32_t colors[4], uint8_t* out) {
+#if defined(__GNUC__)
+  const pixels32 bit = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
+  const pixels32 c0 = (pixels32){ 0 } + colors[0], c1 = (pixels32){ 0 } + colors[1];
+  const pixels32 c2 = (pixels32){ 0 } + colors[2], c3 = (pixels32){ 0 } + colors[3];
+
+  for (size_t i = 0; i < bytes; i++) {
+    pixels32 m0 = MASK((pixels32){ 0 } + bits0[i], bit);
+    pixels32 m1 = MASK((pixels32){ 0 } + bits1[i], bit);
+    pixels32 v = BLEND(m1, BLEND(m0, c3, c2), BLEND(m0, c1, c0));
+    memcpy(out + i * sizeof(v), &v, sizeof(v));
+  }
+#else
+  uint32_t* pixels = (uint32_t*)out;
+  for (size_t i = 0; i < bytes * 8; i++) {
+    int shift = 7 - i % 8;
+    pixels[i] = colors[((bits0[i / 8] >> shift) & 1) | (((bits1[i / 8] >> shift) & 1) << 1)];
+  }
+#endif
+}
+
+// sixteen pixels, two bytes of each plane, per vector
+RASTER_CLONES
+static void colorize16(const uint8_t* bits0, const uint8_t* bits1, size_t bytes,
+                       const uint32_t colors[4], uint8_t* out) {
+#if defined(__GNUC__)
+  const pixels16 bit = { 0x8000, 0x4000, 0x2000, 0x1000, 0x0800, 0x0400, 0x0200, 0x0100,
+                         0x0080, 0x0040, 0x0020, 0x0010, 0x0008, 0x0004, 0x0002, 0x0001 };
+  const pixels16 c0 = (pixels16){ 0 } + (uint16_t)colors[0], c1 = (pixels16){ 0 } + (uint16_t)colors[1];
+  const pixels16 c2 = (pixels16){ 0 } + (uint16_t)colors[2], c3 = (pixels16){ 0 } + (uint16_t)colors[3];
+
+  for (size_t i = 0; i < bytes; i += 2) {
+    uint16_t word0 = (uint16_t)(bits0[i] << 8 | bits0[i + 1]);
+    uint16_t word1 = (uint16_t)(bits1[i] << 8 | bits1[i + 1]);
+    pixels16 m0 = MASK((pixels16){ 0 } + word0, bit);
+    pixels16 m1 = MASK((pixels16){ 0 } + word1, bit);
+    pixels16 v = BLEND(m1, BLEND(m0, c3, c2), BLEND(m0, c1, c0));
+    memcpy(out + i / 2 * sizeof(v), &v, sizeof(v));
+  }
+#else
+  uint16_t* pixels = (uint16_t*)out;
+  for (size_t i = 0; i < bytes * 8; i++) {
+    int shift = 7 - i % 8;
+    pixels[i] = (uint16_t)colors[((bits0[i / 8] >> shift) & 1) | (((bits1[i / 8] >> shift) & 1) << 1)];
+  }
+#endif
+}
+
+void raster_render(const raster* r, const uint64_t* plane0, const uint64_t* plane1, bool hires,
+                   void* out) {
+  int words = hires ? HIRES_WIDTH / 64 : 1;
+  int rows = hires ? HIRES_HEIGHT : HEIGHT;
+  uint32_t factor = hires ? r->scale : 2 * r->scale;
+  const uint8_t (*spread)[2 * RASTER_MAX_SCALE] = r->spread[hires ? 0 : 1];
+  void (*colorize)(const uint8_t*, const uint8_t*, size_t, const uint32_t[4], uint8_t*) =
+    r->format == RASTER_RGB565 ? colorize16 : colorize32;
+  size_t lineBytes = r->width / 8;
+
+  uint8_t bits0[MAX_LINE_BYTES];
+  uint8_t bits1[MAX_LINE_BYTES];
+
+  for (int y = 0; y < rows; y++) {
+    widen(spread, factor, plane0 + y * words, words, bits0);
+    widen(spread, factor, plane1 + y * words, words, bits1);
+
+    // the first row is drawn, the others it covers are copies of it or of
+    // the first scanline
+    uint8_t* line = (uint8_t*)out + (size_t)y * factor * r->stride;
+    uint8_t* scanline = NULL;
+    colorize(bits0, bits1, lineBytes, r->colors[0], line);
+
+    for (uint32_t k = 1; k < factor; k++) {
+      uint8_t* to = line + k * r->stride;
+      if (!r->scanlines || k % r->scale != r->scale - 1) {
+        memcpy(to, line, r->stride);
+      } else if (scanline == NULL) {
+        colorize(bits0, bits1, lineBytes, r->colors[1], to);
+        scanline = to;
+      } else {
+        memcpy(to, scanline, r->stride);
+      }
+    }
+  }
+}
+
+raster_shm* raster_shmOpen(const raster* r, const char* path) {
+  raster_shm* shm = malloc(sizeof(raster_shm));
+  if (shm == NULL)
+    return NULL;
+  shm->size = RASTER_SHM_PIXELS + raster_size(r);
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    free(shm);
+    return NULL;
+  }
+  void* mapping = MAP_FAILED;
+  if (ftruncate(fd, (off_t)shm->size) == 0)
+    mapping = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  // the mapping stays valid without the descriptor
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    free(shm);
+    return NULL;
+  }
+
+  _Static_assert(sizeof(raster_shmHeader) <= RASTER_SHM_PIXELS, "the header overlaps the pixels");
+  shm->header = mapping;
+  memcpy(shm->header->magic, "C8FB", 4);
+  shm->header->format = r->format;
+  shm->header->width = r->width;
+  shm->header->height = r->height;
+  shm->header->stride = (uint32_t)r->stride;
+  shm->header->reserved = 0;
+  shm->header->frame = 0;
+  atomic_init(&shm->header->sequence, 0);
+  return shm;
+}
+
+void raster_shmClose(raster_shm* shm) {
+  munmap(shm->header, shm->size);
+  free(shm);
+}
+
+void* raster_shmBegin(raster_shm* shm) {
+  uint64_t sequence = atomic_load_explicit(&shm->header->sequence, memory_order_relaxed);
+  atomic_store_explicit(&shm->header->sequence, sequence + 1, memory_order_relaxed);
+  // the odd sequence is visible before any of the pixels change
+  atomic_thread_fence(memory_order_release);
+  return (uint8_t*)shm->header + RASTER_SHM_PIXELS;
+}
+
+void raster_shmEnd(raster_shm* shm, uint64_t frame) {
+  shm->header->frame = frame;
+  uint64_t sequence = atomic_load_explicit(&shm->header->sequence, memory_order_relaxed);
+  atomic_store_explicit(&shm->header->sequence, sequence + 1, memory_order_release);
+}
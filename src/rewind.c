@@ -0,0 +1,173 @@
+#include "rewind.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Delta encoding: a sequence of (zero run, literal run) pairs, both lengths
+// as LEB128 varints, each literal run followed by its XOR bytes.
+#define PACKED_MAX (2 * sizeof(chip8_state) + 16)
+
+static uint8_t* putVarint(uint8_t* out, size_t value) {
+  while (value >= 0x80) {
+    *out++ = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  *out++ = (uint8_t)value;
+  return out;
+}
+
+static const uint8_t* getVarint(const uint8_t* in, size_t* value) {
+  size_t result = 0;
+  int shift = 0;
+
+  while (*in & 0x80) {
+    result |= (size_t)(*in++ & 0x7F) << shift;
+    shift += 7;
+  }
+  result |= (size_t)*in++ << shift;
+
+  *value = result;
+  return in;
+}
+
+static size_t encodeDelta(const uint8_t* a, const uint8_t* b, size_t length, uint8_t* out) {
+  uint8_t* start = out;
+  size_t pos = 0;
+
+  while (pos < length) {
+    // equal bytes, a word at a time while possible
+    size_t run = pos;
+    while (run + 8 <= length && memcmp(a + run, b + run, 8) == 0)
+      run += 8;
+    while (run < length && a[run] == b[run])
+      run++;
+
+    if (run == length)
+      break;
+
+    size_t literal = run;
+    while (literal < length && a[literal] != b[literal])
+      literal++;
+
+    out = putVarint(out, run - pos);
+    out = putVarint(out, literal - run);
+    for (size_t i = run; i < literal; i++)
+      *out++ = a[i] ^ b[i];
+
+    pos = literal;
+  }
+
+  return (size_t)(out - start);
+}
+
+static void applyDelta(uint8_t* target, const uint8_t* in, size_t size) {
+  const uint8_t* end = in + size;
+  size_t pos = 0;
+
+  while (in < end) {
+    size_t zeros, literals;
+    in = getVarint(in, &zeros);
+    in = getVarint(in, &literals);
+
+    pos += zeros;
+    for (size_t i = 0; i < literals; i++)
+      target[pos++] ^= *in++;
+  }
+}
+
+bool rewind_init(rewind_buffer* buffer, size_t arenaSize, size_t maxFrames) {
+  memset(buffer, 0x0, sizeof(*buffer));
+
+  // a delta can never be larger than PACKED_MAX, so one always fits
+  if (arenaSize < PACKED_MAX)
+    arenaSize = PACKED_MAX;
+
+  buffer->arena = malloc(arenaSize);
+  buffer->entries = malloc(maxFrames * sizeof(*buffer->entries));
+  buffer->packed = malloc(PACKED_MAX);
+  if (buffer->arena == NULL || buffer->entries == NULL || buffer->packed == NULL || maxFrames == 0) {
+    rewind_free(buffer);
+    return false;
+  }
+
+  buffer->arenaSize = arenaSize;
+  buffer->capacity = maxFrames;
+  return true;
+}
+
+void rewind_free(rewind_buffer* buffer) {
+  free(buffer->arena);
+  free(buffer->entries);
+  free(buffer->packed);
+  buffer->arena = NULL;
+  buffer->entries = NULL;
+  buffer->packed = NULL;
+}
+
+static void dropOldest(rewind_buffer* buffer) {
+  buffer->head = (buffer->head + 1) % buffer->capacity;
+  buffer->count--;
+}
+
+static bool overlaps(const rewind_entry* entry, size_t offset, size_t size) {
+  return entry->offset < offset + size && offset < entry->offset + entry->size;
+}
+
+void rewind_push(rewind_buffer* buffer, const chip8* chip) {
+  chip8_snapshot(chip, &buffer->scratch);
+
+  // memcpy rather than assignment, so the (zeroed) padding bytes are
+  // carried along and never show up in a delta
+  if (!buffer->hasCurrent) {
+    memcpy(&buffer->current, &buffer->scratch, sizeof(chip8_state));
+    buffer->hasCurrent = true;
+    return;
+  }
+
+  size_t size = encodeDelta((const uint8_t*)&buffer->current, (const uint8_t*)&buffer->scratch,
+                            sizeof(chip8_state), buffer->packed);
+  memcpy(&buffer->current, &buffer->scratch, sizeof(chip8_state));
+
+  // deltas are stored contiguously. Anything between the write position
+  // and the end of the arena is left over from the previous lap, so it is
+  // older than what we are about to overwrite at the start
+  if (buffer->writePos + size > buffer->arenaSize) {
+    while (buffer->count > 0 && buffer->entries[buffer->head].offset >= buffer->writePos)
+      dropOldest(buffer);
+    buffer->writePos = 0;
+  }
+
+  if (buffer->count == buffer->capacity)
+    dropOldest(buffer);
+
+  // the oldest entries are the ones right after the write position
+  while (buffer->count > 0 && overlaps(&buffer->entries[buffer->head], buffer->writePos, size))
+    dropOldest(buffer);
+
+  memcpy(buffer->arena + buffer->writePos, buffer->packed, size);
+
+  size_t slot = (buffer->head + buffer->count) % buffer->capacity;
+  buffer->entries[slot] = (rewind_entry){ .offset = buffer->writePos, .size = size };
+  buffer->count++;
+  buffer->writePos += size;
+}
+
+bool rewind_stepBack(rewind_buffer* buffer, chip8* chip) {
+  if (buffer->count == 0)
+    return false;
+
+  size_t slot = (buffer->head + buffer->count - 1) % buffer->capacity;
+  rewind_entry* entry = &buffer->entries[slot];
+
+  applyDelta((uint8_t*)&buffer->current, buffer->arena + entry->offset, entry->size);
+  chip8_restore(chip, &buffer->current);
+
+  // the newest delta is always the last one written, reuse its space
+  buffer->writePos = entry->offset;
+  buffer->count--;
+  return true;
+}
+
+size_t rewind_frames(const rewind_buffer* buffer) {
+  return buffer->count;
+}
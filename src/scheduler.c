@@ -0,0 +1,50 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "scheduler.h"
+
+#include <errno.h>
+
+#define NSEC_PER_SEC 1000000000L
+#define FRAME_NSEC (NSEC_PER_SEC / FRAME_RATE)
+
+static void addNsec(struct timespec* t, long nsec) {
+  t->tv_nsec += nsec;
+  while (t->tv_nsec >= NSEC_PER_SEC) {
+    t->tv_nsec -= NSEC_PER_SEC;
+    t->tv_sec++;
+  }
+}
+
+static bool isBefore(const struct timespec* a, const struct timespec* b) {
+  return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+void scheduler_init(scheduler* sched, uint32_t ipf, bool turbo) {
+  sched->ipf = ipf;
+  sched->turbo = turbo;
+  sched->frames = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &sched->deadline);
+  addNsec(&sched->deadline, FRAME_NSEC);
+}
+
+void scheduler_waitNextFrame(scheduler* sched) {
+  sched->frames++;
+
+  if (sched->turbo)
+    return;
+
+  // absolute deadlines, so time spent emulating and rendering is not added
+  // on top of the frame period
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &sched->deadline, NULL) == EINTR)
+    ;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  addNsec(&sched->deadline, FRAME_NSEC);
+  if (isBefore(&sched->deadline, &now)) {
+    sched->deadline = now;
+    addNsec(&sched->deadline, FRAME_NSEC);
+  }
+}
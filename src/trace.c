@@ -0,0 +1,878 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "trace.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_VERSION 3
+// LZ4's worst case, incompressible input
+#define COMPRESSED_BYTES (TRACE_BLOCK_BYTES + TRACE_BLOCK_BYTES / 255 + 16)
+#define READ_ENTRIES 65536        // per trace_read
+
+// records, see trace.h
+#define RECORD_KIND_CALL 0
+#define RECORD_KIND_MACHINE 1
+#define RECORD_FIRST 4
+#define RECORD_INSTRUCTIONS 12
+#define RECORD_FLAGS 18
+#define RECORD_HASH 20
+#define RECORD_HEADER 24
+#define RECORD_UNFINISHED 0x1
+#define RECORD_GFX (PLANES * PLANE_WORDS * 8)
+#define RECORD_BLOCK (2 + DIRTY_BLOCK)
+#define STATE_BYTES 120
+#define STATE_GROUPS 8
+#define RECORD_MAX (RECORD_HEADER + STATE_BYTES + RECORD_GFX + 2 + MAX_MEMORY / DIRTY_BLOCK * RECORD_BLOCK)
+
+// what a call record may leave out: the machine, but its memory and
+// screen, as the last call left it
+typedef struct {
+  uint8_t quirks;
+  uint8_t sp;
+  uint8_t delay_timer;
+  uint8_t sound_timer;
+  bool hires;
+  uint8_t planes;
+  uint8_t pitch;
+  uint16_t I;
+  uint16_t pc;
+  uint16_t opcode;
+  uint64_t rng;
+  uint8_t key[KEY_SIZE];
+  uint8_t V[REGISTERS_SIZE];
+  uint8_t flags[REGISTERS_SIZE];
+  uint8_t pattern[16];
+  uint16_t stack[STACK_SIZE];
+} traceState;
+
+// LZ4 block format: the last match starts 12 bytes before the end at the
+// latest and leaves at least 5 bytes of literals after it
+#define LZ_MIN_MATCH 4
+#define LZ_MATCH_LIMIT 12
+#define LZ_LAST_LITERALS 5
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
+
+struct trace {
+  chip8_traceLink link;           // first, the core only sees this
+  bool lossless;
+  FILE* file;
+  uint8_t* ring;
+  uint64_t mask;                  // ring bytes - 1, a power of two
+  uint8_t spill[RECORD_MAX];      // a record that wraps around the ring's end
+
+  // the traced chip's thread: bytes appended so far, where the record of
+  // the call in progress starts, or that it is dropped
+  uint64_t head;
+  uint64_t record;
+  bool dropping;
+  traceState state;               // the machine as the last call left it
+  uint8_t memory[MAX_MEMORY];     // and its memory, as far as the reader knows
+  bool idled;                     // it skipped an idle loop, which is not replayed
+  uint64_t traced;
+  uint64_t dropped;
+
+  // how far the writer may read, and how far it got: everything before
+  // consumed is copied out and may be overwritten
+  atomic_uint_least64_t published;
+  atomic_uint_least64_t consumed;
+
+  // the writer polls every TRACE_FLUSH_MS, or is kicked once a quarter of
+  // the ring is waiting. In lossless mode the chip's thread waits on room
+  sem_t wake;
+  atomic_bool kicked;
+  atomic_bool closing;
+  atomic_bool waiting;
+  pthread_mutex_t lock;
+  pthread_cond_t room;
+
+  // writer thread
+  pthread_t thread;
+  uint64_t written;
+  uint64_t bytes;
+  bool failed;
+  uint8_t block[TRACE_BLOCK_BYTES];
+  uint8_t compressed[COMPRESSED_BYTES];
+  uint32_t table[1 << LZ_HASH_BITS];
+};
+
+struct trace_reader {
+  FILE* file;
+  bool complete;
+  uint64_t entries;
+  uint8_t block[TRACE_BLOCK_BYTES];
+  uint8_t compressed[COMPRESSED_BYTES];
+  size_t at;                      // next record in block
+  size_t length;
+  uint16_t flags;                 // of the current call, and its end hash
+  uint32_t hash;
+
+  // the calls run again, from the last whole machine record on
+  chip8 chip;
+  bool synced;
+  uint64_t next;                  // number of the next instruction
+  uint32_t remaining;             // of the current call
+  trace_entry decoded[READ_ENTRIES];
+};
+
+static uint8_t* putLe16(uint8_t* out, uint16_t value) {
+  out[0] = value & 0xFF;
+  out[1] = value >> 8;
+  return out + 2;
+}
+
+static uint8_t* putLe32(uint8_t* out, uint32_t value) {
+  return putLe16(putLe16(out, value & 0xFFFF), value >> 16);
+}
+
+static uint8_t* putLe64(uint8_t* out, uint64_t value) {
+  return putLe32(putLe32(out, value & 0xFFFFFFFF), value >> 32);
+}
+
+static uint16_t getLe16(const uint8_t* in) {
+  return (uint16_t)(in[0] | in[1] << 8);
+}
+
+static uint32_t getLe32(const uint8_t* in) {
+  return getLe16(in) | (uint32_t)getLe16(in + 2) << 16;
+}
+
+static uint64_t getLe64(const uint8_t* in) {
+  return getLe32(in) | (uint64_t)getLe32(in + 4) << 32;
+}
+
+static void put(trace* t, const void* data, size_t size) {
+  if (!t->failed && fwrite(data, 1, size, t->file) != size)
+    t->failed = true;
+  t->bytes += size;
+}
+
+// what the file header says the core was built with, see trace.h
+static uint16_t buildFlags(void) {
+  uint16_t flags = 0;
+#ifdef CHIP8_CHECKED
+  flags |= 1 << 0;
+#endif
+#ifdef CHIP8_PROFILE
+  flags |= 1 << 1;
+#endif
+  return flags;
+}
+
+// 32-bit FNV-1a of where a call left the chip
+static uint32_t stateHash(const chip8* chip) {
+  uint8_t state[2 + 2 + REGISTERS_SIZE + 1];
+  putLe16(putLe16(state, chip->pc), chip->I);
+  memcpy(state + 4, chip->V, REGISTERS_SIZE);
+  state[4 + REGISTERS_SIZE] = chip->sp;
+
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < sizeof(state); i++)
+    hash = (hash ^ state[i]) * 16777619u;
+  return hash;
+}
+
+// LZ4 compression, the greedy single-probe kind: fast, and traces are
+// mostly the same few loops over and over
+
+static uint32_t lzHash(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// the part of a length past the 15 its token holds
+static uint8_t* lzLength(uint8_t* out, size_t length) {
+  for (; length >= 255; length -= 255)
+    *out++ = 255;
+  *out++ = (uint8_t)length;
+  return out;
+}
+
+static uint8_t* lzSequence(uint8_t* out, const uint8_t* literals, size_t count, size_t offset,
+                           size_t match) {
+  uint8_t* token = out++;
+  *token = (uint8_t)((count < 15 ? count : 15) << 4);
+  if (count >= 15)
+    out = lzLength(out, count - 15);
+  memcpy(out, literals, count);
+  out += count;
+
+  // the last sequence is literals only
+  if (match == 0)
+    return out;
+  match -= LZ_MIN_MATCH;
+  *token |= match < 15 ? match : 15;
+  out = putLe16(out, (uint16_t)offset);
+  if (match >= 15)
+    out = lzLength(out, match - 15);
+  return out;
+}
+
+// where the match of in + at against in + with, at < limit, ends
+static size_t lzExtend(const uint8_t* in, size_t at, size_t with, size_t limit) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // eight bytes at a time, the first that differs is the lowest set bit
+  while (at + 8 <= limit) {
+    uint64_t a, b;
+    memcpy(&a, in + at, sizeof(a));
+    memcpy(&b, in + with, sizeof(b));
+    if (a != b)
+      return at + (size_t)(__builtin_ctzll(a ^ b) >> 3);
+    at += 8;
+    with += 8;
+  }
+#endif
+  while (at < limit && in[at] == in[with]) {
+    at++;
+    with++;
+  }
+  return at;
+}
+
+static size_t lzCompress(const uint8_t* in, size_t length, uint8_t* out, uint32_t* table) {
+  uint8_t* o = out;
+  size_t anchor = 0;
+  size_t i = 0;
+  uint32_t misses = 0;
+
+  memset(table, 0x0, sizeof(uint32_t) << LZ_HASH_BITS);
+  while (i + LZ_MATCH_LIMIT <= length) {
+    uint32_t h = lzHash(in + i);
+    size_t candidate = table[h];
+    table[h] = (uint32_t)i;
+
+    if (candidate >= i || i - candidate > LZ_MAX_OFFSET || memcmp(in + candidate, in + i, LZ_MIN_MATCH) != 0) {
+      // skips faster through data that does not compress
+      i += 1 + (misses++ >> 6);
+      continue;
+    }
+    misses = 0;
+
+    size_t end = lzExtend(in, i + LZ_MIN_MATCH, candidate + LZ_MIN_MATCH, length - LZ_LAST_LITERALS);
+    while (i > anchor && candidate > 0 && in[i - 1] == in[candidate - 1]) {
+      i--;
+      candidate--;
+    }
+
+    o = lzSequence(o, in + anchor, i - anchor, i - candidate, end - i);
+    i = anchor = end;
+  }
+
+  o = lzSequence(o, in + anchor, length - anchor, 0, 0);
+  return (size_t)(o - out);
+}
+
+// false unless it decompresses to exactly length bytes
+static bool lzDecompress(const uint8_t* in, size_t size, uint8_t* out, size_t length) {
+  const uint8_t* end = in + size;
+  size_t o = 0;
+
+  while (in < end) {
+    uint8_t token = *in++;
+
+    size_t count = token >> 4;
+    if (count == 15) {
+      uint8_t more;
+      do {
+        if (in == end)
+          return false;
+        count += more = *in++;
+      } while (more == 255);
+    }
+    if (count > (size_t)(end - in) || count > length - o)
+      return false;
+    memcpy(out + o, in, count);
+    in += count;
+    o += count;
+
+    if (in == end)
+      break;
+
+    if (end - in < 2)
+      return false;
+    size_t offset = getLe16(in);
+    in += 2;
+    size_t match = (token & 0x0F) + LZ_MIN_MATCH;
+    if ((token & 0x0F) == 15) {
+      uint8_t more;
+      do {
+        if (in == end)
+          return false;
+        match += more = *in++;
+      } while (more == 255);
+    }
+    if (offset == 0 || offset > o || match > length - o)
+      return false;
+    // byte by byte, a match may overlap what it copies
+    for (size_t k = 0; k < match; k++, o++)
+      out[o] = out[o - offset];
+  }
+  return o == length;
+}
+
+// Ring, bytes at ever growing offsets
+
+static void ringPut(trace* t, uint64_t at, const void* data, size_t size) {
+  size_t offset = (size_t)(at & t->mask);
+  size_t piece = size < t->mask + 1 - offset ? size : (size_t)(t->mask + 1 - offset);
+  memcpy(t->ring + offset, data, piece);
+  memcpy(t->ring, (const uint8_t*)data + piece, size - piece);
+}
+
+static void ringGet(const trace* t, uint64_t at, void* out, size_t size) {
+  size_t offset = (size_t)(at & t->mask);
+  size_t piece = size < t->mask + 1 - offset ? size : (size_t)(t->mask + 1 - offset);
+  memcpy(out, t->ring + offset, piece);
+  memcpy((uint8_t*)out + piece, t->ring, size - piece);
+}
+
+// Writer
+
+static void writeBlock(trace* t, uint64_t first, const uint8_t* records, size_t length, uint64_t instructions) {
+  size_t size = length > 0 ? lzCompress(records, length, t->compressed, t->table) : 0;
+
+  uint8_t header[16];
+  putLe32(putLe32(putLe64(header, first), (uint32_t)length), (uint32_t)size);
+  put(t, header, sizeof(header));
+  put(t, t->compressed, size);
+  t->written += instructions;
+}
+
+// hands the ring before consumed back to the chip's thread
+static void release(trace* t, uint64_t consumed) {
+  atomic_store(&t->consumed, consumed);
+  if (atomic_load(&t->waiting)) {
+    pthread_mutex_lock(&t->lock);
+    pthread_cond_broadcast(&t->room);
+    pthread_mutex_unlock(&t->lock);
+  }
+}
+
+// writes every record published so far, as many whole ones per block as fit
+static void flush(trace* t) {
+  uint64_t end = atomic_load_explicit(&t->published, memory_order_acquire);
+  uint64_t start = atomic_load_explicit(&t->consumed, memory_order_relaxed);
+
+  while (start < end) {
+    uint8_t fields[16];
+    ringGet(t, start, fields, sizeof(fields));
+    uint64_t first = getLe64(fields + RECORD_FIRST);
+
+    uint64_t at = start;
+    uint64_t instructions = 0;
+    while (at < end) {
+      ringGet(t, at, fields, sizeof(fields));
+      uint32_t size = getLe32(fields);
+      if (at > start && at + size - start > TRACE_BLOCK_BYTES)
+        break;
+      instructions += getLe32(fields + RECORD_INSTRUCTIONS);
+      at += size;
+    }
+
+    ringGet(t, start, t->block, (size_t)(at - start));
+    release(t, at);
+    writeBlock(t, first, t->block, (size_t)(at - start), instructions);
+    start = at;
+  }
+}
+
+static void* writerThread(void* arg) {
+  trace* t = arg;
+
+  for (;;) {
+    bool closing = atomic_load_explicit(&t->closing, memory_order_acquire);
+    flush(t);
+    if (closing)
+      break;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += TRACE_FLUSH_MS / 1000;
+    deadline.tv_nsec += TRACE_FLUSH_MS % 1000 * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while (sem_timedwait(&t->wake, &deadline) != 0 && errno == EINTR)
+      continue;
+    atomic_store_explicit(&t->kicked, false, memory_order_relaxed);
+  }
+  return NULL;
+}
+
+static void traceBegin(chip8_traceLink* link, const chip8* chip);
+static void traceEnd(chip8_traceLink* link, const chip8* chip, uint64_t instructions);
+
+trace* trace_open(const char* path, uint32_t bytes, bool lossless) {
+  // the largest record, a whole machine with every block dirty, fits
+  // easily, and so does a block being copied out
+  uint64_t size = 2 * TRACE_BLOCK_BYTES;
+  while (size < bytes)
+    size <<= 1;
+
+  trace* t = calloc(1, sizeof(trace));
+  if (t == NULL)
+    return NULL;
+  t->link.begin = traceBegin;
+  t->link.end = traceEnd;
+  t->lossless = lossless;
+  t->mask = size - 1;
+  if ((t->ring = malloc(size)) == NULL)
+    goto fail;
+  if ((t->file = fopen(path, "wb")) == NULL)
+    goto fail;
+
+  uint8_t header[16];
+  memcpy(header, "C8TR", 4);
+  putLe32(putLe32(putLe16(putLe16(header + 4, TRACE_VERSION), buildFlags()), (uint32_t)size), CHIP8_CORE_ABI);
+  put(t, header, sizeof(header));
+
+  atomic_init(&t->published, 0);
+  atomic_init(&t->consumed, 0);
+  atomic_init(&t->kicked, false);
+  atomic_init(&t->closing, false);
+  atomic_init(&t->waiting, false);
+  sem_init(&t->wake, 0, 0);
+  pthread_mutex_init(&t->lock, NULL);
+  pthread_cond_init(&t->room, NULL);
+
+  if (pthread_create(&t->thread, NULL, writerThread, t) != 0) {
+    sem_destroy(&t->wake);
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->room);
+    goto fail;
+  }
+  return t;
+
+fail:
+  if (t->file != NULL)
+    fclose(t->file);
+  free(t->ring);
+  free(t);
+  return NULL;
+}
+
+chip8_traceLink* trace_link(trace* t) {
+  t->link.sync = true;
+  return &t->link;
+}
+
+trace_stats trace_close(trace* t) {
+  atomic_store_explicit(&t->closing, true, memory_order_release);
+  sem_post(&t->wake);
+  pthread_join(t->thread, NULL);
+
+  // the block of no records that ends the file
+  writeBlock(t, t->traced, NULL, 0, 0);
+  if (fclose(t->file) != 0)
+    t->failed = true;
+
+  trace_stats stats = { t->traced, t->written, t->dropped, t->bytes, t->failed };
+
+  sem_destroy(&t->wake);
+  pthread_mutex_destroy(&t->lock);
+  pthread_cond_destroy(&t->room);
+  free(t->ring);
+  free(t);
+  return stats;
+}
+
+// the blocks among those listed whose memory the reader does not have yet,
+// or all of them
+static uint32_t changedBlocks(const trace* t, const chip8* chip, const uint64_t* blocks, bool all,
+                              uint16_t* changed) {
+  uint32_t count = 0;
+  for (uint32_t word = 0; word < DIRTY_WORDS; word++) {
+    for (uint64_t bits = blocks[word]; bits != 0; bits &= bits - 1) {
+      uint32_t block = word * 64;
+      for (uint64_t low = bits & -bits; low > 1; low >>= 1)
+        block++;
+      if (all || memcmp(chip->memory + block * DIRTY_BLOCK, t->memory + block * DIRTY_BLOCK, DIRTY_BLOCK) != 0)
+        changed[count++] = (uint16_t)block;
+    }
+  }
+  return count;
+}
+
+static void keepState(traceState* state, const chip8* chip) {
+  state->quirks = chip->quirks;
+  state->sp = chip->sp;
+  state->delay_timer = chip->delay_timer;
+  state->sound_timer = chip->sound_timer;
+  state->hires = chip->hires;
+  state->planes = chip->planes;
+  state->pitch = chip->pitch;
+  state->I = chip->I;
+  state->pc = chip->pc;
+  state->opcode = chip->opcode;
+  state->rng = chip->rng;
+  memcpy(state->key, chip->key, KEY_SIZE);
+  memcpy(state->V, chip->V, REGISTERS_SIZE);
+  memcpy(state->flags, chip->flags, REGISTERS_SIZE);
+  memcpy(state->pattern, chip->pattern, sizeof(chip->pattern));
+  memcpy(state->stack, chip->stack, sizeof(chip->stack));
+}
+
+// one bit per group of the state in trace.h that differs from the chip's
+static uint8_t changedGroups(const traceState* state, const chip8* chip) {
+  uint8_t changed = 0;
+  if (state->quirks != chip->quirks || state->sp != chip->sp || state->delay_timer != chip->delay_timer ||
+      state->sound_timer != chip->sound_timer || state->hires != chip->hires || state->planes != chip->planes ||
+      state->pitch != chip->pitch)
+    changed |= 1 << 0;
+  if (state->I != chip->I || state->pc != chip->pc || state->opcode != chip->opcode)
+    changed |= 1 << 1;
+  if (state->rng != chip->rng)
+    changed |= 1 << 2;
+  if (memcmp(state->key, chip->key, KEY_SIZE) != 0)
+    changed |= 1 << 3;
+  if (memcmp(state->V, chip->V, REGISTERS_SIZE) != 0)
+    changed |= 1 << 4;
+  if (memcmp(state->flags, chip->flags, REGISTERS_SIZE) != 0)
+    changed |= 1 << 5;
+  if (memcmp(state->pattern, chip->pattern, sizeof(chip->pattern)) != 0)
+    changed |= 1 << 6;
+  if (memcmp(state->stack, chip->stack, sizeof(chip->stack)) != 0)
+    changed |= 1 << 7;
+  return changed;
+}
+
+static uint8_t* putGroup(uint8_t* out, const chip8* chip, int group) {
+  switch (group) {
+    case 0:
+      *out++ = chip->quirks;
+      *out++ = chip->sp;
+      *out++ = chip->delay_timer;
+      *out++ = chip->sound_timer;
+      *out++ = chip->hires;
+      *out++ = chip->planes;
+      *out++ = chip->pitch;
+      *out++ = 0;
+      return out;
+    case 1: return putLe16(putLe16(putLe16(putLe16(out, chip->I), chip->pc), chip->opcode), 0);
+    case 2: return putLe64(out, chip->rng);
+    case 3: memcpy(out, chip->key, KEY_SIZE); return out + KEY_SIZE;
+    case 4: memcpy(out, chip->V, REGISTERS_SIZE); return out + REGISTERS_SIZE;
+    case 5: memcpy(out, chip->flags, REGISTERS_SIZE); return out + REGISTERS_SIZE;
+    case 6: memcpy(out, chip->pattern, sizeof(chip->pattern)); return out + sizeof(chip->pattern);
+    default:
+      for (int s = 0; s < STACK_SIZE; s++)
+        out = putLe16(out, chip->stack[s]);
+      return out;
+  }
+}
+
+static const uint8_t* getGroup(const uint8_t* in, chip8* chip, int group) {
+  switch (group) {
+    case 0:
+      chip->quirks = in[0];
+      chip->sp = in[1];
+      chip->delay_timer = in[2];
+      chip->sound_timer = in[3];
+      chip->hires = in[4] != 0;
+      chip->planes = in[5];
+      chip->pitch = in[6];
+      return in + 8;
+    case 1:
+      chip->I = getLe16(in);
+      chip->pc = getLe16(in + 2);
+      chip->opcode = getLe16(in + 4);
+      return in + 8;
+    case 2: chip->rng = getLe64(in); return in + 8;
+    case 3: memcpy(chip->key, in, KEY_SIZE); return in + KEY_SIZE;
+    case 4: memcpy(chip->V, in, REGISTERS_SIZE); return in + REGISTERS_SIZE;
+    case 5: memcpy(chip->flags, in, REGISTERS_SIZE); return in + REGISTERS_SIZE;
+    case 6: memcpy(chip->pattern, in, sizeof(chip->pattern)); return in + sizeof(chip->pattern);
+    default:
+      for (int s = 0; s < STACK_SIZE; s++)
+        chip->stack[s] = getLe16(in + 2 * s);
+      return in + 2 * STACK_SIZE;
+  }
+}
+
+static size_t groupsBytes(uint8_t groups) {
+  static const uint8_t bytes[STATE_GROUPS] = { 8, 8, 8, 16, 16, 16, 16, 32 };
+  size_t total = 0;
+  for (int g = 0; g < STATE_GROUPS; g++)
+    total += groups & (1 << g) ? bytes[g] : 0;
+  return total;
+}
+
+// chip8_traceLink.begin: records the state the chip starts from, waiting
+// for room in lossless mode
+static void traceBegin(chip8_traceLink* link, const chip8* chip) {
+  trace* t = (trace*)link;
+  bool machine = link->sync;
+  const uint64_t* blocks = machine ? chip->dirty : link->written;
+
+  // usually only what the frontend changed between calls, the timers and
+  // the keys, differs from where the last call stopped
+  uint8_t changed = machine || t->idled ? (1 << STATE_GROUPS) - 1 : changedGroups(&t->state, chip);
+
+  // a whole machine starts the reader from chip8_initialize, which is what
+  // the chip's memory outside its dirty blocks holds
+  if (machine)
+    memcpy(t->memory, chip->memory, MAX_MEMORY);
+  uint16_t written[MAX_MEMORY / DIRTY_BLOCK];
+  uint32_t count = changedBlocks(t, chip, blocks, machine, written);
+  uint64_t size = RECORD_HEADER + groupsBytes(changed) + (machine ? RECORD_GFX : 0) + 2 + (uint64_t)count * RECORD_BLOCK;
+  uint64_t capacity = t->mask + 1;
+
+  if (t->head + size - atomic_load(&t->consumed) > capacity) {
+    if (!t->lossless) {
+      // the next call that fits starts over from the whole machine
+      t->dropping = true;
+      link->sync = true;
+      memset(link->written, 0x0, sizeof(link->written));
+      return;
+    }
+    pthread_mutex_lock(&t->lock);
+    atomic_store(&t->waiting, true);
+    sem_post(&t->wake);
+    while (t->head + size - atomic_load(&t->consumed) > capacity)
+      pthread_cond_wait(&t->room, &t->lock);
+    atomic_store(&t->waiting, false);
+    pthread_mutex_unlock(&t->lock);
+  }
+
+  // straight into the ring unless the record wraps around its end
+  size_t offset = (size_t)(t->head & t->mask);
+  bool wraps = offset + size > capacity;
+  uint8_t* out = wraps ? t->spill : t->ring + offset;
+  out = putLe32(out, (uint32_t)size);
+  out = putLe64(out, t->traced);
+  out = putLe32(out, 0);          // these three filled in by traceEnd
+  *out++ = machine ? RECORD_KIND_MACHINE : RECORD_KIND_CALL;
+  *out++ = changed;
+  out = putLe16(out, 0);
+  out = putLe32(out, 0);
+  for (int g = 0; g < STATE_GROUPS; g++) {
+    if (changed & (1 << g))
+      out = putGroup(out, chip, g);
+  }
+  if (machine) {
+    for (int p = 0; p < PLANES; p++) {
+      for (int w = 0; w < PLANE_WORDS; w++)
+        out = putLe64(out, chip->gfx[p][w]);
+    }
+  }
+  out = putLe16(out, (uint16_t)count);
+  for (uint32_t k = 0; k < count; k++) {
+    const uint8_t* memory = chip->memory + written[k] * DIRTY_BLOCK;
+    out = putLe16(out, written[k]);
+    memcpy(out, memory, DIRTY_BLOCK);
+    memcpy(t->memory + written[k] * DIRTY_BLOCK, memory, DIRTY_BLOCK);
+    out += DIRTY_BLOCK;
+  }
+  if (wraps)
+    ringPut(t, t->head, t->spill, (size_t)size);
+
+  t->record = t->head;
+  t->head += size;
+  t->dropping = false;
+  link->sync = false;
+  memset(link->written, 0x0, sizeof(link->written));
+}
+
+// chip8_traceLink.end: how many instructions the call ran and the state
+// they left
+static void traceEnd(chip8_traceLink* link, const chip8* chip, uint64_t instructions) {
+  trace* t = (trace*)link;
+  t->traced += instructions;
+  if (t->dropping) {
+    t->dropped += instructions;
+    return;
+  }
+  keepState(&t->state, chip);
+  t->idled = chip->idle != CHIP8_IDLE_NONE;
+
+  // a fault stops inside the instruction, which the reader never runs
+  bool unfinished = t->idled;
+#ifdef CHIP8_CHECKED
+  unfinished = unfinished || chip->fault != CHIP8_FAULT_NONE;
+#endif
+
+  uint8_t count[4], flags[2], hash[4];
+  putLe32(count, (uint32_t)instructions);
+  putLe16(flags, unfinished ? RECORD_UNFINISHED : 0);
+  putLe32(hash, unfinished ? 0 : stateHash(chip));
+  ringPut(t, t->record + RECORD_INSTRUCTIONS, count, sizeof(count));
+  ringPut(t, t->record + RECORD_FLAGS, flags, sizeof(flags));
+  ringPut(t, t->record + RECORD_HASH, hash, sizeof(hash));
+  atomic_store_explicit(&t->published, t->head, memory_order_release);
+
+  uint64_t pending = t->head - atomic_load_explicit(&t->consumed, memory_order_relaxed);
+  if (pending >= (t->mask + 1) / 4 && !atomic_exchange_explicit(&t->kicked, true, memory_order_relaxed))
+    sem_post(&t->wake);
+}
+
+// Reader
+
+trace_reader* trace_readerOpen(const char* path) {
+  trace_reader* reader = calloc(1, sizeof(trace_reader));
+  if (reader == NULL)
+    return NULL;
+  if ((reader->file = fopen(path, "rb")) == NULL) {
+    free(reader);
+    return NULL;
+  }
+
+  uint8_t header[16];
+  if (fread(header, 1, sizeof(header), reader->file) != sizeof(header) || memcmp(header, "C8TR", 4) != 0 ||
+      getLe16(header + 4) != TRACE_VERSION) {
+    trace_readerClose(reader);
+    return NULL;
+  }
+
+  // a checked core stops at faults the other runs through, and a core of
+  // another ABI may run the same instructions differently
+  uint16_t flags = getLe16(header + 6);
+  uint32_t abi = getLe32(header + 12);
+  if (flags != buildFlags() || abi != CHIP8_CORE_ABI) {
+    fprintf(stderr, "\"%s\" was traced by core ABI %" PRIu32 " with build flags %" PRIx16
+            ", this one is ABI %d with %" PRIx16 ".\n", path, abi, flags, CHIP8_CORE_ABI, buildFlags());
+    trace_readerClose(reader);
+    return NULL;
+  }
+  return reader;
+}
+
+void trace_readerClose(trace_reader* reader) {
+  fclose(reader->file);
+  free(reader);
+}
+
+// the next block of records, false at the end or when it cannot be read
+static bool readBlock(trace_reader* reader) {
+  uint8_t header[16];
+  if (reader->complete || fread(header, 1, sizeof(header), reader->file) != sizeof(header))
+    return false;
+
+  uint32_t length = getLe32(header + 8);
+  uint32_t size = getLe32(header + 12);
+  if (length == 0) {
+    reader->complete = size == 0;
+    reader->entries = getLe64(header);
+    return false;
+  }
+  if (length > TRACE_BLOCK_BYTES || size > COMPRESSED_BYTES ||
+      fread(reader->compressed, 1, size, reader->file) != size ||
+      !lzDecompress(reader->compressed, size, reader->block, length))
+    return false;
+  reader->at = 0;
+  reader->length = length;
+  return true;
+}
+
+// puts the chip into the state the next call started from
+static bool readRecord(trace_reader* reader) {
+  if (reader->at == reader->length && !readBlock(reader))
+    return false;
+
+  const uint8_t* in = reader->block + reader->at;
+  size_t left = reader->length - reader->at;
+  if (left < RECORD_HEADER + 2)
+    return false;
+  uint32_t size = getLe32(in);
+  bool machine = in[16] == RECORD_KIND_MACHINE;
+  uint8_t changed = in[17];
+  size_t fixed = RECORD_HEADER + groupsBytes(changed) + (machine ? RECORD_GFX : 0);
+  if (size > left || size < fixed + 2 || (!machine && !reader->synced))
+    return false;
+  uint16_t count = getLe16(in + fixed);
+  if (size != fixed + 2 + (size_t)count * RECORD_BLOCK)
+    return false;
+
+  chip8* chip = &reader->chip;
+  if (machine) {
+    chip8_initialize(chip);
+    reader->synced = true;
+  }
+  reader->next = getLe64(in + RECORD_FIRST);
+  reader->remaining = getLe32(in + RECORD_INSTRUCTIONS);
+  reader->flags = getLe16(in + RECORD_FLAGS);
+  reader->hash = getLe32(in + RECORD_HASH);
+
+  // the changes to the machine as the last call left it
+  const uint8_t* at = in + RECORD_HEADER;
+  for (int g = 0; g < STATE_GROUPS; g++) {
+    if (changed & (1 << g))
+      at = getGroup(at, chip, g);
+  }
+  if (machine) {
+    for (int p = 0; p < PLANES; p++) {
+      for (int w = 0; w < PLANE_WORDS; w++, at += 8)
+        chip->gfx[p][w] = getLe64(at);
+    }
+  }
+
+  const uint8_t* block = in + fixed + 2;
+  for (uint16_t k = 0; k < count; k++, block += RECORD_BLOCK) {
+    uint16_t number = getLe16(block);
+    if (number >= MAX_MEMORY / DIRTY_BLOCK)
+      return false;
+    memcpy(chip->memory + number * DIRTY_BLOCK, block + 2, DIRTY_BLOCK);
+    chip8_invalidate(chip, (uint16_t)(number * DIRTY_BLOCK), DIRTY_BLOCK);
+  }
+
+  reader->at += size;
+  return true;
+}
+
+// runs the next instruction of the call, as the interpreter did
+static void replay(trace_reader* reader, trace_entry* e) {
+  chip8* chip = &reader->chip;
+  uint16_t pc = chip->pc;
+  uint16_t opcode = (uint16_t)(chip->memory[pc] << 8 | chip->memory[(pc + 1) & (MAX_MEMORY - 1)]);
+
+#ifndef CHIP8_CHECKED
+  // what the interpreter does with one, without printing it again
+  if (chip8_decode(opcode).op == CHIP8_OP_INVALID) {
+    chip->opcode = opcode;
+    chip->pc += 2;
+  } else
+#endif
+    chip8_execute(chip, 1);
+
+  uint8_t x = (opcode >> 8) & 0xF;
+  *e = (trace_entry){ .pc = pc, .opcode = opcode, .I = chip->I, .x = x, .vx = chip->V[x],
+                      .vf = chip->V[0xF], .sp = chip->sp, .delay_timer = chip->delay_timer,
+                      .sound_timer = chip->sound_timer };
+}
+
+bool trace_read(trace_reader* reader, trace_block* block) {
+  while (reader->remaining == 0) {
+    if (!readRecord(reader))
+      return false;
+  }
+
+  uint32_t count = reader->remaining < READ_ENTRIES ? reader->remaining : READ_ENTRIES;
+  for (uint32_t k = 0; k < count; k++)
+    replay(reader, &reader->decoded[k]);
+
+  block->first = reader->next;
+  block->count = count;
+  block->entries = reader->decoded;
+  reader->next += count;
+  reader->remaining -= count;
+
+  // the whole call ran again, it has to end where it did when traced
+  block->diverged = reader->remaining == 0 && (reader->flags & RECORD_UNFINISHED) == 0 &&
+                    stateHash(&reader->chip) != reader->hash;
+  return true;
+}
+
+bool trace_complete(const trace_reader* reader, uint64_t* entries) {
+  if (reader->complete && entries != NULL)
+    *entries = reader->entries;
+  return reader->complete;
+}
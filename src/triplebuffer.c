@@ -0,0 +1,39 @@
+#include "triplebuffer.h"
+
+#include <string.h>
+
+#define TRIPLEBUFFER_FRESH 0x4
+#define TRIPLEBUFFER_INDEX 0x3
+
+_Static_assert(sizeof(((chip8_frame*)0)->gfx) == sizeof(((chip8*)0)->gfx),
+               "chip8_frame.gfx must mirror chip8.gfx");
+
+void triplebuffer_init(triplebuffer* tb) {
+  memset(tb->slots, 0x0, sizeof(tb->slots));
+  tb->back = 0;
+  atomic_init(&tb->middle, 1);
+  tb->front = 2;
+}
+
+chip8_frame* triplebuffer_back(triplebuffer* tb) {
+  return &tb->slots[tb->back];
+}
+
+void triplebuffer_publish(triplebuffer* tb) {
+  uint_fast8_t previous = atomic_exchange_explicit(&tb->middle, tb->back | TRIPLEBUFFER_FRESH,
+                                                   memory_order_acq_rel);
+  tb->back = previous & TRIPLEBUFFER_INDEX;
+}
+
+bool triplebuffer_consume(triplebuffer* tb) {
+  if (!(atomic_load_explicit(&tb->middle, memory_order_relaxed) & TRIPLEBUFFER_FRESH))
+    return false;
+
+  uint_fast8_t previous = atomic_exchange_explicit(&tb->middle, tb->front, memory_order_acq_rel);
+  tb->front = previous & TRIPLEBUFFER_INDEX;
+  return true;
+}
+
+const chip8_frame* triplebuffer_front(const triplebuffer* tb) {
+  return &tb->slots[tb->front];
+}
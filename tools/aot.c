@@ -0,0 +1,480 @@
+// chip8-aot: translates ROMs ahead of time into C, one function per basic
+// block, and compiles each into the cache chip8_aot_load reads from.
+//
+// Blocks start at PROGRAM_START and at every address reachable from there
+// through jumps, calls and skips. A block ends with a jump, call, return,
+// skip, BNNN, memory store or key wait. DXYN, the key ops, the SUPER-CHIP
+// and XO-CHIP display, flag and audio ops and invalid opcodes are handed
+// to the interpreter from inside the block. Only code memory, the first
+// CODE_MEMORY bytes, is translated.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "aot.h"
+#include "chip8.h"
+
+#define ROM_SIZE (MAX_MEMORY - PROGRAM_START)
+#define MAX_BLOCK_OPS 64
+
+#ifndef CHIP8_INCLUDE_DIR
+#define CHIP8_INCLUDE_DIR "include"
+#endif
+
+typedef enum {
+  ACTION_INLINE,                  // translated, the block goes on
+  ACTION_END,                     // translated, ends the block
+  ACTION_CALL,                    // interpreted, the block goes on
+  ACTION_CALL_END,                // interpreted, ends the block
+} op_action;
+
+typedef struct {
+  uint16_t start;
+  uint16_t end;
+  uint16_t count;
+  uint16_t interpreted;
+  uint16_t lastOpcode;
+  uint8_t stores;
+} aot_block;
+
+typedef struct {
+  const uint8_t* rom;
+  size_t size;
+
+  bool leader[CODE_MEMORY];
+  uint16_t worklist[CODE_MEMORY];
+  size_t pending;
+
+  aot_block blocks[CODE_MEMORY];
+  size_t blockCount;
+} translation;
+
+static void usage(const char* program) {
+  fprintf(stderr, "Usage: %s [--cache <dir>] [--cc <compiler>] [--include <chip8 include dir>] [--keep-source] <ROM files...>.\n", program);
+  exit(EXIT_FAILURE);
+}
+
+static uint8_t* readFile(const char* path, size_t* size) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  uint8_t* buffer = malloc(ROM_SIZE + 1);
+  size_t read = buffer != NULL ? fread(buffer, 1, ROM_SIZE + 1, file) : 0;
+  fclose(file);
+
+  // same limits as chip8_load
+  if (read == 0 || read > ROM_SIZE) {
+    free(buffer);
+    return NULL;
+  }
+
+  *size = read;
+  return buffer;
+}
+
+static bool inRom(const translation* t, uint32_t address) {
+  return address >= PROGRAM_START && address + 1 < PROGRAM_START + t->size &&
+         address + 1 < CODE_MEMORY;
+}
+
+static chip8_decoded fetch(const translation* t, uint16_t address) {
+  const uint8_t* at = t->rom + (address - PROGRAM_START);
+  return chip8_decode((uint16_t)((at[0] << 8) | at[1]));
+}
+
+static void addLeader(translation* t, uint32_t address) {
+  if (!inRom(t, address) || t->leader[address])
+    return;
+
+  t->leader[address] = true;
+  t->worklist[t->pending++] = (uint16_t)address;
+}
+
+static op_action actionOf(chip8_op op) {
+  switch (op) {
+    case CHIP8_OP_1NNN:
+    case CHIP8_OP_2NNN:
+    case CHIP8_OP_00EE:
+    case CHIP8_OP_3XNN:
+    case CHIP8_OP_4XNN:
+    case CHIP8_OP_5XY0:
+    case CHIP8_OP_9XY0:
+    case CHIP8_OP_BNNN:
+    case CHIP8_OP_FX33:
+    case CHIP8_OP_FX55:
+      return ACTION_END;
+    case CHIP8_OP_DECODE:
+    case CHIP8_OP_INVALID:
+    case CHIP8_OP_DXYN:
+    case CHIP8_OP_00CN:
+    case CHIP8_OP_00DN:
+    case CHIP8_OP_00FB:
+    case CHIP8_OP_00FC:
+    case CHIP8_OP_00FE:
+    case CHIP8_OP_00FF:
+    case CHIP8_OP_5XY3:
+    case CHIP8_OP_FN01:
+    case CHIP8_OP_F002:
+    case CHIP8_OP_FX30:
+    case CHIP8_OP_FX3A:
+    case CHIP8_OP_FX75:
+    case CHIP8_OP_FX85:
+      return ACTION_CALL;
+    case CHIP8_OP_EX9E:
+    case CHIP8_OP_EXA1:
+    case CHIP8_OP_FX0A:
+    case CHIP8_OP_00FD:
+    case CHIP8_OP_5XY2:
+    case CHIP8_OP_F000:
+      return ACTION_CALL_END;
+    default:
+      return ACTION_INLINE;
+  }
+}
+
+// the addresses control can reach after the instruction at address
+static void addSuccessors(translation* t, const chip8_decoded* d, uint16_t address) {
+  switch (d->op) {
+    case CHIP8_OP_1NNN:
+      addLeader(t, d->nnn);
+      break;
+    case CHIP8_OP_2NNN:
+      addLeader(t, d->nnn);
+      addLeader(t, address + 2);      // where the matching 00EE returns
+      break;
+    case CHIP8_OP_3XNN:
+    case CHIP8_OP_4XNN:
+    case CHIP8_OP_5XY0:
+    case CHIP8_OP_9XY0:
+    case CHIP8_OP_EX9E:
+    case CHIP8_OP_EXA1:
+      addLeader(t, address + 2);
+      addLeader(t, address + 4);
+      break;
+    case CHIP8_OP_F000:
+      addLeader(t, address + 4);      // past the address it loads
+      break;
+    case CHIP8_OP_00EE:
+    case CHIP8_OP_BNNN:
+    case CHIP8_OP_00FD:
+      break;
+    default:
+      addLeader(t, address + 2);
+      break;
+  }
+}
+
+static void formBlock(translation* t, uint16_t start) {
+  aot_block block = { .start = start, .end = start };
+
+  for (uint16_t pc = start; block.count < MAX_BLOCK_OPS && inRom(t, pc); pc += 2) {
+    chip8_decoded d = fetch(t, pc);
+    op_action action = actionOf(d.op);
+
+    block.count++;
+    block.end = pc + 2;
+    block.lastOpcode = d.opcode;
+    if (action == ACTION_CALL || action == ACTION_CALL_END)
+      block.interpreted++;
+
+    if (action == ACTION_END || action == ACTION_CALL_END) {
+      if (d.op == CHIP8_OP_FX33)
+        block.stores = 3;
+      else if (d.op == CHIP8_OP_FX55)
+        block.stores = d.x + 1;
+
+      addSuccessors(t, &d, pc);
+      break;
+    }
+
+    // ran into the size limit, carry on in a new block
+    if (block.count == MAX_BLOCK_OPS)
+      addLeader(t, block.end);
+  }
+
+  if (block.count > 0)
+    t->blocks[t->blockCount++] = block;
+}
+
+static void buildGraph(translation* t) {
+  addLeader(t, PROGRAM_START);
+
+  while (t->pending > 0)
+    formBlock(t, t->worklist[--t->pending]);
+}
+
+// C statements for one instruction, mirroring its handler in chip8.c
+static void emitOp(FILE* out, const chip8_decoded* d, uint16_t address) {
+  unsigned x = d->x;
+  unsigned y = d->y;
+  unsigned next = address + 2;
+
+  switch (d->op) {
+    case CHIP8_OP_00E0:
+      fprintf(out, "  for (int plane = 0; plane < PLANES; plane++)\n");
+      fprintf(out, "    if (chip->planes & (1 << plane))\n");
+      fprintf(out, "      memset(chip->gfx[plane], 0x0, sizeof(chip->gfx[plane]));\n");
+      fprintf(out, "  chip->drawFlag = true;\n");
+      break;
+    case CHIP8_OP_00EE:
+      fprintf(out, "  chip->sp--;\n  pc = chip->stack[chip->sp];\n");
+      break;
+    case CHIP8_OP_1NNN:
+      fprintf(out, "  pc = 0x%03X;\n", d->nnn);
+      break;
+    case CHIP8_OP_2NNN:
+      fprintf(out, "  chip->stack[chip->sp] = 0x%03X;\n  chip->sp++;\n  pc = 0x%03X;\n", next, d->nnn);
+      break;
+    case CHIP8_OP_3XNN:
+      fprintf(out, "  pc = V[%u] == 0x%02X ? 0x%03X : 0x%03X;\n", x, d->nn, next + 2, next);
+      break;
+    case CHIP8_OP_4XNN:
+      fprintf(out, "  pc = V[%u] != 0x%02X ? 0x%03X : 0x%03X;\n", x, d->nn, next + 2, next);
+      break;
+    case CHIP8_OP_5XY0:
+      fprintf(out, "  pc = V[%u] == V[%u] ? 0x%03X : 0x%03X;\n", x, y, next + 2, next);
+      break;
+    case CHIP8_OP_9XY0:
+      fprintf(out, "  pc = V[%u] != V[%u] ? 0x%03X : 0x%03X;\n", x, y, next + 2, next);
+      break;
+    case CHIP8_OP_6XNN:
+      fprintf(out, "  V[%u] = 0x%02X;\n", x, d->nn);
+      break;
+    case CHIP8_OP_7XNN:
+      fprintf(out, "  V[%u] += 0x%02X;\n", x, d->nn);
+      break;
+    case CHIP8_OP_8XY0:
+      fprintf(out, "  V[%u] = V[%u];\n", x, y);
+      break;
+    case CHIP8_OP_8XY1:
+      fprintf(out, "  V[%u] |= V[%u];\n", x, y);
+      break;
+    case CHIP8_OP_8XY2:
+      fprintf(out, "  V[%u] &= V[%u];\n", x, y);
+      break;
+    case CHIP8_OP_8XY3:
+      fprintf(out, "  V[%u] ^= V[%u];\n", x, y);
+      break;
+    case CHIP8_OP_8XY4:
+      fprintf(out, "  sum = V[%u] + V[%u];\n  V[15] = sum > 0xFF;\n  V[%u] = sum & 0xFF;\n", x, y, x);
+      break;
+    case CHIP8_OP_8XY5:
+      fprintf(out, "  V[15] = V[%u] >= V[%u];\n  V[%u] = V[%u] - V[%u];\n", x, y, x, x, y);
+      break;
+    case CHIP8_OP_8XY6:
+      fprintf(out, "  V[15] = V[%u] & 0x1;\n  V[%u] >>= 1;\n", x, x);
+      break;
+    case CHIP8_OP_8XY7:
+      fprintf(out, "  V[15] = V[%u] >= V[%u];\n  V[%u] = V[%u] - V[%u];\n", y, x, x, y, x);
+      break;
+    case CHIP8_OP_8XYE:
+      fprintf(out, "  V[15] = (V[%u] >> 7) & 0x1;\n  V[%u] <<= 1;\n", x, x);
+      break;
+    case CHIP8_OP_ANNN:
+      fprintf(out, "  I = 0x%03X;\n", d->nnn);
+      break;
+    case CHIP8_OP_BNNN:
+      fprintf(out, "  pc = V[0] + 0x%03X;\n", d->nnn);
+      break;
+    case CHIP8_OP_CXNN:
+      fprintf(out, "  V[%u] = chip8_random(&chip->rng) & 0x%02X;\n", x, d->nn);
+      break;
+    case CHIP8_OP_FX07:
+      fprintf(out, "  V[%u] = chip->delay_timer;\n", x);
+      break;
+    case CHIP8_OP_FX15:
+      fprintf(out, "  chip->delay_timer = V[%u];\n", x);
+      break;
+    case CHIP8_OP_FX18:
+      fprintf(out, "  chip->sound_timer = V[%u];\n", x);
+      break;
+    case CHIP8_OP_FX1E:
+      fprintf(out, "  I += V[%u];\n", x);
+      break;
+    case CHIP8_OP_FX29:
+      fprintf(out, "  I = V[%u] * 0x5;\n", x);
+      break;
+    case CHIP8_OP_FX33:
+      fprintf(out, "  chip->memory[I] = V[%u] / 100;\n", x);
+      fprintf(out, "  chip->memory[I + 1] = (V[%u] / 10) %% 10;\n", x);
+      fprintf(out, "  chip->memory[I + 2] = V[%u] %% 10;\n", x);
+      fprintf(out, "  pc = 0x%03X;\n", next);
+      break;
+    case CHIP8_OP_FX55:
+      for (unsigned i = 0; i <= x; i++)
+        fprintf(out, "  chip->memory[I + %u] = V[%u];\n", i, i);
+      fprintf(out, "  pc = 0x%03X;\n", next);
+      break;
+    case CHIP8_OP_FX65:
+      for (unsigned i = 0; i <= x; i++)
+        fprintf(out, "  V[%u] = chip->memory[I + %u];\n", i, i);
+      break;
+    default:
+      // left to the interpreter, which only ever changes V, I and pc here
+      fprintf(out, "  memcpy(chip->V, V, sizeof(V));\n  chip->I = I;\n  chip->pc = 0x%03X;\n", address);
+      fprintf(out, "  interpret(chip, 1);\n");
+      fprintf(out, "  memcpy(V, chip->V, sizeof(V));\n  I = chip->I;\n");
+      if (actionOf(d->op) == ACTION_CALL_END)
+        fprintf(out, "  pc = chip->pc;\n");
+      break;
+  }
+}
+
+static void emitBlock(FILE* out, const translation* t, const aot_block* block) {
+  fprintf(out, "static void block_%03X(chip8* chip, chip8_aot_interpret interpret) {\n", block->start);
+  fprintf(out, "  uint8_t V[REGISTERS_SIZE];\n");
+  fprintf(out, "  uint16_t I = chip->I;\n");
+  fprintf(out, "  uint16_t pc = 0x%03X;\n", block->end);
+  fprintf(out, "  uint16_t sum;\n");
+  fprintf(out, "  memcpy(V, chip->V, sizeof(V));\n\n");
+
+  for (uint16_t pc = block->start; pc < block->end; pc += 2) {
+    chip8_decoded d = fetch(t, pc);
+    fprintf(out, "  // %03X: %04X %s\n", pc, d.opcode, chip8_opName(d.op));
+    emitOp(out, &d, pc);
+  }
+
+  fprintf(out, "\n  (void)interpret;\n  (void)sum;\n");
+  fprintf(out, "  memcpy(chip->V, V, sizeof(V));\n");
+  fprintf(out, "  chip->I = I;\n");
+  fprintf(out, "  chip->pc = pc;\n");
+  fprintf(out, "}\n\n");
+}
+
+static bool emitTranslation(const translation* t, const char* romPath, uint64_t hash, const char* path) {
+  FILE* out = fopen(path, "w");
+  if (out == NULL)
+    return false;
+
+  fprintf(out, "// generated by chip8-aot from %s, do not edit\n\n", romPath);
+  fprintf(out, "#include <string.h>\n\n#include \"aot.h\"\n\n");
+
+  fprintf(out, "static const uint8_t rom[%zu] = {", t->size);
+  for (size_t i = 0; i < t->size; i++)
+    fprintf(out, "%s0x%02X,", i % 16 == 0 ? "\n  " : " ", t->rom[i]);
+  fprintf(out, "\n};\n\n");
+
+  for (size_t i = 0; i < t->blockCount; i++)
+    emitBlock(out, t, &t->blocks[i]);
+
+  fprintf(out, "static const chip8_aot_block blocks[%zu] = {\n", t->blockCount);
+  for (size_t i = 0; i < t->blockCount; i++) {
+    const aot_block* b = &t->blocks[i];
+    fprintf(out, "  { block_%03X, 0x%03X, 0x%03X, %u, %u, 0x%04X, %u },\n",
+            b->start, b->start, b->end, b->count, b->interpreted, b->lastOpcode, b->stores);
+  }
+  fprintf(out, "};\n\n");
+
+  fprintf(out, "const chip8_aot_module chip8_aot_translation = {\n");
+  fprintf(out, "  CHIP8_AOT_ABI, sizeof(chip8), 0x%016" PRIx64 "ULL, %zu, rom, %zu, blocks,\n", hash, t->size, t->blockCount);
+  fprintf(out, "};\n");
+
+  return fclose(out) == 0;
+}
+
+static bool compile(const char* compiler, const char* includeDir, const char* source, const char* library) {
+  char command[8192];
+
+  // the chip8 struct layout depends on CHIP8_PROFILE, match this build
+#ifdef CHIP8_PROFILE
+  const char* defines = "-DCHIP8_PROFILE";
+#else
+  const char* defines = "";
+#endif
+
+  int length = snprintf(command, sizeof(command),
+                        "%s -std=c11 -O2 -shared -fPIC %s -I\"%s\" -o \"%s\" \"%s\"",
+                        compiler, defines, includeDir, library, source);
+  if (length < 0 || (size_t)length >= sizeof(command))
+    return false;
+
+  return system(command) == 0;
+}
+
+int main(int argc, char* argv[]) {
+  const char* cacheDir = getenv("CHIP8_AOT_CACHE");
+  const char* compiler = getenv("CC");
+  const char* includeDir = CHIP8_INCLUDE_DIR;
+  bool keepSource = false;
+  int firstRom = argc;
+
+  if (cacheDir == NULL)
+    cacheDir = "chip8-aot-cache";
+  if (compiler == NULL)
+    compiler = "cc";
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+      cacheDir = argv[++i];
+    } else if (strcmp(argv[i], "--cc") == 0 && i + 1 < argc) {
+      compiler = argv[++i];
+    } else if (strcmp(argv[i], "--include") == 0 && i + 1 < argc) {
+      includeDir = argv[++i];
+    } else if (strcmp(argv[i], "--keep-source") == 0) {
+      keepSource = true;
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+    } else {
+      firstRom = i;
+      break;
+    }
+  }
+
+  if (firstRom == argc)
+    usage(argv[0]);
+
+  if (mkdir(cacheDir, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Could not create cache directory \"%s\".\n", cacheDir);
+    return EXIT_FAILURE;
+  }
+
+  static translation t;
+  int failed = 0;
+
+  for (int i = firstRom; i < argc; i++) {
+    size_t size;
+    uint8_t* rom = readFile(argv[i], &size);
+    if (rom == NULL) {
+      fprintf(stderr, "Could not read ROM \"%s\".\n", argv[i]);
+      failed++;
+      continue;
+    }
+
+    memset(&t, 0x0, sizeof(t));
+    t.rom = rom;
+    t.size = size;
+    buildGraph(&t);
+
+    uint64_t hash = chip8_romHash(rom, size);
+    char library[4096], source[4096], temporary[4096];
+    chip8_aot_cachePath(library, sizeof(library), cacheDir, hash);
+    snprintf(source, sizeof(source), "%.*s.c", (int)(strlen(library) - 3), library);
+    snprintf(temporary, sizeof(temporary), "%s.tmp", library);
+
+    // build next to the final name and rename, so loaders never see half a file
+    bool ok = emitTranslation(&t, argv[i], hash, source) &&
+              compile(compiler, includeDir, source, temporary) &&
+              rename(temporary, library) == 0;
+
+    if (ok) {
+      printf("%s\t%016" PRIx64 "\t%zu blocks\t%s\n", argv[i], hash, t.blockCount, library);
+    } else {
+      fprintf(stderr, "Could not translate \"%s\".\n", argv[i]);
+      remove(temporary);
+      failed++;
+    }
+
+    if (!keepSource)
+      remove(source);
+    free(rom);
+  }
+
+  return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,480 @@
+// chip8-batch: runs (ROM, input script, frame count) jobs headless across
+// all cores and prints the final frame hash, instruction count and wall
+// time of each job.
+//
+// --jit runs the jobs on the x86-64 recompiler instead of the interpreter,
+// --jit-diff runs both side by side on one thread and fails a job at the
+// first frame where their states differ. --aot <cache> runs each ROM from
+// its chip8-aot translation. Frames where the ROM waits for a key with its
+// timers stopped are skipped up to the next input event.
+//
+// --quirks <profile> runs the jobs with another quirk profile (quirks.h),
+// --quirks-db <file> looks each ROM up in a quirk database first.
+//
+// --profile <file> writes the summed opcode and hot-PC profile of all jobs
+// there (profile.h), in a core built with -DCHIP8_PROFILING=ON.
+//
+// Jobs file, one job per line ('#' starts a comment):
+//   <rom> <input script, input log or -> <frames or ->
+//
+// Input script, one change of the keypad per line:
+//   <frame> <key mask in hex, bit N is key N>
+//
+// Input logs are the binary files chip8-emu --record writes (inputlog.h).
+// A job replaying one runs with the log's seed, ipf and quirk profile.
+// A frame count of - runs until the last input event, or the end of the
+// recording.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aot.h"
+#include "chip8.h"
+#include "inputlog.h"
+#include "jit.h"
+#include "pool.h"
+#include "profile.h"
+#include "quirks.h"
+#include "scheduler.h"
+
+typedef struct {
+  char* rom;
+  char* script;                   // NULL without input
+  uint32_t frames;                // 0 for the length of the input
+
+  bool ok;
+  char error[128];
+  uint64_t instructions;
+  uint64_t hash;
+  double wallMs;
+} batch_job;
+
+typedef enum {
+  MODE_INTERPRET,
+  MODE_JIT,
+  MODE_JIT_DIFF,
+  MODE_AOT,
+} batch_mode;
+
+typedef struct {
+  batch_job* jobs;
+  size_t count;
+  chip8* instances;               // one per worker, recycled across jobs
+  chip8* references;              // interpreter twins for MODE_JIT_DIFF
+  chip8_jit** jits;
+  chip8* profiles;                // one per worker summing its jobs, or NULL
+  const char* aotCache;
+  const char* quirksDb;           // NULL, or a database to look ROMs up in
+  chip8_quirks quirks;
+  batch_mode mode;
+  uint32_t ipf;
+} batch;
+
+static void usage(const char* program) {
+  fprintf(stderr, "Usage: %s [--threads <n>] [--ipf <instructions per frame>] [--jit | --jit-diff | --aot <cache dir>] "
+                  "[--quirks <profile>] [--quirks-db <file>] [--profile <file>] <jobs file>.\n", program);
+  exit(EXIT_FAILURE);
+}
+
+static uint8_t* readFile(const char* path, size_t* size) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  fseek(file, 0L, SEEK_END);
+  long fileSize = ftell(file);
+  rewind(file);
+
+  uint8_t* buffer = fileSize > 0 ? malloc(fileSize) : NULL;
+  if (buffer == NULL || fread(buffer, 1, fileSize, file) != (size_t)fileSize) {
+    free(buffer);
+    fclose(file);
+    return NULL;
+  }
+
+  fclose(file);
+  *size = (size_t)fileSize;
+  return buffer;
+}
+
+static bool readScript(const char* path, inputlog* input) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL)
+    return false;
+
+  bool ok = true;
+  char line[256];
+  while (ok && fgets(line, sizeof(line), file) != NULL) {
+    unsigned frame, keys;
+    if (line[0] == '#' || sscanf(line, "%u %x", &frame, &keys) != 2)
+      continue;
+
+    // the keys are held from the frame on, whatever the last one was
+    ok = inputlog_record(input, frame, (uint16_t)keys);
+  }
+
+  fclose(file);
+  return ok;
+}
+
+// a binary input log, or else a text script played with the batch's ipf
+static bool readInput(const char* path, inputlog* input, uint32_t ipf) {
+  if (inputlog_load(input, path))
+    return true;
+
+  inputlog_init(input, ipf, CHIP8_DEFAULT_SEED, 0);
+  if (readScript(path, input))
+    return true;
+
+  inputlog_free(input);
+  return false;
+}
+
+static double elapsedMs(const struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// NULL when both states match, otherwise the first field that differs
+static const char* compareStates(const chip8* chip, const chip8* reference) {
+  chip8_state a, b;
+  // zeroed so padding never counts as a difference
+  memset(&a, 0x0, sizeof(a));
+  memset(&b, 0x0, sizeof(b));
+  chip8_snapshot(chip, &a);
+  chip8_snapshot(reference, &b);
+  // where the two wrote is bookkeeping, only what they hold counts
+  memset(a.dirty, 0x0, sizeof(a.dirty));
+  memset(b.dirty, 0x0, sizeof(b.dirty));
+
+  if (memcmp(&a, &b, sizeof(a)) == 0)
+    return NULL;
+  if (a.pc != b.pc)
+    return "pc";
+  if (memcmp(a.V, b.V, sizeof(a.V)) != 0)
+    return "V registers";
+  if (a.I != b.I)
+    return "I";
+  if (memcmp(a.memory, b.memory, sizeof(a.memory)) != 0)
+    return "memory";
+  if (memcmp(a.gfx, b.gfx, sizeof(a.gfx)) != 0 || a.hires != b.hires || a.planes != b.planes)
+    return "display";
+  if (memcmp(a.flags, b.flags, sizeof(a.flags)) != 0)
+    return "flags";
+  if (memcmp(a.pattern, b.pattern, sizeof(a.pattern)) != 0 || a.pitch != b.pitch)
+    return "audio";
+  if (a.delay_timer != b.delay_timer || a.sound_timer != b.sound_timer)
+    return "timers";
+  return "stack";
+}
+
+static void runJob(void* context, size_t index, unsigned worker) {
+  batch* b = context;
+  batch_job* job = &b->jobs[index];
+  chip8* chip = &b->instances[worker];
+  chip8* reference = b->mode == MODE_JIT_DIFF ? &b->references[worker] : NULL;
+  chip8_jit* jit = b->mode == MODE_JIT || b->mode == MODE_JIT_DIFF ? b->jits[worker] : NULL;
+
+  size_t romSize;
+  uint8_t* rom = readFile(job->rom, &romSize);
+  if (rom == NULL) {
+    snprintf(job->error, sizeof(job->error), "could not read ROM");
+    return;
+  }
+
+  inputlog input;
+  inputlog_init(&input, b->ipf, CHIP8_DEFAULT_SEED, 0);
+  if (job->script != NULL && !readInput(job->script, &input, b->ipf)) {
+    snprintf(job->error, sizeof(job->error), "could not read input");
+    free(rom);
+    return;
+  }
+
+  uint64_t romHash = chip8_romHash(rom, romSize);
+  if (input.romHash != 0 && input.romHash != romHash) {
+    snprintf(job->error, sizeof(job->error), "input log recorded with another ROM");
+    inputlog_free(&input);
+    free(rom);
+    return;
+  }
+
+  uint32_t ipf = input.ipf;
+
+  // a recorded log replays with the profile it was recorded with
+  chip8_quirks quirks = b->quirksDb != NULL ? quirks_lookup(b->quirksDb, romHash, b->quirks) : b->quirks;
+  if (input.romHash != 0)
+    quirks = (chip8_quirks)input.quirks;
+  if (job->frames == 0)
+    job->frames = input.frames;
+  if (job->frames == 0) {
+    snprintf(job->error, sizeof(job->error), "no input to take the frame count from");
+    inputlog_free(&input);
+    free(rom);
+    return;
+  }
+
+  chip8_initialize(chip);
+  if (!chip8_loadBuffer(chip, rom, romSize)) {
+    snprintf(job->error, sizeof(job->error), "invalid ROM size");
+    inputlog_free(&input);
+    free(rom);
+    return;
+  }
+  chip8_seed(chip, input.seed);
+  chip->quirks = quirks;
+
+  if (jit != NULL)
+    chip8_jit_reset(jit);
+
+  chip8_aot* aot = NULL;
+  if (b->mode == MODE_AOT && (aot = chip8_aot_load(chip, b->aotCache, rom, romSize)) == NULL) {
+    snprintf(job->error, sizeof(job->error), "no AOT translation in the cache");
+    inputlog_free(&input);
+    free(rom);
+    return;
+  }
+  if (reference != NULL) {
+    chip8_initialize(reference);
+    chip8_loadBuffer(reference, rom, romSize);
+    chip8_seed(reference, input.seed);
+    reference->quirks = quirks;
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  const inputlog_event* events = input.events;
+  size_t eventCount = input.count;
+  size_t next = 0;
+  for (uint32_t frame = 0; frame < job->frames; frame++) {
+    while (next < eventCount && events[next].frame <= frame) {
+      chip8_setKeys(chip, events[next].keys);
+      if (reference != NULL)
+        chip8_setKeys(reference, events[next].keys);
+      next++;
+    }
+
+    if (reference == NULL) {
+      if (aot != NULL)
+        chip8_aot_runFrame(aot, ipf);
+      else if (jit != NULL)
+        chip8_jit_runFrame(jit, ipf);
+      else
+        chip8_runFrame(chip, ipf);
+
+      // nothing changes before the next input event, jump straight to it
+      if (chip8_waitsForInput(chip)) {
+        uint32_t until = next < eventCount && events[next].frame < job->frames ? events[next].frame : job->frames;
+        if (until > frame + 1) {
+          chip8_skipFrames(chip, ipf, until - frame - 1);
+          frame = until - 1;
+        }
+      }
+      continue;
+    }
+
+    // both draw CXNN's numbers from their own generator, seeded alike
+    chip8_jit_runFrame(jit, ipf);
+    chip8_runFrame(reference, ipf);
+
+    const char* field = compareStates(chip, reference);
+    if (field != NULL) {
+      snprintf(job->error, sizeof(job->error),
+               "JIT diverged in %s at frame %" PRIu32 " (pc 0x%03X, interpreter 0x%03X)",
+               field, frame, chip->pc, reference->pc);
+      inputlog_free(&input);
+      free(rom);
+      return;
+    }
+  }
+
+  job->wallMs = elapsedMs(&start);
+  job->instructions = chip->cycles;
+  job->hash = chip8_frameHash(chip);
+  job->ok = true;
+#ifdef CHIP8_PROFILE
+  if (b->profiles != NULL)
+    chip8_profileMerge(&b->profiles[worker], chip);
+#endif
+
+  chip8_aot_unload(aot);
+
+  inputlog_free(&input);
+  free(rom);
+}
+
+static batch_job* readJobs(const char* path, size_t* count) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL)
+    return NULL;
+
+  size_t capacity = 64;
+  batch_job* jobs = malloc(capacity * sizeof(*jobs));
+  *count = 0;
+
+  char line[4096];
+  unsigned lineNumber = 0;
+  while (jobs != NULL && fgets(line, sizeof(line), file) != NULL) {
+    lineNumber++;
+
+    char rom[2048], script[2048], frames[32];
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+    if (sscanf(line, "%2047s %2047s %31s", rom, script, frames) != 3 ||
+        (strcmp(frames, "-") != 0 && strtoul(frames, NULL, 10) == 0)) {
+      fprintf(stderr, "%s:%u: expected \"<rom> <input script, input log or -> <frames or ->\".\n", path, lineNumber);
+      continue;
+    }
+
+    if (*count == capacity) {
+      capacity *= 2;
+      batch_job* grown = realloc(jobs, capacity * sizeof(*jobs));
+      if (grown == NULL) {
+        free(jobs);
+        jobs = NULL;
+        break;
+      }
+      jobs = grown;
+    }
+
+    jobs[(*count)++] = (batch_job){
+      .rom = strdup(rom),
+      .script = strcmp(script, "-") == 0 ? NULL : strdup(script),
+      .frames = strcmp(frames, "-") == 0 ? 0 : (uint32_t)strtoul(frames, NULL, 10),
+    };
+  }
+
+  fclose(file);
+  return jobs;
+}
+
+int main(int argc, char* argv[]) {
+  const char* jobsPath = NULL;
+  unsigned threads = pool_defaultWorkers();
+  uint32_t ipf = DEFAULT_IPF;
+  batch_mode mode = MODE_INTERPRET;
+  const char* aotCache = NULL;
+  chip8_quirks quirks = CHIP8_QUIRKS_DEFAULT;
+  const char* quirksDb = NULL;
+  const char* profilePath = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = (unsigned)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc) {
+      ipf = (uint32_t)strtoul(argv[++i], NULL, 10);
+      if (ipf == 0)
+        usage(argv[0]);
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      mode = MODE_JIT;
+    } else if (strcmp(argv[i], "--jit-diff") == 0) {
+      mode = MODE_JIT_DIFF;
+    } else if (strcmp(argv[i], "--aot") == 0 && i + 1 < argc) {
+      mode = MODE_AOT;
+      aotCache = argv[++i];
+    } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+      if (!quirks_parse(argv[++i], &quirks))
+        usage(argv[0]);
+    } else if (strcmp(argv[i], "--quirks-db") == 0 && i + 1 < argc) {
+      quirksDb = argv[++i];
+    } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      profilePath = argv[++i];
+    } else if (argv[i][0] == '-' || jobsPath != NULL) {
+      usage(argv[0]);
+    } else {
+      jobsPath = argv[i];
+    }
+  }
+
+  if (jobsPath == NULL)
+    usage(argv[0]);
+#ifndef CHIP8_PROFILE
+  if (profilePath != NULL) {
+    fprintf(stderr, "--profile needs a core built with -DCHIP8_PROFILING=ON.\n");
+    return EXIT_FAILURE;
+  }
+#endif
+
+  batch b = { .ipf = ipf, .mode = mode, .aotCache = aotCache, .quirks = quirks, .quirksDb = quirksDb };
+  b.jobs = readJobs(jobsPath, &b.count);
+  if (b.jobs == NULL) {
+    fprintf(stderr, "Could not read jobs file \"%s\".\n", jobsPath);
+    return EXIT_FAILURE;
+  }
+
+  pool* workers = pool_create(threads);
+  unsigned instances = pool_workers(workers);
+  b.instances = calloc(instances, sizeof(chip8));
+  b.references = mode == MODE_JIT_DIFF ? calloc(instances, sizeof(chip8)) : NULL;
+  if (b.instances == NULL || (mode == MODE_JIT_DIFF && b.references == NULL)) {
+    fprintf(stderr, "Not enough memory for %u instances.\n", instances);
+    return EXIT_FAILURE;
+  }
+
+  if (profilePath != NULL && (b.profiles = calloc(instances, sizeof(chip8))) == NULL) {
+    fprintf(stderr, "Not enough memory for %u instances.\n", instances);
+    return EXIT_FAILURE;
+  }
+
+  if (mode == MODE_JIT || mode == MODE_JIT_DIFF) {
+    b.jits = calloc(instances, sizeof(*b.jits));
+    for (unsigned i = 0; b.jits != NULL && i < instances; i++) {
+      b.jits[i] = chip8_jit_create(&b.instances[i]);
+      if (b.jits[i] == NULL) {
+        fprintf(stderr, "The JIT is not supported on this platform.\n");
+        return EXIT_FAILURE;
+      }
+    }
+    if (b.jits == NULL) {
+      fprintf(stderr, "Not enough memory for %u instances.\n", instances);
+      return EXIT_FAILURE;
+    }
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pool_run(workers, b.count, runJob, &b);
+  double totalMs = elapsedMs(&start);
+
+  int failed = 0;
+  printf("# rom\tframes\tinstructions\thash\twall_ms\n");
+  for (size_t i = 0; i < b.count; i++) {
+    batch_job* job = &b.jobs[i];
+    if (job->ok) {
+      printf("%s\t%" PRIu32 "\t%" PRIu64 "\t%016" PRIx64 "\t%.3f\n",
+             job->rom, job->frames, job->instructions, job->hash, job->wallMs);
+    } else {
+      printf("%s\t%" PRIu32 "\terror: %s\n", job->rom, job->frames, job->error);
+      failed++;
+    }
+    free(job->rom);
+    free(job->script);
+  }
+  fprintf(stderr, "%zu jobs on %u threads in %.1f ms.\n", b.count, pool_workers(workers), totalMs);
+
+#ifdef CHIP8_PROFILE
+  if (b.profiles != NULL) {
+    for (unsigned i = 1; i < instances; i++)
+      chip8_profileMerge(&b.profiles[0], &b.profiles[i]);
+    if (!chip8_profileDump(&b.profiles[0], profilePath))
+      failed++;
+  }
+#endif
+
+  pool_destroy(workers);
+  for (unsigned i = 0; b.jits != NULL && i < instances; i++)
+    chip8_jit_destroy(b.jits[i]);
+  free(b.jits);
+  free(b.references);
+  free(b.profiles);
+  free(b.instances);
+  free(b.jobs);
+
+  return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,417 @@
+// chip8-bench: dispatch, sprite drawing and whole-ROM throughput of the
+// core, reported as JSON on stdout so results can be tracked over time.
+//
+// Every benchmark runs --frames frames of --ipf instructions on a fresh
+// instance, --reps times, counting only the instructions that ran, not
+// those idle loops skip. A ROM that goes idle is marked as such and fails
+// the run, as it stopped measuring anything. The only whole ROM bundled
+// is Maze, other ROMs are given as files on the command line and run
+// alongside it. --jit measures the x86-64 recompiler instead of the
+// interpreter, --lanes <n> the lockstep core running n copies of each
+// ROM, counting instructions across all lanes.
+// --trace <file> measures the interpreter with every instruction traced
+// into file (trace.h), dropping what the writer cannot keep up with.
+// --profile <file> writes the opcode and hot-PC profile of every run there
+// (profile.h), in a core built with -DCHIP8_PROFILING=ON.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+#include "jit.h"
+#include "lockstep.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "trace.h"
+
+#define ROM_SIZE (MAX_MEMORY - PROGRAM_START)
+#define MICRO_REPEAT 64
+
+typedef struct {
+  const char* name;
+  uint8_t rom[ROM_SIZE];
+  size_t size;
+} bench_rom;
+
+typedef struct {
+  double mean;
+  double stddev;
+} stat;
+
+// Maze, by David Winter (public domain). It ends in a jump to itself once
+// the screen is full, which would leave nothing but an idle loop to
+// measure, so the 121C at 0x21C is patched into 1200: mazes are drawn over
+// each other for as long as the benchmark runs
+static const uint8_t mazeRom[] = {
+  0x60, 0x00, 0x61, 0x00, 0xA2, 0x22, 0xC2, 0x01, 0x32, 0x01, 0xA2, 0x1E,
+  0xD0, 0x14, 0x70, 0x04, 0x30, 0x40, 0x12, 0x04, 0x60, 0x00, 0x71, 0x04,
+  0x31, 0x20, 0x12, 0x04, 0x12, 0x00, 0x80, 0x40, 0x20, 0x10, 0x20, 0x40,
+  0x80, 0x10,
+};
+
+static void emit(bench_rom* rom, uint16_t opcode) {
+  rom->rom[rom->size++] = opcode >> 8;
+  rom->rom[rom->size++] = opcode & 0xFF;
+}
+
+// closes a synthetic loop by jumping back to the start of the program
+static void loop(bench_rom* rom) {
+  emit(rom, 0x1000 | PROGRAM_START);
+}
+
+static void microLoad(bench_rom* rom) {
+  for (int i = 0; i < MICRO_REPEAT; i++) {
+    emit(rom, 0x6000 | ((i % 15) << 8) | (i & 0xFF));
+    emit(rom, 0x7000 | ((i % 15) << 8) | 0x03);
+  }
+  loop(rom);
+}
+
+static void microArithmetic(bench_rom* rom) {
+  static const uint8_t ops[] = { 0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0xE };
+
+  for (int i = 0; i < MICRO_REPEAT; i++) {
+    uint8_t x = i % 15;
+    uint8_t y = (i + 7) % 15;
+    emit(rom, 0x8000 | (x << 8) | (y << 4) | ops[i % sizeof(ops)]);
+  }
+  loop(rom);
+}
+
+static void microSkip(bench_rom* rom) {
+  // V0 and V1 stay zero, every skip alternates between taken and not taken
+  for (int i = 0; i < MICRO_REPEAT / 4; i++) {
+    emit(rom, 0x3000);            // taken
+    emit(rom, 0x6101);
+    emit(rom, 0x4001);            // taken
+    emit(rom, 0x6101);
+    emit(rom, 0x5010);            // taken
+    emit(rom, 0x6101);
+    emit(rom, 0x9010);            // not taken
+    emit(rom, 0x6200);
+  }
+  loop(rom);
+}
+
+static void microIndex(bench_rom* rom) {
+  for (int i = 0; i < MICRO_REPEAT; i++) {
+    emit(rom, 0xA300 | i);
+    emit(rom, 0xF01E | ((i % 16) << 8));
+    emit(rom, 0xF029 | ((i % 16) << 8));
+  }
+  loop(rom);
+}
+
+static void microMemory(bench_rom* rom) {
+  for (int i = 0; i < MICRO_REPEAT; i++) {
+    emit(rom, 0xA800 | (i * 16));
+    emit(rom, 0xF333);
+    emit(rom, 0xF755);
+    emit(rom, 0xF765);
+  }
+  loop(rom);
+}
+
+static void microFlow(bench_rom* rom) {
+  // call a subroutine that returns right away, then hop through jumps
+  emit(rom, 0x2000 | (PROGRAM_START + 0x100));
+  for (int i = 0; i < MICRO_REPEAT; i++)
+    emit(rom, 0x1000 | (PROGRAM_START + 4 + i * 2));
+  loop(rom);
+
+  rom->size = 0x100;
+  emit(rom, 0x00EE);
+}
+
+static void microTimers(bench_rom* rom) {
+  for (int i = 0; i < MICRO_REPEAT; i++) {
+    emit(rom, 0xF015 | ((i % 16) << 8));
+    emit(rom, 0xF007 | ((i % 16) << 8));
+    emit(rom, 0xF018 | ((i % 16) << 8));
+  }
+  loop(rom);
+}
+
+static void microRandom(bench_rom* rom) {
+  for (int i = 0; i < MICRO_REPEAT; i++)
+    emit(rom, 0xC0FF | ((i % 16) << 8));
+  loop(rom);
+}
+
+// DXYN-heavy: full height sprites at positions that move every draw,
+// including ones clipped at the right and bottom edges
+static void spriteHeavy(bench_rom* rom) {
+  const uint16_t sprite = PROGRAM_START + 0x600;
+
+  emit(rom, 0xA000 | sprite);
+  for (int i = 0; i < MICRO_REPEAT; i++) {
+    emit(rom, 0xD01F);
+    emit(rom, 0x7007);
+    emit(rom, 0x7103);
+    emit(rom, 0xD12F);
+  }
+  loop(rom);
+
+  rom->size = sprite - PROGRAM_START;
+  for (int i = 0; i < 15; i++)
+    rom->rom[rom->size++] = (uint8_t)(0x81 | (0x3C >> (i % 3)));
+}
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static stat summarize(const double* samples, int count) {
+  stat s = { 0.0, 0.0 };
+
+  for (int i = 0; i < count; i++)
+    s.mean += samples[i];
+  s.mean /= count;
+
+  for (int i = 0; i < count; i++)
+    s.stddev += (samples[i] - s.mean) * (samples[i] - s.mean);
+  s.stddev = count > 1 ? sqrt(s.stddev / (count - 1)) : 0.0;
+
+  return s;
+}
+
+static void printStat(const char* name, stat s, const char* separator) {
+  printf("      \"%s\": { \"mean\": %.6g, \"stddev\": %.6g }%s\n", name, s.mean, s.stddev, separator);
+}
+
+// false if the ROM went idle, the rest of its numbers say nothing then.
+// Every repetition is added to profile unless it is NULL
+static bool runBenchmark(chip8* chip, chip8_jit* jit, chip8_lockstep* lanes, trace* tracer, chip8* profile,
+                         const bench_rom* rom, uint32_t frames, uint32_t ipf, int reps, bool first) {
+  double* ips = malloc(reps * sizeof(double));
+  double* nsPerInstruction = malloc(reps * sizeof(double));
+  double* fps = malloc(reps * sizeof(double));
+  uint64_t instructions = 0;
+  double uniform = 1.0;
+  bool busy = true;
+
+  for (int r = 0; r < reps; r++) {
+    chip8_initialize(chip);
+    chip8_loadBuffer(chip, rom->rom, rom->size);
+    if (tracer != NULL)
+      chip->trace = trace_link(tracer);
+    if (jit != NULL)
+      chip8_jit_reset(jit);
+    if (lanes != NULL)
+      chip8_lockstep_load(lanes, rom->rom, rom->size);
+
+    double start = now();
+    for (uint32_t f = 0; f < frames; f++) {
+      if (lanes != NULL)
+        chip8_lockstep_runFrame(lanes, ipf);
+      else if (jit != NULL)
+        chip8_jit_runFrame(jit, ipf);
+      else
+        chip8_runFrame(chip, ipf);
+    }
+    double seconds = now() - start;
+
+    // what idle loops skip in one step is not a workload
+    instructions = chip->cycles - chip->skipped;
+    busy = busy && chip->skipped == 0;
+    if (lanes != NULL) {
+      chip8_lockstep_stats stats = chip8_lockstep_getStats(lanes);
+      instructions = stats.steps * chip8_lockstep_lanes(lanes);
+      uniform = (double)stats.uniformSteps / stats.steps;
+    }
+    ips[r] = instructions / seconds;
+    nsPerInstruction[r] = seconds * 1e9 / instructions;
+    fps[r] = frames / seconds;
+#ifdef CHIP8_PROFILE
+    if (profile != NULL)
+      chip8_profileMerge(profile, chip);
+#else
+    (void)profile;
+#endif
+  }
+
+  printf("%s    {\n", first ? "" : ",\n");
+  printf("      \"name\": \"%s\",\n", rom->name);
+  printf("      \"instructions\": %llu,\n", (unsigned long long)instructions);
+  printf("      \"frames\": %u,\n", frames);
+  if (lanes != NULL)
+    printf("      \"uniform_steps\": %.4f,\n", uniform);
+  if (!busy)
+    printf("      \"idle\": true,\n");
+  printStat("instructions_per_second", summarize(ips, reps), ",");
+  printStat("ns_per_instruction", summarize(nsPerInstruction, reps), ",");
+  printStat("frames_per_second", summarize(fps, reps), "");
+  printf("    }");
+  fflush(stdout);
+
+  free(ips);
+  free(nsPerInstruction);
+  free(fps);
+  return busy;
+}
+
+static bool readRom(const char* path, bench_rom* rom) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    return false;
+
+  rom->name = path;
+  rom->size = fread(rom->rom, 1, ROM_SIZE, file);
+  fclose(file);
+  return rom->size > 0;
+}
+
+static void usage(const char* program) {
+  fprintf(stderr, "Usage: %s [--reps <n>] [--frames <n>] [--ipf <n>] [--filter <substring>] [--jit | --lanes <n> | --trace <file>] [--profile <file>] [ROM files...].\n", program);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+  int reps = 10;
+  uint32_t frames = 20000;
+  uint32_t ipf = 100;
+  const char* filter = NULL;
+  bool useJit = false;
+  uint32_t laneCount = 0;
+  const char* tracePath = NULL;
+  const char* profilePath = NULL;
+
+  static const struct {
+    const char* name;
+    void (*build)(bench_rom* rom);
+  } synthetic[] = {
+    { "micro/load", microLoad },
+    { "micro/arithmetic", microArithmetic },
+    { "micro/skip", microSkip },
+    { "micro/index", microIndex },
+    { "micro/memory", microMemory },
+    { "micro/flow", microFlow },
+    { "micro/timers", microTimers },
+    { "micro/random", microRandom },
+    { "sprite/dxyn", spriteHeavy },
+  };
+  const size_t syntheticCount = sizeof(synthetic) / sizeof(synthetic[0]);
+
+  size_t romCount = syntheticCount + 1;
+  bench_rom* roms = calloc(romCount + argc, sizeof(bench_rom));
+
+  for (size_t i = 0; i < syntheticCount; i++) {
+    roms[i].name = synthetic[i].name;
+    synthetic[i].build(&roms[i]);
+  }
+
+  roms[syntheticCount].name = "rom/maze";
+  memcpy(roms[syntheticCount].rom, mazeRom, sizeof(mazeRom));
+  roms[syntheticCount].size = sizeof(mazeRom);
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+      reps = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frames = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc) {
+      ipf = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      filter = argv[++i];
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      useJit = true;
+    } else if (strcmp(argv[i], "--lanes") == 0 && i + 1 < argc) {
+      laneCount = (uint32_t)strtoul(argv[++i], NULL, 10);
+      if (laneCount == 0)
+        usage(argv[0]);
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      tracePath = argv[++i];
+    } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      profilePath = argv[++i];
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+    } else if (!readRom(argv[i], &roms[romCount++])) {
+      fprintf(stderr, "Could not read ROM \"%s\".\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (reps <= 0 || frames == 0 || ipf == 0)
+    usage(argv[0]);
+#ifndef CHIP8_PROFILE
+  if (profilePath != NULL) {
+    fprintf(stderr, "--profile needs a core built with -DCHIP8_PROFILING=ON.\n");
+    return EXIT_FAILURE;
+  }
+#endif
+
+  static chip8 chip;
+  chip8_jit* jit = NULL;
+  if (useJit && (jit = chip8_jit_create(&chip)) == NULL) {
+    fprintf(stderr, "The JIT is not supported on this platform.\n");
+    return EXIT_FAILURE;
+  }
+
+  chip8_lockstep* lanes = NULL;
+  if (laneCount != 0 && (useJit || (lanes = chip8_lockstep_create(laneCount)) == NULL))
+    usage(argv[0]);
+
+  trace* tracer = NULL;
+  if (tracePath != NULL && (useJit || lanes != NULL))
+    usage(argv[0]);
+  if (tracePath != NULL && (tracer = trace_open(tracePath, TRACE_DEFAULT_BYTES, false)) == NULL) {
+    fprintf(stderr, "Could not trace to \"%s\".\n", tracePath);
+    return EXIT_FAILURE;
+  }
+
+  // large, like the instance
+  chip8* profile = NULL;
+  if (profilePath != NULL && (profile = calloc(1, sizeof(chip8))) == NULL) {
+    fprintf(stderr, "Not enough memory for a profile.\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("{\n");
+  printf("  \"backend\": \"%s\",\n", jit != NULL ? "jit" : lanes != NULL ? "lockstep" : "interpreter");
+  if (lanes != NULL)
+    printf("  \"lanes\": %u,\n", laneCount);
+  if (tracer != NULL)
+    printf("  \"traced\": true,\n");
+  printf("  \"repetitions\": %d,\n", reps);
+  printf("  \"frames\": %u,\n", frames);
+  printf("  \"ipf\": %u,\n", ipf);
+  printf("  \"benchmarks\": [\n");
+
+  bool first = true;
+  int idle = 0;
+  for (size_t i = 0; i < romCount; i++) {
+    if (filter != NULL && strstr(roms[i].name, filter) == NULL)
+      continue;
+    if (!runBenchmark(&chip, jit, lanes, tracer, profile, &roms[i], frames, ipf, reps, first)) {
+      fprintf(stderr, "\"%s\" went idle, e.g. waiting for a key, and stopped being a workload.\n", roms[i].name);
+      idle++;
+    }
+    first = false;
+  }
+
+  printf("\n  ]\n}\n");
+
+  if (tracer != NULL) {
+    chip.trace = NULL;
+    trace_stats stats = trace_close(tracer);
+    fprintf(stderr, "Traced %llu instructions, %llu dropped.\n", (unsigned long long)stats.entries,
+            (unsigned long long)stats.dropped);
+  }
+  int failed = idle;
+#ifdef CHIP8_PROFILE
+  if (profile != NULL && !chip8_profileDump(profile, profilePath))
+    failed++;
+#endif
+  free(profile);
+  chip8_jit_destroy(jit);
+  chip8_lockstep_destroy(lanes);
+  free(roms);
+  return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,538 @@
+// chip8-conformance: runs every ROM of a directory headless across all
+// cores and compares framebuffer hashes at checkpoint frames against a
+// golden manifest, to catch emulation regressions.
+//
+// A ROM is any file ending in .ch8 or .c8. If <rom>.log exists next to it,
+// an input log as written by chip8-emu --record, the ROM is played with
+// its keys and seed. --update runs --frames frames and writes a checkpoint
+// every --every frames and at the end; checking runs each ROM up to its
+// last checkpoint in the manifest. For every mismatch the first differing
+// checkpoint is written to the --dump directory as a PBM image, expected
+// on the left and actual on the right.
+//
+// ROMs with an input log run with the quirk profile it was recorded with,
+// the others with --quirks (quirks.h), or what the --quirks-db database
+// lists for them.
+//
+// Manifest, one line per checkpoint after the ipf the ROMs ran with:
+//   ipf <instructions per frame>
+//   <rom file name> <frame> <hash> <framebuffer>
+// The framebuffer is 16 hex digits per word of chip8.gfx plane 0, at the
+// resolution of the frame (HEIGHT words in lores, PLANE_WORDS in hires),
+// followed by plane 1 in the same form only if it has any pixel set.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+#include "inputlog.h"
+#include "pool.h"
+#include "quirks.h"
+#include "scheduler.h"
+
+#define DEFAULT_FRAMES 600
+#define DEFAULT_EVERY 60
+#define DUMP_GAP 1                // columns between expected and actual
+
+typedef struct {
+  uint32_t frame;                 // frames emulated before the hash was taken
+  uint64_t hash;
+  uint64_t gfx[PLANES][PLANE_WORDS];
+  bool hires;
+} checkpoint;
+
+#define HEX_DIGITS (PLANES * PLANE_WORDS * 16)
+
+typedef struct {
+  char* name;                     // file name inside the ROM directory
+  checkpoint* golden;
+  size_t goldenCount;
+  size_t goldenCapacity;
+
+  checkpoint* actual;             // filled in by the run, one per golden
+  size_t actualCount;
+
+  bool ok;
+  char error[128];
+  size_t mismatch;                // index of the first differing checkpoint
+  bool hasMismatch;
+  double wallMs;
+} conformance_rom;
+
+typedef struct {
+  const char* dir;
+  conformance_rom* roms;
+  size_t count;
+  uint32_t ipf;
+  uint32_t frames;
+  uint32_t every;
+  bool update;
+  const char* quirksDb;           // NULL, or a database to look ROMs up in
+  chip8_quirks quirks;
+} conformance;
+
+static void usage(const char* program) {
+  fprintf(stderr, "Usage: %s [--threads <n>] [--update [--frames <n>] [--every <n>] [--ipf <n>]] "
+                  "[--quirks <profile>] [--quirks-db <file>] [--dump <dir>] <ROM dir> <manifest>.\n", program);
+  exit(EXIT_FAILURE);
+}
+
+static uint8_t* readFile(const char* path, size_t* size) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  fseek(file, 0L, SEEK_END);
+  long fileSize = ftell(file);
+  rewind(file);
+
+  uint8_t* buffer = fileSize > 0 ? malloc(fileSize) : NULL;
+  if (buffer == NULL || fread(buffer, 1, fileSize, file) != (size_t)fileSize) {
+    free(buffer);
+    fclose(file);
+    return NULL;
+  }
+
+  fclose(file);
+  *size = (size_t)fileSize;
+  return buffer;
+}
+
+static double elapsedMs(const struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static char* joinPath(const char* dir, const char* name, const char* suffix) {
+  size_t length = strlen(dir) + strlen(name) + strlen(suffix) + 2;
+  char* path = malloc(length);
+  if (path != NULL)
+    snprintf(path, length, "%s/%s%s", dir, name, suffix);
+  return path;
+}
+
+static bool addCheckpoint(conformance_rom* rom, const checkpoint* point) {
+  if (rom->goldenCount == rom->goldenCapacity) {
+    size_t capacity = rom->goldenCapacity != 0 ? rom->goldenCapacity * 2 : 16;
+    checkpoint* grown = realloc(rom->golden, capacity * sizeof(*grown));
+    if (grown == NULL)
+      return false;
+
+    rom->golden = grown;
+    rom->goldenCapacity = capacity;
+  }
+
+  rom->golden[rom->goldenCount++] = *point;
+  return true;
+}
+
+static bool isRom(const char* name) {
+  const char* extension = strrchr(name, '.');
+  return extension != NULL && (strcmp(extension, ".ch8") == 0 || strcmp(extension, ".c8") == 0);
+}
+
+static int compareRoms(const void* a, const void* b) {
+  return strcmp(((const conformance_rom*)a)->name, ((const conformance_rom*)b)->name);
+}
+
+// sorted by name, so reports and manifests come out in a stable order
+static conformance_rom* listRoms(const char* dir, size_t* count) {
+  DIR* d = opendir(dir);
+  if (d == NULL)
+    return NULL;
+
+  size_t capacity = 64;
+  conformance_rom* roms = calloc(capacity, sizeof(*roms));
+  *count = 0;
+
+  struct dirent* entry;
+  while (roms != NULL && (entry = readdir(d)) != NULL) {
+    if (!isRom(entry->d_name))
+      continue;
+
+    if (*count == capacity) {
+      capacity *= 2;
+      conformance_rom* grown = realloc(roms, capacity * sizeof(*roms));
+      if (grown == NULL) {
+        free(roms);
+        roms = NULL;
+        break;
+      }
+      roms = grown;
+    }
+
+    roms[(*count)++] = (conformance_rom){ .name = strdup(entry->d_name) };
+  }
+
+  closedir(d);
+  if (roms != NULL)
+    qsort(roms, *count, sizeof(*roms), compareRoms);
+  return roms;
+}
+
+static conformance_rom* findRom(conformance* c, const char* name) {
+  conformance_rom key = { .name = (char*)name };
+  return bsearch(&key, c->roms, c->count, sizeof(*c->roms), compareRoms);
+}
+
+// the number of words tells the resolution and whether plane 1 is there
+static bool parseGfx(const char* hex, checkpoint* point) {
+  size_t length = strlen(hex);
+  size_t words = length / 16;
+  if (length % 16 != 0 ||
+      (words != HEIGHT && words != PLANES * HEIGHT && words != PLANE_WORDS && words != PLANES * PLANE_WORDS))
+    return false;
+
+  point->hires = words >= PLANE_WORDS;
+  size_t perPlane = point->hires ? PLANE_WORDS : HEIGHT;
+  memset(point->gfx, 0x0, sizeof(point->gfx));
+
+  for (size_t w = 0; w < words; w++) {
+    char word[17];
+    memcpy(word, hex + w * 16, 16);
+    word[16] = '\0';
+    point->gfx[w / perPlane][w % perPlane] = strtoull(word, NULL, 16);
+  }
+  return true;
+}
+
+static void writeGfx(FILE* file, const checkpoint* point) {
+  int words = point->hires ? PLANE_WORDS : HEIGHT;
+  bool plane1 = false;
+  for (int w = 0; w < words; w++)
+    plane1 |= point->gfx[1][w] != 0;
+
+  for (int plane = 0; plane < (plane1 ? PLANES : 1); plane++) {
+    for (int w = 0; w < words; w++)
+      fprintf(file, "%016" PRIx64, point->gfx[plane][w]);
+  }
+}
+
+// any plane set at (x, y) of a hires frame, lores frames doubled
+static bool lit(const checkpoint* point, int x, int y) {
+  int scale = point->hires ? 1 : 2;
+  int column = x / scale;
+  int word = point->hires ? (y * HIRES_WIDTH + column) / 64 : y / scale;
+
+  for (int plane = 0; plane < PLANES; plane++) {
+    if ((point->gfx[plane][word] >> (63 - column % 64)) & 1)
+      return true;
+  }
+  return false;
+}
+
+static bool readManifest(conformance* c, const char* path) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL)
+    return false;
+
+  char line[HEX_DIGITS + 1024];
+  unsigned lineNumber = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), file) != NULL) {
+    lineNumber++;
+
+    char name[512], hex[HEX_DIGITS + 1];
+    unsigned ipf, frame;
+    checkpoint point;
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+    if (sscanf(line, "ipf %u", &ipf) == 1) {
+      c->ipf = ipf;
+      continue;
+    }
+    if (sscanf(line, "%511s %u %" SCNx64 " %4096s", name, &frame, &point.hash, hex) != 4 ||
+        !parseGfx(hex, &point)) {
+      fprintf(stderr, "%s:%u: expected \"<rom> <frame> <hash> <framebuffer>\".\n", path, lineNumber);
+      continue;
+    }
+
+    point.frame = frame;
+    conformance_rom* rom = findRom(c, name);
+    if (rom == NULL) {
+      fprintf(stderr, "%s:%u: no ROM \"%s\" in \"%s\".\n", path, lineNumber, name, c->dir);
+      ok = false;
+    } else if (rom->goldenCount != 0 && rom->golden[rom->goldenCount - 1].frame >= point.frame) {
+      fprintf(stderr, "%s:%u: checkpoints of \"%s\" out of order.\n", path, lineNumber, name);
+      ok = false;
+    } else {
+      ok = addCheckpoint(rom, &point);
+    }
+  }
+
+  fclose(file);
+  return ok;
+}
+
+static bool writeManifest(const conformance* c, const char* path) {
+  FILE* file = fopen(path, "w");
+  if (file == NULL)
+    return false;
+
+  fprintf(file, "# chip8-conformance golden manifest\n");
+  fprintf(file, "ipf %" PRIu32 "\n", c->ipf);
+
+  for (size_t i = 0; i < c->count; i++) {
+    const conformance_rom* rom = &c->roms[i];
+    for (size_t p = 0; rom->ok && p < rom->actualCount; p++) {
+      const checkpoint* point = &rom->actual[p];
+      fprintf(file, "%s %" PRIu32 " %016" PRIx64 " ", rom->name, point->frame, point->hash);
+      writeGfx(file, point);
+      fputc('\n', file);
+    }
+  }
+
+  return fclose(file) == 0;
+}
+
+// a 1-bit PBM, the expected frame left of the actual one. Pixels set in any
+// plane are black, both frames are drawn in hires if either one is
+static bool dumpMismatch(const char* dir, const conformance_rom* rom) {
+  const checkpoint* expected = &rom->golden[rom->mismatch];
+  const checkpoint* actual = &rom->actual[rom->mismatch];
+
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), "-%" PRIu32 ".pbm", expected->frame);
+  char* path = joinPath(dir, rom->name, suffix);
+  FILE* file = path != NULL ? fopen(path, "wb") : NULL;
+  free(path);
+  if (file == NULL)
+    return false;
+
+  int scale = expected->hires || actual->hires ? 1 : 2;
+  int frameWidth = HIRES_WIDTH / scale;
+  int width = 2 * frameWidth + DUMP_GAP;
+  fprintf(file, "P4\n%d %d\n", width, HIRES_HEIGHT / scale);
+
+  for (int y = 0; y < HIRES_HEIGHT; y += scale) {
+    uint8_t row[(2 * HIRES_WIDTH + DUMP_GAP + 7) / 8] = { 0 };
+    for (int x = 0; x < frameWidth; x++) {
+      int right = x + frameWidth + DUMP_GAP;
+      if (lit(expected, x * scale, y))
+        row[x / 8] |= 0x80 >> (x % 8);
+      if (lit(actual, x * scale, y))
+        row[right / 8] |= 0x80 >> (right % 8);
+    }
+    fwrite(row, (width + 7) / 8, 1, file);
+  }
+
+  return fclose(file) == 0;
+}
+
+static void takeCheckpoint(conformance_rom* rom, const chip8* chip, uint32_t frame) {
+  checkpoint* point = &rom->actual[rom->actualCount++];
+  point->frame = frame;
+  point->hash = chip8_frameHash(chip);
+  memcpy(point->gfx, chip->gfx, sizeof(point->gfx));
+  point->hires = chip->hires;
+}
+
+// emulates frames until *frame frames ran in total, skipping the ones
+// spent waiting for a key up to the next input event
+static void runUntil(chip8* chip, const inputlog* input, size_t* nextEvent, uint32_t* frame, uint32_t target) {
+  while (*frame < target) {
+    while (*nextEvent < input->count && input->events[*nextEvent].frame <= *frame)
+      chip8_setKeys(chip, input->events[(*nextEvent)++].keys);
+
+    chip8_runFrame(chip, input->ipf);
+    (*frame)++;
+
+    if (chip8_waitsForInput(chip)) {
+      uint32_t until = *nextEvent < input->count && input->events[*nextEvent].frame < target
+                         ? input->events[*nextEvent].frame : target;
+      if (until > *frame) {
+        chip8_skipFrames(chip, input->ipf, until - *frame);
+        *frame = until;
+      }
+    }
+  }
+}
+
+static void runRom(void* context, size_t index, unsigned worker) {
+  conformance* c = context;
+  conformance_rom* rom = &c->roms[index];
+  (void)worker;
+
+  if (!c->update && rom->goldenCount == 0) {
+    snprintf(rom->error, sizeof(rom->error), "not in the manifest");
+    return;
+  }
+
+  char* romPath = joinPath(c->dir, rom->name, "");
+  char* logPath = joinPath(c->dir, rom->name, ".log");
+  size_t romSize;
+  uint8_t* data = romPath != NULL ? readFile(romPath, &romSize) : NULL;
+  free(romPath);
+  if (data == NULL || logPath == NULL) {
+    snprintf(rom->error, sizeof(rom->error), "could not read ROM");
+    free(logPath);
+    free(data);
+    return;
+  }
+
+  // without a log the ROM runs with no keys pressed
+  inputlog input;
+  FILE* probe = fopen(logPath, "rb");
+  if (probe != NULL) {
+    fclose(probe);
+    if (!inputlog_load(&input, logPath)) {
+      snprintf(rom->error, sizeof(rom->error), "could not read input log");
+      free(logPath);
+      free(data);
+      return;
+    }
+  } else {
+    inputlog_init(&input, c->ipf, CHIP8_DEFAULT_SEED, 0);
+  }
+  free(logPath);
+
+  // checkpoints every --every frames and at the end when updating,
+  // the manifest's otherwise
+  size_t points = c->update ? (c->frames + c->every - 1) / c->every : rom->goldenCount;
+  chip8* chip = malloc(sizeof(*chip));
+  rom->actual = malloc(points * sizeof(*rom->actual));
+  if (chip == NULL || rom->actual == NULL) {
+    snprintf(rom->error, sizeof(rom->error), "out of memory");
+  } else if (input.romHash != 0 && input.romHash != chip8_romHash(data, romSize)) {
+    snprintf(rom->error, sizeof(rom->error), "input log recorded with another ROM");
+  } else {
+    // a recorded log replays with the profile it was recorded with
+    chip8_quirks quirks = c->quirks;
+    if (input.romHash != 0)
+      quirks = (chip8_quirks)input.quirks;
+    else if (c->quirksDb != NULL)
+      quirks = quirks_lookup(c->quirksDb, chip8_romHash(data, romSize), c->quirks);
+
+    chip8_initialize(chip);
+    chip->quirks = quirks;
+    if (!chip8_loadBuffer(chip, data, romSize)) {
+      snprintf(rom->error, sizeof(rom->error), "invalid ROM size");
+    } else {
+      chip8_seed(chip, input.seed);
+
+      struct timespec start;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+
+      size_t nextEvent = 0;
+      uint32_t frame = 0;
+      for (size_t p = 0; p < points; p++) {
+        uint32_t target = c->update ? (p + 1 < points ? (uint32_t)(p + 1) * c->every : c->frames)
+                                    : rom->golden[p].frame;
+        runUntil(chip, &input, &nextEvent, &frame, target);
+        takeCheckpoint(rom, chip, frame);
+
+        if (!c->update && !rom->hasMismatch && rom->actual[p].hash != rom->golden[p].hash) {
+          rom->mismatch = p;
+          rom->hasMismatch = true;
+        }
+      }
+
+      rom->wallMs = elapsedMs(&start);
+      rom->ok = true;
+    }
+  }
+
+  free(chip);
+  inputlog_free(&input);
+  free(data);
+}
+
+int main(int argc, char* argv[]) {
+  const char* romDir = NULL;
+  const char* manifestPath = NULL;
+  const char* dumpDir = NULL;
+  unsigned threads = pool_defaultWorkers();
+  conformance c = { .ipf = DEFAULT_IPF, .frames = DEFAULT_FRAMES, .every = DEFAULT_EVERY,
+                    .quirks = CHIP8_QUIRKS_DEFAULT };
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = (unsigned)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc) {
+      c.ipf = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      c.frames = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--every") == 0 && i + 1 < argc) {
+      c.every = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--update") == 0) {
+      c.update = true;
+    } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+      if (!quirks_parse(argv[++i], &c.quirks))
+        usage(argv[0]);
+    } else if (strcmp(argv[i], "--quirks-db") == 0 && i + 1 < argc) {
+      c.quirksDb = argv[++i];
+    } else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc) {
+      dumpDir = argv[++i];
+    } else if (argv[i][0] == '-' || manifestPath != NULL) {
+      usage(argv[0]);
+    } else if (romDir == NULL) {
+      romDir = argv[i];
+    } else {
+      manifestPath = argv[i];
+    }
+  }
+
+  if (manifestPath == NULL || c.ipf == 0 || c.frames == 0 || c.every == 0)
+    usage(argv[0]);
+
+  c.dir = romDir;
+  c.roms = listRoms(romDir, &c.count);
+  if (c.roms == NULL) {
+    fprintf(stderr, "Could not list ROM directory \"%s\".\n", romDir);
+    return EXIT_FAILURE;
+  }
+
+  if (!c.update && !readManifest(&c, manifestPath)) {
+    fprintf(stderr, "Could not read manifest \"%s\".\n", manifestPath);
+    return EXIT_FAILURE;
+  }
+
+  pool* workers = pool_create(threads);
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pool_run(workers, c.count, runRom, &c);
+  double totalMs = elapsedMs(&start);
+
+  int failed = 0;
+  printf("# rom\tresult\twall_ms\n");
+  for (size_t i = 0; i < c.count; i++) {
+    conformance_rom* rom = &c.roms[i];
+    if (!rom->ok) {
+      printf("%s\terror: %s\n", rom->name, rom->error);
+      failed++;
+    } else if (rom->hasMismatch) {
+      const checkpoint* expected = &rom->golden[rom->mismatch];
+      printf("%s\tmismatch at frame %" PRIu32 ": expected %016" PRIx64 ", got %016" PRIx64 "\t%.3f\n",
+             rom->name, expected->frame, expected->hash, rom->actual[rom->mismatch].hash, rom->wallMs);
+      if (dumpDir != NULL && !dumpMismatch(dumpDir, rom))
+        fprintf(stderr, "Could not write a dump of \"%s\" to \"%s\".\n", rom->name, dumpDir);
+      failed++;
+    } else {
+      printf("%s\t%s\t%.3f\n", rom->name, c.update ? "updated" : "ok", rom->wallMs);
+    }
+  }
+
+  if (c.update && !writeManifest(&c, manifestPath)) {
+    fprintf(stderr, "Could not write manifest \"%s\".\n", manifestPath);
+    failed++;
+  }
+
+  fprintf(stderr, "%zu ROMs on %u threads in %.1f ms, %d failed.\n", c.count, pool_workers(workers), totalMs, failed);
+
+  pool_destroy(workers);
+  for (size_t i = 0; i < c.count; i++) {
+    free(c.roms[i].name);
+    free(c.roms[i].golden);
+    free(c.roms[i].actual);
+  }
+  free(c.roms);
+
+  return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,204 @@
+// chip8-fuzz: fuzzing harness for the core. Built against a CHIP8_CHECKED
+// core, so a ROM going out of bounds is a deterministic fault instead of
+// memory corruption, and sanitizers are left to find bugs in the core.
+//
+// With -DCHIP8_FUZZING=ON (Clang) it is a libFuzzer target; compiled with
+// afl-clang-fast it runs in AFL++ persistent mode. Otherwise it runs the
+// inputs given on the command line, to reproduce findings, --runs times
+// each and reports executions per second.
+//
+// An input is a key schedule followed by the ROM:
+//   u8 n, then n times (u8 frames after the previous event, u16 key mask
+//   little-endian), then the ROM bytes
+// Each input starts from a snapshot of a freshly initialized machine,
+// put back with chip8_restore, and runs FUZZ_FRAMES frames or until it
+// faults or waits for a key that never comes. Faults end the run quietly;
+// with CHIP8_FUZZ_ABORT set in the environment they are reported and abort,
+// so the fuzzer keeps the ROMs that cause them.
+//
+// Besides the fuzzer's own edge coverage of the core, libFuzzer gets a
+// counter per emulated address and per opcode handler (chip8.coverage).
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+#include "scheduler.h"
+
+#ifndef CHIP8_CHECKED
+#error "chip8-fuzz needs a core built with CHIP8_CHECKED"
+#endif
+
+#define FUZZ_FRAMES 16
+#define FUZZ_IPF DEFAULT_IPF
+#define FUZZ_MAX_EVENTS 32
+
+#ifdef CHIP8_LIBFUZZER
+__attribute__((used, section("__libfuzzer_extra_counters")))
+#endif
+static uint8_t coverage[CHIP8_COVERAGE_SIZE];
+
+static chip8 chip;
+static chip8_state initial;
+static bool abortOnFault;
+
+static void setup(void) {
+  chip8_initialize(&chip);
+  chip8_snapshot(&chip, &initial);
+  chip.coverage = coverage;
+  abortOnFault = getenv("CHIP8_FUZZ_ABORT") != NULL;
+}
+
+static void fuzzOne(const uint8_t* data, size_t size) {
+  typedef struct {
+    uint32_t frame;
+    uint16_t keys;
+  } key_event;
+
+  key_event events[FUZZ_MAX_EVENTS];
+  size_t count = 0;
+  uint32_t frame = 0;
+
+  if (size == 0)
+    return;
+
+  size_t requested = data[0] % (FUZZ_MAX_EVENTS + 1);
+  data++;
+  size--;
+  while (count < requested && size >= 3) {
+    frame += data[0];
+    events[count++] = (key_event){ .frame = frame, .keys = (uint16_t)(data[1] | (data[2] << 8)) };
+    data += 3;
+    size -= 3;
+  }
+
+  // only the bytes the last run dirtied are copied back
+  chip8_restore(&chip, &initial);
+  chip8_seed(&chip, CHIP8_DEFAULT_SEED);
+  if (!chip8_loadBuffer(&chip, data, size))
+    return;
+
+  size_t next = 0;
+  for (frame = 0; frame < FUZZ_FRAMES && chip.fault == CHIP8_FAULT_NONE; frame++) {
+    while (next < count && events[next].frame <= frame)
+      chip8_setKeys(&chip, events[next++].keys);
+
+    chip8_runFrame(&chip, FUZZ_IPF);
+
+    // nothing but a key changes the state from here
+    if (chip8_waitsForInput(&chip) && next == count)
+      break;
+  }
+
+  if (chip.fault != CHIP8_FAULT_NONE && abortOnFault) {
+    fprintf(stderr, "Fault: %s at pc 0x%03X (0x%04X).\n",
+            chip8_faultName(chip.fault), chip.faultPc, chip.faultAddress);
+    abort();
+  }
+}
+
+#if defined(CHIP8_LIBFUZZER)
+
+int LLVMFuzzerInitialize(int* argc, char*** argv) {
+  (void)argc;
+  (void)argv;
+  setup();
+  return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  fuzzOne(data, size);
+  return 0;
+}
+
+#elif defined(__AFL_FUZZ_TESTCASE_LEN)
+
+__AFL_FUZZ_INIT();
+
+int main(void) {
+  setup();
+  __AFL_INIT();
+
+  const uint8_t* data = __AFL_FUZZ_TESTCASE_BUF;
+  while (__AFL_LOOP(100000))
+    fuzzOne(data, (size_t)__AFL_FUZZ_TESTCASE_LEN);
+
+  return EXIT_SUCCESS;
+}
+
+#else
+
+static void usage(const char* program) {
+  fprintf(stderr, "Usage: %s [--runs <n>] <input files...>.\n", program);
+  exit(EXIT_FAILURE);
+}
+
+static uint8_t* readFile(const char* path, size_t* size) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  fseek(file, 0L, SEEK_END);
+  long fileSize = ftell(file);
+  rewind(file);
+
+  uint8_t* buffer = malloc(fileSize > 0 ? fileSize : 1);
+  if (buffer == NULL || fread(buffer, 1, fileSize, file) != (size_t)fileSize) {
+    free(buffer);
+    fclose(file);
+    return NULL;
+  }
+
+  fclose(file);
+  *size = (size_t)fileSize;
+  return buffer;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+  unsigned long runs = 1;
+  int first = 1;
+
+  if (argc > 2 && strcmp(argv[1], "--runs") == 0) {
+    runs = strtoul(argv[2], NULL, 10);
+    first = 3;
+  }
+  if (first >= argc || runs == 0)
+    usage(argv[0]);
+
+  setup();
+
+  for (int i = first; i < argc; i++) {
+    size_t size;
+    uint8_t* data = readFile(argv[i], &size);
+    if (data == NULL) {
+      fprintf(stderr, "Could not read \"%s\".\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+
+    double start = now();
+    for (unsigned long r = 0; r < runs; r++)
+      fuzzOne(data, size);
+    double seconds = now() - start;
+
+    printf("%s\t%s", argv[i], chip.fault != CHIP8_FAULT_NONE ? chip8_faultName(chip.fault) : "ok");
+    if (chip.fault != CHIP8_FAULT_NONE)
+      printf(" at pc 0x%03X (0x%04X)", chip.faultPc, chip.faultAddress);
+    printf("\t%.0f execs/s\n", runs / seconds);
+
+    free(data);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+#endif
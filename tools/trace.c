@@ -0,0 +1,278 @@
+// chip8-trace: reads an execution trace written by chip8-emu --trace
+// (trace.h) and prints what led up to its end.
+//
+// Prints how many instructions were traced and dropped, then the last
+// --last instructions (32 by default) before the first invalid opcode, or
+// before the end of the trace if it never ran into one, disassembled with
+// the state each left behind. --hits prints the addresses executed most,
+// with their share of the trace (16 by default, 0 for all of them).
+// --from <entry> lists --count entries (32 by default) from that entry
+// number on instead of the last ones.
+//
+// The trace is replayed to get the instructions back. Where a call ends
+// elsewhere than it did when traced, e.g. because the trace does not come
+// from the ROM's run it claims to, the first such entry is reported and
+// the tool fails.
+//
+// Instructions are written as in Cowgod's reference, with the SUPER-CHIP
+// and XO-CHIP extensions under their usual names. BNNN is shown as JP V0
+// whatever quirk profile the ROM ran with.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "trace.h"
+
+#define DEFAULT_LAST 32
+#define DEFAULT_HITS 16
+#define DEFAULT_COUNT 32
+
+typedef struct {
+  uint64_t number;
+  trace_entry entry;
+} numbered;
+
+static void usage(const char* program) {
+  fprintf(stderr, "Usage: %s [--last <n>] [--hits <n>] [--from <entry> [--count <n>]] <trace file>.\n", program);
+  exit(EXIT_FAILURE);
+}
+
+// after is the entry that ran it, or NULL
+static void disassemble(uint16_t opcode, const trace_entry* after, char* out, size_t size) {
+  chip8_decoded d = chip8_decode(opcode);
+  int n = d.nn & 0x0F;
+
+  switch (d.op) {
+    case CHIP8_OP_00CN: snprintf(out, size, "SCD %d", n); break;
+    case CHIP8_OP_00DN: snprintf(out, size, "SCU %d", n); break;
+    case CHIP8_OP_00E0: snprintf(out, size, "CLS"); break;
+    case CHIP8_OP_00EE: snprintf(out, size, "RET"); break;
+    case CHIP8_OP_00FB: snprintf(out, size, "SCR"); break;
+    case CHIP8_OP_00FC: snprintf(out, size, "SCL"); break;
+    case CHIP8_OP_00FD: snprintf(out, size, "EXIT"); break;
+    case CHIP8_OP_00FE: snprintf(out, size, "LOW"); break;
+    case CHIP8_OP_00FF: snprintf(out, size, "HIGH"); break;
+    case CHIP8_OP_1NNN: snprintf(out, size, "JP 0x%03X", d.nnn); break;
+    case CHIP8_OP_2NNN: snprintf(out, size, "CALL 0x%03X", d.nnn); break;
+    case CHIP8_OP_3XNN: snprintf(out, size, "SE V%X, 0x%02X", d.x, d.nn); break;
+    case CHIP8_OP_4XNN: snprintf(out, size, "SNE V%X, 0x%02X", d.x, d.nn); break;
+    case CHIP8_OP_5XY0: snprintf(out, size, "SE V%X, V%X", d.x, d.y); break;
+    case CHIP8_OP_5XY2: snprintf(out, size, "SAVE V%X-V%X", d.x, d.y); break;
+    case CHIP8_OP_5XY3: snprintf(out, size, "LOAD V%X-V%X", d.x, d.y); break;
+    case CHIP8_OP_6XNN: snprintf(out, size, "LD V%X, 0x%02X", d.x, d.nn); break;
+    case CHIP8_OP_7XNN: snprintf(out, size, "ADD V%X, 0x%02X", d.x, d.nn); break;
+    case CHIP8_OP_8XY0: snprintf(out, size, "LD V%X, V%X", d.x, d.y); break;
+    case CHIP8_OP_8XY1: snprintf(out, size, "OR V%X, V%X", d.x, d.y); break;
+    case CHIP8_OP_8XY2: snprintf(out, size, "AND V%X, V%X", d.x, d.y); break;
+    case CHIP8_OP_8XY3: snprintf(out, size, "XOR V%X, V%X", d.x, d.y); break;
+    case CHIP8_OP_8XY4: snprintf(out, size, "ADD V%X, V%X", d.x, d.y); break;
+    case CHIP8_OP_8XY5: snprintf(out, size, "SUB V%X, V%X", d.x, d.y); break;
+    case CHIP8_OP_8XY6: snprintf(out, size, "SHR V%X, V%X", d.x, d.y); break;
+    case CHIP8_OP_8XY7: snprintf(out, size, "SUBN V%X, V%X", d.x, d.y); break;
+    case CHIP8_OP_8XYE: snprintf(out, size, "SHL V%X, V%X", d.x, d.y); break;
+    case CHIP8_OP_9XY0: snprintf(out, size, "SNE V%X, V%X", d.x, d.y); break;
+    case CHIP8_OP_ANNN: snprintf(out, size, "LD I, 0x%03X", d.nnn); break;
+    case CHIP8_OP_BNNN: snprintf(out, size, "JP V0, 0x%03X", d.nnn); break;
+    case CHIP8_OP_CXNN: snprintf(out, size, "RND V%X, 0x%02X", d.x, d.nn); break;
+    case CHIP8_OP_DXYN: snprintf(out, size, "DRW V%X, V%X, %d", d.x, d.y, n); break;
+    case CHIP8_OP_EX9E: snprintf(out, size, "SKP V%X", d.x); break;
+    case CHIP8_OP_EXA1: snprintf(out, size, "SKNP V%X", d.x); break;
+    // the address is the next word, which I holds afterwards
+    case CHIP8_OP_F000:
+      if (after != NULL)
+        snprintf(out, size, "LD I, long 0x%04X", after->I);
+      else
+        snprintf(out, size, "LD I, long");
+      break;
+    case CHIP8_OP_FN01: snprintf(out, size, "PLANE %d", d.x); break;
+    case CHIP8_OP_F002: snprintf(out, size, "AUDIO"); break;
+    case CHIP8_OP_FX07: snprintf(out, size, "LD V%X, DT", d.x); break;
+    case CHIP8_OP_FX0A: snprintf(out, size, "LD V%X, K", d.x); break;
+    case CHIP8_OP_FX15: snprintf(out, size, "LD DT, V%X", d.x); break;
+    case CHIP8_OP_FX18: snprintf(out, size, "LD ST, V%X", d.x); break;
+    case CHIP8_OP_FX1E: snprintf(out, size, "ADD I, V%X", d.x); break;
+    case CHIP8_OP_FX29: snprintf(out, size, "LD F, V%X", d.x); break;
+    case CHIP8_OP_FX30: snprintf(out, size, "LD HF, V%X", d.x); break;
+    case CHIP8_OP_FX33: snprintf(out, size, "LD B, V%X", d.x); break;
+    case CHIP8_OP_FX3A: snprintf(out, size, "PITCH V%X", d.x); break;
+    case CHIP8_OP_FX55: snprintf(out, size, "LD [I], V%X", d.x); break;
+    case CHIP8_OP_FX65: snprintf(out, size, "LD V%X, [I]", d.x); break;
+    case CHIP8_OP_FX75: snprintf(out, size, "LD R, V%X", d.x); break;
+    case CHIP8_OP_FX85: snprintf(out, size, "LD V%X, R", d.x); break;
+    default: snprintf(out, size, "invalid"); break;
+  }
+}
+
+// whether the instruction writes VX, the register an entry records
+static bool writesX(uint16_t opcode) {
+  switch (chip8_decode(opcode).op) {
+    case CHIP8_OP_5XY3: case CHIP8_OP_6XNN: case CHIP8_OP_7XNN:
+    case CHIP8_OP_8XY0: case CHIP8_OP_8XY1: case CHIP8_OP_8XY2: case CHIP8_OP_8XY3:
+    case CHIP8_OP_8XY4: case CHIP8_OP_8XY5: case CHIP8_OP_8XY6: case CHIP8_OP_8XY7:
+    case CHIP8_OP_8XYE: case CHIP8_OP_CXNN: case CHIP8_OP_FX07: case CHIP8_OP_FX0A:
+    case CHIP8_OP_FX65: case CHIP8_OP_FX85:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void printHeader(void) {
+  printf("#      entry   pc  opcode  instruction        VX    VF  I     SP DT ST\n");
+}
+
+static void printEntry(uint64_t number, const trace_entry* e) {
+  char text[32];
+  char vx[8] = "";
+  disassemble(e->opcode, e, text, sizeof(text));
+  if (writesX(e->opcode))
+    snprintf(vx, sizeof(vx), "V%X=%02X", e->x, e->vx);
+
+  printf("%12" PRIu64 "  %03X  %04X    %-18s %-5s %02X  %04X  %X  %02X %02X\n", number, e->pc, e->opcode,
+         text, vx, e->vf, e->I, e->sp, e->delay_timer, e->sound_timer);
+}
+
+static void printGap(uint64_t from, uint64_t to) {
+  printf("#  %" PRIu64 " dropped\n", to - from);
+}
+
+static const uint64_t* sortHits;
+
+static int byHits(const void* a, const void* b) {
+  uint64_t left = sortHits[*(const uint16_t*)a], right = sortHits[*(const uint16_t*)b];
+  return left < right ? 1 : left > right ? -1 : *(const uint16_t*)a - *(const uint16_t*)b;
+}
+
+int main(int argc, char* argv[]) {
+  const char* path = NULL;
+  uint64_t last = DEFAULT_LAST;
+  uint64_t shown = DEFAULT_HITS;
+  uint64_t from = UINT64_MAX;     // none given
+  uint64_t count = DEFAULT_COUNT;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--last") == 0 && i + 1 < argc) {
+      last = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--hits") == 0 && i + 1 < argc) {
+      shown = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+      from = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+      count = strtoull(argv[++i], NULL, 10);
+    } else if (argv[i][0] == '-' || path != NULL) {
+      usage(argv[0]);
+    } else {
+      path = argv[i];
+    }
+  }
+  if (path == NULL)
+    usage(argv[0]);
+
+  trace_reader* reader = trace_readerOpen(path);
+  if (reader == NULL) {
+    fprintf(stderr, "Could not read trace \"%s\".\n", path);
+    return EXIT_FAILURE;
+  }
+
+  // the last entries up to the first invalid opcode, a ring of them
+  numbered* tail = last > 0 ? malloc(last * sizeof(numbered)) : NULL;
+  uint64_t kept = 0;
+  bool faulted = false;
+
+  static uint64_t hits[MAX_MEMORY];
+  static uint16_t opcodes[MAX_MEMORY]; // the last one run at each address
+  uint64_t read = 0;
+  uint64_t next = 0;              // number the next entry should have
+  uint64_t dropped = 0;
+  uint64_t listed = UINT64_MAX;   // the last entry --from printed
+  uint64_t diverged = 0;          // calls that replayed differently
+  uint64_t divergedAt = 0;        // the last entry of the first of them
+
+  if (from != UINT64_MAX)
+    printHeader();
+
+  trace_block block;
+  while (trace_read(reader, &block)) {
+    dropped += block.first - next;
+    for (uint32_t k = 0; k < block.count; k++) {
+      const trace_entry* e = &block.entries[k];
+      uint64_t number = block.first + k;
+
+      hits[e->pc]++;
+      opcodes[e->pc] = e->opcode;
+
+      if (from != UINT64_MAX) {
+        if (number >= from && number - from < count) {
+          if (listed != UINT64_MAX && number != listed + 1)
+            printGap(listed + 1, number);
+          printEntry(number, e);
+          listed = number;
+        }
+      } else if (!faulted && tail != NULL) {
+        tail[kept++ % last] = (numbered){ number, *e };
+        faulted = chip8_decode(e->opcode).op == CHIP8_OP_INVALID;
+      }
+    }
+    read += block.count;
+    next = block.first + block.count;
+    if (block.diverged && diverged++ == 0)
+      divergedAt = next - 1;
+  }
+
+  uint64_t entries = 0;
+  bool complete = trace_complete(reader, &entries);
+  trace_readerClose(reader);
+  if (complete)
+    dropped += entries - next;
+
+  printf("# %s: %" PRIu64 " instructions in the trace, %" PRIu64 " dropped\n", path, read, dropped);
+  if (!complete)
+    printf("# the trace ends early, it was not closed or is damaged\n");
+  if (diverged > 0)
+    printf("# the replay diverged from the traced run at entry %" PRIu64 ", in %" PRIu64 " calls\n",
+           divergedAt, diverged);
+
+  if (from == UINT64_MAX && kept > 0) {
+    uint64_t first = kept > last ? kept - last : 0;
+    const numbered* end = &tail[(kept - 1) % last];
+    if (faulted)
+      printf("# invalid opcode %04X at %03X, entry %" PRIu64 ", after:\n", end->entry.opcode, end->entry.pc,
+             end->number);
+    else
+      printf("# the last %" PRIu64 " instructions:\n", kept - first);
+
+    printHeader();
+    for (uint64_t k = first; k < kept; k++) {
+      const numbered* n = &tail[k % last];
+      if (k > first && n->number != tail[(k - 1) % last].number + 1)
+        printGap(tail[(k - 1) % last].number + 1, n->number);
+      printEntry(n->number, &n->entry);
+    }
+  }
+  free(tail);
+
+  if (read > 0) {
+    static uint16_t order[MAX_MEMORY];
+    uint32_t addresses = 0;
+    for (uint32_t pc = 0; pc < MAX_MEMORY; pc++) {
+      if (hits[pc] != 0)
+        order[addresses++] = (uint16_t)pc;
+    }
+    sortHits = hits;
+    qsort(order, addresses, sizeof(order[0]), byHits);
+
+    printf("# hits: %" PRIu32 " addresses executed\n", addresses);
+    printf("#   pc          hits   share  instruction\n");
+    for (uint32_t k = 0; k < addresses && (shown == 0 || k < shown); k++) {
+      uint16_t pc = order[k];
+      char text[32];
+      disassemble(opcodes[pc], NULL, text, sizeof(text));
+      printf("  %03X  %12" PRIu64 "  %5.1f%%  %04X  %s\n", pc, hits[pc], 100.0 * hits[pc] / read, opcodes[pc], text);
+    }
+  }
+
+  return complete && diverged == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}